@@ -0,0 +1,98 @@
+#include <stdlib.h>
+#include "backlog.h"
+#include "epoch.h"
+#include "shared.h"
+
+/*
+ * Function which sets up an empty backlog.
+ * Parameters:
+ * backlog - backlog to set up
+ * capacity - most messages kept (0 to keep none)
+ */
+void backlog_init(Backlog* backlog, size_t capacity) {
+    backlog->capacity = capacity;
+    backlog->slots = capacity == 0 ? NULL : calloc(capacity, sizeof(Frame*));
+    backlog->head = 0;
+}
+
+/*
+ * Function which releases a frame pushed out of a backlog once no replay can
+ * still be reading it.
+ * Parameters:
+ * data - frame to release
+ */
+static void release_frame(void* data) {
+    frame_release(data);
+}
+
+/*
+ * Function which adds a message to a backlog from any thread, pushing out
+ * the oldest message once the backlog is full. The frame is given its
+ * position in the backlog, so it must not have been shared yet.
+ * Parameters:
+ * backlog - backlog to add to
+ * frame - frame of the message, referenced by the backlog
+ */
+void backlog_append(Backlog* backlog, Frame* frame) {
+    if (backlog->capacity == 0) {
+        return;
+    }
+    unsigned long position = __atomic_fetch_add(&backlog->head, 1,
+            __ATOMIC_SEQ_CST);
+    frame->sequence = position;
+    Frame* old = __atomic_exchange_n(
+            &backlog->slots[position % backlog->capacity], frame_ref(frame),
+            __ATOMIC_SEQ_CST);
+    if (old != NULL) {
+        epoch_retire(old, release_frame);
+    }
+}
+
+/*
+ * Function which pushes every message in a backlog to a client's queue,
+ * oldest first. A slot which has already been claimed by a newer message,
+ * or not yet filled by the one which claimed it, is skipped. Replayed
+ * messages are not counted in the delivery timings.
+ * Parameters:
+ * backlog - backlog to replay
+ * queue - queue of the client the messages are sent to
+ * Return:
+ * int - number of messages replayed
+ */
+int backlog_replay(Backlog* backlog, OutQueue* queue) {
+    int replayed = 0;
+    if (backlog->capacity == 0) {
+        return 0;
+    }
+    out_queue_time_from(queue, now_usec());
+    epoch_enter();
+    unsigned long head = __atomic_load_n(&backlog->head, __ATOMIC_SEQ_CST);
+    unsigned long position = head > backlog->capacity ?
+            head - backlog->capacity : 0;
+    for (; position < head; position++) {
+        Frame* frame = __atomic_load_n(
+                &backlog->slots[position % backlog->capacity],
+                __ATOMIC_SEQ_CST);
+        if (frame != NULL && frame->sequence == position) {
+            out_queue_push(queue, frame);
+            replayed++;
+        }
+    }
+    epoch_exit();
+    return replayed;
+}
+
+/*
+ * Function which releases every message in a backlog once nothing can
+ * append to or replay it.
+ * Parameters:
+ * backlog - backlog to free
+ */
+void backlog_destroy(Backlog* backlog) {
+    for (size_t i = 0; i < backlog->capacity; i++) {
+        if (backlog->slots[i] != NULL) {
+            frame_release(backlog->slots[i]);
+        }
+    }
+    free(backlog->slots);
+}
@@ -0,0 +1,29 @@
+#ifndef _BACKLOG_H
+#define _BACKLOG_H
+#include <stddef.h>
+#include "frame.h"
+#include "outqueue.h"
+
+/*
+ * Ring of the most recent messages sent in a room, kept as the frames that
+ * were broadcast so replaying them to a client copies nothing. Appending
+ * takes no lock: each message claims the next position and swaps its frame
+ * into that slot, and the frame it replaces is released once no replay can
+ * still be reading it. A capacity of 0 keeps no messages.
+ */
+typedef struct {
+    Frame** slots;
+    size_t capacity;
+    // number of messages ever appended, so the next position to claim
+    unsigned long head;
+} Backlog;
+
+void backlog_init(Backlog* backlog, size_t capacity);
+
+void backlog_append(Backlog* backlog, Frame* frame);
+
+int backlog_replay(Backlog* backlog, OutQueue* queue);
+
+void backlog_destroy(Backlog* backlog);
+
+#endif
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Loopback benchmark comparing the server's modes under the same load.
+# Starts the server once in each mode on an ephemeral port and runs loadgen
+# against it. Any loadgen option may be given to override the defaults.
+# Usage: ./bench.sh [loadgen options]
+DIR=$(dirname "$0")
+AUTH=$(mktemp)
+LOG=$(mktemp)
+echo benchmark > "$AUTH"
+trap 'rm -f "$AUTH" "$LOG"' EXIT
+
+for MODE in threads --event-loop --io-uring; do
+    if [ "$MODE" = threads ]; then
+        "$DIR/server" "$AUTH" 2> "$LOG" > /dev/null &
+    else
+        "$DIR/server" "$MODE" "$AUTH" 2> "$LOG" > /dev/null &
+    fi
+    SERVER=$!
+    PORT=""
+    while [ -z "$PORT" ]; do
+        sleep 0.1
+        PORT=$(head -n 1 "$LOG")
+    done
+    echo "== $MODE"
+    "$DIR/loadgen" --connections 100 --threads 4 --rate 5000 --duration 5 \
+            "$@" "$AUTH" "$PORT"
+    kill "$SERVER"
+    wait "$SERVER" 2> /dev/null
+    # say so if the server fell back to another mode
+    tail -n +2 "$LOG"
+done
@@ -0,0 +1,338 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include "chatlog.h"
+#include "logrecord.h"
+#include "protocol.h"
+#include "shared.h"
+#include "slab.h"
+#include "stats.h"
+#define LOG_BUFFER_SIZE (256 * 1024)
+// bytes of messages which may wait for the writer before more are dropped
+#define LOG_MAX_WAITING (64 * 1024 * 1024)
+#define USEC_PER_MSEC 1000
+#define USEC_PER_SEC 1000000LL
+#define NSEC_PER_USEC 1000
+
+/*
+ * A message waiting in the log's inbox to be written.
+ */
+typedef struct {
+    ShardMessage message;
+    // binary encoding of the MSG: frame, whose payload is the sender's name,
+    // a null and the message
+    Frame* frame;
+    char* room;
+    long long time;
+    size_t size;
+} LogEntry;
+
+static Slab entrySlab = SLAB_INITIALIZER(sizeof(LogEntry));
+
+/*
+ * Function which returns the time of day in microseconds since the epoch.
+ * Return:
+ * long long - the time
+ */
+static long long wall_usec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * USEC_PER_SEC + now.tv_nsec / NSEC_PER_USEC;
+}
+
+/*
+ * Function which makes sure a new file's name in the log directory survives
+ * a crash.
+ * Parameters:
+ * log - log whose directory is synced
+ */
+static void sync_directory(ChatLog* log) {
+    int directory = open(log->directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directory >= 0) {
+        fsync(directory);
+        close(directory);
+    }
+}
+
+/*
+ * Function which starts the next segment of the log.
+ * Parameters:
+ * log - log to start a segment of
+ * Return:
+ * bool - false if the segment could not be created.
+ */
+static bool open_segment(ChatLog* log) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/" LOG_SEGMENT_FORMAT, log->directory,
+            ++log->segmentNumber);
+    log->segment = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND |
+            O_CLOEXEC, 0644);
+    log->segmentBytes = 0;
+    if (log->segment < 0) {
+        return false;
+    }
+    sync_directory(log);
+    return true;
+}
+
+/*
+ * Function which finds the highest numbered segment already in the log's
+ * directory, so new segments follow it.
+ * Parameters:
+ * log - log whose directory is searched
+ * Return:
+ * bool - false if the directory could not be read.
+ */
+static bool find_last_segment(ChatLog* log) {
+    DIR* directory = opendir(log->directory);
+    struct dirent* entry;
+    unsigned number;
+    if (directory == NULL) {
+        return false;
+    }
+    log->segmentNumber = 0;
+    while ((entry = readdir(directory)) != NULL) {
+        if (sscanf(entry->d_name, LOG_SEGMENT_FORMAT, &number) == 1 &&
+                number > log->segmentNumber) {
+            log->segmentNumber = number;
+        }
+    }
+    closedir(directory);
+    return true;
+}
+
+/*
+ * Function which writes the records encoded so far to the current segment.
+ * Records which cannot be written are counted as dropped.
+ * Parameters:
+ * log - log to write
+ */
+static void write_buffer(ChatLog* log) {
+    size_t written = 0;
+    while (written < log->buffered) {
+        ssize_t count = write(log->segment, log->buffer + written,
+                log->buffered - written);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            stats_add(STAT_LOG_DROPPED, log->bufferedRecords);
+            log->bufferedRecords = 0;
+            break;
+        }
+        written += count;
+    }
+    log->segmentBytes += written;
+    log->unsynced |= written > 0;
+    stats_add(STAT_LOG_RECORDS, log->bufferedRecords);
+    log->buffered = 0;
+    log->bufferedRecords = 0;
+}
+
+/*
+ * Function which syncs everything written to the current segment.
+ * Parameters:
+ * log - log to sync
+ */
+static void sync_log(ChatLog* log) {
+    fdatasync(log->segment);
+    log->unsynced = false;
+    log->lastSync = now_usec();
+    stats_add(STAT_LOG_SYNCS, 1);
+}
+
+/*
+ * Function which encodes a message as a record at the end of the log's
+ * buffer, starting a new segment first if the message would take the
+ * current one past its limit.
+ * Parameters:
+ * log - log to add to
+ * entry - message to encode
+ */
+static void encode_entry(ChatLog* log, LogEntry* entry) {
+    size_t roomLength = strlen(entry->room) + 1;
+    size_t length = roomLength + entry->frame->length - PROTOCOL_HEADER_SIZE;
+    size_t size = LOG_HEADER_SIZE + length;
+    if (log->segmentBytes + log->buffered + size > log->segmentLimit &&
+            log->segmentBytes + log->buffered > 0) {
+        write_buffer(log);
+        if (log->unsynced) {
+            sync_log(log);
+        }
+        close(log->segment);
+        if (!open_segment(log)) {
+            fprintf(stderr, "chat log: cannot start segment %u\n",
+                    log->segmentNumber);
+        }
+    }
+    if (log->buffered + size > log->bufferSize) {
+        write_buffer(log);
+        if (size > log->bufferSize) {
+            log->bufferSize = size;
+            log->buffer = realloc(log->buffer, size);
+        }
+    }
+    char* payload = log->buffer + log->buffered + LOG_HEADER_SIZE;
+    memcpy(payload, entry->room, roomLength);
+    memcpy(payload + roomLength, entry->frame->data + PROTOCOL_HEADER_SIZE,
+            length - roomLength);
+    uint32_t checksum = log_checksum(log_time_checksum(entry->time), payload,
+            length);
+    log_encode_header(log->buffer + log->buffered, length, checksum,
+            entry->time);
+    log->buffered += size;
+    log->bufferedRecords++;
+}
+
+/*
+ * Function which works out how many milliseconds the writer may wait for
+ * more messages before written ones must be synced.
+ * Parameters:
+ * log - log being written
+ * Return:
+ * int - milliseconds to wait, -1 to wait until a message arrives
+ */
+static int sync_wait(ChatLog* log) {
+    if (!log->unsynced) {
+        return -1;
+    }
+    long long wait = log->lastSync + log->syncInterval - now_usec();
+    return wait <= 0 ? 0 : (wait + USEC_PER_MSEC - 1) / USEC_PER_MSEC;
+}
+
+/*
+ * Thread function which writes the messages posted to the log, each batch
+ * drained from the inbox with as few writes as the buffer allows, and syncs
+ * them as the sync interval requires.
+ * Parameters:
+ * data - ChatLog to write
+ */
+static void* log_writer(void* data) {
+    ChatLog* log = data;
+    struct pollfd waiting;
+    waiting.fd = log->inbox.wakeDiscriptor;
+    waiting.events = POLLIN;
+    while (1) {
+        poll(&waiting, 1, sync_wait(log));
+        // every message posted before a flush was asked for is taken below
+        unsigned wanted = __atomic_load_n(&log->flushesWanted,
+                __ATOMIC_ACQUIRE);
+        ShardMessage* message = shard_take(&log->inbox);
+        while (message != NULL) {
+            LogEntry* entry = (LogEntry*) message;
+            message = message->next;
+            encode_entry(log, entry);
+            __atomic_fetch_sub(&log->waiting, entry->size, __ATOMIC_RELAXED);
+            frame_release(entry->frame);
+            free(entry->room);
+            slab_free(&entrySlab, entry);
+        }
+        write_buffer(log);
+        if (log->unsynced && (log->syncInterval == 0 ||
+                now_usec() - log->lastSync >= log->syncInterval)) {
+            sync_log(log);
+        }
+        if (wanted != log->flushesDone) {
+            if (log->unsynced) {
+                sync_log(log);
+            }
+            pthread_mutex_lock(&log->flushMutex);
+            log->flushesDone = wanted;
+            pthread_cond_broadcast(&log->flushed);
+            pthread_mutex_unlock(&log->flushMutex);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function which opens a chat log in a directory, creating the directory if
+ * need be, and starts its writer. Messages go into a new segment after any
+ * the directory already holds.
+ * Parameters:
+ * directory - directory of the log's segments
+ * segmentLimit - bytes after which a new segment is started
+ * syncInterval - microseconds written messages may wait to be synced (0
+ * syncs each batch as soon as it is written)
+ * Return:
+ * ChatLog* - the log, NULL if it could not be opened
+ */
+ChatLog* chat_log_open(const char* directory, size_t segmentLimit,
+        long long syncInterval) {
+    pthread_t thread;
+    ChatLog* log = calloc(1, sizeof(ChatLog));
+    log->directory = strdup(directory);
+    log->segmentLimit = segmentLimit;
+    log->syncInterval = syncInterval;
+    mkdir(directory, 0755);
+    if (!find_last_segment(log) || !open_segment(log)) {
+        free(log->directory);
+        free(log);
+        return NULL;
+    }
+    shard_init(&log->inbox, -1);
+    pthread_mutex_init(&log->flushMutex, NULL);
+    pthread_cond_init(&log->flushed, NULL);
+    log->bufferSize = LOG_BUFFER_SIZE;
+    log->buffer = malloc(log->bufferSize);
+    log->lastSync = now_usec();
+    pthread_create(&thread, NULL, log_writer, log);
+    pthread_detach(thread);
+    return log;
+}
+
+/*
+ * Function which posts a message to the log from any thread without waiting
+ * for it to be written. If the writer has fallen too far behind the message
+ * is dropped instead, so a slow disk never holds up fan-out.
+ * Parameters:
+ * log - log to add the message to
+ * room - name of the room the message was sent in
+ * message - MSG: frame broadcast for the message
+ */
+void chat_log_append(ChatLog* log, const char* room, Frame* message) {
+    size_t size = LOG_HEADER_SIZE + strlen(room) + 1 +
+            message->binary->length;
+    if (__atomic_add_fetch(&log->waiting, size, __ATOMIC_RELAXED) >
+            LOG_MAX_WAITING) {
+        __atomic_fetch_sub(&log->waiting, size, __ATOMIC_RELAXED);
+        stats_add(STAT_LOG_DROPPED, 1);
+        return;
+    }
+    LogEntry* entry = slab_alloc(&entrySlab);
+    entry->frame = frame_ref(message->binary);
+    entry->room = strdup(room);
+    entry->time = wall_usec();
+    entry->size = size;
+    shard_post(&log->inbox, &entry->message);
+}
+
+/*
+ * Function which waits until every message posted to the log so far has
+ * been written and synced, such as before the server hands its clients to
+ * another process.
+ * Parameters:
+ * log - log to flush
+ */
+void chat_log_flush(ChatLog* log) {
+    uint64_t wake = 1;
+    unsigned wanted = __atomic_add_fetch(&log->flushesWanted, 1,
+            __ATOMIC_RELEASE);
+    write(log->inbox.wakeDiscriptor, &wake, sizeof(wake));
+    pthread_mutex_lock(&log->flushMutex);
+    while ((int) (log->flushesDone - wanted) < 0) {
+        pthread_cond_wait(&log->flushed, &log->flushMutex);
+    }
+    pthread_mutex_unlock(&log->flushMutex);
+}
@@ -0,0 +1,55 @@
+#ifndef _CHATLOG_H
+#define _CHATLOG_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "frame.h"
+#include "shard.h"
+
+/*
+ * Append-only record of every message sent on the server, kept in a
+ * directory of numbered segment files in the format of logrecord.h. Threads
+ * broadcasting a message only post it to the log's inbox, which a thread of
+ * the log's own drains, so writing to disk never holds up fan-out. The
+ * writer syncs once for everything it drained at once, or at most once per
+ * sync interval, so the cost of durability is shared between messages.
+ */
+typedef struct {
+    char* directory;
+    // bytes after which a new segment is started
+    size_t segmentLimit;
+    // microseconds written messages may wait to be synced (0 syncs every
+    // batch as soon as it is written)
+    long long syncInterval;
+    // messages waiting to be written, woken like a shard's loop
+    Shard inbox;
+    // bytes of messages in the inbox, which stops growing once the writer
+    // falls too far behind
+    size_t waiting;
+    int segment;
+    unsigned segmentNumber;
+    size_t segmentBytes;
+    // records encoded but not yet written to the segment
+    char* buffer;
+    size_t bufferSize;
+    size_t buffered;
+    int bufferedRecords;
+    // set while written records have not been synced
+    bool unsynced;
+    long long lastSync;
+    // flushes asked for and carried out, counted so the writer serves every
+    // caller waiting at once with a single sync
+    unsigned flushesWanted;
+    unsigned flushesDone;
+    pthread_mutex_t flushMutex;
+    pthread_cond_t flushed;
+} ChatLog;
+
+ChatLog* chat_log_open(const char* directory, size_t segmentLimit,
+        long long syncInterval);
+
+void chat_log_append(ChatLog* log, const char* room, Frame* message);
+
+void chat_log_flush(ChatLog* log);
+
+#endif
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Loopback check that binary clients sending SAY: longer than --max-line
+# are still served, in the modes which read into a ring bounded by it.
+# Starts the server with a --max-line larger than the ring starts out and
+# oversized messages split, runs loadgen with binary framing and longer
+# messages against it, and fails unless messages were relayed and LIST: was
+# answered.
+# Usage: ./check.sh
+DIR=$(dirname "$0")
+AUTH=$(mktemp)
+LOG=$(mktemp)
+OUT=$(mktemp)
+echo check > "$AUTH"
+trap 'rm -f "$AUTH" "$LOG" "$OUT"' EXIT
+STATUS=0
+
+for MODE in threads --event-loop; do
+    if [ "$MODE" = threads ]; then
+        "$DIR/server" --max-line 8192 --oversize split "$AUTH" \
+                2> "$LOG" > /dev/null &
+    else
+        "$DIR/server" "$MODE" --max-line 8192 --oversize split "$AUTH" \
+                2> "$LOG" > /dev/null &
+    fi
+    SERVER=$!
+    PORT=""
+    while [ -z "$PORT" ]; do
+        sleep 0.1
+        PORT=$(head -n 1 "$LOG")
+    done
+    "$DIR/loadgen" --connections 4 --threads 1 --rate 20 --duration 2 \
+            --size 20000 --list 50 --binary "$AUTH" "$PORT" > "$OUT"
+    kill "$SERVER"
+    wait "$SERVER" 2> /dev/null
+    # recieved: MSG n (n/s) LIST n KICK n
+    if awk '/^recieved:/ { exit !($3 > 0 && $6 > 0) }' "$OUT"; then
+        echo "== $MODE ok"
+    else
+        echo "== $MODE FAILED"
+        cat "$OUT"
+        STATUS=1
+    fi
+done
+exit $STATUS
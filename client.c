@@ -1,16 +1,74 @@
+#define _GNU_SOURCE
 #include <netdb.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <getopt.h>
 #include "shared.h"
+#include "linebuf.h"
+#include "histogram.h"
 #include <unistd.h>
 #define KICKED 3
 #define AUTH_ERROR 4
 #define NORMAL_EXIT 0
+#define USAGE "Usage: client name authfile port\n"
+#define DEFAULT_BENCH_COUNT 1000
+#define DEFAULT_BENCH_RATE 100
+#define DEFAULT_BENCH_SIZE 32
+#define LINE_BUFFER_SIZE 4096
+// bytes of SAY: lines written to the server at once
+#define SEND_BUFFER_SIZE (64 * 1024)
+// microseconds to wait for echoes once every SAY: has been sent
+#define DRAIN_USEC (5 * USEC_PER_SEC)
+#define USEC_PER_SEC 1000000LL
+#define USEC_PER_MSEC 1000.0
 
+/*
+ * Stores the command line options of the client.
+ */
+typedef struct {
+    // set to send SAY: lines from a script or generator rather than stdin,
+    // and time their echoes
+    bool bench;
+    // SAY: lines per second (0 to send as fast as the server reads them)
+    double rate;
+    long count;
+    // bytes of generated text in each SAY: when there is no script
+    int size;
+    // file whose lines are sent in turn, NULL to generate text
+    char* script;
+} ClientOptions;
+
+/*
+ * Data structure which stores the state of a benchmark run, shared by the
+ * thread sending SAY: lines and the thread timing their echoes.
+ */
+typedef struct {
+    const ClientOptions* options;
+    int fd;
+    LineBuffer from;
+    // name the server accepted, which each echo is sent from
+    char* name;
+    // text sent in each SAY:, in turn
+    char** texts;
+    int textCount;
+    // time each SAY: was sent, by its sequence number (0 until sent)
+    long long* sentAt;
+    long long startedAt;
+    // time the last SAY: was sent, 0 until then
+    long long finishedAt;
+    long received;
+    long long lastReceivedAt;
+    Histogram roundTrip;
+    // PING: lines recieved while SAY: lines were being sent, which the
+    // sending thread answers so its writes are never split
+    int pongsWanted;
+} Bench;
 
 /*
  * Function which sends a message to the server based on what the client types
@@ -28,34 +86,6 @@ void* send_message(void* toServer);
  */
 void* recieve_message(void* fromServer);
 
-/*
- * Function which attempts to connect the client to the server given to port
- * Paramters:
- * port - port given to client to attempt to connect to the server
- *
- * (code addpated from CSSE2310 lecture code)
- */
-int connect_socket(const char* port) {
-    struct addrinfo* addressInfo = 0;
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_INET;          
-    hints.ai_socktype = SOCK_STREAM;
-    int error;
-
-    if ((error = getaddrinfo("localhost", port, &hints, &addressInfo))) {
-        freeaddrinfo(addressInfo);
-        communications_error();
-    }
-
-    int connectionDiscriptor = socket(AF_INET, SOCK_STREAM, 0); 
-    if (connect(connectionDiscriptor, (struct sockaddr*)addressInfo->ai_addr, 
-            sizeof(struct sockaddr))) {
-        communications_error();
-    }
-    return connectionDiscriptor;
-}
-
 /*
  * Function which checks if there has been an authentication error after
  * sending auth string to server. (ie checks if server disconnected client)
@@ -104,21 +134,395 @@ void wait_for_server(FILE* from, char* command) {
     } while (strcmp(serverCommand, command) != 0);
 }
 
+/*
+ * Function which converts the value given to a numeric option, causing a
+ * usage error if it is not a non-negative number.
+ * Parameters:
+ * value - text given for the option
+ * Return:
+ * double - value of the option
+ */
+double parse_number_option(char* value) {
+    char* end;
+    double number = strtod(value, &end);
+    if (end == value || *end != '\0' || number < 0) {
+        usage_error(USAGE);
+    }
+    return number;
+}
+
+/*
+ * Function which reads the options given before the client's name. On
+ * return optind is the index of the first non-option argument.
+ * Supported options:
+ * --bench      - rather than reading stdin, send SAY: lines at a set rate
+ *                without waiting for their echoes, then report how long the
+ *                echoes took to come back and how many were sent per second.
+ * --rate N     - with --bench, send N SAY: lines per second (default 100, 0
+ *                sends them as fast as the server takes them).
+ * --count N    - with --bench, send N SAY: lines (default 1000).
+ * --size BYTES - with --bench, pad each generated SAY: to BYTES bytes of
+ *                text (default 32).
+ * --script FILE - with --bench, send the lines of FILE in turn (starting
+ *                again at the top when they run out) rather than generated
+ *                text.
+ * Parameters:
+ * options - options structure to be filled in
+ * argc - number of arguments given to the client
+ * argv - arguments given to the client
+ */
+void parse_client_options(ClientOptions* options, int argc, char* argv[]) {
+    struct option longOptions[] = {
+        {"bench", no_argument, NULL, 'b'},
+        {"rate", required_argument, NULL, 'r'},
+        {"count", required_argument, NULL, 'c'},
+        {"size", required_argument, NULL, 's'},
+        {"script", required_argument, NULL, 'f'},
+        {NULL, 0, NULL, 0}
+    };
+    int option;
+    options->bench = false;
+    options->rate = DEFAULT_BENCH_RATE;
+    options->count = DEFAULT_BENCH_COUNT;
+    options->size = DEFAULT_BENCH_SIZE;
+    options->script = NULL;
+    opterr = 0;
+    while ((option = getopt_long(argc, argv, "+", longOptions,
+            NULL)) != -1) {
+        switch (option) {
+            case 'b':
+                options->bench = true;
+                break;
+            case 'r':
+                options->rate = parse_number_option(optarg);
+                break;
+            case 'c':
+                options->count = parse_number_option(optarg);
+                break;
+            case 's':
+                options->size = parse_number_option(optarg);
+                break;
+            case 'f':
+                options->script = optarg;
+                break;
+            default:
+                usage_error(USAGE);
+        }
+    }
+    if (argc - optind != 3) {
+        usage_error(USAGE);
+    }
+}
+
+/*
+ * Function which reads the text a benchmark sends, either every line of its
+ * script or a single generated line of the requested size.
+ * Parameters:
+ * bench - benchmark to set up
+ */
+void load_texts(Bench* bench) {
+    const ClientOptions* options = bench->options;
+    if (options->script == NULL) {
+        bench->texts = malloc(sizeof(char*));
+        bench->texts[0] = malloc(options->size + 1);
+        for (int i = 0; i < options->size; i++) {
+            bench->texts[0][i] = 'a' + i % 26;
+        }
+        bench->texts[0][options->size] = '\0';
+        bench->textCount = 1;
+        return;
+    }
+    FILE* script = fopen(options->script, "r");
+    check_file(script, USAGE);
+    int capacity = 16;
+    bench->texts = malloc(capacity * sizeof(char*));
+    bench->textCount = 0;
+    while (1) {
+        char* line = read_file_line(script);
+        if (feof(script) && line[0] == '\0') {
+            free(line);
+            break;
+        }
+        if (bench->textCount == capacity) {
+            bench->texts = realloc(bench->texts,
+                    (capacity *= 2) * sizeof(char*));
+        }
+        bench->texts[bench->textCount++] = line;
+    }
+    fclose(script);
+    if (bench->textCount == 0) {
+        usage_error(USAGE);
+    }
+}
+
+/*
+ * Function which writes all of a buffer to the server.
+ * Parameters:
+ * fd - socket connected to the server
+ * data - bytes to write
+ * length - number of bytes
+ */
+void write_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written <= 0) {
+            communications_error();
+        }
+        data += written;
+        length -= written;
+    }
+}
+
+/*
+ * Function which reads lines from the server until the given line is
+ * recieved, returning NULL if the server closes the connection.
+ * Parameters:
+ * bench - benchmark whose connection is read
+ * expected - line to wait for, or NULL for OK: or NAME_TAKEN:
+ * Return:
+ * char* - the line waited for, or NULL if the connection closed
+ */
+char* bench_wait_for(Bench* bench, const char* expected) {
+    char* line;
+    do {
+        line = line_buffer_read_line(&bench->from);
+        if (line == NULL) {
+            return NULL;
+        }
+    } while (expected == NULL ? strcmp(line, "OK:") != 0 &&
+            strcmp(line, "NAME_TAKEN:") != 0 : strcmp(line, expected) != 0);
+    return line;
+}
+
+/*
+ * Function which takes a benchmark's connection through AUTH: and NAME:
+ * in the same way as an interactive client, adding a number to the name
+ * each time it is taken.
+ * Parameters:
+ * bench - benchmark to connect
+ * name - name to join the chat with
+ * auth - auth string to send to the server
+ */
+void bench_join(Bench* bench, const char* name, const char* auth) {
+    char line[LINE_BUFFER_SIZE];
+    if (bench_wait_for(bench, "AUTH:") == NULL) {
+        communications_error();
+    }
+    snprintf(line, sizeof(line), "AUTH:%s\n", auth);
+    write_all(bench->fd, line, strlen(line));
+    if (bench_wait_for(bench, "OK:") == NULL) {
+        fprintf(stderr, "Authentication error\n");
+        exit(AUTH_ERROR);
+    }
+    char* reply;
+    int iteration = -1;
+    do {
+        free(bench->name);
+        if (iteration == -1) {
+            bench->name = strdup(name);
+        } else {
+            asprintf(&bench->name, "%s%d", name, iteration);
+        }
+        if (bench_wait_for(bench, "WHO:") == NULL) {
+            communications_error();
+        }
+        snprintf(line, sizeof(line), "NAME:%s\n", bench->name);
+        write_all(bench->fd, line, strlen(line));
+        if ((reply = bench_wait_for(bench, NULL)) == NULL) {
+            communications_error();
+        }
+        iteration++;
+    } while (strcmp(reply, "OK:") != 0);
+}
+
+/*
+ * Thread function which sends a benchmark's SAY: lines at the requested
+ * rate. Every line due is written at once without waiting for any echoes,
+ * and carries its sequence number so its echo can be matched to it.
+ * Parameters:
+ * data - Bench being run
+ */
+void* bench_send(void* data) {
+    Bench* bench = data;
+    const ClientOptions* options = bench->options;
+    char* buffer = malloc(SEND_BUFFER_SIZE);
+    size_t length = 0;
+    bench->startedAt = now_usec();
+    for (long sequence = 0; sequence < options->count; sequence++) {
+        const char* text = bench->texts[sequence % bench->textCount];
+        size_t needed = strlen("SAY:#") + 24 + strlen(text);
+        long long due = options->rate == 0 ? 0 : bench->startedAt +
+                sequence * USEC_PER_SEC / options->rate;
+        if (length > 0 && (length + needed > SEND_BUFFER_SIZE ||
+                due > now_usec())) {
+            write_all(bench->fd, buffer, length);
+            length = 0;
+        }
+        long long wait = due - now_usec();
+        if (wait > 0) {
+            usleep(wait);
+        }
+        if (needed > SEND_BUFFER_SIZE) {
+            buffer = realloc(buffer, needed);
+        }
+        __atomic_store_n(&bench->sentAt[sequence], now_usec(),
+                __ATOMIC_RELEASE);
+        length += sprintf(buffer + length, "SAY:#%ld %s\n", sequence, text);
+        if (__atomic_exchange_n(&bench->pongsWanted, 0,
+                __ATOMIC_RELAXED) > 0 &&
+                length + strlen("PONG:\n") < SEND_BUFFER_SIZE) {
+            length += sprintf(buffer + length, "PONG:\n");
+        }
+    }
+    write_all(bench->fd, buffer, length);
+    __atomic_store_n(&bench->finishedAt, now_usec(), __ATOMIC_RELEASE);
+    free(buffer);
+    return NULL;
+}
+
+/*
+ * Function which times the echo of one of the benchmark's own SAY: lines,
+ * ignoring every other line.
+ * Parameters:
+ * bench - benchmark being run
+ * line - line recieved from the server
+ */
+void bench_receive(Bench* bench, char* line) {
+    size_t nameLength = strlen(bench->name);
+    if (strcmp(line, "KICK:") == 0) {
+        fprintf(stderr, "Kicked\n");
+        exit(KICKED);
+    }
+    if (strcmp(line, "PING:") == 0) {
+        if (__atomic_load_n(&bench->finishedAt, __ATOMIC_ACQUIRE) != 0) {
+            write_all(bench->fd, "PONG:\n", strlen("PONG:\n"));
+        } else {
+            __atomic_store_n(&bench->pongsWanted, 1, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+    if (strncmp(line, "MSG:", 4) != 0 ||
+            strncmp(line + 4, bench->name, nameLength) != 0 ||
+            strncmp(line + 4 + nameLength, ":#", 2) != 0) {
+        return;
+    }
+    char* end;
+    long sequence = strtol(line + 6 + nameLength, &end, 10);
+    if (end == line + 6 + nameLength || *end != ' ' || sequence < 0 ||
+            sequence >= bench->options->count) {
+        return;
+    }
+    long long sentAt = __atomic_load_n(&bench->sentAt[sequence],
+            __ATOMIC_ACQUIRE);
+    if (sentAt == 0) {
+        return;
+    }
+    bench->lastReceivedAt = now_usec();
+    histogram_record(&bench->roundTrip, bench->lastReceivedAt - sentAt);
+    bench->received++;
+}
+
+/*
+ * Function which prints a histogram of times in the same form as loadgen.
+ * Parameters:
+ * label - name of what was timed
+ * histogram - times in microseconds
+ */
+void report(const char* label, Histogram* histogram) {
+    printf("%s: samples %lu p50 %.3f p99 %.3f p999 %.3f max %.3f (ms)\n",
+            label, histogram_count(histogram),
+            histogram_percentile(histogram, 50) / USEC_PER_MSEC,
+            histogram_percentile(histogram, 99) / USEC_PER_MSEC,
+            histogram_percentile(histogram, 99.9) / USEC_PER_MSEC,
+            histogram_percentile(histogram, 100) / USEC_PER_MSEC);
+}
+
+/*
+ * Function which runs the client as a benchmark: it joins the chat, streams
+ * SAY: lines from one thread while timing their echoes on this one, and
+ * once every echo is back (or has not come back within a few seconds of
+ * the last SAY:) reports the round trip times and messages per second.
+ * Parameters:
+ * options - options describing what to send
+ * name - name to join the chat with
+ * authfile - file holding the auth string
+ * port - port the server is listening on
+ */
+void run_bench(const ClientOptions* options, char* name, char* authfile,
+        char* port) {
+    Bench bench;
+    pthread_t sender;
+    memset(&bench, 0, sizeof(Bench));
+    bench.options = options;
+    FILE* auth = fopen(authfile, "r");
+    check_file(auth, USAGE);
+    char* authString = read_file_line(auth);
+    fclose(auth);
+    load_texts(&bench);
+    bench.sentAt = calloc(options->count, sizeof(long long));
+    bench.fd = connect_socket(port);
+    line_buffer_init(&bench.from, bench.fd, LINE_BUFFER_SIZE);
+    bench_join(&bench, name, authString);
+
+    pthread_create(&sender, NULL, bench_send, &bench);
+    struct pollfd waiting;
+    waiting.fd = bench.fd;
+    waiting.events = POLLIN;
+    while (bench.received < options->count) {
+        long long finishedAt = __atomic_load_n(&bench.finishedAt,
+                __ATOMIC_ACQUIRE);
+        int timeout = -1;
+        if (finishedAt != 0) {
+            long long wait = finishedAt + DRAIN_USEC - now_usec();
+            if (wait <= 0) {
+                break;
+            }
+            timeout = (wait + USEC_PER_MSEC - 1) / USEC_PER_MSEC;
+        } else {
+            timeout = 100;
+        }
+        if (poll(&waiting, 1, timeout) <= 0) {
+            continue;
+        }
+        if (line_buffer_fill(&bench.from) <= 0 && bench.from.closed) {
+            communications_error();
+        }
+        char* line;
+        while ((line = line_buffer_next(&bench.from)) != NULL) {
+            bench_receive(&bench, line);
+        }
+    }
+    pthread_join(sender, NULL);
+
+    long long elapsed = (bench.received > 0 ? bench.lastReceivedAt :
+            bench.finishedAt) - bench.startedAt;
+    double seconds = elapsed > 0 ? (double) elapsed / USEC_PER_SEC : 0;
+    printf("sent %ld received %ld lost %ld in %.3fs (%.0f/s)\n",
+            options->count, bench.received, options->count - bench.received,
+            seconds, seconds > 0 ? bench.received / seconds : 0);
+    report("round-trip", &bench.roundTrip);
+    close(bench.fd);
+}
+
 int main(int argc, char** argv) {
-    if (argc != 4) {
-        usage_error("Usage: client name authfile port\n");
+    ClientOptions options;
+    parse_client_options(&options, argc, argv);
+    char** arguments = argv + optind;
+    if (options.bench) {
+        run_bench(&options, arguments[0], arguments[1], arguments[2]);
+        exit(NORMAL_EXIT);
     }
-    const char* port = argv[3];
+    const char* port = arguments[2];
     int toDiscriptor = connect_socket(port);
-    int authfileDiscriptor = open(argv[2], O_RDONLY);
+    int authfileDiscriptor = open(arguments[1], O_RDONLY);
     FILE* authfile = fdopen(authfileDiscriptor, "r");
-    check_file(authfile, "Usage: client name authfile port\n");    
+    check_file(authfile, USAGE);    
     int fromDiscriptor = dup(toDiscriptor);
     FILE* to = fdopen(toDiscriptor, "w");
     FILE* from = fdopen(fromDiscriptor, "r");
     char* serverCommand;
     int iteration = -1;
-    char* name = argv[1];
+    char* name = arguments[0];
 
     wait_for_server(from, "AUTH:");
     char* auth = read_file_line(authfile);
@@ -192,6 +596,14 @@ void* recieve_message(void* fromServer) {
             fprintf(stderr, "Kicked\n");
             exit(KICKED);
         }
+        // the socket is answered directly, as stdin may be waiting on the
+        // sending thread
+        if (strcmp(serverCommand, "PING:") == 0) {
+            if (write(fileno(from), "PONG:\n", strlen("PONG:\n")) < 0) {
+                communications_error();
+            }
+            continue;
+        }
         char* commandType;
         char* commandArgument;
         char* rest;
@@ -0,0 +1,204 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+#include "epoch.h"
+#include "slab.h"
+#define SYNCHRONIZE_WAIT 100
+
+/*
+ * Data structure which stores the epoch a thread is reading in. Records are
+ * reused by later threads but never freed, so they can be walked without a
+ * lock.
+ */
+typedef struct EpochRecord {
+    // epoch the thread entered in, or 0 while it is outside
+    unsigned long epoch;
+    // how many times the thread has entered without leaving
+    int depth;
+    bool used;
+    struct EpochRecord* next;
+} EpochRecord;
+
+/*
+ * Data structure which stores an item waiting to be freed.
+ */
+typedef struct Retired {
+    void* item;
+    void (*destroy)(void*);
+    // epoch the item was retired in
+    unsigned long epoch;
+    struct Retired* next;
+} Retired;
+
+static unsigned long globalEpoch = 1;
+static EpochRecord* records = NULL;
+static pthread_mutex_t recordMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t recordKey;
+static pthread_once_t recordKeyOnce = PTHREAD_ONCE_INIT;
+static __thread EpochRecord* record = NULL;
+static Retired* retired = NULL;
+static int retiredCount = 0;
+static pthread_mutex_t retiredMutex = PTHREAD_MUTEX_INITIALIZER;
+static Slab retiredSlab = SLAB_INITIALIZER(sizeof(Retired));
+
+/*
+ * Function which lets a record be reused once its thread has exited.
+ * Parameters:
+ * data - record of the thread which exited
+ */
+static void release_record(void* data) {
+    EpochRecord* released = data;
+    pthread_mutex_lock(&recordMutex);
+    released->depth = 0;
+    __atomic_store_n(&released->epoch, 0, __ATOMIC_SEQ_CST);
+    released->used = false;
+    pthread_mutex_unlock(&recordMutex);
+}
+
+/*
+ * Function which creates the key used to release a thread's record when the
+ * thread exits.
+ */
+static void create_record_key(void) {
+    pthread_key_create(&recordKey, release_record);
+}
+
+/*
+ * Function which returns the calling thread's record, taking an unused one
+ * (or adding a new one) the first time the thread enters an epoch.
+ * Return:
+ * EpochRecord* - record of the calling thread
+ */
+static EpochRecord* thread_record(void) {
+    if (record != NULL) {
+        return record;
+    }
+    pthread_once(&recordKeyOnce, create_record_key);
+    pthread_mutex_lock(&recordMutex);
+    EpochRecord* found = records;
+    while (found != NULL && found->used) {
+        found = found->next;
+    }
+    if (found == NULL) {
+        found = calloc(1, sizeof(EpochRecord));
+        found->next = records;
+        __atomic_store_n(&records, found, __ATOMIC_RELEASE);
+    }
+    found->used = true;
+    pthread_mutex_unlock(&recordMutex);
+    pthread_setspecific(recordKey, found);
+    record = found;
+    return record;
+}
+
+/*
+ * Function which finds the oldest epoch any thread is currently reading in.
+ * Return:
+ * unsigned long - oldest epoch in use, ULONG_MAX if no thread is reading
+ */
+static unsigned long oldest_epoch(void) {
+    unsigned long oldest = ULONG_MAX;
+    EpochRecord* reader = __atomic_load_n(&records, __ATOMIC_ACQUIRE);
+    for (; reader != NULL; reader = reader->next) {
+        unsigned long epoch = __atomic_load_n(&reader->epoch,
+                __ATOMIC_SEQ_CST);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    return oldest;
+}
+
+/*
+ * Function which frees every retired item that no reader can still be
+ * using. Nothing is done if another thread is already reclaiming.
+ */
+static void reclaim(void) {
+    Retired* ready = NULL;
+    if (pthread_mutex_trylock(&retiredMutex) != 0) {
+        return;
+    }
+    unsigned long oldest = oldest_epoch();
+    Retired** link = &retired;
+    while (*link != NULL) {
+        Retired* item = *link;
+        if (item->epoch < oldest) {
+            *link = item->next;
+            item->next = ready;
+            ready = item;
+            __atomic_sub_fetch(&retiredCount, 1, __ATOMIC_RELAXED);
+        } else {
+            link = &item->next;
+        }
+    }
+    pthread_mutex_unlock(&retiredMutex);
+    while (ready != NULL) {
+        Retired* next = ready->next;
+        ready->destroy(ready->item);
+        slab_free(&retiredSlab, ready);
+        ready = next;
+    }
+}
+
+/*
+ * Function which marks the calling thread as reading shared data. Anything
+ * the thread loads before the matching epoch_exit() will not be freed until
+ * then. Calls may be nested.
+ */
+void epoch_enter(void) {
+    EpochRecord* reader = thread_record();
+    if (reader->depth++ == 0) {
+        __atomic_store_n(&reader->epoch,
+                __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST),
+                __ATOMIC_SEQ_CST);
+    }
+}
+
+/*
+ * Function which marks the calling thread as no longer reading shared data,
+ * and frees any retired items that were only waiting for it.
+ */
+void epoch_exit(void) {
+    EpochRecord* reader = thread_record();
+    if (--reader->depth == 0) {
+        __atomic_store_n(&reader->epoch, 0, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&retiredCount, __ATOMIC_RELAXED) > 0) {
+            reclaim();
+        }
+    }
+}
+
+/*
+ * Function which frees an item once no reader can still be using it. The
+ * item must already be unreachable for new readers.
+ * Parameters:
+ * item - item to free
+ * destroy - function which frees the item
+ */
+void epoch_retire(void* item, void (*destroy)(void*)) {
+    Retired* entry = slab_alloc(&retiredSlab);
+    entry->item = item;
+    entry->destroy = destroy;
+    entry->epoch = __atomic_fetch_add(&globalEpoch, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&retiredMutex);
+    entry->next = retired;
+    retired = entry;
+    __atomic_add_fetch(&retiredCount, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&retiredMutex);
+    reclaim();
+}
+
+/*
+ * Function which waits until every reader that might be using data which
+ * has already been made unreachable has left its epoch. It must not be
+ * called from inside an epoch.
+ */
+void epoch_synchronize(void) {
+    unsigned long epoch = __atomic_fetch_add(&globalEpoch, 1,
+            __ATOMIC_SEQ_CST);
+    while (oldest_epoch() <= epoch) {
+        usleep(SYNCHRONIZE_WAIT);
+    }
+}
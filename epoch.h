@@ -0,0 +1,19 @@
+#ifndef _EPOCH_H
+#define _EPOCH_H
+
+/*
+ * Epoch based reclamation. Readers wrap their use of shared data in
+ * epoch_enter() and epoch_exit() and take no locks. Writers replace shared
+ * data, then hand the old copy to epoch_retire(), which frees it once every
+ * reader that might still be using it has left its epoch.
+ */
+
+void epoch_enter(void);
+
+void epoch_exit(void);
+
+void epoch_retire(void* item, void (*destroy)(void*));
+
+void epoch_synchronize(void);
+
+#endif
@@ -0,0 +1,600 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include "shared.h"
+#include "server.h"
+#include "linebuf.h"
+#include "outqueue.h"
+#include "epoch.h"
+#include "stats.h"
+#include "session.h"
+#include "slab.h"
+#include "timerwheel.h"
+#define MAX_EVENTS 256
+#define USEC_PER_MSEC 1000
+#define NSEC_PER_USEC 1000
+#define USEC_PER_SEC 1000000
+// microseconds in a tick of the timer wheel, short enough that held back
+// output is not kept much past its deadline
+#define TIMER_TICK 10
+
+/*
+ * Data structure which stores the state of a single non-blocking client
+ * connection being served by the event loop.
+ */
+typedef struct Connection {
+    // expires by the earliest of the connection's deadlines: the session's
+    // next, the end of its hold by the rate policy and the flush of its held
+    // back output
+    Timer timer;
+    int fd;
+    Session session;
+    // the session's next deadline, 0 if it has none
+    long long deadline;
+    // set while the client is held back by the rate policy
+    bool parked;
+    long long resumeAt;
+    // next connection whose timer has expired, while they are handled
+    struct Connection* nextDue;
+    // neighbours in the loop's list of every open connection
+    struct Connection* previousOpen;
+    struct Connection* nextOpen;
+    struct EventLoop* loop;
+} Connection;
+
+/*
+ * Data structure which stores the information shared by every connection
+ * served by the event loop.
+ */
+typedef struct EventLoop {
+    int epoll;
+    int listenDiscriptor;
+    // time to start watching the listening socket again after accepting
+    // ran out of file descriptors, 0 while it is watched
+    long long acceptAt;
+    char* serverAuth;
+    ClientList* clientList;
+    // shard served by the loop, whose inbox wakes it
+    Shard* shard;
+    // deadlines of the connections
+    TimerWheel timers;
+    // every open connection, so they can all be handed to another server
+    Connection* open;
+    int openCount;
+} EventLoop;
+
+static Slab connectionSlab = SLAB_INITIALIZER(sizeof(Connection));
+
+/*
+ * Function which sets the events the event loop waits for on a connection.
+ * A parked connection is not read from, but is still written to.
+ * Parameters:
+ * connection - connection to watch
+ * writable - true if the connection's queue is waiting for writability
+ */
+static void watch_connection(Connection* connection, bool writable) {
+    struct epoll_event event;
+    event.events = (connection->parked ? 0 : EPOLLIN) |
+            (writable ? EPOLLOUT : 0);
+    event.data.ptr = connection;
+    epoll_ctl(connection->loop->epoll, EPOLL_CTL_MOD, connection->fd, &event);
+}
+
+/*
+ * Function which is told by a connection's outbound queue when it needs the
+ * socket to become writable, and updates the events the event loop waits for
+ * on the connection to match.
+ * Parameters:
+ * queue - outbound queue of the connection
+ * writable - true if the queue has bytes waiting to be written
+ */
+static void update_interest(OutQueue* queue, bool writable) {
+    watch_connection(queue->owner, writable);
+}
+
+/*
+ * Function which returns whether a connection's queue is waiting for the
+ * socket to become writable, rather than for held back output to be due.
+ * Parameters:
+ * connection - connection to check
+ * Return:
+ * bool - true if the connection should be watched for writability
+ */
+static bool write_wanted(Connection* connection) {
+    OutQueue* output = &connection->session.output;
+    return out_queue_flush_at(output) == 0 && out_queue_pending(output);
+}
+
+/*
+ * Function which makes sure a connection's timer expires by the given time,
+ * leaving it alone if it already expires sooner.
+ * Parameters:
+ * connection - connection with a new deadline
+ * when - time in microseconds of the deadline
+ */
+static void schedule_by(Connection* connection, long long when) {
+    TimerWheel* timers = &connection->loop->timers;
+    if (!timer_scheduled(&connection->timer) ||
+            when < timer_expires_at(timers, &connection->timer)) {
+        timer_wheel_schedule(timers, &connection->timer, when);
+    }
+}
+
+/*
+ * Function which is told by a connection's outbound queue when it starts
+ * holding frames back, and makes sure the connection's timer expires in
+ * time to flush the queue.
+ * Parameters:
+ * queue - outbound queue of the connection
+ * flushAt - time in microseconds by which the queue must be flushed
+ */
+static void schedule_flush(OutQueue* queue, long long flushAt) {
+    schedule_by(queue->owner, flushAt);
+}
+
+/*
+ * Function which works out the next of a connection's session's deadlines,
+ * if it has any, and makes sure the connection's timer expires by then.
+ * Parameters:
+ * connection - connection whose deadlines have changed
+ */
+static void arm_timer(Connection* connection) {
+    connection->deadline = session_check_deadlines(&connection->session,
+            now_usec());
+    if (connection->deadline > 0) {
+        schedule_by(connection, connection->deadline);
+    }
+}
+
+/*
+ * Function which creates a connection for a client socket, adds it to the
+ * loop's open connections and starts watching it.
+ * Parameters:
+ * loop - event loop that will serve the client
+ * fd - non-blocking socket connected to the client
+ * Return:
+ * Connection* - the new connection, whose session is yet to be set up
+ */
+static Connection* create_connection(EventLoop* loop, int fd) {
+    Connection* connection = slab_alloc(&connectionSlab);
+    memset(connection, 0, sizeof(Connection));
+    connection->fd = fd;
+    connection->loop = loop;
+    connection->nextOpen = loop->open;
+    if (loop->open != NULL) {
+        loop->open->previousOpen = connection;
+    }
+    loop->open = connection;
+    loop->openCount++;
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = connection;
+    epoll_ctl(loop->epoll, EPOLL_CTL_ADD, fd, &event);
+    return connection;
+}
+
+/*
+ * Function which accepts a new client socket and sends it the AUTH: prompt.
+ * Parameters:
+ * loop - event loop that will serve the client
+ * fd - non-blocking socket connected to the client
+ */
+static void open_connection(EventLoop* loop, int fd) {
+    int noDelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(int));
+    Connection* connection = create_connection(loop, fd);
+    session_open(&connection->session, fd, loop->clientList, loop->serverAuth,
+            false, update_interest, schedule_flush, connection);
+    arm_timer(connection);
+}
+
+/*
+ * Function which frees a connection's outbound queue and the connection
+ * itself once no other thread can still be pushing to the queue.
+ * Parameters:
+ * data - connection to free
+ */
+static void destroy_connection(void* data) {
+    Connection* connection = data;
+    out_queue_destroy(&connection->session.output);
+    slab_free(&connectionSlab, connection);
+}
+
+/*
+ * Function which releases everything held by a connection once it has
+ * closed or the client has left the server. The queue has been closed by
+ * then, but a thread using an older snapshot of the client list may still
+ * push to it, so the memory is only freed once that can no longer happen.
+ * Parameters:
+ * connection - connection to release
+ */
+static void free_connection(Connection* connection) {
+    timer_wheel_cancel(&connection->loop->timers, &connection->timer);
+    if (connection->previousOpen == NULL) {
+        connection->loop->open = connection->nextOpen;
+    } else {
+        connection->previousOpen->nextOpen = connection->nextOpen;
+    }
+    if (connection->nextOpen != NULL) {
+        connection->nextOpen->previousOpen = connection->previousOpen;
+    }
+    connection->loop->openCount--;
+    epoll_ctl(connection->loop->epoll, EPOLL_CTL_DEL, connection->fd, NULL);
+    close(connection->fd);
+    connection_closed(connection->session.clientList);
+    session_close(&connection->session);
+    epoch_retire(connection, destroy_connection);
+}
+
+/*
+ * Function which stops reading from a connection until the rate policy
+ * allows its client to send another command. Output for the client is still
+ * written while it is held back.
+ * Parameters:
+ * connection - connection to hold back
+ * resumeAt - time in microseconds at which the connection may continue
+ */
+static void park_connection(Connection* connection, long long resumeAt) {
+    connection->parked = true;
+    watch_connection(connection, write_wanted(connection));
+    connection->resumeAt = resumeAt;
+    schedule_by(connection, resumeAt);
+}
+
+/*
+ * Function which handles every complete line recieved from a connection,
+ * parking the connection if its client is held back by the rate policy. A
+ * connection which has moved on to another stage without a deadline pending
+ * has its timer armed for the new stage. A pending deadline is checked when
+ * it expires, and moved later if the stage allows.
+ * Parameters:
+ * connection - connection to handle lines from
+ */
+static void handle_lines(Connection* connection) {
+    SessionState state = connection->session.state;
+    long long resumeAt = session_handle_lines(&connection->session, 0);
+    if (connection->session.state != state &&
+            !connection->session.closing && connection->deadline == 0) {
+        arm_timer(connection);
+    }
+    if (resumeAt > 0) {
+        park_connection(connection, resumeAt);
+    }
+}
+
+/*
+ * Function which reads whatever is available from a connection with a single
+ * read and handles every complete line that has been recieved, so pipelined
+ * commands are all handled in one wakeup.
+ * Parameters:
+ * connection - connection which is readable
+ */
+static void read_connection(Connection* connection) {
+    ssize_t got = line_buffer_fill(&connection->session.input);
+    if (got > 0) {
+        stats_add(STAT_BYTES_IN, got);
+    }
+    handle_lines(connection);
+}
+
+/*
+ * Function which starts reading from a parked connection again now that the
+ * rate policy allows, and handles the lines it already has waiting.
+ * Parameters:
+ * connection - connection to resume
+ */
+static void resume_connection(Connection* connection) {
+    connection->parked = false;
+    watch_connection(connection, write_wanted(connection));
+    handle_lines(connection);
+}
+
+/*
+ * Function which handles whichever of a connection's deadlines have passed
+ * once its timer expires: held back output is flushed, the session's
+ * deadline is checked and a parked connection is resumed. The timer is then
+ * scheduled for the next of them.
+ * Parameters:
+ * connection - connection whose timer has expired
+ * now - current time in microseconds
+ */
+static void connection_due(Connection* connection, long long now) {
+    OutQueue* output = &connection->session.output;
+    long long flushAt = out_queue_flush_at(output);
+    if (flushAt > 0 && flushAt <= now) {
+        out_queue_flush(output);
+    }
+    if (connection->deadline > 0 && connection->deadline <= now) {
+        connection->deadline = session_check_deadlines(&connection->session,
+                now);
+    }
+    if (connection->parked && connection->resumeAt <= now &&
+            !connection->session.closing) {
+        resume_connection(connection);
+    }
+    if (connection->session.closing) {
+        free_connection(connection);
+        return;
+    }
+    long long when = connection->deadline;
+    if (connection->parked && (when == 0 || connection->resumeAt < when)) {
+        when = connection->resumeAt;
+    }
+    flushAt = out_queue_flush_at(output);
+    if (flushAt > 0 && (when == 0 || flushAt < when)) {
+        when = flushAt;
+    }
+    if (when > 0) {
+        schedule_by(connection, when);
+    }
+}
+
+/*
+ * Function which handles every connection whose timer has expired.
+ * Handling one can schedule the timers of others, so the expired timers are
+ * all taken off the wheel's list before any is handled.
+ * Parameters:
+ * loop - event loop the connections belong to
+ * Return:
+ * long long - time in microseconds the timers next need checking, or -1 if
+ * no timers are scheduled.
+ */
+static long long expire_timers(EventLoop* loop) {
+    long long now = now_usec();
+    Connection* due = NULL;
+    Timer* timer = timer_wheel_expire(&loop->timers, now);
+    while (timer != NULL) {
+        Connection* connection = (Connection*) timer;
+        timer = timer->next;
+        connection->nextDue = due;
+        due = connection;
+    }
+    while (due != NULL) {
+        Connection* connection = due;
+        due = connection->nextDue;
+        connection_due(connection, now);
+    }
+    return timer_wheel_next(&loop->timers);
+}
+
+/*
+ * Function which waits for events until the given time, with microsecond
+ * precision where the kernel supports it.
+ * Parameters:
+ * loop - event loop to wait on
+ * events - filled in with the events which happened
+ * until - time in microseconds to stop waiting, -1 to wait indefinitely
+ * Return:
+ * int - number of events filled in, -1 on error.
+ */
+static int wait_for_events(EventLoop* loop, struct epoll_event* events,
+        long long until) {
+    static bool precise = true;
+    long long wait = until < 0 ? -1 : until - now_usec();
+    if (until >= 0 && wait < 0) {
+        wait = 0;
+    }
+    if (precise) {
+        struct timespec timeout;
+        timeout.tv_sec = wait / USEC_PER_SEC;
+        timeout.tv_nsec = wait % USEC_PER_SEC * NSEC_PER_USEC;
+        int ready = epoll_pwait2(loop->epoll, events, MAX_EVENTS,
+                wait < 0 ? NULL : &timeout, NULL);
+        if (ready >= 0 || errno != ENOSYS) {
+            return ready;
+        }
+        precise = false;
+    }
+    return epoll_wait(loop->epoll, events, MAX_EVENTS,
+            wait < 0 ? -1 : (wait + USEC_PER_MSEC - 1) / USEC_PER_MSEC);
+}
+
+/*
+ * Function which accepts every pending connection on the listening socket.
+ * Parameters:
+ * loop - event loop which is listening
+ */
+static void accept_connections(EventLoop* loop) {
+    int fd;
+    while ((fd = accept4(loop->listenDiscriptor, NULL, NULL,
+            SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        if (admit_connection(loop->clientList)) {
+            open_connection(loop, fd);
+        } else {
+            close(fd);
+        }
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+            errno == ECONNABORTED) {
+        return;
+    }
+    loop->acceptAt = accept_backoff(errno);
+    if (loop->acceptAt == 0) {
+        communications_error();
+    }
+    epoll_ctl(loop->epoll, EPOLL_CTL_DEL, loop->listenDiscriptor, NULL);
+}
+
+/*
+ * Function which starts watching the listening socket again once the loop
+ * has backed off from it for long enough.
+ * Parameters:
+ * loop - event loop which is listening
+ * Return:
+ * long long - time to call the function again, -1 if the socket is being
+ * watched.
+ */
+static long long resume_accepting(EventLoop* loop) {
+    if (loop->acceptAt == 0) {
+        return -1;
+    }
+    if (now_usec() < loop->acceptAt) {
+        return loop->acceptAt;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = loop;
+    epoll_ctl(loop->epoll, EPOLL_CTL_ADD, loop->listenDiscriptor, &event);
+    loop->acceptAt = 0;
+    return -1;
+}
+
+/*
+ * Function which takes over this loop's share of the clients handed over by
+ * the server this one replaced, and once every loop has taken over its
+ * share, handles anything they sent which the old server had not.
+ * Parameters:
+ * loop - event loop taking the clients over
+ */
+static void adopt_connections(EventLoop* loop) {
+    Handoff* handoff = loop->clientList->handoff;
+    int index = 0;
+    for (HandoffConnection* handed = handoff->adopted; handed != NULL;
+            handed = handed->next, index++) {
+        if (index % loop->clientList->shardCount != loop->shard->index) {
+            continue;
+        }
+        fcntl(handed->fd, F_SETFL, fcntl(handed->fd, F_GETFL) | O_NONBLOCK);
+        Connection* connection = create_connection(loop, handed->fd);
+        session_adopt(&connection->session, handed, loop->clientList,
+                loop->serverAuth, false, update_interest, schedule_flush,
+                connection);
+        arm_timer(connection);
+    }
+    handoff_adopted(handoff);
+    Connection* connection = loop->open;
+    while (connection != NULL) {
+        Connection* next = connection->nextOpen;
+        if (!connection->session.closing) {
+            handle_lines(connection);
+        }
+        if (connection->session.closing) {
+            free_connection(connection);
+        }
+        connection = next;
+    }
+}
+
+/*
+ * Function which stops the loop once the handoff's eventfd says a server is
+ * taking over, and once every other thread has stopped sends it each of the
+ * loop's clients, along with anything other shards posted for them. Only
+ * returns if the handoff failed, as the server exits once it succeeds.
+ * Parameters:
+ * loop - event loop to hand off
+ */
+static void hand_off(EventLoop* loop) {
+    Handoff* handoff = loop->clientList->handoff;
+    if (!handoff_pause(handoff, loop->openCount, true)) {
+        return;
+    }
+    deliver_shard_messages(loop->clientList, loop->shard);
+    for (Connection* connection = loop->open; connection != NULL;
+            connection = connection->nextOpen) {
+        HandoffConnection saved;
+        session_save(&connection->session, &saved);
+        handoff_send(handoff, &saved);
+        handoff_connection_free(&saved);
+    }
+    handoff_finish(handoff);
+}
+
+/*
+ * Function which serves every client from the calling thread using epoll
+ * rather than a thread per client. Each connection moves through the AUTH,
+ * NAME and chatting stages as lines arrive, so the protocol seen by clients
+ * is the same as in the threaded server. Frames other shards post for this
+ * loop's clients are pushed to them when the shard's eventfd wakes the loop.
+ * Clients handed over by a server this one replaced are served alongside
+ * those it accepts. This function never returns.
+ * Parameters:
+ * listenDiscriptor - file descriptor the server is listening on
+ * serverAuth - the auth string provided to the server
+ * clientList - list of clients connected to the server
+ * shard - shard served by the loop
+ */
+void run_event_loop(int listenDiscriptor, char* serverAuth,
+        ClientList* clientList, Shard* shard) {
+    EventLoop loop;
+    struct epoll_event events[MAX_EVENTS];
+    loop.listenDiscriptor = listenDiscriptor;
+    loop.acceptAt = 0;
+    loop.serverAuth = serverAuth;
+    loop.clientList = clientList;
+    loop.shard = shard;
+    loop.open = NULL;
+    loop.openCount = 0;
+    timer_wheel_init(&loop.timers, TIMER_TICK, now_usec());
+    loop.epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epoll < 0) {
+        communications_error();
+    }
+    fcntl(listenDiscriptor, F_SETFL,
+            fcntl(listenDiscriptor, F_GETFL) | O_NONBLOCK);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &loop;
+    epoll_ctl(loop.epoll, EPOLL_CTL_ADD, listenDiscriptor, &event);
+    event.data.ptr = shard;
+    epoll_ctl(loop.epoll, EPOLL_CTL_ADD, shard->wakeDiscriptor, &event);
+    Handoff* handoff = clientList->handoff;
+    if (handoff != NULL) {
+        event.data.ptr = handoff;
+        epoll_ctl(loop.epoll, EPOLL_CTL_ADD, handoff->wakeDiscriptor,
+                &event);
+        if (handoff->adoptedCount > 0) {
+            adopt_connections(&loop);
+        }
+    }
+
+    long long until = -1;
+    while (1) {
+        int ready = wait_for_events(&loop, events, until);
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.ptr == &loop) {
+                accept_connections(&loop);
+                continue;
+            }
+            if (events[i].data.ptr == shard) {
+                deliver_shard_messages(clientList, shard);
+                continue;
+            }
+            if (events[i].data.ptr == handoff) {
+                hand_off(&loop);
+                continue;
+            }
+            Connection* connection = events[i].data.ptr;
+            if (events[i].events & EPOLLOUT) {
+                out_queue_flush(&connection->session.output);
+            }
+            if (connection->parked) {
+                // a client which has hung up is not waited for
+                if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                    session_lost(&connection->session);
+                }
+            } else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                read_connection(connection);
+            }
+            if (connection->session.closing) {
+                free_connection(connection);
+            }
+        }
+        until = expire_timers(&loop);
+        long long acceptAt = resume_accepting(&loop);
+        if (acceptAt >= 0 && (until < 0 || acceptAt < until)) {
+            until = acceptAt;
+        }
+    }
+}
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include "frame.h"
+#include "slab.h"
+#include "stats.h"
+#define FRAME_CLASSES 7
+#define SMALLEST_FRAME 64
+
+/*
+ * Slabs holding frames of each size class, each twice the size of the last.
+ */
+static Slab frameSlabs[FRAME_CLASSES] = {
+    SLAB_INITIALIZER(SMALLEST_FRAME),
+    SLAB_INITIALIZER(SMALLEST_FRAME << 1),
+    SLAB_INITIALIZER(SMALLEST_FRAME << 2),
+    SLAB_INITIALIZER(SMALLEST_FRAME << 3),
+    SLAB_INITIALIZER(SMALLEST_FRAME << 4),
+    SLAB_INITIALIZER(SMALLEST_FRAME << 5),
+    SLAB_INITIALIZER(SMALLEST_FRAME << 6)
+};
+
+/*
+ * Function which finds the size class of a frame holding the given number
+ * of bytes.
+ * Parameters:
+ * length - number of bytes in the frame
+ * Return:
+ * int - index of the frame's slab, or FRAME_CLASSES if the frame is too
+ * large for any of them
+ */
+static int frame_class(size_t length) {
+    size_t size = sizeof(Frame) + length + 1;
+    int class = 0;
+    while (class < FRAME_CLASSES && (SMALLEST_FRAME << class) < size) {
+        class++;
+    }
+    return class;
+}
+
+/*
+ * Function which allocates a frame able to hold the given number of bytes
+ * (plus a null terminator, which is not sent). The caller holds the only
+ * reference to the new frame. Frames come from the slab for their size
+ * class, and only frames too large for any class are allocated with malloc.
+ * Parameters:
+ * length - number of bytes in the frame
+ * Return:
+ * Frame* - the new frame
+ */
+Frame* frame_create(size_t length) {
+    Frame* frame;
+    int class = frame_class(length);
+    if (class < FRAME_CLASSES) {
+        frame = slab_alloc(&frameSlabs[class]);
+    } else {
+        frame = malloc(sizeof(Frame) + length + 1);
+        stats_add(STAT_MALLOC, 1);
+    }
+    frame->references = 1;
+    frame->received = 0;
+    frame->sequence = 0;
+    frame->urgent = false;
+    frame->binary = NULL;
+    frame->length = length;
+    frame->data[length] = '\0';
+    return frame;
+}
+
+/*
+ * Function which builds a frame from a printf style format.
+ * Parameters:
+ * format - format of the frame's contents
+ * Return:
+ * Frame* - the new frame, with a single reference held by the caller
+ */
+Frame* frame_format(const char* format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(NULL, 0, format, arguments);
+    va_end(arguments);
+    Frame* frame = frame_create(length);
+    va_start(arguments, format);
+    vsnprintf(frame->data, length + 1, format, arguments);
+    va_end(arguments);
+    return frame;
+}
+
+/*
+ * Function which takes another reference to a frame.
+ * Parameters:
+ * frame - frame to reference
+ * Return:
+ * Frame* - the same frame
+ */
+Frame* frame_ref(Frame* frame) {
+    __atomic_fetch_add(&frame->references, 1, __ATOMIC_RELAXED);
+    return frame;
+}
+
+/*
+ * Function which releases a reference to a frame, freeing it once no
+ * references remain. The frame's binary encoding is released with it.
+ * Parameters:
+ * frame - frame to release
+ */
+void frame_release(Frame* frame) {
+    if (__atomic_sub_fetch(&frame->references, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (frame->binary != NULL) {
+            frame_release(frame->binary);
+        }
+        int class = frame_class(frame->length);
+        if (class < FRAME_CLASSES) {
+            slab_free(&frameSlabs[class], frame);
+        } else {
+            free(frame);
+        }
+    }
+}
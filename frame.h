@@ -0,0 +1,37 @@
+#ifndef _FRAME_H
+#define _FRAME_H
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * An encoded line which is ready to be sent to clients. A frame is never
+ * changed once it has been built, so a single frame can sit in the queue of
+ * every client it is sent to. It is freed when the last reference to it is
+ * released.
+ */
+typedef struct Frame {
+    int references;
+    // time the command which produced the frame was recieved, so its
+    // delivery can be timed (0 if it is not timed)
+    long long received;
+    // set for control lines which are written as soon as they are queued
+    // rather than being held back to be written with later frames
+    bool urgent;
+    // the same command encoded for clients using binary framing, owned by
+    // this frame (NULL if it is only ever sent to text clients)
+    struct Frame* binary;
+    // position of a message in its room's backlog
+    unsigned long sequence;
+    size_t length;
+    char data[];
+} Frame;
+
+Frame* frame_create(size_t length);
+
+Frame* frame_format(const char* format, ...);
+
+Frame* frame_ref(Frame* frame);
+
+void frame_release(Frame* frame);
+
+#endif
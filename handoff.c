@@ -0,0 +1,774 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "handoff.h"
+#include "server.h"
+#include "session.h"
+#include "chatlog.h"
+#include "shared.h"
+#define HANDOFF_MAGIC 0x43484f46
+#define HANDOFF_VERSION 1
+// bytes of a connection's buffers sent in each DATA record
+#define HANDOFF_CHUNK (64 * 1024)
+// seconds either server waits for the other before giving up
+#define HANDOFF_TIMEOUT 10
+// milliseconds between checks that every serving thread has stopped
+#define PAUSE_POLL_MSEC 10
+#define NSEC_PER_MSEC 1000000
+#define NSEC_PER_SEC 1000000000
+#define USEC_PER_SEC 1000000LL
+
+/*
+ * What a record sent between the two servers carries.
+ */
+typedef enum {
+    // old to new: ready to hand off, with the version of the records
+    RECORD_HELLO,
+    // old to new: a listening socket (attached)
+    RECORD_LISTENER,
+    // old to new: a client's socket (attached), its state and the lengths
+    // of its buffers, which follow in DATA records
+    RECORD_CONNECTION,
+    RECORD_DATA,
+    // old to new: everything has been sent, with how many of each
+    RECORD_END,
+    // new to old: everything has been recieved
+    RECORD_ACK,
+    // old to new: the old server is exiting, so the new one owns the clients
+    RECORD_COMMIT
+} RecordKind;
+
+/*
+ * Fixed header of every record but DATA, which is raw bytes. Both servers
+ * run on the same machine, so fields are in host byte order.
+ */
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t kind;
+    // CONNECTION: a HandoffConnection's state, flags (binaryWanted,
+    // binary, sayRejected and discarding), piece and command counts
+    uint32_t state;
+    uint32_t flags;
+    uint32_t piece;
+    int32_t say;
+    int32_t kick;
+    int32_t list;
+    uint64_t remaining;
+    // CONNECTION: lengths of the name, room, input and output. END: how
+    // many listeners and connections were sent
+    uint64_t lengths[4];
+} HandoffRecord;
+
+enum {
+    FLAG_BINARY_WANTED = 1,
+    FLAG_BINARY = 2,
+    FLAG_SAY_REJECTED = 4,
+    FLAG_DISCARDING = 8
+};
+
+/*
+ * Function which fills in the header of a record with nothing but its kind.
+ * Parameters:
+ * record - record to fill in
+ * kind - what the record carries
+ */
+static void init_record(HandoffRecord* record, RecordKind kind) {
+    memset(record, 0, sizeof(HandoffRecord));
+    record->magic = HANDOFF_MAGIC;
+    record->version = HANDOFF_VERSION;
+    record->kind = kind;
+}
+
+/*
+ * Function which sends one record to the other server, with a file
+ * descriptor attached if one is given.
+ * Parameters:
+ * peer - connection to the other server
+ * data - bytes of the record
+ * length - number of bytes
+ * fd - file descriptor to pass, -1 for none
+ * Return:
+ * bool - false if the record could not be sent.
+ */
+static bool send_record(int peer, const void* data, size_t length, int fd) {
+    struct iovec part = {(void*) data, length};
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    if (fd >= 0) {
+        memset(&control, 0, sizeof(control));
+        message.msg_control = control.space;
+        message.msg_controllen = sizeof(control.space);
+        struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(header), &fd, sizeof(int));
+    }
+    ssize_t sent;
+    do {
+        sent = sendmsg(peer, &message, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    return sent == (ssize_t) length;
+}
+
+/*
+ * Function which recieves one record from the other server, along with any
+ * file descriptor attached to it.
+ * Parameters:
+ * peer - connection to the other server
+ * data - filled in with the bytes of the record
+ * size - most bytes the record may have
+ * fd - filled in with the attached file descriptor, -1 if there is none
+ * Return:
+ * ssize_t - bytes recieved, -1 if nothing could be recieved or the record
+ * was too long.
+ */
+static ssize_t receive_record(int peer, void* data, size_t size, int* fd) {
+    struct iovec part = {data, size};
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    message.msg_control = control.space;
+    message.msg_controllen = sizeof(control.space);
+    ssize_t got;
+    do {
+        got = recvmsg(peer, &message, MSG_CMSG_CLOEXEC);
+    } while (got < 0 && errno == EINTR);
+    *fd = -1;
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    if (got >= 0 && header != NULL && header->cmsg_level == SOL_SOCKET &&
+            header->cmsg_type == SCM_RIGHTS) {
+        memcpy(fd, CMSG_DATA(header), sizeof(int));
+    }
+    if (got <= 0 || (message.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        if (*fd >= 0) {
+            close(*fd);
+            *fd = -1;
+        }
+        return -1;
+    }
+    return got;
+}
+
+/*
+ * Function which recieves a record with a fixed header of the expected
+ * kind and no attached file descriptor.
+ * Parameters:
+ * peer - connection to the other server
+ * record - filled in with the record
+ * kind - kind of record expected
+ * Return:
+ * bool - false if anything else was recieved.
+ */
+static bool expect_record(int peer, HandoffRecord* record, RecordKind kind) {
+    int fd;
+    ssize_t got = receive_record(peer, record, sizeof(HandoffRecord), &fd);
+    if (fd >= 0) {
+        close(fd);
+        return false;
+    }
+    return got == sizeof(HandoffRecord) && record->magic == HANDOFF_MAGIC &&
+            record->version == HANDOFF_VERSION && record->kind == kind;
+}
+
+/*
+ * Function which sends bytes to the other server as DATA records of at most
+ * HANDOFF_CHUNK bytes each.
+ * Parameters:
+ * peer - connection to the other server
+ * data - bytes to send
+ * length - number of bytes
+ * Return:
+ * bool - false if they could not be sent.
+ */
+static bool send_data(int peer, const char* data, size_t length) {
+    while (length > 0) {
+        size_t chunk = length < HANDOFF_CHUNK ? length : HANDOFF_CHUNK;
+        if (!send_record(peer, data, chunk, -1)) {
+            return false;
+        }
+        data += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
+/*
+ * Function which recieves bytes sent with send_data(), null terminated.
+ * Parameters:
+ * peer - connection to the other server
+ * length - number of bytes expected
+ * Return:
+ * char* - the bytes, NULL if they could not all be recieved.
+ */
+static char* receive_data(int peer, size_t length) {
+    char* data = malloc(length + 1);
+    size_t got = 0;
+    int fd;
+    while (got < length) {
+        size_t chunk = length - got < HANDOFF_CHUNK ? length - got :
+                HANDOFF_CHUNK;
+        if (receive_record(peer, data + got, chunk, &fd) !=
+                (ssize_t) chunk || fd >= 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            free(data);
+            return NULL;
+        }
+        got += chunk;
+    }
+    data[length] = '\0';
+    return data;
+}
+
+/*
+ * Function which sends a connection's state and socket to the server
+ * taking over, followed by its name, room, input and output.
+ * Parameters:
+ * peer - connection to the other server
+ * connection - connection to send
+ * Return:
+ * bool - false if it could not be sent.
+ */
+static bool send_connection(int peer, HandoffConnection* connection) {
+    HandoffRecord record;
+    init_record(&record, RECORD_CONNECTION);
+    record.state = connection->state;
+    record.flags = (connection->binaryWanted ? FLAG_BINARY_WANTED : 0) |
+            (connection->binary ? FLAG_BINARY : 0) |
+            (connection->sayRejected ? FLAG_SAY_REJECTED : 0) |
+            (connection->discarding ? FLAG_DISCARDING : 0);
+    record.piece = connection->piece;
+    record.say = connection->say;
+    record.kick = connection->kick;
+    record.list = connection->list;
+    record.remaining = connection->remaining;
+    record.lengths[0] = connection->name == NULL ? 0 :
+            strlen(connection->name);
+    record.lengths[1] = connection->room == NULL ? 0 :
+            strlen(connection->room);
+    record.lengths[2] = connection->inputLength;
+    record.lengths[3] = connection->outputLength;
+    return send_record(peer, &record, sizeof(record), connection->fd) &&
+            send_data(peer, connection->name, record.lengths[0]) &&
+            send_data(peer, connection->room, record.lengths[1]) &&
+            send_data(peer, connection->input, record.lengths[2]) &&
+            send_data(peer, connection->output, record.lengths[3]);
+}
+
+/*
+ * Function which recieves the buffers of a connection whose CONNECTION
+ * record has been recieved.
+ * Parameters:
+ * peer - connection to the other server
+ * record - the connection's record
+ * connection - connection to fill in
+ * Return:
+ * bool - false if they could not all be recieved.
+ */
+static bool receive_buffers(int peer, HandoffRecord* record,
+        HandoffConnection* connection) {
+    connection->state = record->state;
+    connection->binaryWanted = record->flags & FLAG_BINARY_WANTED;
+    connection->binary = record->flags & FLAG_BINARY;
+    connection->sayRejected = record->flags & FLAG_SAY_REJECTED;
+    connection->discarding = record->flags & FLAG_DISCARDING;
+    connection->piece = record->piece;
+    connection->say = record->say;
+    connection->kick = record->kick;
+    connection->list = record->list;
+    connection->remaining = record->remaining;
+    connection->inputLength = record->lengths[2];
+    connection->outputLength = record->lengths[3];
+    if (record->state == STATE_CHAT) {
+        connection->name = receive_data(peer, record->lengths[0]);
+        connection->room = receive_data(peer, record->lengths[1]);
+        if (connection->name == NULL || connection->room == NULL) {
+            return false;
+        }
+    } else if (record->lengths[0] > 0 || record->lengths[1] > 0 ||
+            record->state > STATE_CHAT) {
+        return false;
+    }
+    connection->input = receive_data(peer, connection->inputLength);
+    connection->output = receive_data(peer, connection->outputLength);
+    return connection->input != NULL && connection->output != NULL;
+}
+
+/*
+ * Function which frees what is known about a connection being handed off,
+ * but does not close its socket.
+ * Parameters:
+ * connection - connection to free
+ */
+void handoff_connection_free(HandoffConnection* connection) {
+    free(connection->name);
+    free(connection->room);
+    free(connection->input);
+    free(connection->output);
+}
+
+/*
+ * Function which closes and frees everything taken over so far from a server
+ * whose handoff failed.
+ * Parameters:
+ * handoff - handoff which failed
+ */
+static void abandon_adopted(Handoff* handoff) {
+    while (handoff->adopted != NULL) {
+        HandoffConnection* connection = handoff->adopted;
+        handoff->adopted = connection->next;
+        close(connection->fd);
+        handoff_connection_free(connection);
+        free(connection);
+    }
+    for (int i = 0; i < handoff->adoptedListenerCount; i++) {
+        close(handoff->adoptedListeners[i]);
+    }
+    free(handoff->adoptedListeners);
+    handoff->adoptedListeners = NULL;
+    handoff->adoptedListenerCount = 0;
+    handoff->adoptedCount = 0;
+}
+
+/*
+ * Function which takes over the listening sockets and clients of the server
+ * listening on the handoff socket, which exits once it has confirmed that
+ * everything arrived.
+ * Parameters:
+ * handoff - handoff of the server taking over
+ * peer - connection to the old server
+ * Return:
+ * bool - false if anything went wrong, in which case the old server carries
+ * on serving its clients.
+ */
+static bool take_over(Handoff* handoff, int peer) {
+    HandoffRecord record;
+    HandoffConnection* last = NULL;
+    int fd;
+    struct timeval timeout = {HANDOFF_TIMEOUT, 0};
+    setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(peer, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (!expect_record(peer, &record, RECORD_HELLO)) {
+        return false;
+    }
+    while (1) {
+        ssize_t got = receive_record(peer, &record, sizeof(record), &fd);
+        if (got != sizeof(record) || record.magic != HANDOFF_MAGIC ||
+                record.version != HANDOFF_VERSION) {
+            break;
+        }
+        if (record.kind == RECORD_LISTENER && fd >= 0) {
+            handoff->adoptedListeners = realloc(handoff->adoptedListeners,
+                    (handoff->adoptedListenerCount + 1) * sizeof(int));
+            handoff->adoptedListeners[handoff->adoptedListenerCount++] = fd;
+        } else if (record.kind == RECORD_CONNECTION && fd >= 0) {
+            HandoffConnection* connection = calloc(1,
+                    sizeof(HandoffConnection));
+            connection->fd = fd;
+            if (last == NULL) {
+                handoff->adopted = connection;
+            } else {
+                last->next = connection;
+            }
+            last = connection;
+            handoff->adoptedCount++;
+            if (!receive_buffers(peer, &record, connection)) {
+                break;
+            }
+        } else if (record.kind == RECORD_END && fd < 0) {
+            if (record.lengths[0] != (uint64_t)
+                    handoff->adoptedListenerCount ||
+                    record.lengths[1] != (uint64_t) handoff->adoptedCount) {
+                break;
+            }
+            init_record(&record, RECORD_ACK);
+            return send_record(peer, &record, sizeof(record), -1) &&
+                    expect_record(peer, &record, RECORD_COMMIT);
+        } else {
+            if (fd >= 0) {
+                close(fd);
+            }
+            break;
+        }
+    }
+    return false;
+}
+
+/*
+ * Function which fills in the address of a Unix socket.
+ * Parameters:
+ * address - address to fill in
+ * path - path of the socket
+ * Return:
+ * bool - false if the path is too long.
+ */
+static bool unix_address(struct sockaddr_un* address, const char* path) {
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        return false;
+    }
+    strcpy(address->sun_path, path);
+    return true;
+}
+
+/*
+ * Function which sets up a server's side of handing its clients off. If a
+ * server is already listening on the handoff socket its listening sockets
+ * and clients are taken over first, and the server exits if that fails
+ * partway, as the old server carries on serving them. Either way the
+ * socket is then listened on for the server which will replace this one.
+ * Parameters:
+ * path - path of the handoff socket
+ * Return:
+ * Handoff* - the server's handoff, NULL if the socket cannot be used.
+ */
+Handoff* handoff_open(const char* path) {
+    struct sockaddr_un address;
+    if (!unix_address(&address, path)) {
+        return NULL;
+    }
+    Handoff* handoff = calloc(1, sizeof(Handoff));
+    handoff->path = strdup(path);
+    handoff->peer = -1;
+    pthread_mutex_init(&handoff->mutex, NULL);
+    pthread_mutex_init(&handoff->sendMutex, NULL);
+    pthread_cond_init(&handoff->changed, NULL);
+    handoff->wakeDiscriptor = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    int peer = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (connect(peer, (struct sockaddr*) &address, sizeof(address)) == 0) {
+        if (!take_over(handoff, peer)) {
+            abandon_adopted(handoff);
+            fprintf(stderr, "Cannot take over from %s\n", path);
+            communications_error();
+        }
+    } else if (errno != ENOENT && errno != ECONNREFUSED) {
+        close(peer);
+        return NULL;
+    }
+    close(peer);
+
+    // the old server has exited, or there was none, so the path is free
+    unlink(path);
+    handoff->listenDiscriptor = socket(AF_UNIX, SOCK_SEQPACKET |
+            SOCK_CLOEXEC, 0);
+    if (bind(handoff->listenDiscriptor, (struct sockaddr*) &address,
+            sizeof(address)) < 0 || chmod(path, S_IRUSR | S_IWUSR) < 0 ||
+            listen(handoff->listenDiscriptor, 1) < 0) {
+        return NULL;
+    }
+    return handoff;
+}
+
+/*
+ * Function which checks that the process connected to the handoff socket is
+ * run by the same user as the server (or by root), as it is about to be
+ * given every client.
+ * Parameters:
+ * peer - connection to the other process
+ * Return:
+ * bool - true if it may take over.
+ */
+static bool trusted_peer(int peer) {
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+    if (getsockopt(peer, SOL_SOCKET, SO_PEERCRED, &credentials,
+            &length) < 0) {
+        return false;
+    }
+    return credentials.uid == geteuid() || credentials.uid == 0;
+}
+
+/*
+ * Function which waits on the handoff's condition for a short while, so
+ * the caller can check whether its deadline has passed. The caller holds
+ * the mutex.
+ * Parameters:
+ * handoff - handoff to wait on
+ */
+static void wait_briefly(Handoff* handoff) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += PAUSE_POLL_MSEC * NSEC_PER_MSEC;
+    if (until.tv_nsec >= NSEC_PER_SEC) {
+        until.tv_sec++;
+        until.tv_nsec -= NSEC_PER_SEC;
+    }
+    pthread_cond_timedwait(&handoff->changed, &handoff->mutex, &until);
+}
+
+/*
+ * Function which stops every serving thread and, once each holds all of its
+ * connections where no other thread can touch them, has them send the
+ * connections to the server taking over. The caller holds the mutex.
+ * Parameters:
+ * handoff - handoff taking place
+ * Return:
+ * bool - true if every connection was sent.
+ */
+static bool collect_connections(Handoff* handoff) {
+    HandoffRecord record;
+    long long deadline = now_usec() + HANDOFF_TIMEOUT * USEC_PER_SEC;
+    uint64_t wake = 1;
+    handoff->phase = HANDOFF_PAUSE;
+    write(handoff->wakeDiscriptor, &wake, sizeof(wake));
+    // a connection being accepted or closed is counted by the thread doing
+    // so, which has not stopped until it is done
+    while (handoff->pausedThreads < handoff->threads || handoff->held !=
+            __atomic_load_n(&handoff->clientList->connections,
+            __ATOMIC_RELAXED)) {
+        if (now_usec() >= deadline) {
+            return false;
+        }
+        wait_briefly(handoff);
+    }
+    init_record(&record, RECORD_LISTENER);
+    for (int i = 0; i < handoff->listenerCount; i++) {
+        if (!send_record(handoff->peer, &record, sizeof(record),
+                handoff->listeners[i])) {
+            return false;
+        }
+    }
+    handoff->phase = HANDOFF_COLLECT;
+    pthread_cond_broadcast(&handoff->changed);
+    while (handoff->finished < handoff->paused) {
+        pthread_cond_wait(&handoff->changed, &handoff->mutex);
+    }
+    return !handoff->failed;
+}
+
+/*
+ * Function which lets every stopped thread carry on serving after a handoff
+ * failed. The caller holds the mutex.
+ * Parameters:
+ * handoff - handoff which failed
+ */
+static void resume_serving(Handoff* handoff) {
+    uint64_t wakes;
+    read(handoff->wakeDiscriptor, &wakes, sizeof(wakes));
+    handoff->phase = HANDOFF_IDLE;
+    handoff->generation++;
+    handoff->pausedThreads = 0;
+    handoff->paused = 0;
+    handoff->held = 0;
+    handoff->finished = 0;
+    handoff->failed = false;
+    pthread_cond_broadcast(&handoff->changed);
+}
+
+/*
+ * Function which hands every client to the server which has connected to
+ * the handoff socket, exiting once it has confirmed that everything
+ * arrived. Everything logged so far is synced first, so the new server's
+ * log follows on from it.
+ * Parameters:
+ * handoff - handoff of this server
+ * peer - connection to the server taking over
+ * Return:
+ * bool - only returns (false) if the handoff failed, in which case the
+ * server has carried on serving its clients.
+ */
+static bool hand_off(Handoff* handoff, int peer) {
+    HandoffRecord record;
+    struct timeval timeout = {HANDOFF_TIMEOUT, 0};
+    setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(peer, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    init_record(&record, RECORD_HELLO);
+    if (!send_record(peer, &record, sizeof(record), -1)) {
+        return false;
+    }
+    pthread_mutex_lock(&handoff->mutex);
+    handoff->peer = peer;
+    bool sent = collect_connections(handoff);
+    pthread_mutex_unlock(&handoff->mutex);
+    if (sent) {
+        if (handoff->clientList->log != NULL) {
+            chat_log_flush(handoff->clientList->log);
+        }
+        init_record(&record, RECORD_END);
+        record.lengths[0] = handoff->listenerCount;
+        record.lengths[1] = handoff->held;
+        sent = send_record(peer, &record, sizeof(record), -1) &&
+                expect_record(peer, &record, RECORD_ACK);
+        init_record(&record, RECORD_COMMIT);
+        if (sent && send_record(peer, &record, sizeof(record), -1)) {
+            // the stopped threads never touch the clients again, and the
+            // sockets stay open in the new server
+            exit(EXIT_SUCCESS);
+        }
+    }
+    pthread_mutex_lock(&handoff->mutex);
+    resume_serving(handoff);
+    pthread_mutex_unlock(&handoff->mutex);
+    return false;
+}
+
+/*
+ * Thread function which waits for a server to connect to the handoff socket
+ * and hands it every client, for as long as the server runs.
+ * Parameters:
+ * data - Handoff of this server
+ */
+static void* handoff_thread(void* data) {
+    Handoff* handoff = data;
+    while (1) {
+        int peer = accept4(handoff->listenDiscriptor, NULL, NULL,
+                SOCK_CLOEXEC);
+        if (peer < 0) {
+            // out of file descriptors, wait for some to be freed rather
+            // than spinning
+            long long wait = accept_backoff(errno) - now_usec();
+            if (wait > 0) {
+                usleep(wait);
+            }
+            continue;
+        }
+        if (trusted_peer(peer)) {
+            hand_off(handoff, peer);
+        }
+        close(peer);
+    }
+    return NULL;
+}
+
+/*
+ * Function which starts waiting for a server to take over, once the server
+ * knows what it will be serving.
+ * Parameters:
+ * handoff - handoff of this server
+ * clientList - list of clients connected to the server
+ * listeners - sockets the server accepts clients on
+ * listenerCount - number of listening sockets
+ * threads - number of threads which serve for as long as the server runs,
+ * each of which must call handoff_adopted() before serving if anything was
+ * taken over
+ */
+void handoff_start(Handoff* handoff, ClientList* clientList,
+        int* listeners, int listenerCount, int threads) {
+    pthread_t thread;
+    handoff->clientList = clientList;
+    handoff->listeners = listeners;
+    handoff->listenerCount = listenerCount;
+    handoff->threads = threads;
+    pthread_barrier_init(&handoff->adopting, NULL, threads);
+    pthread_create(&thread, NULL, handoff_thread, handoff);
+    pthread_detach(thread);
+}
+
+/*
+ * Function which is called by a thread serving clients once the handoff's
+ * eventfd wakes it, and stops it until either every thread has stopped, so
+ * it may send its connections to the server taking over, or the handoff
+ * has failed. The thread must hold no locks and not be inside an epoch.
+ * Parameters:
+ * handoff - handoff of this server
+ * held - number of connections the thread serves
+ * serving - true for a thread serving for as long as the server runs,
+ * false for one serving a single client
+ * Return:
+ * bool - true if the thread should send its connections with
+ * handoff_send() and then call handoff_finish(), false if it should carry
+ * on serving.
+ */
+bool handoff_pause(Handoff* handoff, int held, bool serving) {
+    pthread_mutex_lock(&handoff->mutex);
+    unsigned generation = handoff->generation;
+    if (handoff->phase != HANDOFF_PAUSE) {
+        pthread_mutex_unlock(&handoff->mutex);
+        return false;
+    }
+    handoff->pausedThreads += serving;
+    handoff->paused++;
+    handoff->held += held;
+    pthread_cond_broadcast(&handoff->changed);
+    while (handoff->phase == HANDOFF_PAUSE &&
+            handoff->generation == generation) {
+        pthread_cond_wait(&handoff->changed, &handoff->mutex);
+    }
+    bool collect = handoff->generation == generation;
+    pthread_mutex_unlock(&handoff->mutex);
+    return collect;
+}
+
+/*
+ * Function which sends one connection to the server taking over. Once
+ * any connection could not be sent the rest are not tried.
+ * Parameters:
+ * handoff - handoff of this server
+ * connection - connection to send, whose socket stays open
+ */
+void handoff_send(Handoff* handoff, HandoffConnection* connection) {
+    pthread_mutex_lock(&handoff->sendMutex);
+    if (!handoff->failed && !send_connection(handoff->peer, connection)) {
+        handoff->failed = true;
+    }
+    pthread_mutex_unlock(&handoff->sendMutex);
+}
+
+/*
+ * Function which is called by a thread once it has sent its connections,
+ * and only returns if the handoff failed, in which case the thread carries
+ * on serving them. Otherwise the server exits while the thread waits.
+ * Parameters:
+ * handoff - handoff of this server
+ */
+void handoff_finish(Handoff* handoff) {
+    pthread_mutex_lock(&handoff->mutex);
+    unsigned generation = handoff->generation;
+    handoff->finished++;
+    pthread_cond_broadcast(&handoff->changed);
+    while (handoff->generation == generation) {
+        pthread_cond_wait(&handoff->changed, &handoff->mutex);
+    }
+    pthread_mutex_unlock(&handoff->mutex);
+}
+
+/*
+ * Function which is called by every serving thread once it has taken over
+ * its share of the connections handed over by the old server, and waits
+ * until all have, so no client is sent anything by a thread which has not
+ * taken over the clients it would tell. The last to arrive frees what the
+ * old server sent.
+ * Parameters:
+ * handoff - handoff of this server
+ */
+void handoff_adopted(Handoff* handoff) {
+    if (pthread_barrier_wait(&handoff->adopting) !=
+            PTHREAD_BARRIER_SERIAL_THREAD) {
+        return;
+    }
+    while (handoff->adopted != NULL) {
+        HandoffConnection* connection = handoff->adopted;
+        handoff->adopted = connection->next;
+        handoff_connection_free(connection);
+        free(connection);
+    }
+    free(handoff->adoptedListeners);
+    handoff->adoptedListeners = NULL;
+}
@@ -0,0 +1,117 @@
+#ifndef _HANDOFF_H
+#define _HANDOFF_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "linebuf.h"
+
+struct ClientList;
+
+/*
+ * Everything a server handing its clients off knows about one connection,
+ * which is passed to the server taking over along with the socket itself.
+ */
+typedef struct HandoffConnection {
+    int fd;
+    // stage of the protocol the client is in (a SessionState), and whether
+    // it asked for and has switched to binary framing
+    int state;
+    bool binaryWanted;
+    bool binary;
+    // name and room of a client in the chat (NULL otherwise), and how many of
+    // each command it has sent
+    char* name;
+    char* room;
+    int say;
+    int kick;
+    int list;
+    bool sayRejected;
+    // bytes recieved from the client but not yet handled, and how far the
+    // buffer had got through a line or record being handed out in pieces
+    char* input;
+    size_t inputLength;
+    LinePiece piece;
+    size_t remaining;
+    bool discarding;
+    // bytes queued for the client but not yet written
+    char* output;
+    size_t outputLength;
+    struct HandoffConnection* next;
+} HandoffConnection;
+
+/*
+ * How far a handoff to another server has got.
+ */
+typedef enum {
+    HANDOFF_IDLE,
+    // serving threads are stopping, each reporting how many connections it
+    // holds once it has
+    HANDOFF_PAUSE,
+    // every connection is held by a stopped thread, which is now sending
+    // them to the server taking over
+    HANDOFF_COLLECT
+} HandoffPhase;
+
+/*
+ * A server's side of handing its clients to a new server process without
+ * dropping them, and of taking them over from the server it replaces. The
+ * server listens on a Unix socket for a new server to connect. When one
+ * does, the eventfd wakes every serving thread, which stops where it holds
+ * no locks, and once all have stopped each sends its own connections with
+ * their sockets attached. The old server exits once the new one has
+ * everything, and resumes serving if the handoff fails at any point.
+ */
+typedef struct Handoff {
+    char* path;
+    int listenDiscriptor;
+    struct ClientList* clientList;
+    // listening sockets the server accepts clients on
+    int* listeners;
+    int listenerCount;
+    // connections and listening sockets taken over from the server this one
+    // replaced, and the loops which must all have added their share of the
+    // clients before any starts serving
+    HandoffConnection* adopted;
+    int adoptedCount;
+    int* adoptedListeners;
+    int adoptedListenerCount;
+    pthread_barrier_t adopting;
+    // readable while serving threads are being asked to stop
+    int wakeDiscriptor;
+    // connection to the server taking over, written under sendMutex
+    int peer;
+    pthread_mutex_t sendMutex;
+    bool failed;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    HandoffPhase phase;
+    // changes every time a handoff fails, so stopped threads can tell
+    // they should carry on
+    unsigned generation;
+    // threads which serve for as long as the server runs (the loops or the
+    // handshake workers), how many of them and of any other threads have
+    // stopped, the connections the stopped threads hold, and how many have
+    // finished sending them
+    int threads;
+    int pausedThreads;
+    int paused;
+    int held;
+    int finished;
+} Handoff;
+
+Handoff* handoff_open(const char* path);
+
+void handoff_start(Handoff* handoff, struct ClientList* clientList,
+        int* listeners, int listenerCount, int threads);
+
+bool handoff_pause(Handoff* handoff, int held, bool serving);
+
+void handoff_send(Handoff* handoff, HandoffConnection* connection);
+
+void handoff_finish(Handoff* handoff);
+
+void handoff_adopted(Handoff* handoff);
+
+void handoff_connection_free(HandoffConnection* connection);
+
+#endif
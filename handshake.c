@@ -0,0 +1,589 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "shared.h"
+#include "server.h"
+#include "linebuf.h"
+#include "outqueue.h"
+#include "stats.h"
+#include "session.h"
+#include "slab.h"
+#define MAX_EVENTS 256
+#define USEC_PER_MSEC 1000
+
+/*
+ * Data structure which stores a client of the threaded server, first while
+ * a handshake worker takes it through AUTH: and NAME:, and then for as long
+ * as its own thread serves it.
+ */
+typedef struct ThreadedConnection {
+    Session session;
+    // eventfd the client's outbound queue wakes its thread with
+    int wakeDiscriptor;
+    // time in microseconds the stage the client is in must be finished by,
+    // 0 if the stage has no deadline
+    long long deadline;
+    // neighbours in the worker's list of clients in the same stage
+    struct ThreadedConnection* previous;
+    struct ThreadedConnection* next;
+    // neighbours in the worker's list of every client in the handshake
+    struct ThreadedConnection* previousOpen;
+    struct ThreadedConnection* nextOpen;
+} ThreadedConnection;
+
+/*
+ * Clients in one stage of the handshake. Every client in a stage is given
+ * the same time to finish it, so appending clients as they enter the stage
+ * keeps the list in order of deadline.
+ */
+typedef struct {
+    ThreadedConnection* first;
+    ThreadedConnection* last;
+    // microseconds a client has to finish the stage (0 for no limit)
+    long long timeout;
+    Stat expired;
+} StageList;
+
+/*
+ * Data structure which stores the information used by one of the workers
+ * taking new clients through the handshake.
+ */
+typedef struct {
+    int index;
+    int epoll;
+    // sockets the server listens on
+    int* listeners;
+    int listenerCount;
+    // time to start watching the listening sockets again after accepting
+    // ran out of file descriptors, 0 while they are watched
+    long long acceptAt;
+    char* serverAuth;
+    ClientList* clientList;
+    // clients authenticating and choosing a name
+    StageList stages[STATE_CHAT];
+    // every client in the handshake, so they can all be handed to another
+    // server
+    ThreadedConnection* open;
+    int openCount;
+} HandshakeWorker;
+
+static Slab connectionSlab = SLAB_INITIALIZER(sizeof(ThreadedConnection));
+
+/*
+ * Function which adds a client to the end of the list for the stage it has
+ * just entered, giving it the stage's deadline.
+ * Parameters:
+ * worker - worker serving the client
+ * connection - client which has entered a stage of the handshake
+ */
+static void enter_stage(HandshakeWorker* worker,
+        ThreadedConnection* connection) {
+    StageList* stage = &worker->stages[connection->session.state];
+    connection->deadline = 0;
+    if (stage->timeout == 0) {
+        return;
+    }
+    connection->deadline = now_usec() + stage->timeout;
+    connection->previous = stage->last;
+    connection->next = NULL;
+    if (stage->last == NULL) {
+        stage->first = connection;
+    } else {
+        stage->last->next = connection;
+    }
+    stage->last = connection;
+}
+
+/*
+ * Function which takes a client out of the list for a stage of the
+ * handshake, if the stage has a deadline.
+ * Parameters:
+ * worker - worker serving the client
+ * connection - client to take out
+ * state - stage the client was in
+ */
+static void leave_stage(HandshakeWorker* worker,
+        ThreadedConnection* connection, SessionState state) {
+    StageList* stage = &worker->stages[state];
+    if (connection->deadline == 0) {
+        return;
+    }
+    if (connection->previous == NULL) {
+        stage->first = connection->next;
+    } else {
+        connection->previous->next = connection->next;
+    }
+    if (connection->next == NULL) {
+        stage->last = connection->previous;
+    } else {
+        connection->next->previous = connection->previous;
+    }
+    connection->deadline = 0;
+}
+
+/*
+ * Function which creates a connection for a client socket and adds it to the
+ * worker's clients in the handshake.
+ * Parameters:
+ * worker - worker that will take the client through the handshake
+ * fd - non-blocking socket connected to the client
+ * Return:
+ * ThreadedConnection* - the new connection, whose session is yet to be set
+ * up
+ */
+static ThreadedConnection* create_connection(HandshakeWorker* worker,
+        int fd) {
+    ThreadedConnection* connection = slab_alloc(&connectionSlab);
+    memset(connection, 0, sizeof(ThreadedConnection));
+    connection->wakeDiscriptor = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    connection->nextOpen = worker->open;
+    if (worker->open != NULL) {
+        worker->open->previousOpen = connection;
+    }
+    worker->open = connection;
+    worker->openCount++;
+    return connection;
+}
+
+/*
+ * Function which takes a client out of the worker's clients in the
+ * handshake, once it has finished it or closed.
+ * Parameters:
+ * worker - worker serving the client
+ * connection - client to take out
+ */
+static void remove_connection(HandshakeWorker* worker,
+        ThreadedConnection* connection) {
+    if (connection->previousOpen == NULL) {
+        worker->open = connection->nextOpen;
+    } else {
+        connection->previousOpen->nextOpen = connection->nextOpen;
+    }
+    if (connection->nextOpen != NULL) {
+        connection->nextOpen->previousOpen = connection->previousOpen;
+    }
+    worker->openCount--;
+}
+
+/*
+ * Function which closes a client which did not finish the handshake. It was
+ * never added to the client list, so no other thread can be using it.
+ * Parameters:
+ * worker - worker serving the client
+ * connection - client to close
+ */
+static void close_connection(HandshakeWorker* worker,
+        ThreadedConnection* connection) {
+    remove_connection(worker, connection);
+    leave_stage(worker, connection, connection->session.state);
+    epoll_ctl(worker->epoll, EPOLL_CTL_DEL, connection->session.input.fd,
+            NULL);
+    close(connection->session.input.fd);
+    close(connection->wakeDiscriptor);
+    connection_closed(worker->clientList);
+    session_close(&connection->session);
+    out_queue_destroy(&connection->session.output);
+    slab_free(&connectionSlab, connection);
+}
+
+/*
+ * Thread function which serves a client once it has finished the handshake,
+ * until it leaves the server. If the client is handed to a server taking
+ * over, the thread only carries on if the handoff fails.
+ * Parameters:
+ * data - ThreadedConnection of the client
+ */
+static void* chat_thread(void* data) {
+    ThreadedConnection* connection = data;
+    Session* session = &connection->session;
+    Handoff* handoff = session->clientList->handoff;
+    while (client_chatting(session->clientList, session->client,
+            &session->output, &session->input, session->binary)) {
+        HandoffConnection saved;
+        session_save(session, &saved);
+        handoff_send(handoff, &saved);
+        handoff_connection_free(&saved);
+        handoff_finish(handoff);
+    }
+    close_client_connection(&session->input, &session->output);
+    connection_closed(session->clientList);
+    slab_free(&connectionSlab, connection);
+    return NULL;
+}
+
+/*
+ * Function which gives a client which has finished the handshake a thread
+ * of its own. Frames pushed to it since it was added to the client list
+ * have woken its eventfd, which the thread sees as soon as it starts.
+ * Parameters:
+ * worker - worker which served the handshake
+ * connection - client which has joined the chat
+ */
+static void start_chatting(HandshakeWorker* worker,
+        ThreadedConnection* connection) {
+    pthread_t thread;
+    remove_connection(worker, connection);
+    epoll_ctl(worker->epoll, EPOLL_CTL_DEL, connection->session.input.fd,
+            NULL);
+    pthread_create(&thread, NULL, chat_thread, connection);
+    pthread_detach(thread);
+}
+
+/*
+ * Function which accepts a new client socket, sends it the AUTH: prompt and
+ * starts its AUTH deadline.
+ * Parameters:
+ * worker - worker that will take the client through the handshake
+ * fd - non-blocking socket connected to the client
+ */
+static void open_connection(HandshakeWorker* worker, int fd) {
+    int noDelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(int));
+    ThreadedConnection* connection = create_connection(worker, fd);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = connection;
+    epoll_ctl(worker->epoll, EPOLL_CTL_ADD, fd, &event);
+    session_open(&connection->session, fd, worker->clientList,
+            worker->serverAuth, false, wake_client_thread,
+            schedule_client_flush, &connection->wakeDiscriptor);
+    enter_stage(worker, connection);
+}
+
+/*
+ * Function which handles a client's socket becoming readable or writable,
+ * handling one command at a time so that the client is handed to a thread
+ * of its own as soon as its name is accepted, with anything it sent after
+ * NAME: left for that thread.
+ * Parameters:
+ * worker - worker serving the client
+ * connection - client whose socket is ready
+ * events - events which happened on the socket
+ */
+static void handle_connection(HandshakeWorker* worker,
+        ThreadedConnection* connection, uint32_t events) {
+    Session* session = &connection->session;
+    if (events & EPOLLOUT) {
+        out_queue_flush(&session->output);
+    }
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        ssize_t got = line_buffer_fill(&session->input);
+        if (got > 0) {
+            stats_add(STAT_BYTES_IN, got);
+        }
+    }
+    do {
+        SessionState state = session->state;
+        session_handle_lines(session, 1);
+        if (session->closing) {
+            close_connection(worker, connection);
+            return;
+        }
+        if (session->state != state) {
+            leave_stage(worker, connection, state);
+            if (session->state == STATE_CHAT) {
+                start_chatting(worker, connection);
+                return;
+            }
+            enter_stage(worker, connection);
+        }
+    } while (session->moreLines);
+    struct epoll_event event;
+    event.events = EPOLLIN |
+            (out_queue_pending(&session->output) ? EPOLLOUT : 0);
+    event.data.ptr = connection;
+    epoll_ctl(worker->epoll, EPOLL_CTL_MOD, session->input.fd, &event);
+}
+
+/*
+ * Function which closes every client which has not finished its stage of
+ * the handshake in time.
+ * Parameters:
+ * worker - worker whose clients are to be checked
+ * Return:
+ * long long - time in microseconds of the next deadline, -1 if there are
+ * none.
+ */
+static long long expire_connections(HandshakeWorker* worker) {
+    long long now = now_usec();
+    long long next = -1;
+    for (int state = STATE_AUTH; state < STATE_CHAT; state++) {
+        StageList* stage = &worker->stages[state];
+        while (stage->first != NULL && stage->first->deadline <= now) {
+            stats_add(stage->expired, 1);
+            close_connection(worker, stage->first);
+        }
+        if (stage->first != NULL &&
+                (next < 0 || stage->first->deadline < next)) {
+            next = stage->first->deadline;
+        }
+    }
+    return next;
+}
+
+/*
+ * Function which accepts every pending connection on the listening sockets.
+ * Parameters:
+ * worker - worker which is listening
+ */
+static void accept_connections(HandshakeWorker* worker) {
+    int fd;
+    for (int i = 0; i < worker->listenerCount; i++) {
+        while ((fd = accept4(worker->listeners[i], NULL, NULL,
+                SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+            if (admit_connection(worker->clientList)) {
+                open_connection(worker, fd);
+            } else {
+                close(fd);
+            }
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+                errno == ECONNABORTED) {
+            continue;
+        }
+        worker->acceptAt = accept_backoff(errno);
+        if (worker->acceptAt == 0) {
+            communications_error();
+        }
+        for (int j = 0; j < worker->listenerCount; j++) {
+            epoll_ctl(worker->epoll, EPOLL_CTL_DEL, worker->listeners[j],
+                    NULL);
+        }
+        return;
+    }
+}
+
+/*
+ * Function which starts watching the listening sockets.
+ * Parameters:
+ * worker - worker which listens on them
+ */
+static void watch_listeners(HandshakeWorker* worker) {
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = worker;
+    for (int i = 0; i < worker->listenerCount; i++) {
+        epoll_ctl(worker->epoll, EPOLL_CTL_ADD, worker->listeners[i],
+                &event);
+    }
+}
+
+/*
+ * Function which starts watching the listening sockets again once the
+ * worker has backed off from them for long enough.
+ * Parameters:
+ * worker - worker which listens on them
+ * Return:
+ * long long - time to call the function again, -1 if the sockets are
+ * being watched.
+ */
+static long long resume_accepting(HandshakeWorker* worker) {
+    if (worker->acceptAt == 0) {
+        return -1;
+    }
+    if (now_usec() < worker->acceptAt) {
+        return worker->acceptAt;
+    }
+    watch_listeners(worker);
+    worker->acceptAt = 0;
+    return -1;
+}
+
+/*
+ * Function which stops the worker once the handoff's eventfd says a server
+ * is taking over, and once every other thread has stopped sends it each of
+ * the clients the worker is taking through the handshake. Only returns if
+ * the handoff failed, as the server exits once it succeeds.
+ * Parameters:
+ * worker - worker to hand off
+ */
+static void hand_off(HandshakeWorker* worker) {
+    Handoff* handoff = worker->clientList->handoff;
+    if (!handoff_pause(handoff, worker->openCount, true)) {
+        return;
+    }
+    for (ThreadedConnection* connection = worker->open; connection != NULL;
+            connection = connection->nextOpen) {
+        HandoffConnection saved;
+        session_save(&connection->session, &saved);
+        handoff_send(handoff, &saved);
+        handoff_connection_free(&saved);
+    }
+    handoff_finish(handoff);
+}
+
+/*
+ * Function which takes over the worker's share of the clients handed over
+ * by the server this one replaced. Those still in the handshake are shared
+ * between the workers, and the first worker gives each client in the chat
+ * a thread of its own once every worker has taken over its share, so no
+ * client is sent anything by a thread which has not taken over the clients
+ * it would tell. Anything the clients sent which the old server had not
+ * handled is then handled.
+ * Parameters:
+ * worker - worker taking the clients over
+ * workers - number of workers
+ */
+static void adopt_connections(HandshakeWorker* worker, int workers) {
+    Handoff* handoff = worker->clientList->handoff;
+    ThreadedConnection* chatting = NULL;
+    int shared = 0;
+    for (HandoffConnection* handed = handoff->adopted; handed != NULL;
+            handed = handed->next) {
+        bool chat = handed->state == STATE_CHAT;
+        bool mine = chat ? worker->index == 0 :
+                shared++ % workers == worker->index;
+        if (!mine) {
+            continue;
+        }
+        fcntl(handed->fd, F_SETFL, fcntl(handed->fd, F_GETFL) | O_NONBLOCK);
+        ThreadedConnection* connection = create_connection(worker,
+                handed->fd);
+        if (!chat) {
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = connection;
+            epoll_ctl(worker->epoll, EPOLL_CTL_ADD, handed->fd, &event);
+        }
+        session_adopt(&connection->session, handed, worker->clientList,
+                worker->serverAuth, false, wake_client_thread,
+                schedule_client_flush, &connection->wakeDiscriptor);
+        if (!chat) {
+            enter_stage(worker, connection);
+        } else if (connection->session.closing) {
+            close_connection(worker, connection);
+        } else {
+            remove_connection(worker, connection);
+            connection->next = chatting;
+            chatting = connection;
+        }
+    }
+    handoff_adopted(handoff);
+    while (chatting != NULL) {
+        ThreadedConnection* next = chatting->next;
+        pthread_t thread;
+        pthread_create(&thread, NULL, chat_thread, chatting);
+        pthread_detach(thread);
+        chatting = next;
+    }
+    ThreadedConnection* connection = worker->open;
+    while (connection != NULL) {
+        ThreadedConnection* next = connection->nextOpen;
+        handle_connection(worker, connection, 0);
+        connection = next;
+    }
+}
+
+/*
+ * Function which accepts clients and takes them through the handshake
+ * until the server exits, without ever blocking on any one client. Every
+ * worker waits on the same listening sockets, and the kernel wakes only one
+ * of them for each new connection.
+ * Parameters:
+ * data - HandshakeWorker to run
+ */
+static void* handshake_worker(void* data) {
+    HandshakeWorker* worker = data;
+    struct epoll_event events[MAX_EVENTS];
+    Handoff* handoff = worker->clientList->handoff;
+    long long until = -1;
+    if (handoff != NULL && handoff->adoptedCount > 0) {
+        adopt_connections(worker,
+                worker->clientList->options->handshakeWorkers);
+        until = expire_connections(worker);
+    }
+    while (1) {
+        int timeout = -1;
+        if (until >= 0) {
+            long long wait = until - now_usec();
+            timeout = wait <= 0 ? 0 : (wait + USEC_PER_MSEC - 1) /
+                    USEC_PER_MSEC;
+        }
+        int ready = epoll_wait(worker->epoll, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.ptr == worker) {
+                accept_connections(worker);
+            } else if (events[i].data.ptr == handoff) {
+                hand_off(worker);
+            } else {
+                handle_connection(worker, events[i].data.ptr,
+                        events[i].events);
+            }
+        }
+        until = expire_connections(worker);
+        long long acceptAt = resume_accepting(worker);
+        if (acceptAt >= 0 && (until < 0 || acceptAt < until)) {
+            until = acceptAt;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function which serves clients with a thread each, once a fixed pool of
+ * workers started up front has taken them through AUTH: and NAME:. A client
+ * which never answers only holds its socket until its deadline passes, so
+ * connection storms and stalled clients cannot use up threads or hold up
+ * other clients' handshakes. The calling thread becomes the first worker,
+ * so the function only returns when the server exits. Clients handed over
+ * by a server this one replaced are served alongside those accepted, and
+ * the server listens on every socket it was handed as well as its own.
+ * Parameters:
+ * listeners - file descriptors the server is listening on
+ * listenerCount - number of listening sockets
+ * serverAuth - the auth string provided to the server
+ * clientList - list of clients connected to the server
+ */
+void run_handshake_pool(int* listeners, int listenerCount, char* serverAuth,
+        ClientList* clientList) {
+    const ServerOptions* options = clientList->options;
+    pthread_t thread;
+    for (int i = 0; i < listenerCount; i++) {
+        fcntl(listeners[i], F_SETFL, fcntl(listeners[i], F_GETFL) |
+                O_NONBLOCK);
+    }
+    HandshakeWorker* workers = calloc(options->handshakeWorkers,
+            sizeof(HandshakeWorker));
+    for (int i = 0; i < options->handshakeWorkers; i++) {
+        HandshakeWorker* worker = &workers[i];
+        worker->index = i;
+        worker->listeners = listeners;
+        worker->listenerCount = listenerCount;
+        worker->serverAuth = serverAuth;
+        worker->clientList = clientList;
+        worker->stages[STATE_AUTH].timeout = options->authTimeout;
+        worker->stages[STATE_AUTH].expired = STAT_AUTH_TIMEOUT;
+        worker->stages[STATE_NAME].timeout = options->nameTimeout;
+        worker->stages[STATE_NAME].expired = STAT_NAME_TIMEOUT;
+        worker->epoll = epoll_create1(EPOLL_CLOEXEC);
+        if (worker->epoll < 0) {
+            communications_error();
+        }
+        watch_listeners(worker);
+        if (clientList->handoff != NULL) {
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = clientList->handoff;
+            epoll_ctl(worker->epoll, EPOLL_CTL_ADD,
+                    clientList->handoff->wakeDiscriptor, &event);
+        }
+    }
+    for (int i = 1; i < options->handshakeWorkers; i++) {
+        pthread_create(&thread, NULL, handshake_worker, &workers[i]);
+        pthread_detach(thread);
+    }
+    handshake_worker(&workers[0]);
+}
@@ -0,0 +1,125 @@
+#include "histogram.h"
+#define SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+/*
+ * Function which finds the bucket a value is counted in. Values below
+ * SUB_BUCKETS each have their own bucket, and every power of two above that
+ * is split into SUB_BUCKETS equal buckets.
+ * Parameters:
+ * value - value to find the bucket of
+ * Return:
+ * int - index of the bucket
+ */
+static int bucket_index(long long value) {
+    if (value < 0) {
+        value = 0;
+    }
+    if (value >= 1LL << HISTOGRAM_MAX_BITS) {
+        value = (1LL << HISTOGRAM_MAX_BITS) - 1;
+    }
+    if (value < SUB_BUCKETS) {
+        return value;
+    }
+    int magnitude = 63 - __builtin_clzll(value);
+    int sub = (value >> (magnitude - HISTOGRAM_SUB_BITS)) & (SUB_BUCKETS - 1);
+    return (magnitude - HISTOGRAM_SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+/*
+ * Function which finds the largest value counted in a bucket.
+ * Parameters:
+ * index - index of the bucket
+ * Return:
+ * long long - largest value in the bucket
+ */
+static long long bucket_value(int index) {
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+    int magnitude = index / SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+    long long width = 1LL << (magnitude - HISTOGRAM_SUB_BITS);
+    return (1LL << magnitude) + (index % SUB_BUCKETS + 1) * width - 1;
+}
+
+/*
+ * Function which counts a value in a histogram.
+ * Parameters:
+ * histogram - histogram to count the value in
+ * value - value to count
+ */
+void histogram_record(Histogram* histogram, long long value) {
+    __atomic_fetch_add(&histogram->counts[bucket_index(value)], 1,
+            __ATOMIC_RELAXED);
+}
+
+/*
+ * Function which adds the counts of one histogram to another.
+ * Parameters:
+ * into - histogram to add to
+ * from - histogram whose counts are added
+ */
+void histogram_merge(Histogram* into, const Histogram* from) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        into->counts[i] += __atomic_load_n(&from->counts[i],
+                __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Function which counts the values recorded in a histogram.
+ * Parameters:
+ * histogram - histogram to count
+ * Return:
+ * unsigned long - number of values recorded
+ */
+unsigned long histogram_count(const Histogram* histogram) {
+    unsigned long count = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        count += histogram->counts[i];
+    }
+    return count;
+}
+
+/*
+ * Function which adds up the values recorded in a histogram, each taken as
+ * the largest value of its bucket as percentiles are.
+ * Parameters:
+ * histogram - histogram to add up
+ * Return:
+ * double - sum of the recorded values, to within the widths of their
+ * buckets
+ */
+double histogram_sum(const Histogram* histogram) {
+    double sum = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        sum += (double) histogram->counts[i] * bucket_value(i);
+    }
+    return sum;
+}
+
+/*
+ * Function which finds the value below which a given percentage of the
+ * recorded values fall.
+ * Parameters:
+ * histogram - histogram to look in
+ * percentile - percentage of values (100 gives the largest value)
+ * Return:
+ * long long - the percentile, to within the width of its bucket (0 if
+ * nothing has been recorded)
+ */
+long long histogram_percentile(const Histogram* histogram,
+        double percentile) {
+    unsigned long count = histogram_count(histogram);
+    unsigned long target = count * percentile / 100.0;
+    unsigned long seen = 0;
+    if (target == 0) {
+        target = 1;
+    }
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= target && histogram->counts[i] > 0) {
+            return bucket_value(i);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKETS \
+        ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 2) << HISTOGRAM_SUB_BITS)
+
+/*
+ * Histogram of non-negative values (such as times in microseconds) in the
+ * style of an HDR histogram. Buckets get wider as values grow so every value
+ * is recorded to within about 6% using a fixed, small amount of memory.
+ * Values can be recorded from several threads at once.
+ */
+typedef struct {
+    unsigned long counts[HISTOGRAM_BUCKETS];
+} Histogram;
+
+void histogram_record(Histogram* histogram, long long value);
+
+void histogram_merge(Histogram* into, const Histogram* from);
+
+unsigned long histogram_count(const Histogram* histogram);
+
+double histogram_sum(const Histogram* histogram);
+
+long long histogram_percentile(const Histogram* histogram, double percentile);
+
+#endif
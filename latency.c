@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include "shared.h"
+#include "linebuf.h"
+#define DEFAULT_SAMPLES 100
+#define LINE_BUFFER_SIZE 4096
+#define NAME_LENGTH 64
+#define USEC_PER_MSEC 1000.0
+#define USAGE "Usage: latency authfile port [samples]\n"
+
+/*
+ * Data structure which stores a connection to the server being timed.
+ */
+typedef struct {
+    int fd;
+    LineBuffer from;
+} Connection;
+
+/*
+ * Function which sends a formatted line to the server.
+ * Parameters:
+ * connection - connection to send the line on
+ * format - printf style format of the line (without the newline)
+ */
+void send_line(Connection* connection, const char* format, ...) {
+    char line[LINE_BUFFER_SIZE];
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(line, sizeof(line) - 1, format, arguments);
+    va_end(arguments);
+    line[length++] = '\n';
+    if (write(connection->fd, line, length) != length) {
+        communications_error();
+    }
+}
+
+/*
+ * Function which reads lines from the server until the given line is
+ * recieved.
+ * Parameters:
+ * connection - connection to read from
+ * expected - line to wait for
+ */
+void wait_for_line(Connection* connection, const char* expected) {
+    char* line;
+    do {
+        line = line_buffer_read_line(&connection->from);
+        if (line == NULL || strcmp(line, "NAME_TAKEN:") == 0) {
+            communications_error();
+        }
+    } while (strcmp(line, expected) != 0);
+}
+
+/*
+ * Function which connects to the server and completes the AUTH: and NAME:
+ * handshake with the given name.
+ * Parameters:
+ * connection - connection to open
+ * port - port the server is listening on
+ * auth - auth string to send to the server
+ * name - name to join the chat with
+ */
+void join_server(Connection* connection, const char* port, char* auth,
+        char* name) {
+    connection->fd = connect_socket(port);
+    line_buffer_init(&connection->from, connection->fd, LINE_BUFFER_SIZE);
+    wait_for_line(connection, "AUTH:");
+    send_line(connection, "AUTH:%s", auth);
+    wait_for_line(connection, "OK:");
+    wait_for_line(connection, "WHO:");
+    send_line(connection, "NAME:%s", name);
+    wait_for_line(connection, "OK:");
+}
+
+/*
+ * Function which closes a connection to the server.
+ * Parameters:
+ * connection - connection to close
+ */
+void leave_server(Connection* connection) {
+    close(connection->fd);
+    line_buffer_free(&connection->from);
+}
+
+/*
+ * Comparison function used to sort timings.
+ */
+int compare_timings(const void* first, const void* second) {
+    long long a = *(const long long*) first;
+    long long b = *(const long long*) second;
+    return (a > b) - (a < b);
+}
+
+/*
+ * Function which prints a summary of a set of timings in milliseconds.
+ * Parameters:
+ * label - what was timed
+ * timings - timings in microseconds (sorted by this function)
+ * count - number of timings
+ */
+void report(const char* label, long long* timings, int count) {
+    long long total = 0;
+    qsort(timings, count, sizeof(long long), compare_timings);
+    for (int i = 0; i < count; i++) {
+        total += timings[i];
+    }
+    printf("%s: samples %d min %.3f avg %.3f p50 %.3f p99 %.3f max %.3f "
+            "(ms)\n", label, count, timings[0] / USEC_PER_MSEC,
+            total / (double) count / USEC_PER_MSEC,
+            timings[count / 2] / USEC_PER_MSEC,
+            timings[count * 99 / 100] / USEC_PER_MSEC,
+            timings[count - 1] / USEC_PER_MSEC);
+}
+
+/*
+ * Program which measures how long the server takes to complete the AUTH:
+ * and NAME: handshake, and how long a SAY: takes to reach another client as
+ * a MSG:.
+ */
+int main(int argc, char** argv) {
+    if (argc != 3 && argc != 4) {
+        usage_error(USAGE);
+    }
+    int samples = argc == 4 ? atoi(argv[3]) : DEFAULT_SAMPLES;
+    if (samples <= 0) {
+        usage_error(USAGE);
+    }
+    FILE* authfile = fdopen(open(argv[1], O_RDONLY), "r");
+    check_file(authfile, USAGE);
+    char* auth = read_file_line(authfile);
+    const char* port = argv[2];
+    long long* timings = malloc(samples * sizeof(long long));
+    char name[NAME_LENGTH];
+    char expected[LINE_BUFFER_SIZE];
+    Connection sender;
+    Connection observer;
+
+    for (int i = 0; i < samples; i++) {
+        Connection connection;
+        snprintf(name, sizeof(name), "latency%d-%d", getpid(), i);
+        long long start = now_usec();
+        join_server(&connection, port, auth, name);
+        timings[i] = now_usec() - start;
+        leave_server(&connection);
+    }
+    report("handshake", timings, samples);
+
+    snprintf(name, sizeof(name), "latency%d-observer", getpid());
+    join_server(&observer, port, auth, name);
+    snprintf(name, sizeof(name), "latency%d-sender", getpid());
+    join_server(&sender, port, auth, name);
+    for (int i = 0; i < samples; i++) {
+        snprintf(expected, sizeof(expected), "MSG:%s:%d", name, i);
+        long long start = now_usec();
+        send_line(&sender, "SAY:%d", i);
+        wait_for_line(&observer, expected);
+        timings[i] = now_usec() - start;
+        wait_for_line(&sender, expected);
+    }
+    report("say-to-msg", timings, samples);
+    leave_server(&sender);
+    leave_server(&observer);
+    free(timings);
+    free(auth);
+    return 0;
+}
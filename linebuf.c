@@ -0,0 +1,421 @@
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "linebuf.h"
+
+/*
+ * Function which initialises an empty line buffer reading from the given
+ * socket.
+ * Parameters:
+ * buffer - buffer to initialise
+ * fd - file descriptor lines will be read from
+ * capacity - initial size of the ring in bytes
+ */
+void line_buffer_init(LineBuffer* buffer, int fd, size_t capacity) {
+    buffer->fd = fd;
+    buffer->capacity = capacity;
+    buffer->data = malloc(capacity);
+    buffer->scratch = malloc(capacity + 1);
+    buffer->start = 0;
+    buffer->length = 0;
+    buffer->scanned = 0;
+    buffer->closed = false;
+    buffer->limit = 0;
+    buffer->piece = LINE_WHOLE;
+    buffer->remaining = 0;
+    buffer->discarding = false;
+}
+
+/*
+ * Function which limits the length of the lines and records a buffer hands
+ * out whole. Longer ones are handed out in pieces instead, so at most about
+ * this many bytes are held for them at once.
+ * Parameters:
+ * buffer - buffer to limit
+ * limit - longest line (not counting its newline) or record handed out
+ * whole, 0 for no limit
+ */
+void line_buffer_set_limit(LineBuffer* buffer, size_t limit) {
+    buffer->limit = limit;
+}
+
+/*
+ * Function which frees the memory held by a line buffer. The file descriptor
+ * is not closed.
+ * Parameters:
+ * buffer - buffer to free
+ */
+void line_buffer_free(LineBuffer* buffer) {
+    free(buffer->data);
+    free(buffer->scratch);
+}
+
+/*
+ * Function which grows a full ring so that a line longer than the ring can
+ * still be recieved. The unread bytes are moved to the start of the new ring.
+ * Parameters:
+ * buffer - buffer to grow
+ * newCapacity - size of the new ring in bytes
+ */
+static void grow_line_buffer(LineBuffer* buffer, size_t newCapacity) {
+    char* data = malloc(newCapacity);
+    size_t first = buffer->capacity - buffer->start;
+    if (first > buffer->length) {
+        first = buffer->length;
+    }
+    memcpy(data, buffer->data + buffer->start, first);
+    memcpy(data + first, buffer->data, buffer->length - first);
+    free(buffer->data);
+    buffer->data = data;
+    buffer->start = 0;
+    buffer->capacity = newCapacity;
+    buffer->scratch = realloc(buffer->scratch, newCapacity + 1);
+}
+
+/*
+ * Function which takes bytes out of the front of the ring once they have
+ * been handed out or thrown away.
+ * Parameters:
+ * buffer - buffer to take the bytes from
+ * used - number of bytes to take
+ */
+static void remove_front(LineBuffer* buffer, size_t used) {
+    buffer->start = (buffer->start + used) % buffer->capacity;
+    buffer->length -= used;
+    buffer->scanned = buffer->scanned > used ? buffer->scanned - used : 0;
+}
+
+/*
+ * Function which reads as much as is available from the socket into the free
+ * space of the ring using a single system call. A full ring is grown first,
+ * but never past the buffer's limit.
+ * Parameters:
+ * buffer - buffer to fill
+ * Return:
+ * ssize_t - number of bytes read, 0 on end of file or -1 on error (errno is
+ * left set, and EAGAIN means nothing was available yet while ENOBUFS means
+ * the ring is full and at its limit).
+ */
+ssize_t line_buffer_fill(LineBuffer* buffer) {
+    struct iovec space[2];
+    int count = 1;
+    if (buffer->length == buffer->capacity) {
+        size_t newCapacity = buffer->capacity * 2;
+        if (buffer->limit > 0 && newCapacity > buffer->limit) {
+            newCapacity = buffer->limit;
+        }
+        if (newCapacity <= buffer->capacity) {
+            errno = ENOBUFS;
+            return -1;
+        }
+        grow_line_buffer(buffer, newCapacity);
+    }
+    if (buffer->length == 0) {
+        buffer->start = 0;
+    }
+    size_t end = (buffer->start + buffer->length) % buffer->capacity;
+    if (end >= buffer->start) {
+        // free space may wrap around to the front of the ring
+        space[0].iov_base = buffer->data + end;
+        space[0].iov_len = buffer->capacity - end;
+        space[1].iov_base = buffer->data;
+        space[1].iov_len = buffer->start;
+        count = buffer->start > 0 ? 2 : 1;
+    } else {
+        space[0].iov_base = buffer->data + end;
+        space[0].iov_len = buffer->start - end;
+    }
+    ssize_t got;
+    do {
+        got = readv(buffer->fd, space, count);
+    } while (got < 0 && errno == EINTR);
+    if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        buffer->closed = true;
+    }
+    if (got > 0) {
+        buffer->length += got;
+    }
+    return got;
+}
+
+/*
+ * Function which adds bytes that have already been recieved by the caller to
+ * the end of the buffer, growing the ring if they do not fit (even past the
+ * buffer's limit, as the bytes have nowhere else to go). Used when the
+ * socket is read by something other than line_buffer_fill().
+ * Parameters:
+ * buffer - buffer to add to
+ * data - bytes recieved
+ * length - number of bytes recieved
+ */
+void line_buffer_append(LineBuffer* buffer, const char* data, size_t length) {
+    while (buffer->capacity - buffer->length < length) {
+        grow_line_buffer(buffer, buffer->capacity * 2);
+    }
+    if (buffer->length == 0) {
+        buffer->start = 0;
+    }
+    size_t end = (buffer->start + buffer->length) % buffer->capacity;
+    size_t first = buffer->capacity - end;
+    if (first > length) {
+        first = length;
+    }
+    memcpy(buffer->data + end, data, first);
+    memcpy(buffer->data, data + first, length - first);
+    buffer->length += length;
+}
+
+/*
+ * Function which finds the first newline among the bytes not yet handed out,
+ * remembering how far it has looked so that no byte is searched twice.
+ * Parameters:
+ * buffer - buffer to search
+ * Return:
+ * ssize_t - offset of the newline from the front of the buffer, or -1 if no
+ * complete line has been recieved.
+ */
+static ssize_t find_newline(LineBuffer* buffer) {
+    size_t first = buffer->capacity - buffer->start;
+    if (first > buffer->length) {
+        first = buffer->length;
+    }
+    char* newline;
+    if (buffer->scanned < first) {
+        char* line = buffer->data + buffer->start;
+        newline = memchr(line + buffer->scanned, '\n',
+                first - buffer->scanned);
+        if (newline != NULL) {
+            return newline - line;
+        }
+        buffer->scanned = first;
+    }
+    newline = memchr(buffer->data + buffer->scanned - first, '\n',
+            buffer->length - buffer->scanned);
+    if (newline == NULL) {
+        buffer->scanned = buffer->length;
+        return -1;
+    }
+    return first + (newline - buffer->data);
+}
+
+/*
+ * Function which copies bytes from the front of the buffer into its scratch
+ * space, null terminated, and takes them out of the buffer.
+ * Parameters:
+ * buffer - buffer to take the bytes from
+ * length - number of bytes to copy
+ * skip - number of bytes after them to take out without copying
+ * Return:
+ * char* - the buffer's scratch space
+ */
+static char* take_into_scratch(LineBuffer* buffer, size_t length,
+        size_t skip) {
+    line_buffer_peek(buffer, buffer->scratch, length);
+    buffer->scratch[length] = '\0';
+    remove_front(buffer, length + skip);
+    return buffer->scratch;
+}
+
+/*
+ * Function which throws away the rest of a line being discarded, as far as
+ * it has been recieved, and finds the newline ending the line after it.
+ * Parameters:
+ * buffer - buffer to search
+ * Return:
+ * ssize_t - offset of the newline from the front of the buffer, or -1 if no
+ * complete line is waiting.
+ */
+static ssize_t skip_discarded(LineBuffer* buffer) {
+    ssize_t newline = find_newline(buffer);
+    if (!buffer->discarding) {
+        return newline;
+    }
+    if (newline < 0) {
+        remove_front(buffer, buffer->length);
+        return -1;
+    }
+    remove_front(buffer, newline + 1);
+    buffer->discarding = false;
+    buffer->piece = LINE_WHOLE;
+    return find_newline(buffer);
+}
+
+/*
+ * Function which takes the next complete line out of the buffer. The newline
+ * is replaced by a null terminator and the line is returned in place unless
+ * it wraps around the end of the ring, in which case it is copied into the
+ * buffer's scratch space. If the buffer has a limit and no newline is found
+ * within that many bytes, the bytes so far are handed out as a piece of the
+ * line (and the rest of it in later pieces), with the buffer's piece field
+ * saying which part of the line was handed out.
+ * Parameters:
+ * buffer - buffer to take the line from
+ * Return:
+ * char* - the line, or NULL if no complete line has been recieved.
+ */
+char* line_buffer_next(LineBuffer* buffer) {
+    ssize_t newline = skip_discarded(buffer);
+    bool continued = buffer->piece == LINE_FIRST ||
+            buffer->piece == LINE_MIDDLE;
+    if (buffer->limit > 0 && (newline < 0 ?
+            buffer->length >= buffer->limit :
+            (size_t) newline >= buffer->limit)) {
+        buffer->piece = continued ? LINE_MIDDLE : LINE_FIRST;
+        return take_into_scratch(buffer, buffer->limit, 0);
+    }
+    if (newline < 0) {
+        return NULL;
+    }
+    buffer->piece = continued ? LINE_LAST : LINE_WHOLE;
+    if (buffer->start + newline >= buffer->capacity) {
+        return take_into_scratch(buffer, newline, 1);
+    }
+    char* line = buffer->data + buffer->start;
+    line[newline] = '\0';
+    remove_front(buffer, newline + 1);
+    return line;
+}
+
+/*
+ * Function which returns whether line_buffer_next() would hand out a line or
+ * piece of one, without taking it out of the buffer. The rest of a line
+ * being discarded is thrown away first, as that hands out nothing.
+ * Parameters:
+ * buffer - buffer to check
+ * Return:
+ * bool - true if a line or piece of one is waiting.
+ */
+bool line_buffer_ready(LineBuffer* buffer) {
+    ssize_t newline = skip_discarded(buffer);
+    return newline >= 0 ||
+            (buffer->limit > 0 && buffer->length >= buffer->limit);
+}
+
+/*
+ * Function which copies bytes from the front of the buffer without taking
+ * them out of it.
+ * Parameters:
+ * buffer - buffer to copy from
+ * to - filled in with the bytes
+ * length - number of bytes wanted
+ * Return:
+ * bool - false if fewer bytes than that have been recieved.
+ */
+bool line_buffer_peek(LineBuffer* buffer, char* to, size_t length) {
+    if (buffer->length < length) {
+        return false;
+    }
+    size_t first = buffer->capacity - buffer->start;
+    if (first > length) {
+        first = length;
+    }
+    memcpy(to, buffer->data + buffer->start, first);
+    memcpy(to + first, buffer->data, length - first);
+    return true;
+}
+
+/*
+ * Function which takes the given number of bytes out of the front of the
+ * buffer, for records whose length is known rather than found by looking
+ * for a newline. The bytes are copied into the buffer's scratch space and
+ * null terminated, so they are only valid until the buffer is next filled.
+ * Parameters:
+ * buffer - buffer to take the bytes from
+ * length - number of bytes to take
+ * Return:
+ * char* - the bytes, or NULL if fewer than that have been recieved.
+ */
+char* line_buffer_take(LineBuffer* buffer, size_t length) {
+    if (buffer->length < length) {
+        return NULL;
+    }
+    return take_into_scratch(buffer, length, 0);
+}
+
+/*
+ * Function which starts handing out a record of known length in pieces with
+ * line_buffer_take_piece(), for records longer than the buffer's limit.
+ * Parameters:
+ * buffer - buffer the record is being recieved in
+ * length - number of bytes in the record
+ */
+void line_buffer_begin_record(LineBuffer* buffer, size_t length) {
+    buffer->remaining = length;
+    buffer->piece = LINE_WHOLE;
+}
+
+/*
+ * Function which takes the next piece of a record begun with
+ * line_buffer_begin_record() out of the buffer. Every piece but the last is
+ * as long as the buffer's limit, and the buffer's piece field says which
+ * part of the record was handed out. Pieces are copied into the buffer's
+ * scratch space and null terminated like line_buffer_take().
+ * Parameters:
+ * buffer - buffer to take the piece from
+ * length - filled in with the number of bytes in the piece
+ * Return:
+ * char* - the piece, or NULL if it has not all been recieved or the rest of
+ * the record is being thrown away. The record is over once the buffer's
+ * remaining field is 0.
+ */
+char* line_buffer_take_piece(LineBuffer* buffer, size_t* length) {
+    size_t wanted = buffer->remaining;
+    if (buffer->limit > 0 && wanted > buffer->limit) {
+        wanted = buffer->limit;
+    }
+    if (buffer->discarding) {
+        size_t dropped = buffer->length < buffer->remaining ?
+                buffer->length : buffer->remaining;
+        remove_front(buffer, dropped);
+        buffer->remaining -= dropped;
+        if (buffer->remaining == 0) {
+            buffer->discarding = false;
+            buffer->piece = LINE_WHOLE;
+        }
+        return NULL;
+    }
+    if (wanted == 0 || buffer->length < wanted) {
+        return NULL;
+    }
+    bool continued = buffer->piece == LINE_FIRST ||
+            buffer->piece == LINE_MIDDLE;
+    buffer->remaining -= wanted;
+    if (buffer->remaining == 0) {
+        buffer->piece = continued ? LINE_LAST : LINE_WHOLE;
+    } else {
+        buffer->piece = continued ? LINE_MIDDLE : LINE_FIRST;
+    }
+    *length = wanted;
+    return take_into_scratch(buffer, wanted, 0);
+}
+
+/*
+ * Function which throws away the rest of the line or record which is being
+ * handed out in pieces, as it arrives, rather than handing it out.
+ * Parameters:
+ * buffer - buffer the line or record is being recieved in
+ */
+void line_buffer_discard(LineBuffer* buffer) {
+    buffer->discarding = true;
+}
+
+/*
+ * Function which blocks until a complete line has been recieved and returns
+ * it in the same way as line_buffer_next().
+ * Parameters:
+ * buffer - buffer to read the line from
+ * Return:
+ * char* - the line, or NULL if the socket closed before a full line arrived.
+ */
+char* line_buffer_read_line(LineBuffer* buffer) {
+    char* line;
+    while ((line = line_buffer_next(buffer)) == NULL) {
+        if (line_buffer_fill(buffer) <= 0 && buffer->closed) {
+            return NULL;
+        }
+    }
+    return line;
+}
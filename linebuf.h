@@ -0,0 +1,73 @@
+#ifndef _LINEBUF_H
+#define _LINEBUF_H
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * Which part of its line or record the last one handed out by a buffer was.
+ * Only buffers with a limit hand out anything but whole lines and records.
+ */
+typedef enum {
+    LINE_WHOLE,
+    LINE_FIRST,
+    LINE_MIDDLE,
+    LINE_LAST
+} LinePiece;
+
+/*
+ * Ring buffer which holds bytes recieved on a socket until they form complete
+ * lines, or records of a known length. Lines are handed out in place, so they
+ * are only valid until the buffer is next filled. If the buffer has a limit,
+ * lines and records longer than it are handed out in pieces of at most that
+ * many bytes (or thrown away) rather than being held whole, so the ring only
+ * grows past the limit by what a caller appends at once.
+ */
+typedef struct {
+    int fd;
+    char* data;
+    size_t capacity;
+    // index of the first byte not yet handed out and number of such bytes
+    size_t start;
+    size_t length;
+    // number of bytes after start already known not to contain a newline
+    size_t scanned;
+    // holds a line which wraps around the end of the ring
+    char* scratch;
+    bool closed;
+    // longest line or record handed out whole, 0 for no limit
+    size_t limit;
+    // which part of its line or record the last one handed out was
+    LinePiece piece;
+    // bytes still to come of a record being handed out in pieces
+    size_t remaining;
+    // set while the rest of a line or record is being thrown away
+    bool discarding;
+} LineBuffer;
+
+void line_buffer_init(LineBuffer* buffer, int fd, size_t capacity);
+
+void line_buffer_free(LineBuffer* buffer);
+
+void line_buffer_set_limit(LineBuffer* buffer, size_t limit);
+
+ssize_t line_buffer_fill(LineBuffer* buffer);
+
+void line_buffer_append(LineBuffer* buffer, const char* data, size_t length);
+
+char* line_buffer_next(LineBuffer* buffer);
+
+bool line_buffer_ready(LineBuffer* buffer);
+
+bool line_buffer_peek(LineBuffer* buffer, char* to, size_t length);
+
+char* line_buffer_take(LineBuffer* buffer, size_t length);
+
+void line_buffer_begin_record(LineBuffer* buffer, size_t length);
+
+char* line_buffer_take_piece(LineBuffer* buffer, size_t* length);
+
+void line_buffer_discard(LineBuffer* buffer);
+
+char* line_buffer_read_line(LineBuffer* buffer);
+
+#endif
@@ -0,0 +1,612 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include "shared.h"
+#include "linebuf.h"
+#include "histogram.h"
+#include "protocol.h"
+#define USAGE "Usage: loadgen [--connections n] [--threads n] [--rate n] " \
+        "[--duration seconds] [--size bytes] [--list percent] " \
+        "[--kick percent] [--binary] authfile port\n"
+#define LINE_BUFFER_SIZE 4096
+#define OUTPUT_SIZE 65536
+#define MAX_EVENTS 256
+#define NAME_LENGTH 32
+#define USEC_PER_SEC 1000000LL
+#define USEC_PER_MSEC 1000.0
+#define PERCENT 100
+
+/*
+ * Stores the command line options which describe the load to generate.
+ */
+typedef struct {
+    int connections;
+    int threads;
+    // SAY:, LIST: and KICK: commands per second over all connections
+    double rate;
+    double duration;
+    // bytes of padding added to each SAY:
+    int size;
+    // percentage of commands which are LIST: and KICK: rather than SAY:
+    double listPercent;
+    double kickPercent;
+    // set to ask the server for binary framing
+    bool binary;
+    char* auth;
+    char* port;
+} LoadOptions;
+
+/*
+ * The stage of the protocol that a connection is currently in.
+ */
+typedef enum {
+    STATE_AUTH,
+    STATE_OK,
+    STATE_WHO,
+    STATE_NAME,
+    STATE_CHAT,
+    STATE_CLOSED
+} ConnectionState;
+
+/*
+ * Data structure which stores a single connection to the server.
+ */
+typedef struct {
+    int fd;
+    ConnectionState state;
+    char name[NAME_LENGTH];
+    LineBuffer from;
+    // set once the server has switched the connection to binary framing
+    bool binary;
+    // bytes which could not be written straight away
+    char output[OUTPUT_SIZE];
+    size_t outputLength;
+    // set while waiting for the socket to become writable
+    bool writeWanted;
+    long long connectedAt;
+} Connection;
+
+/*
+ * Data structure which stores the connections driven by one thread and what
+ * the thread has measured.
+ */
+typedef struct {
+    int id;
+    const LoadOptions* options;
+    int epoll;
+    Connection* connections;
+    int count;
+    int next;
+    unsigned random;
+    // counts of what was sent and recieved
+    unsigned long joined;
+    unsigned long closed;
+    unsigned long say;
+    unsigned long list;
+    unsigned long kick;
+    unsigned long skipped;
+    unsigned long messages;
+    unsigned long lists;
+    unsigned long kicks;
+    Histogram handshake;
+    Histogram fanout;
+} Worker;
+
+static volatile bool running = true;
+static volatile bool measuring = false;
+
+/*
+ * Function which converts the value given to a numeric option, causing a
+ * usage error if it is not a non-negative number.
+ * Parameters:
+ * value - text given for the option
+ * Return:
+ * double - value of the option
+ */
+double parse_number_option(char* value) {
+    char* end;
+    double number = strtod(value, &end);
+    if (end == value || *end != '\0' || number < 0) {
+        usage_error(USAGE);
+    }
+    return number;
+}
+
+/*
+ * Function which reads the command line options and arguments of loadgen,
+ * causing a usage error if they are not valid.
+ * Parameters:
+ * options - filled in with the options given
+ * argc - number of command line arguments
+ * argv - command line arguments
+ */
+void parse_load_options(LoadOptions* options, int argc, char* argv[]) {
+    struct option longOptions[] = {
+        {"connections", required_argument, NULL, 'c'},
+        {"threads", required_argument, NULL, 't'},
+        {"rate", required_argument, NULL, 'r'},
+        {"duration", required_argument, NULL, 'd'},
+        {"size", required_argument, NULL, 's'},
+        {"list", required_argument, NULL, 'l'},
+        {"kick", required_argument, NULL, 'k'},
+        {"binary", no_argument, NULL, 'b'},
+        {NULL, 0, NULL, 0}
+    };
+    int option;
+    options->connections = 100;
+    options->threads = 4;
+    options->rate = 1000;
+    options->duration = 10;
+    options->size = 0;
+    options->listPercent = 0;
+    options->kickPercent = 0;
+    options->binary = false;
+    opterr = 0;
+    while ((option = getopt_long(argc, argv, "+", longOptions,
+            NULL)) != -1) {
+        switch (option) {
+            case 'c':
+                options->connections = parse_number_option(optarg);
+                break;
+            case 't':
+                options->threads = parse_number_option(optarg);
+                break;
+            case 'r':
+                options->rate = parse_number_option(optarg);
+                break;
+            case 'd':
+                options->duration = parse_number_option(optarg);
+                break;
+            case 's':
+                options->size = parse_number_option(optarg);
+                break;
+            case 'l':
+                options->listPercent = parse_number_option(optarg);
+                break;
+            case 'k':
+                options->kickPercent = parse_number_option(optarg);
+                break;
+            case 'b':
+                options->binary = true;
+                break;
+            default:
+                usage_error(USAGE);
+        }
+    }
+    if (argc - optind != 2 || options->connections < 1 ||
+            options->threads < 1 || options->size >= OUTPUT_SIZE / 2 ||
+            options->listPercent + options->kickPercent > PERCENT) {
+        usage_error(USAGE);
+    }
+    if (options->threads > options->connections) {
+        options->threads = options->connections;
+    }
+    FILE* authfile = fopen(argv[optind], "r");
+    check_file(authfile, USAGE);
+    options->auth = read_file_line(authfile);
+    fclose(authfile);
+    options->port = argv[optind + 1];
+}
+
+/*
+ * Function which returns a random number from a worker's own generator.
+ * Parameters:
+ * worker - worker wanting the number
+ * Return:
+ * unsigned - random number
+ */
+unsigned next_random(Worker* worker) {
+    unsigned random = worker->random;
+    random ^= random << 13;
+    random ^= random >> 17;
+    random ^= random << 5;
+    worker->random = random;
+    return random;
+}
+
+/*
+ * Function which changes whether a connection is waiting for its socket to
+ * become writable.
+ * Parameters:
+ * worker - worker driving the connection
+ * connection - connection to update
+ */
+void update_interest(Worker* worker, Connection* connection) {
+    struct epoll_event event;
+    connection->writeWanted = connection->outputLength > 0;
+    event.events = EPOLLIN | (connection->writeWanted ? EPOLLOUT : 0);
+    event.data.ptr = connection;
+    epoll_ctl(worker->epoll, EPOLL_CTL_MOD, connection->fd, &event);
+}
+
+/*
+ * Function which writes as much of a connection's waiting output as the
+ * socket will accept.
+ * Parameters:
+ * worker - worker driving the connection
+ * connection - connection to write to
+ */
+void flush_output(Worker* worker, Connection* connection) {
+    ssize_t sent = send(connection->fd, connection->output,
+            connection->outputLength, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent > 0) {
+        connection->outputLength -= sent;
+        memmove(connection->output, connection->output + sent,
+                connection->outputLength);
+    }
+    if (connection->writeWanted != (connection->outputLength > 0)) {
+        update_interest(worker, connection);
+    }
+}
+
+/*
+ * Function which sends a command to the server in the framing the
+ * connection uses, keeping whatever the socket does not accept straight
+ * away.
+ * Parameters:
+ * worker - worker driving the connection
+ * connection - connection to send the command on
+ * type - command to send
+ * argument - argument of the command
+ * length - bytes in the argument
+ * Return:
+ * bool - false if too much output is already waiting (nothing is sent).
+ */
+bool send_request(Worker* worker, Connection* connection, CommandType type,
+        const char* argument, size_t length) {
+    const char* word = protocol_command_word(type);
+    size_t needed = length + (connection->binary ? PROTOCOL_HEADER_SIZE :
+            strlen(word) + strlen(":\n"));
+    if (connection->outputLength + needed > OUTPUT_SIZE) {
+        return false;
+    }
+    char* to = connection->output + connection->outputLength;
+    if (connection->binary) {
+        to += protocol_encode_header(to, type, length);
+    } else {
+        to += sprintf(to, "%s:", word);
+    }
+    memcpy(to, argument, length);
+    if (!connection->binary) {
+        to[length] = '\n';
+    }
+    connection->outputLength += needed;
+    if (connection->outputLength == needed) {
+        flush_output(worker, connection);
+    }
+    return true;
+}
+
+/*
+ * Function which handles a MSG: command, timing it if it is one of the
+ * timed messages sent by loadgen (MSG:name:sendtime:...). In binary framing
+ * the name is followed by a null rather than a colon.
+ * Parameters:
+ * worker - worker which recieved the command
+ * connection - connection the command was recieved on
+ * command - command recieved
+ */
+void handle_message(Worker* worker, Connection* connection,
+        Command* command) {
+    char* text = connection->binary ?
+            memchr(command->argument, '\0', command->length) :
+            strchr(command->argument, ':');
+    if (text == NULL) {
+        return;
+    }
+    char* end;
+    long long sentAt = strtoll(text + 1, &end, 10);
+    if (end == text + 1 || *end != ':') {
+        return;
+    }
+    if (measuring) {
+        worker->messages++;
+        histogram_record(&worker->fanout, now_usec() - sentAt);
+    }
+}
+
+/*
+ * Function which handles a command recieved from the server, moving the
+ * connection through the handshake and timing any messages. With --binary
+ * the connection asks for binary framing along with its AUTH:, and
+ * switches to it once the server answers OK:BINARY.
+ * Parameters:
+ * worker - worker driving the connection
+ * connection - connection the command was recieved on
+ * command - command recieved
+ */
+void handle_command(Worker* worker, Connection* connection,
+        Command* command) {
+    const char* auth = worker->options->auth;
+    switch (connection->state) {
+        case STATE_AUTH:
+            if (command->type == COMMAND_AUTH) {
+                if (worker->options->binary) {
+                    send_request(worker, connection, COMMAND_BINARY, "", 0);
+                }
+                send_request(worker, connection, COMMAND_AUTH, auth,
+                        strlen(auth));
+                connection->state = STATE_OK;
+            }
+            break;
+        case STATE_OK:
+            if (command->type == COMMAND_OK) {
+                connection->binary = strcmp(command->argument, "BINARY") == 0;
+                connection->state = STATE_WHO;
+            }
+            break;
+        case STATE_WHO:
+            if (command->type == COMMAND_WHO) {
+                send_request(worker, connection, COMMAND_NAME,
+                        connection->name, strlen(connection->name));
+                connection->state = STATE_NAME;
+            }
+            break;
+        case STATE_NAME:
+            if (command->type == COMMAND_OK) {
+                connection->state = STATE_CHAT;
+                worker->joined++;
+                histogram_record(&worker->handshake,
+                        now_usec() - connection->connectedAt);
+            } else if (command->type == COMMAND_NAME_TAKEN) {
+                fprintf(stderr, "Name %s taken\n", connection->name);
+                connection->state = STATE_CLOSED;
+            }
+            break;
+        case STATE_CHAT:
+            if (command->type == COMMAND_MSG) {
+                handle_message(worker, connection, command);
+            } else if (command->type == COMMAND_LIST) {
+                worker->lists += measuring;
+            } else if (command->type == COMMAND_KICK) {
+                // stay connected so the load does not change
+                worker->kicks += measuring;
+            } else if (command->type == COMMAND_PING) {
+                send_request(worker, connection, COMMAND_PONG, "", 0);
+            }
+            break;
+        case STATE_CLOSED:
+            break;
+    }
+}
+
+/*
+ * Function which reads whatever is available on a connection and handles
+ * every complete command.
+ * Parameters:
+ * worker - worker driving the connection
+ * connection - connection which is readable
+ */
+void read_connection(Worker* worker, Connection* connection) {
+    Command command;
+    line_buffer_fill(&connection->from);
+    while (connection->state != STATE_CLOSED &&
+            protocol_next_command(&connection->from, connection->binary,
+            &command)) {
+        handle_command(worker, connection, &command);
+    }
+    if (connection->from.closed || connection->state == STATE_CLOSED) {
+        if (connection->state == STATE_CHAT) {
+            worker->joined--;
+        }
+        connection->state = STATE_CLOSED;
+        worker->closed++;
+        epoll_ctl(worker->epoll, EPOLL_CTL_DEL, connection->fd, NULL);
+    }
+}
+
+/*
+ * Function which sends the next command from the load mix on the next
+ * chatting connection.
+ * Parameters:
+ * worker - worker sending the command
+ */
+void send_command(Worker* worker) {
+    const LoadOptions* options = worker->options;
+    char argument[OUTPUT_SIZE];
+    CommandType type = COMMAND_SAY;
+    int length = 0;
+    Connection* connection = NULL;
+    for (int tried = 0; tried < worker->count; tried++) {
+        Connection* next = &worker->connections[worker->next];
+        worker->next = (worker->next + 1) % worker->count;
+        if (next->state == STATE_CHAT) {
+            connection = next;
+            break;
+        }
+    }
+    if (connection == NULL) {
+        return;
+    }
+    double choice = next_random(worker) % (PERCENT * 100) / 100.0;
+    unsigned long* sent = &worker->say;
+    if (choice < options->listPercent) {
+        type = COMMAND_LIST;
+        sent = &worker->list;
+    } else if (choice < options->listPercent + options->kickPercent) {
+        // kick another loadgen connection, which ignores the KICK:
+        Connection* kicked = &worker->connections[next_random(worker) %
+                worker->count];
+        type = COMMAND_KICK;
+        length = snprintf(argument, sizeof(argument), "%s", kicked->name);
+        sent = &worker->kick;
+    } else {
+        length = snprintf(argument, sizeof(argument), "%lld:", now_usec());
+        memset(argument + length, 'x', options->size);
+        length += options->size;
+    }
+    if (!send_request(worker, connection, type, argument, length)) {
+        worker->skipped += measuring;
+    } else if (measuring) {
+        (*sent)++;
+    }
+}
+
+/*
+ * Function which opens a worker's connections to the server.
+ * Parameters:
+ * worker - worker to open connections for
+ */
+void open_connections(Worker* worker) {
+    int noDelay = 1;
+    for (int i = 0; i < worker->count; i++) {
+        Connection* connection = &worker->connections[i];
+        snprintf(connection->name, sizeof(connection->name), "lg%d-%d-%d",
+                getpid(), worker->id, i);
+        connection->connectedAt = now_usec();
+        connection->fd = connect_socket(worker->options->port);
+        setsockopt(connection->fd, IPPROTO_TCP, TCP_NODELAY, &noDelay,
+                sizeof(int));
+        fcntl(connection->fd, F_SETFL,
+                fcntl(connection->fd, F_GETFL) | O_NONBLOCK);
+        line_buffer_init(&connection->from, connection->fd,
+                LINE_BUFFER_SIZE);
+        connection->state = STATE_AUTH;
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = connection;
+        epoll_ctl(worker->epoll, EPOLL_CTL_ADD, connection->fd, &event);
+    }
+}
+
+/*
+ * Thread function which drives a share of the connections, sending commands
+ * at the worker's share of the overall rate until loadgen stops.
+ * Parameters:
+ * data - worker to run
+ */
+void* worker_thread(void* data) {
+    Worker* worker = data;
+    struct epoll_event events[MAX_EVENTS];
+    double rate = worker->options->rate / worker->options->threads;
+    long long started = now_usec();
+    unsigned long commands = 0;
+    open_connections(worker);
+    while (running) {
+        long long now = now_usec();
+        unsigned long due = rate * (now - started) / USEC_PER_SEC;
+        for (; commands < due; commands++) {
+            send_command(worker);
+        }
+        int ready = epoll_wait(worker->epoll, events, MAX_EVENTS, 1);
+        for (int i = 0; i < ready; i++) {
+            Connection* connection = events[i].data.ptr;
+            if (events[i].events & EPOLLOUT) {
+                flush_output(worker, connection);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                read_connection(worker, connection);
+            }
+        }
+    }
+    for (int i = 0; i < worker->count; i++) {
+        close(worker->connections[i].fd);
+        line_buffer_free(&worker->connections[i].from);
+    }
+    return NULL;
+}
+
+/*
+ * Function which prints a latency histogram in milliseconds.
+ * Parameters:
+ * label - what was timed
+ * histogram - times in microseconds
+ */
+void report(const char* label, Histogram* histogram) {
+    printf("%s: samples %lu p50 %.3f p99 %.3f p999 %.3f max %.3f (ms)\n",
+            label, histogram_count(histogram),
+            histogram_percentile(histogram, 50) / USEC_PER_MSEC,
+            histogram_percentile(histogram, 99) / USEC_PER_MSEC,
+            histogram_percentile(histogram, 99.9) / USEC_PER_MSEC,
+            histogram_percentile(histogram, 100) / USEC_PER_MSEC);
+}
+
+/*
+ * Program which opens many connections to the server from a few threads,
+ * joins the chat on each and sends a mix of SAY:, LIST: and KICK: at a set
+ * rate. Each SAY: carries the time it was sent, so every MSG: recieved can
+ * be timed. Once every connection has joined the load is measured for the
+ * given duration and throughput and latency are reported.
+ */
+int main(int argc, char* argv[]) {
+    LoadOptions options;
+    parse_load_options(&options, argc, argv);
+    // thousands of connections need more descriptors than the default
+    struct rlimit files;
+    getrlimit(RLIMIT_NOFILE, &files);
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+
+    Worker* workers = calloc(options.threads, sizeof(Worker));
+    pthread_t* threads = malloc(options.threads * sizeof(pthread_t));
+    for (int i = 0; i < options.threads; i++) {
+        Worker* worker = &workers[i];
+        worker->id = i;
+        worker->options = &options;
+        worker->epoll = epoll_create1(EPOLL_CLOEXEC);
+        worker->count = options.connections / options.threads +
+                (i < options.connections % options.threads ? 1 : 0);
+        worker->connections = calloc(worker->count, sizeof(Connection));
+        worker->random = getpid() * (i + 1) | 1;
+        pthread_create(&threads[i], NULL, worker_thread, worker);
+    }
+
+    unsigned long joined;
+    do {
+        usleep(USEC_PER_SEC / PERCENT);
+        joined = 0;
+        for (int i = 0; i < options.threads; i++) {
+            joined += workers[i].joined + workers[i].closed;
+        }
+    } while (joined < options.connections);
+    measuring = true;
+    long long start = now_usec();
+    usleep(options.duration * USEC_PER_SEC);
+    measuring = false;
+    double elapsed = (now_usec() - start) / (double) USEC_PER_SEC;
+    running = false;
+
+    Worker total;
+    memset(&total, 0, sizeof(Worker));
+    for (int i = 0; i < options.threads; i++) {
+        pthread_join(threads[i], NULL);
+        total.joined += workers[i].joined;
+        total.closed += workers[i].closed;
+        total.say += workers[i].say;
+        total.list += workers[i].list;
+        total.kick += workers[i].kick;
+        total.skipped += workers[i].skipped;
+        total.messages += workers[i].messages;
+        total.lists += workers[i].lists;
+        total.kicks += workers[i].kicks;
+        histogram_merge(&total.handshake, &workers[i].handshake);
+        histogram_merge(&total.fanout, &workers[i].fanout);
+        free(workers[i].connections);
+        close(workers[i].epoll);
+    }
+    printf("connections: joined %lu closed %lu\n", total.joined,
+            total.closed);
+    printf("sent in %.1fs: SAY %lu (%.0f/s) LIST %lu KICK %lu skipped %lu\n",
+            elapsed, total.say, total.say / elapsed, total.list, total.kick,
+            total.skipped);
+    printf("recieved: MSG %lu (%.0f/s) LIST %lu KICK %lu\n", total.messages,
+            total.messages / elapsed, total.lists, total.kicks);
+    report("handshake", &total.handshake);
+    report("fan-out", &total.fanout);
+    free(workers);
+    free(threads);
+    free(options.auth);
+    return 0;
+}
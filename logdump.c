@@ -0,0 +1,255 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <ctype.h>
+#include <time.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include "shared.h"
+#include "logrecord.h"
+#define USAGE "Usage: logdump [--follow] logdirectory\n"
+#define USEC_PER_SEC 1000000LL
+// how long --follow waits before looking for more of the log
+#define FOLLOW_USEC 100000
+
+/*
+ * Data structure which stores a segment of the log mapped into memory.
+ */
+typedef struct {
+    unsigned number;
+    int fd;
+    char* data;
+    size_t size;
+    // bytes of records already printed
+    size_t offset;
+} Segment;
+
+/*
+ * Function which finds the lowest numbered segment in the log directory
+ * after a given one.
+ * Parameters:
+ * directory - directory of the log
+ * after - number of the last segment read (0 to find the first)
+ * Return:
+ * unsigned - number of the segment, 0 if there is none
+ */
+unsigned next_segment(const char* directory, unsigned after) {
+    DIR* log = opendir(directory);
+    struct dirent* entry;
+    unsigned number;
+    unsigned next = 0;
+    if (log == NULL) {
+        usage_error(USAGE);
+    }
+    while ((entry = readdir(log)) != NULL) {
+        if (sscanf(entry->d_name, LOG_SEGMENT_FORMAT, &number) == 1 &&
+                number > after && (next == 0 || number < next)) {
+            next = number;
+        }
+    }
+    closedir(log);
+    return next;
+}
+
+/*
+ * Function which maps as much of a segment as has been written so far,
+ * keeping how far through it has been read.
+ * Parameters:
+ * segment - segment to map
+ */
+void map_segment(Segment* segment) {
+    struct stat status;
+    if (fstat(segment->fd, &status) != 0 ||
+            (size_t) status.st_size == segment->size) {
+        return;
+    }
+    if (segment->data != NULL) {
+        munmap(segment->data, segment->size);
+    }
+    segment->size = status.st_size;
+    segment->data = mmap(NULL, segment->size, PROT_READ, MAP_SHARED,
+            segment->fd, 0);
+    if (segment->data == MAP_FAILED) {
+        perror("logdump: mmap");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Function which opens a segment of the log and maps it.
+ * Parameters:
+ * segment - segment to open
+ * directory - directory of the log
+ * number - number of the segment
+ */
+void open_segment(Segment* segment, const char* directory, unsigned number) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/" LOG_SEGMENT_FORMAT, directory,
+            number);
+    segment->number = number;
+    segment->fd = open(path, O_RDONLY | O_CLOEXEC);
+    segment->data = NULL;
+    segment->size = 0;
+    segment->offset = 0;
+    if (segment->fd < 0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    map_segment(segment);
+}
+
+/*
+ * Function which unmaps and closes a segment.
+ * Parameters:
+ * segment - segment to close
+ */
+void close_segment(Segment* segment) {
+    if (segment->data != NULL) {
+        munmap(segment->data, segment->size);
+    }
+    close(segment->fd);
+}
+
+/*
+ * Function which prints text from the log, with any unprintable characters
+ * printed as '?'.
+ * Parameters:
+ * text - text to print
+ * length - number of bytes of text
+ */
+void print_readable(const char* text, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        putchar(isprint((unsigned char) text[i]) ? text[i] : '?');
+    }
+}
+
+/*
+ * Function which prints a record as the time it was sent (in UTC), the
+ * room, and the sender and message as the server prints them.
+ * Parameters:
+ * record - record to print
+ */
+void print_record(LogRecord* record) {
+    char date[32];
+    time_t seconds = record->time / USEC_PER_SEC;
+    struct tm utc;
+    gmtime_r(&seconds, &utc);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &utc);
+    printf("%s.%06lldZ ", date, record->time % USEC_PER_SEC);
+    const char* end = record->payload + record->length;
+    const char* room = record->payload;
+    const char* name = memchr(room, '\0', record->length);
+    name = name == NULL ? end : name + 1;
+    const char* message = memchr(name, '\0', end - name);
+    message = message == NULL ? end : message + 1;
+    print_readable(room, strnlen(room, end - room));
+    putchar(' ');
+    print_readable(name, strnlen(name, end - name));
+    printf(": ");
+    print_readable(message, end - message);
+    putchar('\n');
+}
+
+/*
+ * Function which prints every complete record of a segment not yet printed.
+ * Parameters:
+ * segment - segment to print from
+ * Return:
+ * bool - true if the segment ends with a complete record, false if
+ * anything after the last record printed is not yet (or was never) a whole
+ * record with a valid checksum.
+ */
+bool print_segment(Segment* segment) {
+    LogRecord record;
+    while (segment->offset < segment->size) {
+        if (!log_decode_record(segment->data + segment->offset,
+                segment->size - segment->offset, &record)) {
+            return false;
+        }
+        print_record(&record);
+        segment->offset += record.size;
+    }
+    return true;
+}
+
+/*
+ * Function which prints the records of every segment of a log in order.
+ * A segment which ends partway through a record is reported, and the rest
+ * of it skipped, as is left by a crash. When following, the last segment is
+ * watched for records being added, and for the server moving on to a new
+ * segment, until the program is killed.
+ * Parameters:
+ * directory - directory of the log
+ * follow - whether to keep printing records as they are added
+ */
+void dump_log(const char* directory, bool follow) {
+    Segment segment;
+    unsigned number = next_segment(directory, 0);
+    while (number == 0 && follow) {
+        usleep(FOLLOW_USEC);
+        number = next_segment(directory, 0);
+    }
+    if (number == 0) {
+        return;
+    }
+    open_segment(&segment, directory, number);
+    while (1) {
+        bool whole = print_segment(&segment);
+        fflush(stdout);
+        unsigned next = next_segment(directory, segment.number);
+        if (next == 0 && follow) {
+            usleep(FOLLOW_USEC);
+            map_segment(&segment);
+            continue;
+        }
+        if (next != 0) {
+            // the server finishes a segment before starting the next, so
+            // anything written since it was last looked at is complete
+            map_segment(&segment);
+            whole = print_segment(&segment);
+        }
+        if (!whole) {
+            fprintf(stderr, "logdump: " LOG_SEGMENT_FORMAT
+                    " is damaged after byte %zu\n", segment.number,
+                    segment.offset);
+        }
+        close_segment(&segment);
+        if (next == 0) {
+            return;
+        }
+        open_segment(&segment, directory, next);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    struct option longOptions[] = {
+        {"follow", no_argument, NULL, 'f'},
+        {NULL, 0, NULL, 0}
+    };
+    int option;
+    bool follow = false;
+    opterr = 0;
+    while ((option = getopt_long(argc, argv, "+", longOptions,
+            NULL)) != -1) {
+        switch (option) {
+            case 'f':
+                follow = true;
+                break;
+            default:
+                usage_error(USAGE);
+        }
+    }
+    if (argc - optind != 1) {
+        usage_error(USAGE);
+    }
+    dump_log(argv[optind], follow);
+    return 0;
+}
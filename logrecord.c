@@ -0,0 +1,109 @@
+#include "logrecord.h"
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+#define TIME_BYTES 8
+
+/*
+ * Function which adds bytes to an FNV-1a checksum.
+ * Parameters:
+ * hash - checksum of the bytes before these
+ * data - bytes to add
+ * length - number of bytes to add
+ * Return:
+ * uint32_t - checksum including the bytes
+ */
+uint32_t log_checksum(uint32_t hash, const char* data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char) data[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+/*
+ * Function which writes a time as eight big-endian bytes.
+ * Parameters:
+ * to - where to write the time
+ * time - time in microseconds
+ */
+static void encode_time(char* to, long long time) {
+    for (int i = 0; i < TIME_BYTES; i++) {
+        to[i] = (unsigned long long) time >> (8 * (TIME_BYTES - 1 - i));
+    }
+}
+
+/*
+ * Function which starts the checksum of a record with the time it carries.
+ * Parameters:
+ * time - time of the record in microseconds
+ * Return:
+ * uint32_t - checksum of the time, to be continued with the payload
+ */
+uint32_t log_time_checksum(long long time) {
+    char bytes[TIME_BYTES];
+    encode_time(bytes, time);
+    return log_checksum(FNV_OFFSET, bytes, TIME_BYTES);
+}
+
+/*
+ * Function which writes the header of a record.
+ * Parameters:
+ * to - filled in with LOG_HEADER_SIZE bytes of header
+ * length - bytes of payload which follow the header
+ * checksum - checksum of the time and payload
+ * time - time the message was sent in microseconds since the epoch
+ */
+void log_encode_header(char* to, size_t length, uint32_t checksum,
+        long long time) {
+    to[0] = length >> 24;
+    to[1] = length >> 16;
+    to[2] = length >> 8;
+    to[3] = length;
+    to[4] = checksum >> 24;
+    to[5] = checksum >> 16;
+    to[6] = checksum >> 8;
+    to[7] = checksum;
+    encode_time(to + 8, time);
+}
+
+/*
+ * Function which reads a big-endian number.
+ * Parameters:
+ * from - bytes of the number
+ * count - number of bytes
+ * Return:
+ * unsigned long long - the number
+ */
+static unsigned long long decode_number(const char* from, int count) {
+    unsigned long long number = 0;
+    for (int i = 0; i < count; i++) {
+        number = number << 8 | (unsigned char) from[i];
+    }
+    return number;
+}
+
+/*
+ * Function which reads the record at the start of some bytes of a log.
+ * Parameters:
+ * data - bytes of the log from the start of the record
+ * available - number of bytes which have been written
+ * record - filled in with the record
+ * Return:
+ * bool - false if the record has not been completely written yet, or its
+ * checksum does not match (as after a crash part way through writing it).
+ */
+bool log_decode_record(const char* data, size_t available,
+        LogRecord* record) {
+    if (available < LOG_HEADER_SIZE) {
+        return false;
+    }
+    record->length = decode_number(data, 4);
+    if (record->length > available - LOG_HEADER_SIZE) {
+        return false;
+    }
+    record->time = decode_number(data + 8, TIME_BYTES);
+    record->payload = data + LOG_HEADER_SIZE;
+    record->size = LOG_HEADER_SIZE + record->length;
+    uint32_t checksum = log_checksum(log_time_checksum(record->time),
+            record->payload, record->length);
+    return checksum == decode_number(data + 4, 4);
+}
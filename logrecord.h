@@ -0,0 +1,34 @@
+#ifndef _LOGRECORD_H
+#define _LOGRECORD_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#define LOG_HEADER_SIZE 16
+#define LOG_SEGMENT_FORMAT "chat-%010u.log"
+
+/*
+ * A message as it is kept in the chat log. Each record is a 16 byte header
+ * of the payload's length (u32), a checksum of the time and payload (u32)
+ * and the time the message was sent in microseconds since the epoch (u64),
+ * all big-endian, followed by the payload: the room's name, a null, the
+ * sender's name, a null and the message.
+ */
+typedef struct {
+    long long time;
+    const char* payload;
+    size_t length;
+    // bytes taken up by the whole record
+    size_t size;
+} LogRecord;
+
+uint32_t log_checksum(uint32_t hash, const char* data, size_t length);
+
+uint32_t log_time_checksum(long long time);
+
+void log_encode_header(char* to, size_t length, uint32_t checksum,
+        long long time);
+
+bool log_decode_record(const char* data, size_t available,
+        LogRecord* record);
+
+#endif
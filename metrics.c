@@ -0,0 +1,391 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "metrics.h"
+#include "server.h"
+#include "stats.h"
+#include "slab.h"
+#include "chatlog.h"
+#include "shared.h"
+#define USEC_PER_SEC 1000000.0
+// most bytes of a scraper's request which are read before answering it
+#define REQUEST_LIMIT 4096
+// seconds a scraper has to send its request and to read the answer
+#define SCRAPE_TIMEOUT 2
+
+/*
+ * A counter of the server's statistics as it is served. Counters which
+ * share a name are one metric told apart by their labels, and follow each
+ * other.
+ */
+typedef struct {
+    Stat stat;
+    const char* name;
+    // labels of the counter, NULL if it has none
+    const char* labels;
+    const char* help;
+} CounterMetric;
+
+static const CounterMetric counterMetrics[] = {
+    {STAT_AUTH, "chat_commands_total", "command=\"auth\"",
+            "Commands handled, by type."},
+    {STAT_NAME, "chat_commands_total", "command=\"name\"", NULL},
+    {STAT_SAY, "chat_commands_total", "command=\"say\"", NULL},
+    {STAT_KICK, "chat_commands_total", "command=\"kick\"", NULL},
+    {STAT_LIST, "chat_commands_total", "command=\"list\"", NULL},
+    {STAT_LEAVE, "chat_commands_total", "command=\"leave\"", NULL},
+    {STAT_BYTES_IN, "chat_received_bytes_total", NULL,
+            "Bytes recieved from clients."},
+    {STAT_BYTES_OUT, "chat_sent_bytes_total", NULL,
+            "Bytes written to clients."},
+    {STAT_FANOUT, "chat_fanout_lines_total", NULL,
+            "Lines queued for clients by broadcasts."},
+    {STAT_OVERSIZE, "chat_oversize_commands_total", NULL,
+            "Commands recieved which were longer than the line limit."},
+    {STAT_THROTTLED, "chat_throttled_commands_total", NULL,
+            "Commands held back by the rate policy."},
+    {STAT_REJECTED, "chat_rejected_commands_total", NULL,
+            "Commands thrown away for going over the limit for their type."},
+    {STAT_CONNECTIONS_FULL, "chat_refused_connections_total",
+            "reason=\"full\"",
+            "Connections closed as soon as they were accepted, by reason."},
+    {STAT_ACCEPTS_SHED, "chat_refused_connections_total", "reason=\"shed\"",
+            NULL},
+    {STAT_AUTH_TIMEOUT, "chat_timeouts_total", "stage=\"auth\"",
+            "Clients closed for taking too long, by what they took long at."},
+    {STAT_NAME_TIMEOUT, "chat_timeouts_total", "stage=\"name\"", NULL},
+    {STAT_IDLE_TIMEOUT, "chat_timeouts_total", "stage=\"idle\"", NULL},
+    {STAT_WRITE_TIMEOUT, "chat_timeouts_total", "stage=\"write\"", NULL},
+    {STAT_PING, "chat_pings_total", NULL, "PING: lines sent to quiet clients."},
+    {STAT_CROSS_SHARD, "chat_cross_shard_frames_total", NULL,
+            "Frames posted to another shard's loop."},
+    {STAT_SLAB_ALLOC, "chat_slab_allocations_total", NULL,
+            "Objects allocated from slabs."},
+    {STAT_SLAB_FREE, "chat_slab_frees_total", NULL,
+            "Objects freed to slabs."},
+    {STAT_SLAB_SHARED, "chat_slab_shared_total", NULL,
+            "Trips to a slab's shared list."},
+    {STAT_MALLOC, "chat_malloc_frames_total", NULL,
+            "Frames too large for any slab."},
+    {STAT_REPLAYED, "chat_replayed_messages_total", NULL,
+            "Messages replayed from a room's backlog to clients joining it."},
+    {STAT_LOG_RECORDS, "chat_log_records_total", NULL,
+            "Messages written to the chat log."},
+    {STAT_LOG_SYNCS, "chat_log_syncs_total", NULL,
+            "Syncs of the chat log to disk."},
+    {STAT_LOG_DROPPED, "chat_log_dropped_total", NULL,
+            "Messages left out of the chat log."}
+};
+
+/*
+ * Percentiles of each latency histogram served, with the quantile label
+ * they are served under.
+ */
+static const struct {
+    double percentile;
+    const char* quantile;
+} quantiles[] = {
+    {50, "0.5"},
+    {90, "0.9"},
+    {99, "0.99"},
+    {99.9, "0.999"},
+    {100, "1"}
+};
+
+/*
+ * Data structure which stores what the metrics thread needs to answer a
+ * scrape.
+ */
+typedef struct {
+    int listenDiscriptor;
+    ClientList* clientList;
+    StatsTotals totals;
+} Metrics;
+
+/*
+ * Function which writes the help text and type of a metric.
+ * Parameters:
+ * out - where the metrics are written
+ * name - name of the metric
+ * type - Prometheus type of the metric
+ * help - what the metric measures
+ */
+static void write_header(FILE* out, const char* name, const char* type,
+        const char* help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/*
+ * Function which writes a gauge with a single value.
+ * Parameters:
+ * out - where the metrics are written
+ * name - name of the gauge
+ * help - what the gauge measures
+ * value - current value
+ */
+static void write_gauge(FILE* out, const char* name, const char* help,
+        unsigned long value) {
+    write_header(out, name, "gauge", help);
+    fprintf(out, "%s %lu\n", name, value);
+}
+
+/*
+ * Function which writes one of the server's latency histograms as a
+ * summary, in seconds.
+ * Parameters:
+ * out - where the metrics are written
+ * name - name of the summary
+ * help - what was timed
+ * histogram - times recorded in microseconds
+ */
+static void write_summary(FILE* out, const char* name, const char* help,
+        Histogram* histogram) {
+    write_header(out, name, "summary", help);
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+        fprintf(out, "%s{quantile=\"%s\"} %.6f\n", name,
+                quantiles[i].quantile, histogram_percentile(histogram,
+                quantiles[i].percentile) / USEC_PER_SEC);
+    }
+    fprintf(out, "%s_sum %.6f\n%s_count %lu\n", name,
+            histogram_sum(histogram) / USEC_PER_SEC, name,
+            histogram_count(histogram));
+}
+
+/*
+ * Function which writes every metric of the server in the Prometheus text
+ * format. The counters are all read at one time, and the clients are read
+ * from the published snapshot of the client list, so a scrape never takes
+ * the roster lock or holds up a thread serving clients.
+ * Parameters:
+ * out - where the metrics are written
+ * metrics - metrics of the server
+ */
+static void write_metrics(FILE* out, Metrics* metrics) {
+    ClientList* clientList = metrics->clientList;
+    StatsTotals* totals = &metrics->totals;
+    size_t queued;
+    size_t deepest;
+    stats_read(totals);
+    int clients = queue_depths(clientList, &queued, &deepest);
+    const char* previous = NULL;
+    for (size_t i = 0; i < sizeof(counterMetrics) / sizeof(counterMetrics[0]);
+            i++) {
+        const CounterMetric* counter = &counterMetrics[i];
+        if (previous == NULL || strcmp(previous, counter->name) != 0) {
+            write_header(out, counter->name, "counter", counter->help);
+            previous = counter->name;
+        }
+        if (counter->labels == NULL) {
+            fprintf(out, "%s %lu\n", counter->name,
+                    totals->counters[counter->stat]);
+        } else {
+            fprintf(out, "%s{%s} %lu\n", counter->name, counter->labels,
+                    totals->counters[counter->stat]);
+        }
+    }
+    write_gauge(out, "chat_connections", "Connections open in any stage.",
+            __atomic_load_n(&(clientList->connections), __ATOMIC_RELAXED));
+    write_gauge(out, "chat_clients", "Clients in the chat.", clients);
+    write_gauge(out, "chat_shards", "Loops the clients are split between.",
+            clientList->shardCount);
+    write_gauge(out, "chat_queued_bytes",
+            "Bytes waiting to be sent to clients in the chat.", queued);
+    write_gauge(out, "chat_queued_bytes_max",
+            "Most bytes waiting to be sent to any one client.", deepest);
+    write_gauge(out, "chat_slab_reserved_bytes",
+            "Bytes reserved by slabs.", slab_reserved());
+    if (clientList->log != NULL) {
+        write_gauge(out, "chat_log_waiting_bytes",
+                "Bytes of messages waiting to be written to the chat log.",
+                __atomic_load_n(&(clientList->log->waiting),
+                __ATOMIC_RELAXED));
+    }
+    write_summary(out, "chat_handshake_seconds",
+            "Time from a connection being accepted to its name being "
+            "accepted.", &totals->timings[TIMING_HANDSHAKE]);
+    write_summary(out, "chat_delivery_seconds",
+            "Time from a SAY: being recieved to its MSG: being completely "
+            "written to a client.", &totals->timings[TIMING_DELIVERY]);
+}
+
+/*
+ * Function which sends bytes to a scraper, giving up if it stops reading.
+ * Parameters:
+ * peer - connection to the scraper
+ * data - bytes to send
+ * length - number of bytes
+ * Return:
+ * bool - false if they could not all be sent.
+ */
+static bool send_all(int peer, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(peer, data, length, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+/*
+ * Function which answers one scrape. Whatever was asked for, the answer is
+ * an HTTP response carrying every metric, so the socket can be scraped by
+ * Prometheus or read with curl. The request is read up to the blank line
+ * which ends its headers first, so closing the connection does not reset
+ * it.
+ * Parameters:
+ * metrics - metrics of the server
+ * peer - connection to the scraper
+ */
+static void answer_scrape(Metrics* metrics, int peer) {
+    char request[REQUEST_LIMIT + 1];
+    size_t got = 0;
+    struct timeval timeout = {SCRAPE_TIMEOUT, 0};
+    setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(peer, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    while (got < REQUEST_LIMIT) {
+        ssize_t received = recv(peer, request + got, REQUEST_LIMIT - got,
+                0);
+        if (received <= 0) {
+            break;
+        }
+        got += received;
+        request[got] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL ||
+                strstr(request, "\n\n") != NULL) {
+            break;
+        }
+    }
+
+    char* body;
+    size_t length;
+    FILE* out = open_memstream(&body, &length);
+    write_metrics(out, metrics);
+    fclose(out);
+    char header[128];
+    int headerLength = snprintf(header, sizeof(header),
+            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %zu\r\n\r\n", length);
+    if (send_all(peer, header, headerLength)) {
+        send_all(peer, body, length);
+    }
+    free(body);
+}
+
+/*
+ * Thread function which answers scrapes of the server's metrics one at a
+ * time, for as long as the server runs.
+ * Parameters:
+ * data - Metrics of the server
+ */
+static void* metrics_thread(void* data) {
+    Metrics* metrics = data;
+    while (1) {
+        int peer = accept4(metrics->listenDiscriptor, NULL, NULL,
+                SOCK_CLOEXEC);
+        if (peer < 0) {
+            // out of file descriptors, wait for some to be freed rather
+            // than spinning
+            long long wait = accept_backoff(errno) - now_usec();
+            if (wait > 0) {
+                usleep(wait);
+            }
+            continue;
+        }
+        answer_scrape(metrics, peer);
+        close(peer);
+    }
+    return NULL;
+}
+
+/*
+ * Function which opens the socket metrics are served on. An address with a
+ * '/' in it is the path of a Unix socket, replacing anything already
+ * there. Anything else is a port listened on at the loopback address only,
+ * which a server taking over from this one may share until this one exits.
+ * Parameters:
+ * address - path or port to listen on
+ * Return:
+ * int - the listening socket, -1 if it could not be opened
+ */
+static int open_metrics_listen(const char* address) {
+    int listenDiscriptor;
+    if (strchr(address, '/') != NULL) {
+        struct sockaddr_un unixAddress;
+        memset(&unixAddress, 0, sizeof(unixAddress));
+        unixAddress.sun_family = AF_UNIX;
+        if (strlen(address) >= sizeof(unixAddress.sun_path)) {
+            return -1;
+        }
+        strcpy(unixAddress.sun_path, address);
+        listenDiscriptor = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        unlink(address);
+        if (bind(listenDiscriptor, (struct sockaddr*) &unixAddress,
+                sizeof(unixAddress)) < 0) {
+            close(listenDiscriptor);
+            return -1;
+        }
+    } else {
+        struct addrinfo* addressInfo = NULL;
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(struct addrinfo));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+        if (getaddrinfo("127.0.0.1", address, &hints, &addressInfo) != 0) {
+            return -1;
+        }
+        listenDiscriptor = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int optVal = 1;
+        setsockopt(listenDiscriptor, SOL_SOCKET, SO_REUSEADDR, &optVal,
+                sizeof(int));
+        setsockopt(listenDiscriptor, SOL_SOCKET, SO_REUSEPORT, &optVal,
+                sizeof(int));
+        int bound = bind(listenDiscriptor, addressInfo->ai_addr,
+                addressInfo->ai_addrlen);
+        freeaddrinfo(addressInfo);
+        if (bound < 0) {
+            close(listenDiscriptor);
+            return -1;
+        }
+    }
+    if (listen(listenDiscriptor, SOMAXCONN) < 0) {
+        close(listenDiscriptor);
+        return -1;
+    }
+    return listenDiscriptor;
+}
+
+/*
+ * Function which starts serving the server's metrics on a local socket,
+ * where they can be scraped as often as wanted rather than asked for on
+ * stderr with a signal.
+ * Parameters:
+ * address - Unix socket path, or loopback port, to serve them on
+ * clientList - list of clients connected to the server
+ * Return:
+ * bool - false if the socket could not be opened.
+ */
+bool metrics_start(const char* address, ClientList* clientList) {
+    pthread_t thread;
+    int listenDiscriptor = open_metrics_listen(address);
+    if (listenDiscriptor < 0) {
+        return false;
+    }
+    Metrics* metrics = malloc(sizeof(Metrics));
+    metrics->listenDiscriptor = listenDiscriptor;
+    metrics->clientList = clientList;
+    pthread_create(&thread, NULL, metrics_thread, metrics);
+    pthread_detach(thread);
+    return true;
+}
@@ -0,0 +1,9 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+#include <stdbool.h>
+
+struct ClientList;
+
+bool metrics_start(const char* address, struct ClientList* clientList);
+
+#endif
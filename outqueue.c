@@ -0,0 +1,581 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "outqueue.h"
+#include "shared.h"
+#include "stats.h"
+#include "protocol.h"
+#define MAX_BATCH 64
+#define INITIAL_CAPACITY 16
+
+/*
+ * Function which initialises an empty outbound queue for a socket.
+ * Parameters:
+ * queue - queue to initialise
+ * fd - socket the queue writes to
+ * limit - most bytes that may be waiting in the queue
+ * policy - what to do when a frame would take the queue over its limit
+ * notify - function telling the owner whether to wait for writability
+ * owner - data for the notify function
+ */
+void out_queue_init(OutQueue* queue, int fd, size_t limit, SlowPolicy policy,
+        void (*notify)(OutQueue*, bool), void* owner) {
+    queue->fd = fd;
+    pthread_mutex_init(&queue->mutex, NULL);
+    queue->capacity = INITIAL_CAPACITY;
+    queue->frames = malloc(queue->capacity * sizeof(Frame*));
+    queue->head = 0;
+    queue->count = 0;
+    queue->offset = 0;
+    queue->bytes = 0;
+    queue->written = 0;
+    queue->limit = limit;
+    queue->policy = policy;
+    queue->closed = false;
+    queue->writeWanted = false;
+    queue->held = false;
+    queue->deferred = false;
+    queue->inFlight = 0;
+    queue->binary = false;
+    queue->coalesceBytes = 0;
+    queue->coalesceDelay = 0;
+    queue->lastWrite = 0;
+    queue->flushAt = 0;
+    queue->timedFrom = 0;
+    queue->schedule = NULL;
+    queue->dropped = 0;
+    queue->notify = notify;
+    queue->owner = owner;
+}
+
+/*
+ * Function which returns the frame at a position in the queue, counting from
+ * the head. The caller holds the mutex.
+ * Parameters:
+ * queue - queue to look in
+ * position - position of the frame (0 is the head)
+ * Return:
+ * Frame** - slot of the ring holding the frame
+ */
+static Frame** frame_at(OutQueue* queue, int position) {
+    return &queue->frames[(queue->head + position) % queue->capacity];
+}
+
+/*
+ * Function which removes the head frame from a queue and releases it. The
+ * caller holds the mutex.
+ * Parameters:
+ * queue - queue to remove the frame from
+ */
+static void pop_frame(OutQueue* queue) {
+    frame_release(*frame_at(queue, 0));
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    queue->offset = 0;
+}
+
+/*
+ * Function which releases the frames in a queue from the given position
+ * onwards. Frames the owner is still writing are kept until the write
+ * completes. The caller holds the mutex.
+ * Parameters:
+ * queue - queue to empty
+ * from - position of the first frame to release
+ */
+static void clear_frames(OutQueue* queue, int from) {
+    if (from < queue->inFlight) {
+        from = queue->inFlight;
+    }
+    for (int i = from; i < queue->count; i++) {
+        Frame* frame = *frame_at(queue, i);
+        queue->bytes -= frame->length - (i == 0 ? queue->offset : 0);
+        frame_release(frame);
+    }
+    queue->count = from;
+    if (from == 0) {
+        queue->offset = 0;
+    }
+}
+
+/*
+ * Function which frees everything held by a queue. The socket is not closed.
+ * Parameters:
+ * queue - queue to destroy
+ */
+void out_queue_destroy(OutQueue* queue) {
+    clear_frames(queue, 0);
+    free(queue->frames);
+    pthread_mutex_destroy(&queue->mutex);
+}
+
+/*
+ * Function which adds a reference to a frame to the end of a queue, growing
+ * the ring if it is full. The caller holds the mutex.
+ * Parameters:
+ * queue - queue to add to
+ * frame - frame to add
+ */
+static void append_frame(OutQueue* queue, Frame* frame) {
+    if (queue->count == queue->capacity) {
+        Frame** frames = malloc(queue->capacity * 2 * sizeof(Frame*));
+        for (int i = 0; i < queue->count; i++) {
+            frames[i] = *frame_at(queue, i);
+        }
+        free(queue->frames);
+        queue->frames = frames;
+        queue->head = 0;
+        queue->capacity *= 2;
+    }
+    *frame_at(queue, queue->count++) = frame_ref(frame);
+    queue->bytes += frame->length;
+}
+
+/*
+ * Function which stops a queue accepting frames and shuts its socket down so
+ * that the owner sees the client disconnect. The caller holds the mutex.
+ * Parameters:
+ * queue - queue whose client is to be disconnected
+ */
+static void disconnect_locked(OutQueue* queue) {
+    queue->closed = true;
+    clear_frames(queue, 0);
+    shutdown(queue->fd, SHUT_RDWR);
+}
+
+/*
+ * Function which releases the frames at the head of a queue that have been
+ * completely written and records how far into the next one the socket got.
+ * The caller holds the mutex.
+ * Parameters:
+ * queue - queue which has been written to the socket
+ * sent - number of bytes written
+ */
+static void consume_sent(OutQueue* queue, size_t sent) {
+    queue->bytes -= sent;
+    queue->written += sent;
+    stats_add(STAT_BYTES_OUT, sent);
+    while (queue->count > 0 &&
+            sent >= (*frame_at(queue, 0))->length - queue->offset) {
+        Frame* written = *frame_at(queue, 0);
+        sent -= written->length - queue->offset;
+        if (written->received != 0 &&
+                written->received >= queue->timedFrom) {
+            stats_record(TIMING_DELIVERY, now_usec() - written->received);
+        }
+        pop_frame(queue);
+    }
+    queue->offset += sent;
+}
+
+/*
+ * Function which writes as much of a queue as the socket will accept without
+ * blocking, with each batch of frames going out in a single sendmsg(), and
+ * tells the owner whether it needs to wait for writability. Every batch but
+ * the last is sent with MSG_MORE, so the batches are corked into full
+ * segments. Frames are released as soon as they have been completely
+ * written. A deferred queue is not written here, the owner is only told
+ * that there is something to write. A held queue is left until released.
+ * The caller holds the mutex.
+ * Parameters:
+ * queue - queue to write out
+ */
+static void flush_locked(OutQueue* queue) {
+    struct iovec batch[MAX_BATCH];
+    struct msghdr message;
+    if (queue->held) {
+        return;
+    }
+    queue->flushAt = 0;
+    if (queue->coalesceDelay > 0 && queue->count > 0) {
+        queue->lastWrite = now_usec();
+    }
+    while (queue->count > 0 && !queue->deferred) {
+        int count = queue->count < MAX_BATCH ? queue->count : MAX_BATCH;
+        for (int i = 0; i < count; i++) {
+            Frame* frame = *frame_at(queue, i);
+            size_t skip = i == 0 ? queue->offset : 0;
+            batch[i].iov_base = frame->data + skip;
+            batch[i].iov_len = frame->length - skip;
+        }
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = batch;
+        message.msg_iovlen = count;
+        ssize_t sent = sendmsg(queue->fd, &message, MSG_DONTWAIT |
+                MSG_NOSIGNAL | (queue->count > count ? MSG_MORE : 0));
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                disconnect_locked(queue);
+            }
+            break;
+        }
+        consume_sent(queue, sent);
+    }
+    bool writeWanted = queue->count > 0;
+    if (writeWanted != queue->writeWanted) {
+        queue->writeWanted = writeWanted;
+        if (queue->notify != NULL) {
+            queue->notify(queue, writeWanted);
+        }
+    }
+}
+
+/*
+ * Function which makes room in a full queue for a frame of the given length
+ * according to the queue's slow consumer policy. The caller holds the mutex.
+ * Parameters:
+ * queue - queue which is full
+ * length - size of the frame to be added
+ * Return:
+ * bool - true if the frame may now be added.
+ */
+static bool make_room(OutQueue* queue, size_t length) {
+    // a partly written frame has to be finished to keep the stream intact,
+    // and frames being written by the owner cannot be taken back
+    int keep = queue->offset > 0 ? 1 : 0;
+    if (keep < queue->inFlight) {
+        keep = queue->inFlight;
+    }
+    Frame* kick;
+    switch (queue->policy) {
+        case SLOW_DROP_OLDEST:
+            while (queue->bytes + length > queue->limit) {
+                queue->dropped++;
+                if (queue->count == keep) {
+                    return false;
+                }
+                Frame** oldest = frame_at(queue, keep);
+                queue->bytes -= (*oldest)->length;
+                frame_release(*oldest);
+                for (int i = keep; i > 0; i--) {
+                    *frame_at(queue, i) = *frame_at(queue, i - 1);
+                }
+                queue->head = (queue->head + 1) % queue->capacity;
+                queue->count--;
+            }
+            return true;
+        case SLOW_KICK:
+            clear_frames(queue, keep);
+            // sent in the client's own framing, as out_queue_push() would
+            kick = protocol_frame(COMMAND_KICK, NULL, NULL, 0);
+            append_frame(queue, queue->binary ? kick->binary : kick);
+            frame_release(kick);
+            queue->closed = true;
+            flush_locked(queue);
+            return false;
+        case SLOW_DISCONNECT:
+        default:
+            disconnect_locked(queue);
+            return false;
+    }
+}
+
+/*
+ * Function which decides whether the frames waiting in a queue may be held
+ * back to be written together with later ones. Frames are written straight
+ * away if the queue has not been written to recently, so a quiet client
+ * sees no extra delay, and otherwise held until enough bytes are waiting or
+ * the owner flushes the queue at the deadline it is given. The caller holds
+ * the mutex.
+ * Parameters:
+ * queue - queue a frame has just been added to
+ * Return:
+ * bool - true if the frames should be held back.
+ */
+static bool hold_back(OutQueue* queue) {
+    if (queue->coalesceDelay == 0 || queue->bytes >= queue->coalesceBytes) {
+        return false;
+    }
+    if (queue->flushAt == 0) {
+        long long flushAt = queue->lastWrite + queue->coalesceDelay;
+        if (flushAt <= now_usec()) {
+            return false;
+        }
+        queue->flushAt = flushAt;
+        queue->schedule(queue, flushAt);
+    }
+    return true;
+}
+
+/*
+ * Function which adds a frame to a client's queue and, if the client was
+ * keeping up, writes it straight away unless it can be held back to be
+ * written with later frames. Urgent frames are never held back. If the
+ * queue is full the queue's slow consumer policy decides what happens. The
+ * queue takes its own reference to the frame, or to its binary encoding if
+ * the client uses binary framing.
+ * Parameters:
+ * queue - queue of the client the frame is for
+ * frame - frame to send
+ * Return:
+ * bool - true if the frame was queued.
+ */
+bool out_queue_push(OutQueue* queue, Frame* frame) {
+    bool urgent = frame->urgent;
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->binary && frame->binary != NULL) {
+        frame = frame->binary;
+    }
+    if (queue->closed || (queue->bytes + frame->length > queue->limit &&
+            !make_room(queue, frame->length))) {
+        pthread_mutex_unlock(&queue->mutex);
+        return false;
+    }
+    append_frame(queue, frame);
+    if (!queue->writeWanted && (urgent || !hold_back(queue))) {
+        flush_locked(queue);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return true;
+}
+
+/*
+ * Function which writes as much of a queue as the socket will now accept.
+ * Called by the owner once the socket is writable.
+ * Parameters:
+ * queue - queue to write out
+ */
+void out_queue_flush(OutQueue* queue) {
+    pthread_mutex_lock(&queue->mutex);
+    flush_locked(queue);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+/*
+ * Function which lets a queue hold frames back so that they are written
+ * together, until the given number of bytes are waiting or the given delay
+ * has passed since the queue was last written.
+ * Parameters:
+ * queue - queue to coalesce writes for
+ * bytes - bytes which are written straight away once waiting
+ * delay - most microseconds frames are held back for, 0 to never hold them
+ * schedule - function telling the owner when to flush held back frames
+ */
+void out_queue_set_coalescing(OutQueue* queue, size_t bytes, long long delay,
+        void (*schedule)(OutQueue*, long long)) {
+    pthread_mutex_lock(&queue->mutex);
+    queue->coalesceBytes = bytes;
+    queue->coalesceDelay = delay;
+    queue->schedule = schedule;
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+/*
+ * Function which returns when the frames held back in a queue must be
+ * written.
+ * Parameters:
+ * queue - queue to check
+ * Return:
+ * long long - time in microseconds to call out_queue_flush(), 0 if no
+ * frames are held back.
+ */
+long long out_queue_flush_at(OutQueue* queue) {
+    pthread_mutex_lock(&queue->mutex);
+    long long flushAt = queue->flushAt;
+    pthread_mutex_unlock(&queue->mutex);
+    return flushAt;
+}
+
+/*
+ * Function which makes the owner of a queue responsible for writing it out.
+ * Pushing a frame then only tells the owner, through the notify function,
+ * that the queue has something to write, and the owner writes it with
+ * out_queue_prepare() and out_queue_complete(). Must be called before any
+ * frame is pushed.
+ * Parameters:
+ * queue - queue to defer writes for
+ */
+void out_queue_set_deferred(OutQueue* queue) {
+    pthread_mutex_lock(&queue->mutex);
+    queue->deferred = true;
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+/*
+ * Function which stops a queue being written, or lets it be written again
+ * and writes whatever waited. While held, frames are still queued in the
+ * order they are pushed.
+ * Parameters:
+ * queue - queue to hold or release
+ * held - true to hold the queue, false to release it
+ */
+void out_queue_hold(OutQueue* queue, bool held) {
+    pthread_mutex_lock(&queue->mutex);
+    queue->held = held;
+    if (!held) {
+        flush_locked(queue);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+/*
+ * Function which switches a queue to binary framing once its client has
+ * negotiated it. Frames pushed from then on are queued in their binary
+ * encoding, while those already queued are still sent as text.
+ * Parameters:
+ * queue - queue of the client which switched
+ */
+void out_queue_set_binary(OutQueue* queue) {
+    pthread_mutex_lock(&queue->mutex);
+    queue->binary = true;
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+/*
+ * Function which stops frames recieved before a given time from being
+ * counted in the delivery timings, such as messages replayed to a client
+ * which has just joined.
+ * Parameters:
+ * queue - queue of the client
+ * since - time in microseconds of the earliest frame to be timed
+ */
+void out_queue_time_from(OutQueue* queue, long long since) {
+    pthread_mutex_lock(&queue->mutex);
+    queue->timedFrom = since;
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+/*
+ * Function which describes the frames at the head of a deferred queue so the
+ * owner can write them. The frames stay in the queue until the write is
+ * completed with out_queue_complete(), and only one write may be prepared
+ * at a time.
+ * Parameters:
+ * queue - queue to write out
+ * batch - filled in with the bytes to write
+ * max - most entries batch can hold
+ * more - set to true if further frames are waiting after those prepared, so
+ * the write can be sent with MSG_MORE
+ * Return:
+ * int - number of entries filled in, 0 if nothing is waiting.
+ */
+int out_queue_prepare(OutQueue* queue, struct iovec* batch, int max,
+        bool* more) {
+    pthread_mutex_lock(&queue->mutex);
+    int count = queue->count < max ? queue->count : max;
+    *more = queue->count > count;
+    queue->flushAt = 0;
+    if (queue->coalesceDelay > 0 && count > 0) {
+        queue->lastWrite = now_usec();
+    }
+    for (int i = 0; i < count; i++) {
+        Frame* frame = *frame_at(queue, i);
+        size_t skip = i == 0 ? queue->offset : 0;
+        batch[i].iov_base = frame->data + skip;
+        batch[i].iov_len = frame->length - skip;
+    }
+    queue->inFlight = count;
+    pthread_mutex_unlock(&queue->mutex);
+    return count;
+}
+
+/*
+ * Function which finishes a write prepared with out_queue_prepare(),
+ * releasing the frames that were completely written. The client is
+ * disconnected if the write failed, but not if the owner cancelled it.
+ * Parameters:
+ * queue - queue which was written
+ * sent - bytes written, or a negated errno value if the write failed
+ * Return:
+ * bool - true if the queue still has bytes to be written, in which case the
+ * owner should prepare another write.
+ */
+bool out_queue_complete(OutQueue* queue, ssize_t sent) {
+    pthread_mutex_lock(&queue->mutex);
+    queue->inFlight = 0;
+    if (sent >= 0) {
+        consume_sent(queue, sent);
+    } else if (sent != -EAGAIN && sent != -EINTR && sent != -ECANCELED) {
+        disconnect_locked(queue);
+    }
+    bool pending = queue->count > 0;
+    queue->writeWanted = pending;
+    pthread_mutex_unlock(&queue->mutex);
+    return pending;
+}
+
+/*
+ * Function which checks whether a queue still has bytes to be written.
+ * Parameters:
+ * queue - queue to check
+ * Return:
+ * bool - true if bytes are waiting to be written.
+ */
+bool out_queue_pending(OutQueue* queue) {
+    pthread_mutex_lock(&queue->mutex);
+    bool pending = queue->count > 0;
+    pthread_mutex_unlock(&queue->mutex);
+    return pending;
+}
+
+/*
+ * Function which returns how many bytes are waiting in a queue.
+ * Parameters:
+ * queue - queue to check
+ * Return:
+ * size_t - bytes waiting to be written.
+ */
+size_t out_queue_bytes(OutQueue* queue) {
+    pthread_mutex_lock(&queue->mutex);
+    size_t bytes = queue->bytes;
+    pthread_mutex_unlock(&queue->mutex);
+    return bytes;
+}
+
+/*
+ * Function which reports how far a queue has got with writing to its socket.
+ * Parameters:
+ * queue - queue to check
+ * written - filled in with the bytes the queue has ever written
+ * Return:
+ * bool - true if bytes are waiting to be written.
+ */
+bool out_queue_progress(OutQueue* queue, unsigned long* written) {
+    pthread_mutex_lock(&queue->mutex);
+    bool pending = queue->count > 0;
+    *written = queue->written;
+    pthread_mutex_unlock(&queue->mutex);
+    return pending;
+}
+
+/*
+ * Function which copies out every byte still waiting in a queue, in the
+ * order they would be written, leaving the queue as it was.
+ * Parameters:
+ * queue - queue to copy
+ * length - filled in with the number of bytes copied
+ * Return:
+ * char* - the bytes (to be freed by the caller), NULL if none are waiting.
+ */
+char* out_queue_copy(OutQueue* queue, size_t* length) {
+    pthread_mutex_lock(&queue->mutex);
+    char* data = queue->bytes == 0 ? NULL : malloc(queue->bytes);
+    size_t copied = 0;
+    for (int i = 0; i < queue->count && data != NULL; i++) {
+        Frame* frame = *frame_at(queue, i);
+        size_t skip = i == 0 ? queue->offset : 0;
+        memcpy(data + copied, frame->data + skip, frame->length - skip);
+        copied += frame->length - skip;
+    }
+    *length = copied;
+    pthread_mutex_unlock(&queue->mutex);
+    return data;
+}
+
+/*
+ * Function which stops a queue accepting frames and discards anything still
+ * waiting, once its client has left the server.
+ * Parameters:
+ * queue - queue to close
+ */
+void out_queue_close(OutQueue* queue) {
+    pthread_mutex_lock(&queue->mutex);
+    queue->closed = true;
+    clear_frames(queue, 0);
+    pthread_mutex_unlock(&queue->mutex);
+}
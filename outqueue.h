@@ -0,0 +1,115 @@
+#ifndef _OUTQUEUE_H
+#define _OUTQUEUE_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "frame.h"
+
+/*
+ * What to do with a client whose outbound queue is full because it is not
+ * reading what the server sends it.
+ */
+typedef enum {
+    SLOW_DROP_OLDEST,
+    SLOW_DISCONNECT,
+    SLOW_KICK
+} SlowPolicy;
+
+/*
+ * Bounded queue of frames waiting to be written to a client's socket. Frames
+ * can be pushed from any thread and are written without blocking, so a slow
+ * reader only ever fills its own queue. The queue holds a reference to each
+ * frame rather than a copy, in a ring which grows as needed.
+ */
+typedef struct OutQueue {
+    int fd;
+    pthread_mutex_t mutex;
+    Frame** frames;
+    int capacity;
+    int head;
+    int count;
+    // bytes of the head frame which have already been written
+    size_t offset;
+    size_t bytes;
+    // bytes ever written to the socket, so a stalled client can be spotted
+    unsigned long written;
+    size_t limit;
+    SlowPolicy policy;
+    // set once the queue accepts no more frames
+    bool closed;
+    // set while the owner is waiting for the socket to become writable
+    bool writeWanted;
+    // set while nothing may be written, so frames queued first are not seen
+    // by the client before others can be sent to it
+    bool held;
+    // set if the owner writes the queue out itself, through
+    // out_queue_prepare() and out_queue_complete(), rather than the queue
+    // writing to the socket when frames are pushed
+    bool deferred;
+    // frames at the head which the owner is currently writing, and so must
+    // not be released before out_queue_complete() is called
+    int inFlight;
+    // set once the client has switched to binary framing, so the binary
+    // encoding of each frame is queued instead of the text one
+    bool binary;
+    // frames are held back to be written together until this many bytes are
+    // waiting or coalesceDelay microseconds have passed since the last
+    // write (0 writes every frame straight away)
+    size_t coalesceBytes;
+    long long coalesceDelay;
+    long long lastWrite;
+    // time by which held back frames must be written, 0 if none are held
+    long long flushAt;
+    // frames recieved before this time are not counted in the delivery
+    // timings, as they were sent before the client could hear them
+    long long timedFrom;
+    int dropped;
+    // called with the mutex held when the queue starts (writable true) or
+    // stops needing its owner to flush it once the socket is writable
+    void (*notify)(struct OutQueue* queue, bool writable);
+    // called with the mutex held when frames start being held back, so the
+    // owner calls out_queue_flush() at the given time
+    void (*schedule)(struct OutQueue* queue, long long flushAt);
+    void* owner;
+} OutQueue;
+
+void out_queue_init(OutQueue* queue, int fd, size_t limit, SlowPolicy policy,
+        void (*notify)(OutQueue*, bool), void* owner);
+
+void out_queue_destroy(OutQueue* queue);
+
+bool out_queue_push(OutQueue* queue, Frame* frame);
+
+void out_queue_flush(OutQueue* queue);
+
+void out_queue_set_coalescing(OutQueue* queue, size_t bytes, long long delay,
+        void (*schedule)(OutQueue*, long long));
+
+long long out_queue_flush_at(OutQueue* queue);
+
+void out_queue_set_deferred(OutQueue* queue);
+
+void out_queue_set_binary(OutQueue* queue);
+
+void out_queue_hold(OutQueue* queue, bool held);
+
+void out_queue_time_from(OutQueue* queue, long long since);
+
+int out_queue_prepare(OutQueue* queue, struct iovec* batch, int max,
+        bool* more);
+
+bool out_queue_complete(OutQueue* queue, ssize_t sent);
+
+bool out_queue_pending(OutQueue* queue);
+
+size_t out_queue_bytes(OutQueue* queue);
+
+bool out_queue_progress(OutQueue* queue, unsigned long* written);
+
+char* out_queue_copy(OutQueue* queue, size_t* length);
+
+void out_queue_close(OutQueue* queue);
+
+#endif
@@ -0,0 +1,355 @@
+#include <stdlib.h>
+#include <string.h>
+#include "protocol.h"
+#define VALID_CHARACTERS 32
+
+// argument of commands which have none
+static char noArgument[] = "";
+
+/*
+ * Command words of the text protocol, indexed by command type.
+ */
+static const char* const commandWords[COMMAND_COUNT] = {
+    [COMMAND_AUTH] = "AUTH",
+    [COMMAND_OK] = "OK",
+    [COMMAND_WHO] = "WHO",
+    [COMMAND_NAME] = "NAME",
+    [COMMAND_NAME_TAKEN] = "NAME_TAKEN",
+    [COMMAND_SAY] = "SAY",
+    [COMMAND_MSG] = "MSG",
+    [COMMAND_KICK] = "KICK",
+    [COMMAND_LIST] = "LIST",
+    [COMMAND_LEAVE] = "LEAVE",
+    [COMMAND_ENTER] = "ENTER",
+    [COMMAND_JOIN] = "JOIN",
+    [COMMAND_PART] = "PART",
+    [COMMAND_BINARY] = "BINARY",
+    [COMMAND_PING] = "PING",
+    [COMMAND_PONG] = "PONG"
+};
+
+/*
+ * Function which splits a text line into its command word and argument. The
+ * colon after the command word is replaced by a null terminator.
+ * Parameters:
+ * line - line to parse
+ * command - filled in with the command, whose type is COMMAND_NONE if the
+ * line does not start with a known command word and a colon
+ */
+static void parse_line(char* line, Command* command) {
+    char* colon = strchr(line, ':');
+    command->type = COMMAND_NONE;
+    command->argument = noArgument;
+    command->length = 0;
+    if (colon == NULL) {
+        return;
+    }
+    *colon = '\0';
+    for (int type = COMMAND_AUTH; type < COMMAND_COUNT; type++) {
+        if (strcmp(line, commandWords[type]) == 0) {
+            command->type = type;
+            command->argument = colon + 1;
+            command->length = strlen(command->argument);
+            return;
+        }
+    }
+}
+
+/*
+ * Function which fills in a command for a piece of a SAY: which was too long
+ * to be handed out whole.
+ * Parameters:
+ * buffer - buffer the piece was taken from
+ * piece - bytes of the piece
+ * length - number of bytes in the piece
+ * command - filled in with the piece
+ */
+static void say_piece(LineBuffer* buffer, char* piece, size_t length,
+        Command* command) {
+    command->type = COMMAND_SAY;
+    command->argument = piece;
+    command->length = length;
+    command->piece = buffer->piece;
+}
+
+/*
+ * Function which throws away a command other than SAY: which was too long to
+ * be handed out whole, handing out a COMMAND_NONE piece in its place.
+ * Parameters:
+ * buffer - buffer the command is being recieved in
+ * command - filled in with the piece
+ */
+static void discard_command(LineBuffer* buffer, Command* command) {
+    line_buffer_discard(buffer);
+    command->type = COMMAND_NONE;
+    command->argument = noArgument;
+    command->length = 0;
+    command->piece = LINE_FIRST;
+}
+
+/*
+ * Function which takes the next complete text command out of a buffer. The
+ * line has to be searched for its newline and is split at its first colon.
+ * Parameters:
+ * buffer - buffer to take the command from
+ * command - filled in with the command
+ * Return:
+ * bool - false if no complete command has been recieved.
+ */
+static bool next_text_command(LineBuffer* buffer, Command* command) {
+    char* line = line_buffer_next(buffer);
+    if (line == NULL) {
+        return false;
+    }
+    if (buffer->piece == LINE_MIDDLE || buffer->piece == LINE_LAST) {
+        say_piece(buffer, line, strlen(line), command);
+        return true;
+    }
+    parse_line(line, command);
+    command->piece = buffer->piece;
+    if (command->piece == LINE_FIRST && command->type != COMMAND_SAY) {
+        discard_command(buffer, command);
+    }
+    return true;
+}
+
+/*
+ * Function which returns the length of the payload following a binary
+ * frame's header.
+ * Parameters:
+ * header - PROTOCOL_HEADER_SIZE bytes of header
+ * Return:
+ * size_t - bytes of payload
+ */
+static size_t header_length(const unsigned char* header) {
+    return (size_t) header[0] << 24 | header[1] << 16 | header[2] << 8 |
+            header[3];
+}
+
+/*
+ * Function which takes the next complete command out of a buffer. A binary
+ * frame has a fixed size header giving the length of its payload and its
+ * type, so its payload is taken without being looked at (and a payload
+ * longer than the buffer's limit is known to be so from the header).
+ * Parameters:
+ * buffer - buffer to take the command from
+ * binary - true if the sender uses binary framing
+ * command - filled in with the command
+ * Return:
+ * bool - false if no complete command has been recieved.
+ */
+bool protocol_next_command(LineBuffer* buffer, bool binary, Command* command) {
+    unsigned char header[PROTOCOL_HEADER_SIZE];
+    size_t length;
+    if (!binary) {
+        return next_text_command(buffer, command);
+    }
+    for (;;) {
+        if (buffer->remaining > 0) {
+            char* piece = line_buffer_take_piece(buffer, &length);
+            if (piece != NULL) {
+                say_piece(buffer, piece, length, command);
+                return true;
+            }
+            if (buffer->remaining > 0) {
+                return false;
+            }
+        }
+        if (!line_buffer_peek(buffer, (char*) header,
+                PROTOCOL_HEADER_SIZE)) {
+            return false;
+        }
+        length = header_length(header);
+        if (buffer->limit == 0 ||
+                PROTOCOL_HEADER_SIZE + length <= buffer->limit) {
+            break;
+        }
+        line_buffer_take(buffer, PROTOCOL_HEADER_SIZE);
+        line_buffer_begin_record(buffer, length);
+        if (header[4] != COMMAND_SAY) {
+            discard_command(buffer, command);
+            return true;
+        }
+    }
+    char* frame = line_buffer_take(buffer, PROTOCOL_HEADER_SIZE + length);
+    if (frame == NULL) {
+        return false;
+    }
+    command->type = header[4] < COMMAND_COUNT ? header[4] : COMMAND_NONE;
+    command->argument = frame + PROTOCOL_HEADER_SIZE;
+    command->length = length;
+    command->piece = LINE_WHOLE;
+    return true;
+}
+
+/*
+ * Function which returns whether protocol_next_command() would hand out a
+ * command, without taking it out of the buffer, so a sender can be held
+ * back only once it has actually sent something. Anything being thrown away
+ * is thrown away first, as that hands out nothing.
+ * Parameters:
+ * buffer - buffer to check
+ * binary - true if the sender uses binary framing
+ * Return:
+ * bool - true if a complete command (or piece of one) is waiting, or the
+ * header and some of the first piece of a binary SAY: longer than the
+ * buffer's limit.
+ */
+bool protocol_command_waiting(LineBuffer* buffer, bool binary) {
+    unsigned char header[PROTOCOL_HEADER_SIZE];
+    size_t length;
+    if (!binary) {
+        return line_buffer_ready(buffer);
+    }
+    if (buffer->remaining > 0 && buffer->discarding) {
+        line_buffer_take_piece(buffer, &length);
+    }
+    size_t limit = buffer->limit;
+    if (buffer->remaining > 0) {
+        length = limit > 0 && buffer->remaining > limit ? limit :
+                buffer->remaining;
+        return buffer->length >= length;
+    }
+    if (!line_buffer_peek(buffer, (char*) header, PROTOCOL_HEADER_SIZE)) {
+        return false;
+    }
+    length = header_length(header);
+    if (limit == 0 || PROTOCOL_HEADER_SIZE + length <= limit) {
+        return buffer->length >= PROTOCOL_HEADER_SIZE + length;
+    }
+    // the header of an oversized SAY: is taken before its first piece, which
+    // the ring can only hold once the header has been taken
+    return header[4] != COMMAND_SAY ||
+            buffer->length > PROTOCOL_HEADER_SIZE;
+}
+
+/*
+ * Function which returns the word a command is sent as in the text
+ * protocol.
+ * Parameters:
+ * type - command wanted
+ * Return:
+ * const char* - command word, without its colon
+ */
+const char* protocol_command_word(CommandType type) {
+    return commandWords[type];
+}
+
+/*
+ * Function which writes the header of a binary frame.
+ * Parameters:
+ * to - filled in with PROTOCOL_HEADER_SIZE bytes of header
+ * type - command the frame carries
+ * length - bytes of payload which follow the header
+ * Return:
+ * size_t - number of bytes written
+ */
+size_t protocol_encode_header(char* to, CommandType type, size_t length) {
+    to[0] = length >> 24;
+    to[1] = length >> 16;
+    to[2] = length >> 8;
+    to[3] = length;
+    to[4] = type;
+    return PROTOCOL_HEADER_SIZE;
+}
+
+/*
+ * Function which copies bytes into a text line, converting any unwriteable
+ * characters to '?' so they cannot break the line up.
+ * Parameters:
+ * to - where to copy the bytes
+ * from - bytes to copy
+ * length - number of bytes to copy
+ * Return:
+ * char* - position after the last byte copied
+ */
+static char* copy_readable(char* to, const char* from, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        *to++ = from[i] < VALID_CHARACTERS ? '?' : from[i];
+    }
+    return to;
+}
+
+/*
+ * Function which encodes a command as a text line, of the form
+ * COMMAND:name:data with the name, the data or both left out if not given.
+ * Any unwriteable characters in the name and data are converted to '?'.
+ * Parameters:
+ * type - command to encode
+ * name - name the command is about, or NULL
+ * data - rest of the command, or NULL
+ * length - number of bytes of data
+ * Return:
+ * Frame* - the new frame, with a single reference held by the caller
+ */
+Frame* protocol_text_frame(CommandType type, const char* name,
+        const char* data, size_t length) {
+    const char* word = commandWords[type];
+    size_t wordLength = strlen(word);
+    size_t nameLength = name == NULL ? 0 : strlen(name);
+    bool both = name != NULL && data != NULL;
+    Frame* frame = frame_create(wordLength + 1 + nameLength + both + length +
+            1);
+    char* to = frame->data;
+    memcpy(to, word, wordLength);
+    to += wordLength;
+    *to++ = ':';
+    to = copy_readable(to, name, nameLength);
+    if (both) {
+        *to++ = ':';
+    }
+    to = copy_readable(to, data, length);
+    *to = '\n';
+    return frame;
+}
+
+/*
+ * Function which encodes a command as a binary frame. The payload is the
+ * name and data as they are, with a null between them if both are given.
+ * Parameters:
+ * type - command to encode
+ * name - name the command is about, or NULL
+ * data - rest of the command, or NULL
+ * length - number of bytes of data
+ * Return:
+ * Frame* - the new frame, with a single reference held by the caller
+ */
+Frame* protocol_binary_frame(CommandType type, const char* name,
+        const char* data, size_t length) {
+    size_t nameLength = name == NULL ? 0 : strlen(name);
+    bool both = name != NULL && data != NULL;
+    size_t payload = nameLength + both + length;
+    Frame* frame = frame_create(PROTOCOL_HEADER_SIZE + payload);
+    char* to = frame->data + protocol_encode_header(frame->data, type,
+            payload);
+    if (name != NULL) {
+        memcpy(to, name, nameLength);
+        to += nameLength;
+    }
+    if (both) {
+        *to++ = '\0';
+    }
+    if (data != NULL) {
+        memcpy(to, data, length);
+    }
+    return frame;
+}
+
+/*
+ * Function which encodes a command for clients using either framing. The
+ * text line is returned, carrying the binary frame with it, so the frame
+ * can be pushed to any client's queue.
+ * Parameters:
+ * type - command to encode
+ * name - name the command is about, or NULL
+ * data - rest of the command, or NULL
+ * length - number of bytes of data
+ * Return:
+ * Frame* - the new frame, with a single reference held by the caller
+ */
+Frame* protocol_frame(CommandType type, const char* name, const char* data,
+        size_t length) {
+    Frame* frame = protocol_text_frame(type, name, data, length);
+    frame->binary = protocol_binary_frame(type, name, data, length);
+    return frame;
+}
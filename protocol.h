@@ -0,0 +1,69 @@
+#ifndef _PROTOCOL_H
+#define _PROTOCOL_H
+#include <stdbool.h>
+#include <stddef.h>
+#include "frame.h"
+#include "linebuf.h"
+// bytes before the payload of a binary frame: the payload's length as a
+// 32 bit big endian number, then the command's type byte
+#define PROTOCOL_HEADER_SIZE 5
+
+/*
+ * The commands of the chat protocol. In binary framing the value is the
+ * frame's type byte, so existing values must never change.
+ */
+typedef enum {
+    COMMAND_NONE = 0,
+    COMMAND_AUTH = 1,
+    COMMAND_OK = 2,
+    COMMAND_WHO = 3,
+    COMMAND_NAME = 4,
+    COMMAND_NAME_TAKEN = 5,
+    COMMAND_SAY = 6,
+    COMMAND_MSG = 7,
+    COMMAND_KICK = 8,
+    COMMAND_LIST = 9,
+    COMMAND_LEAVE = 10,
+    COMMAND_ENTER = 11,
+    COMMAND_JOIN = 12,
+    COMMAND_PART = 13,
+    COMMAND_BINARY = 14,
+    COMMAND_PING = 15,
+    COMMAND_PONG = 16,
+    COMMAND_COUNT
+} CommandType;
+
+/*
+ * A command recieved in either framing. The argument is everything after
+ * the command word of a text line, or the payload of a binary frame. It is
+ * null terminated (a binary payload may also contain nulls, so length is
+ * what counts) and only valid until the buffer it came from is next filled.
+ * A SAY: longer than the buffer's limit is handed out in pieces, each with
+ * part of the argument. Any other command that long is thrown away, and
+ * handed out as a single COMMAND_NONE piece so it can still be counted.
+ */
+typedef struct {
+    CommandType type;
+    char* argument;
+    size_t length;
+    LinePiece piece;
+} Command;
+
+bool protocol_next_command(LineBuffer* buffer, bool binary, Command* command);
+
+bool protocol_command_waiting(LineBuffer* buffer, bool binary);
+
+const char* protocol_command_word(CommandType type);
+
+size_t protocol_encode_header(char* to, CommandType type, size_t length);
+
+Frame* protocol_text_frame(CommandType type, const char* name,
+        const char* data, size_t length);
+
+Frame* protocol_binary_frame(CommandType type, const char* name,
+        const char* data, size_t length);
+
+Frame* protocol_frame(CommandType type, const char* name, const char* data,
+        size_t length);
+
+#endif
@@ -0,0 +1,56 @@
+#include "ratelimit.h"
+#define USEC_PER_SEC 1000000.0
+
+/*
+ * Function which initialises a full token bucket.
+ * Parameters:
+ * bucket - bucket to initialise
+ * rate - tokens added per second (0 for no limit)
+ * burst - most tokens the bucket can hold
+ */
+void token_bucket_init(TokenBucket* bucket, double rate, double burst) {
+    bucket->rate = rate;
+    bucket->burst = burst < 1 ? 1 : burst;
+    bucket->tokens = bucket->burst;
+    bucket->updated = 0;
+}
+
+/*
+ * Function which tops up a bucket with the tokens earned since it was last
+ * used and returns how long the caller must wait before a token is
+ * available.
+ * Parameters:
+ * bucket - bucket to check
+ * now - current time in microseconds
+ * Return:
+ * long long - microseconds until a token is available (0 if one is now).
+ */
+long long token_bucket_delay(TokenBucket* bucket, long long now) {
+    if (bucket->rate <= 0) {
+        return 0;
+    }
+    if (bucket->updated != 0) {
+        bucket->tokens += (now - bucket->updated) * bucket->rate / 
+                USEC_PER_SEC;
+        if (bucket->tokens > bucket->burst) {
+            bucket->tokens = bucket->burst;
+        }
+    }
+    bucket->updated = now;
+    if (bucket->tokens >= 1) {
+        return 0;
+    }
+    return (long long) ((1 - bucket->tokens) * USEC_PER_SEC / bucket->rate) 
+            + 1;
+}
+
+/*
+ * Function which uses a token from the bucket once a command is handled.
+ * Parameters:
+ * bucket - bucket to take the token from
+ */
+void token_bucket_take(TokenBucket* bucket) {
+    if (bucket->rate > 0) {
+        bucket->tokens -= 1;
+    }
+}
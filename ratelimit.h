@@ -0,0 +1,22 @@
+#ifndef _RATELIMIT_H
+#define _RATELIMIT_H
+
+/*
+ * Token bucket used to limit how quickly a client may send commands. Tokens
+ * are added at rate per second up to burst, and each command uses one.
+ * A rate of 0 means the client is not limited.
+ */
+typedef struct {
+    double rate;
+    double burst;
+    double tokens;
+    long long updated;
+} TokenBucket;
+
+void token_bucket_init(TokenBucket* bucket, double rate, double burst);
+
+long long token_bucket_delay(TokenBucket* bucket, long long now);
+
+void token_bucket_take(TokenBucket* bucket);
+
+#endif
@@ -0,0 +1,319 @@
+#include <stdlib.h>
+#include <string.h>
+#include "roster.h"
+#define INITIAL_BUCKETS 64
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+/*
+ * Function which hashes a name using FNV-1a.
+ * Parameters:
+ * name - name to hash
+ * Return:
+ * unsigned - hash of the name
+ */
+static unsigned hash_name(const char* name) {
+    unsigned hash = FNV_OFFSET;
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (unsigned char) *name) * FNV_PRIME;
+    }
+    return hash;
+}
+
+/*
+ * Function which allocates a roster entry with the given number of skip list
+ * levels.
+ * Parameters:
+ * levels - number of levels the entry is linked into
+ * Return:
+ * RosterEntry* - the new entry, with every forward pointer empty
+ */
+static RosterEntry* create_entry(int levels) {
+    RosterEntry* entry = calloc(1, sizeof(RosterEntry) +
+            levels * sizeof(RosterEntry*));
+    entry->levels = levels;
+    return entry;
+}
+
+/*
+ * Function which initialises an empty roster.
+ * Parameters:
+ * roster - roster to initialise
+ */
+void roster_init(Roster* roster) {
+    roster->count = 0;
+    roster->bucketCount = INITIAL_BUCKETS;
+    roster->buckets = calloc(roster->bucketCount, sizeof(RosterEntry*));
+    roster->head = create_entry(ROSTER_LEVELS);
+    roster->levels = 1;
+    roster->random = 1;
+}
+
+/*
+ * Function which frees a roster's entries. The values stored in the roster
+ * are left for their owner to free.
+ * Parameters:
+ * roster - roster to destroy
+ */
+void roster_destroy(Roster* roster) {
+    RosterEntry* entry = roster->head;
+    while (entry != NULL) {
+        RosterEntry* next = entry->forward[0];
+        free(entry);
+        entry = next;
+    }
+    free(roster->buckets);
+}
+
+/*
+ * Function which chooses how many skip list levels a new entry is linked
+ * into, with each further level a quarter as likely as the one before.
+ * Parameters:
+ * roster - roster the entry is being added to
+ * Return:
+ * int - number of levels for the entry
+ */
+static int random_levels(Roster* roster) {
+    int levels = 1;
+    // xorshift, so no global random state is shared with the rest of the
+    // program
+    unsigned random = roster->random;
+    random ^= random << 13;
+    random ^= random >> 17;
+    random ^= random << 5;
+    roster->random = random;
+    while (levels < ROSTER_LEVELS && (random & 3) == 0) {
+        levels++;
+        random >>= 2;
+    }
+    return levels;
+}
+
+/*
+ * Function which doubles the number of hash buckets once the roster holds
+ * more entries than it has buckets.
+ * Parameters:
+ * roster - roster to grow
+ */
+static void grow_buckets(Roster* roster) {
+    size_t bucketCount = roster->bucketCount * 2;
+    RosterEntry** buckets = calloc(bucketCount, sizeof(RosterEntry*));
+    for (size_t i = 0; i < roster->bucketCount; i++) {
+        RosterEntry* entry = roster->buckets[i];
+        while (entry != NULL) {
+            RosterEntry* next = entry->bucketNext;
+            RosterEntry** bucket = &buckets[entry->hash & (bucketCount - 1)];
+            entry->bucketNext = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+    free(roster->buckets);
+    roster->buckets = buckets;
+    roster->bucketCount = bucketCount;
+}
+
+/*
+ * Function which finds the entry for a name in the hash index.
+ * Parameters:
+ * roster - roster to search
+ * name - name to look for
+ * hash - hash of the name
+ * Return:
+ * RosterEntry** - link which points to the entry, or to NULL if the name is
+ * not in the roster
+ */
+static RosterEntry** find_link(Roster* roster, const char* name,
+        unsigned hash) {
+    RosterEntry** link = &roster->buckets[hash & (roster->bucketCount - 1)];
+    while (*link != NULL && ((*link)->hash != hash ||
+            strcmp((*link)->name, name) != 0)) {
+        link = &(*link)->bucketNext;
+    }
+    return link;
+}
+
+/*
+ * Function which finds the value stored under a name.
+ * Parameters:
+ * roster - roster to search
+ * name - name to look for
+ * Return:
+ * void* - value stored under the name, NULL if the name is not in the roster
+ */
+void* roster_find(Roster* roster, const char* name) {
+    RosterEntry* entry = *find_link(roster, name, hash_name(name));
+    return entry == NULL ? NULL : entry->value;
+}
+
+/*
+ * Function which finds, on each level of the skip list, the last entry whose
+ * name comes before the given name.
+ * Parameters:
+ * roster - roster to search
+ * name - name to look for
+ * before - filled in with the last entry before the name on each level
+ */
+static void find_before(Roster* roster, const char* name,
+        RosterEntry** before) {
+    RosterEntry* entry = roster->head;
+    for (int level = roster->levels - 1; level >= 0; level--) {
+        while (entry->forward[level] != NULL &&
+                strcmp(entry->forward[level]->name, name) < 0) {
+            entry = entry->forward[level];
+        }
+        before[level] = entry;
+    }
+}
+
+/*
+ * Function which adds a value to a roster under a name, in its alphabetical
+ * position. The name is not copied so it must outlive the entry.
+ * Parameters:
+ * roster - roster to add to
+ * name - name to store the value under
+ * value - value to store
+ * Return:
+ * bool - false if the name is already in the roster (nothing is added).
+ */
+bool roster_insert(Roster* roster, const char* name, void* value) {
+    RosterEntry* before[ROSTER_LEVELS];
+    unsigned hash = hash_name(name);
+    RosterEntry** link = find_link(roster, name, hash);
+    if (*link != NULL) {
+        return false;
+    }
+    RosterEntry* entry = create_entry(random_levels(roster));
+    entry->name = name;
+    entry->value = value;
+    entry->hash = hash;
+    *link = entry;
+
+    find_before(roster, name, before);
+    for (int level = roster->levels; level < entry->levels; level++) {
+        before[level] = roster->head;
+    }
+    if (entry->levels > roster->levels) {
+        roster->levels = entry->levels;
+    }
+    for (int level = 0; level < entry->levels; level++) {
+        entry->forward[level] = before[level]->forward[level];
+        before[level]->forward[level] = entry;
+    }
+    if (++roster->count > roster->bucketCount) {
+        grow_buckets(roster);
+    }
+    return true;
+}
+
+/*
+ * Function which removes a name from a roster.
+ * Parameters:
+ * roster - roster to remove from
+ * name - name to remove
+ * Return:
+ * void* - value that was stored under the name, NULL if it was not there
+ */
+void* roster_remove(Roster* roster, const char* name) {
+    RosterEntry* before[ROSTER_LEVELS];
+    RosterEntry** link = find_link(roster, name, hash_name(name));
+    RosterEntry* entry = *link;
+    if (entry == NULL) {
+        return NULL;
+    }
+    *link = entry->bucketNext;
+
+    find_before(roster, name, before);
+    for (int level = 0; level < entry->levels; level++) {
+        before[level]->forward[level] = entry->forward[level];
+    }
+    while (roster->levels > 1 &&
+            roster->head->forward[roster->levels - 1] == NULL) {
+        roster->levels--;
+    }
+    roster->count--;
+    void* value = entry->value;
+    free(entry);
+    return value;
+}
+
+/*
+ * Function which returns the alphabetically first entry of a roster. The
+ * rest follow through each entry's forward[0] pointer.
+ * Parameters:
+ * roster - roster to walk
+ * Return:
+ * RosterEntry* - first entry, NULL if the roster is empty
+ */
+RosterEntry* roster_first(Roster* roster) {
+    return roster->head->forward[0];
+}
+
+/*
+ * Function which copies the current contents of a roster into a new
+ * snapshot, with its own hash index so names can be looked up in it. The
+ * names are not copied so they must outlive the snapshot.
+ * Parameters:
+ * roster - roster to copy
+ * Return:
+ * RosterSnapshot* - the new snapshot
+ */
+RosterSnapshot* roster_snapshot(Roster* roster) {
+    RosterSnapshot* snapshot = malloc(sizeof(RosterSnapshot));
+    snapshot->count = roster->count;
+    snapshot->names = malloc((roster->count + 1) * sizeof(char*));
+    snapshot->values = malloc((roster->count + 1) * sizeof(void*));
+    // at most half of the slots are used, so probes stay short
+    snapshot->indexSize = INITIAL_BUCKETS;
+    while (snapshot->indexSize < 2 * (size_t) roster->count) {
+        snapshot->indexSize *= 2;
+    }
+    snapshot->index = malloc(snapshot->indexSize * sizeof(int));
+    memset(snapshot->index, -1, snapshot->indexSize * sizeof(int));
+    int position = 0;
+    for (RosterEntry* entry = roster_first(roster); entry != NULL;
+            entry = entry->forward[0]) {
+        snapshot->names[position] = entry->name;
+        snapshot->values[position] = entry->value;
+        size_t slot = entry->hash & (snapshot->indexSize - 1);
+        while (snapshot->index[slot] >= 0) {
+            slot = (slot + 1) & (snapshot->indexSize - 1);
+        }
+        snapshot->index[slot] = position++;
+    }
+    return snapshot;
+}
+
+/*
+ * Function which finds the value stored under a name in a snapshot.
+ * Parameters:
+ * snapshot - snapshot to search
+ * name - name to look for
+ * Return:
+ * void* - value stored under the name, NULL if the name is not in the
+ * snapshot
+ */
+void* roster_snapshot_find(const RosterSnapshot* snapshot, const char* name) {
+    size_t slot = hash_name(name) & (snapshot->indexSize - 1);
+    int position;
+    while ((position = snapshot->index[slot]) >= 0) {
+        if (strcmp(snapshot->names[position], name) == 0) {
+            return snapshot->values[position];
+        }
+        slot = (slot + 1) & (snapshot->indexSize - 1);
+    }
+    return NULL;
+}
+
+/*
+ * Function which frees a snapshot. The values it refers to are left for
+ * their owner to free.
+ * Parameters:
+ * snapshot - snapshot to free
+ */
+void roster_snapshot_free(RosterSnapshot* snapshot) {
+    free(snapshot->names);
+    free(snapshot->values);
+    free(snapshot->index);
+    free(snapshot);
+}
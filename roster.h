@@ -0,0 +1,69 @@
+#ifndef _ROSTER_H
+#define _ROSTER_H
+#include <stdbool.h>
+#include <stddef.h>
+#define ROSTER_LEVELS 16
+
+/*
+ * An entry in a roster, linking a name to the value stored under it.
+ */
+typedef struct RosterEntry {
+    const char* name;
+    void* value;
+    unsigned hash;
+    // next entry in the same hash bucket
+    struct RosterEntry* bucketNext;
+    int levels;
+    // next entry in name order on each level of the skip list (forward[0]
+    // links every entry)
+    struct RosterEntry* forward[];
+} RosterEntry;
+
+/*
+ * Set of values keyed by unique names. A hash index finds a name in constant
+ * time and a skip list keeps the entries in name order. A roster does no
+ * locking of its own, so its owner must serialise access to it.
+ */
+typedef struct {
+    int count;
+    RosterEntry** buckets;
+    size_t bucketCount;
+    // sentinel whose forward pointers start each level of the skip list
+    RosterEntry* head;
+    int levels;
+    unsigned random;
+} Roster;
+
+/*
+ * Copy of a roster's contents at one moment, which is never changed once
+ * built and so can be read by any number of threads without locking.
+ */
+typedef struct {
+    int count;
+    // names and values in name order
+    const char** names;
+    void** values;
+    // open addressing hash index of positions in names, -1 for empty slots
+    int* index;
+    size_t indexSize;
+} RosterSnapshot;
+
+void roster_init(Roster* roster);
+
+void roster_destroy(Roster* roster);
+
+void* roster_find(Roster* roster, const char* name);
+
+bool roster_insert(Roster* roster, const char* name, void* value);
+
+void* roster_remove(Roster* roster, const char* name);
+
+RosterEntry* roster_first(Roster* roster);
+
+RosterSnapshot* roster_snapshot(Roster* roster);
+
+void* roster_snapshot_find(const RosterSnapshot* snapshot, const char* name);
+
+void roster_snapshot_free(RosterSnapshot* snapshot);
+
+#endif
@@ -1,7 +1,9 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,66 +14,93 @@
 #include <stdbool.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <poll.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <errno.h>
+#include <limits.h>
 #include "shared.h"
-#define MAX_COMMAND_LENGTH 6
+#include "server.h"
+#include "linebuf.h"
+#include "outqueue.h"
+#include "metrics.h"
+#include "frame.h"
+#include "epoch.h"
+#include "stats.h"
+#include "protocol.h"
+#include "slab.h"
+#include "shard.h"
+#include "backlog.h"
+#include "chatlog.h"
 #define VALID_CHARACTERS 32
 #define NORMAL_EXIT 0
+#define DEFAULT_QUEUE_LIMIT (1024 * 1024)
+#define DEFAULT_COALESCE_BYTES (16 * 1024)
+#define DEFAULT_COALESCE_DELAY 100
+#define DEFAULT_MAX_LINE (64 * 1024)
+#define MIN_MAX_LINE 64
+#define MAX_SHARDS 1024
+#define MAX_HANDSHAKE_WORKERS 1024
+#define MAX_BACKLOG 65536
+#define DEFAULT_AUTH_TIMEOUT 10000
+#define DEFAULT_NAME_TIMEOUT 30000
+#define USEC_PER_MSEC 1000
+#define DEFAULT_LOG_SEGMENT (64 * 1024 * 1024)
+#define NSEC_PER_USEC 1000
+#define USEC_PER_SEC 1000000
+#define DEFAULT_ROOM "lobby"
+// microseconds a listening socket is left alone once accepting from it ran
+// out of file descriptors or memory
+#define ACCEPT_BACKOFF_USEC (100 * USEC_PER_MSEC)
 
 /*
- * Data structure which stores information about a client which has connected
- * to the server.
+ * Strucutre which stores informaiton required for the SIGHUP statitics 
+ * thread. This informaiton will be passed to the statitics thread when 
+ * generated.
  */
-typedef struct Client {
-    char* name;
-    FILE* to;
-    FILE* from;
-    struct Client* previous;
-    struct Client* next;
-    //counts of command sent by clients
-    int say;
-    int kick;
-    int list;
-} Client;
+typedef struct {
+    sigset_t* set;
+    ClientList* clientList;
+} StatisticsData;
 
 /*
- * Stores informaiton about the linked list which stores clients.
+ * Structure which stores the information a shard's loop needs to start
+ * serving clients on its own thread.
  */
 typedef struct {
-    int count;
-    Client* head;
-    Client* tail;
-    pthread_mutex_t mutex;
-    // counts of total number of commands sent to server
-    int auth;
-    int name;
-    int say;
-    int kick;
-    int list;
-    int leave;
-} ClientList;
-
-/*
- * Structure which stores information required for a client connection to be
- * added to the server. This information will be passed to a client thread
- * when created."
- */
-typedef struct {
-    int serverDiscriptor;
+    int listenDiscriptor;
     char* serverAuth;
     ClientList* clientList;
-} ClientData;
+    Shard* shard;
+} ShardData;
 
 /*
- * Strucutre which stores informaiton required for the SIGHUP statitics 
- * thread. This informaiton will be passed to the statitics thread when 
- * generated.
+ * What waiting for a threaded client's next command ended with.
+ */
+typedef enum {
+    READ_COMMAND,
+    // the client disconnected or missed a deadline
+    READ_CLOSED,
+    // the client is to be handed to a server taking over
+    READ_HANDOFF
+} ReadResult;
+
+/*
+ * Structure which stores a frame posted to another shard, to be pushed to
+ * that shard's members of a room or to one of its clients.
  */
 typedef struct {
-    sigset_t* set;
-    ClientList* clientList;
-} StatisticsData;
+    ShardMessage message;
+    Frame* frame;
+    // room whose members on the shard are sent the frame, or NULL
+    Room* room;
+    // name of the client sent the frame if there is no room
+    char* name;
+} FanoutMessage;
+
+static Slab clientSlab = SLAB_INITIALIZER(sizeof(Client));
+static Slab fanoutSlab = SLAB_INITIALIZER(sizeof(FanoutMessage));
 
-void* client_thread(void* arg);
 
 char* read_file_line(FILE* file);
 
@@ -83,25 +112,142 @@ void usage_error(char* errorMessage);
 
 char* convert_readable(char* message);
 
-void client_left(ClientList* clientList, char* name);
+void client_left(ClientList* clientList, Client* client);
+
+void publish_clients(ClientList* clientList);
+
+void publish_room(ClientList* clientList, Room* room);
+
+Client* find_client(ClientList* clientList, char* name);
+
+/*
+ * Function which takes a snapshot of a room's members grouped by the shard
+ * serving them. The caller holds the client list mutex.
+ * Parameters:
+ * clientList - list of clients connected to the server
+ * room - room whose members are wanted
+ * Return:
+ * RoomMembers* - the new snapshot
+ */
+RoomMembers* group_members(ClientList* clientList, Room* room) {
+    int shards = clientList->shardCount;
+    int next[shards];
+    RoomMembers* snapshot = malloc(sizeof(RoomMembers));
+    snapshot->count = room->members.count;
+    snapshot->start = calloc(shards + 1, sizeof(int));
+    snapshot->members = malloc((snapshot->count + 1) * sizeof(Client*));
+    RosterEntry* entry;
+    for (entry = roster_first(&(room->members)); entry != NULL;
+            entry = entry->forward[0]) {
+        snapshot->start[((Client*) entry->value)->shard + 1]++;
+    }
+    for (int shard = 0; shard < shards; shard++) {
+        snapshot->start[shard + 1] += snapshot->start[shard];
+        next[shard] = snapshot->start[shard];
+    }
+    for (entry = roster_first(&(room->members)); entry != NULL;
+            entry = entry->forward[0]) {
+        Client* client = entry->value;
+        snapshot->members[next[client->shard]++] = client;
+    }
+    return snapshot;
+}
+
+/*
+ * Function which frees a snapshot of a room's members once it has been
+ * replaced and no thread can still be using it.
+ * Paramters:
+ * data - snapshot to be freed
+ */
+void free_members(void* data) {
+    RoomMembers* snapshot = data;
+    free(snapshot->start);
+    free(snapshot->members);
+    free(snapshot);
+}
+
+/*
+ * Function which creates an empty room, referenced by the room index.
+ * Parameters:
+ * clientList - list of clients connected to the server
+ * name - name of the room (copied by the room)
+ * Return:
+ * Room* - the new room
+ */
+Room* create_room(ClientList* clientList, const char* name) {
+    Room* room = (Room*) malloc(sizeof(Room));
+    room->name = strdup(name);
+    roster_init(&(room->members));
+    room->snapshot = group_members(clientList, room);
+    room->listFrame = frame_format("LIST:\n");
+    room->references = 1;
+    backlog_init(&room->backlog, clientList->options->backlog);
+    return room;
+}
+
+/*
+ * Function which releases a reference to a room, freeing it once the room
+ * index and every broadcast waiting for another shard have let it go.
+ * Paramters:
+ * room - room to be released
+ */
+void release_room(Room* room) {
+    if (__atomic_sub_fetch(&room->references, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    free_members(room->snapshot);
+    frame_release(room->listFrame);
+    backlog_destroy(&room->backlog);
+    roster_destroy(&(room->members));
+    free(room->name);
+    free(room);
+}
+
+/*
+ * Function which releases the room index's reference to a room once the
+ * room has been removed from the index and no thread can still find it.
+ * Paramters:
+ * data - room to be released
+ */
+void free_room(void* data) {
+    release_room(data);
+}
 
 /*
  * A function which initialises a singular empty client list (ie holds no 
  * clients and has not recieved any commands of any type) and returns the 
- * corresponding data structure.
+ * corresponding data structure. Only the default room exists to begin with.
+ * Parameters:
+ * options - options the server was run with
  */
-ClientList* create_client_list() {
+ClientList* create_client_list(const ServerOptions* options) {
     ClientList* clientList = (ClientList *) malloc(sizeof(ClientList));
-    clientList->count = 0;
-    clientList->head = NULL;
-    clientList->tail = NULL;
+    clientList->options = options;
+    clientList->shardCount = options->eventLoop || options->ioUring ?
+            options->shards : 1;
+    clientList->shards = malloc(clientList->shardCount * sizeof(Shard));
+    for (int i = 0; i < clientList->shardCount; i++) {
+        shard_init(&(clientList->shards[i]), i);
+    }
+    roster_init(&(clientList->clients));
+    clientList->snapshot = roster_snapshot(&(clientList->clients));
+    roster_init(&(clientList->rooms));
+    clientList->defaultRoom = create_room(clientList, DEFAULT_ROOM);
+    roster_insert(&(clientList->rooms), clientList->defaultRoom->name,
+            clientList->defaultRoom);
     pthread_mutex_init(&(clientList->mutex), NULL);
-    clientList->auth = 0;
-    clientList->name = 0;
-    clientList->say = 0;
-    clientList->kick = 0;
-    clientList->list = 0;
-    clientList->leave = 0;
+    clientList->connections = 0;
+    token_bucket_init(&(clientList->accepts), options->acceptRate,
+            options->acceptBurst);
+    pthread_mutex_init(&(clientList->acceptMutex), NULL);
+    clientList->log = NULL;
+    if (options->logDirectory != NULL) {
+        clientList->log = chat_log_open(options->logDirectory,
+                options->logSegment, options->logSync);
+        if (clientList->log == NULL) {
+            usage_error("Usage: server authfile [port]\n");
+        }
+    }
     return clientList;
 }
 
@@ -120,176 +266,387 @@ StatisticsData* create_statistics_data(sigset_t* set, ClientList* clientList) {
 }
 
 /*
- * Function the initilisies that allocates memory and initilisaes the
- * ClientData strucutre.
- * Parameters:
- * clientList - list of clients connected to the server.
- * Return:
- * ClientData* - created ClientData strucutre.
- */
-ClientData* create_client(ClientList* clientList) {
-    ClientData* data = (ClientData *) malloc(sizeof(ClientList));
-    data->clientList = clientList;
-    return data;
-}
-
-/*
- * Function which adds a client to the client list in its lexogrpahcial 
- * position based upon the servers decided upon name. Returns the data 
- * strucuture representing the client that has been added.
+ * Function which adds a client to the client list under the name decided
+ * upon by the server, unless another client has already taken that name. The
+ * client list keeps clients in lexographical order of name. The client
+ * starts in the room with the given name, which is created if need be.
+ * A greeted client is sent OK: and the room's recent messages before it is
+ * published, so nothing sent to it by another thread can arrive first, and
+ * they are held back until it is, so it is listed once it sees OK:.
+ * Returns the data strucuture representing the client that has been added.
  * Paramters:
  * clientList - list of clients connected to the server
- * name - name of client to be added
- * to - file to send infromaiton to client
- * from - file to recieve informaiton from client
+ * name - name of client to be added (copied by the client)
+ * roomName - name of the room the client starts in, NULL for the default
+ * room
+ * to - queue to send infromaiton to client
+ * greet - true to send the client OK: and the room's recent messages
  * Return:
- * Client* - client that has been added to the server.
+ * Client* - client that has been added to the server, null if the name was
+ * already taken.
  *
  */
-Client* add_client(ClientList* clientList, char* name, FILE* to, FILE* from) {
-    Client* client;
-    pthread_mutex_lock(&(clientList->mutex));
-    client = (Client*) malloc(sizeof(Client));
-    client->name = name;
+Client* add_client(ClientList* clientList, char* name, const char* roomName,
+        OutQueue* to, bool greet) {
+    Client* client = slab_alloc(&clientSlab);
+    client->name = strdup(name);
+    client->readableName = convert_readable(strdup(name));
     client->to = to;
-    client->from = from;
     client->say = 0;
     client->list = 0;
     client->kick = 0;
-    // alphabetically addiing the client to the list based on name and number
-    // of clients already in the list.
-    if (clientList->count == 0) {
-        clientList->head = client;
-        clientList->tail = client;
-    } else if (strcmp(name, clientList->head->name) < 0) {
-        clientList->head->previous = client;
-        client->next = clientList->head;
-        clientList->head = client;
-    } else if (clientList->count == 1) {
-        clientList->head->next = client;
-        client->previous = clientList->head;
-        clientList->tail = client;
-    } else {
-        Client* before = clientList->head;
-        Client* after = clientList->head->next;
-        while (before != NULL) {
-            if (strcmp(after->name, name) > 0) {
-                client->previous = before;
-                before->next = client;
-                client->next = after;
-                after->previous = client;
-                break;
-            }
-            before = before->next;
-            after = after->next;
-            if (after == NULL) {
-                client->previous = before;
-                before->next = client;
-                clientList->tail = client;
-                break;
-            }
+    token_bucket_init(&client->commands, clientList->options->rate,
+            clientList->options->burst);
+    token_bucket_init(&client->sayLimit, clientList->options->sayRate,
+            clientList->options->burst);
+    token_bucket_init(&client->listLimit, clientList->options->listRate,
+            clientList->options->burst);
+    token_bucket_init(&client->kickLimit, clientList->options->kickRate,
+            clientList->options->burst);
+    client->sayRejected = false;
+    client->shard = shard_current() < 0 ? 0 : shard_current();
+    client->lastCommandAt = now_usec();
+    client->pingedAt = 0;
+    client->writeCheckAt = 0;
+    client->written = 0;
+    client->writePending = false;
+    pthread_mutex_lock(&(clientList->mutex));
+    bool added = roster_insert(&(clientList->clients), client->name, client);
+    if (added) {
+        client->room = clientList->defaultRoom;
+        if (roomName != NULL) {
+            client->room = roster_find(&(clientList->rooms), roomName);
+        }
+        if (client->room == NULL) {
+            client->room = create_room(clientList, roomName);
+            roster_insert(&(clientList->rooms), client->room->name,
+                    client->room);
+        }
+        roster_insert(&(client->room->members), client->name, client);
+        if (greet) {
+            out_queue_hold(to, true);
+            send_to_client(to, COMMAND_OK);
+            stats_add(STAT_REPLAYED, backlog_replay(&client->room->backlog,
+                    to));
         }
-    } 
-    clientList->count++;
+        publish_room(clientList, client->room);
+        publish_clients(clientList);
+    }
     pthread_mutex_unlock(&(clientList->mutex));
+    if (added && greet) {
+        out_queue_hold(to, false);
+    }
+    if (!added) {
+        free(client->name);
+        free(client->readableName);
+        slab_free(&clientSlab, client);
+        return NULL;
+    }
     return client;
 }
 
 /*
- * Function which removes a client from the client list and frees assoicated
- * memory space.
+ * Function which adds a client handed over by the server this one replaced
+ * to the client list, in the room it was talking in and with the counts of
+ * commands it had sent. No other client is told, as none saw it leave.
  * Paramters:
  * clientList - list of clients connected to the server
- * name - name of client to be removed
+ * handed - what the old server knew about the client
+ * to - queue to send infromaiton to client
+ * Return:
+ * Client* - client that has been added to the server, null if its name is
+ * somehow already taken.
  */
-void remove_client(ClientList* clientList, char* name) {
-    pthread_mutex_lock(&(clientList->mutex));
-    Client* client = clientList->head;
-    //searching list of clients and removing client. Different prodedure to 
-    //remove client is required depending on number of clients in list.
-    while (client != NULL) {
-        if (strcmp(client->name, name) == 0) {
-            if (clientList->count == 1) {
-                clientList->head = NULL;
-                clientList->tail = NULL;
-            } else if (client->previous == NULL) {
-                clientList->head = client->next;
-                clientList->head->previous = NULL;
-            } else if (client->next == NULL) {
-                clientList->tail = client->previous;
-                clientList->tail->next = NULL;
-            } else {
-                client->previous->next = client->next;
-                client->next->previous = client->previous;
-            }
-            clientList->count--;
-            fclose(client->to);
-            fclose(client->from);
-            free(client);
-            break;
-        }
-        client = client->next;
+Client* adopt_client(ClientList* clientList, HandoffConnection* handed,
+        OutQueue* to) {
+    Client* client = add_client(clientList, handed->name, handed->room, to,
+            false);
+    if (client == NULL) {
+        return NULL;
     }
+    client->say = handed->say;
+    client->kick = handed->kick;
+    client->list = handed->list;
+    client->sayRejected = handed->sayRejected;
+    return client;
+}
+
+/*
+ * Function which frees a client that has been removed from the client list.
+ * Paramters:
+ * data - client to be freed
+ */
+void free_client(void* data) {
+    Client* client = data;
+    free(client->name);
+    free(client->readableName);
+    slab_free(&clientSlab, client);
+}
+
+/*
+ * Function which removes a client from the room it is talking in. A room
+ * other than the default room is removed from the room index once its last
+ * member leaves, and freed once no thread can still be using it. The caller
+ * holds the client list mutex.
+ * Paramters:
+ * clientList - list of clients connected to the server
+ * client - client to be removed from its room
+ */
+void leave_room(ClientList* clientList, Client* client) {
+    Room* room = client->room;
+    roster_remove(&(room->members), client->name);
+    publish_room(clientList, room);
+    if (room->members.count == 0 && room != clientList->defaultRoom) {
+        roster_remove(&(clientList->rooms), room->name);
+        epoch_retire(room, free_room);
+    }
+}
+
+/*
+ * Function which removes a client from the client list and its room. The
+ * client's queue is closed straight away, but its memory is only freed once
+ * no thread can still be using an older snapshot which contains it.
+ * Paramters:
+ * clientList - list of clients connected to the server
+ * client - client to be removed
+ */
+void remove_client(ClientList* clientList, Client* client) {
+    pthread_mutex_lock(&(clientList->mutex));
+    roster_remove(&(clientList->clients), client->name);
+    leave_room(clientList, client);
+    publish_clients(clientList);
+    out_queue_close(client->to);
     pthread_mutex_unlock(&(clientList->mutex));
+    epoch_retire(client, free_client);
+}
+
+/*
+ * Function which frees a snapshot of the client list once it has been
+ * replaced and no thread can still be using it.
+ * Paramters:
+ * data - snapshot to be freed
+ */
+void free_snapshot(void* data) {
+    roster_snapshot_free(data);
+}
+
+/*
+ * Function which releases a room's reference to a LIST: line once it has
+ * been replaced and no thread can still be about to reference it.
+ * Paramters:
+ * data - frame holding the old LIST: line
+ */
+void release_list_frame(void* data) {
+    frame_release(data);
 }
 
 /*
- * Function which sends the names of all clients connected to the server (ie
- * LIST:name1,name2,...) to a particular client.
+ * Function which publishes a new snapshot of the client list after a client
+ * has entered or left. The old one is freed once no thread can still be
+ * using it. The caller holds the client list mutex.
  * Paramaters:
  * clientList - list of clients currently connected to the server.
- * to - file to send informaiton to the client.
  */
-void list_client_names(ClientList* clientList, FILE* to) {
-    Client* client;
-    pthread_mutex_lock(&(clientList->mutex));
-    client = clientList->head;
-    fprintf(to, "LIST:");
-    while (client != NULL) {
+void publish_clients(ClientList* clientList) {
+    RosterSnapshot* snapshot = roster_snapshot(&(clientList->clients));
+    epoch_retire(__atomic_exchange_n(&(clientList->snapshot), snapshot,
+            __ATOMIC_SEQ_CST), free_snapshot);
+}
+
+/*
+ * Function which publishes a new snapshot of a room's members and a new
+ * LIST:name1,name2,... line after a client has joined or left the room. The
+ * binary LIST frame carries the names each followed by a null. The old ones
+ * are freed once no thread can still be using them. The caller holds the
+ * client list mutex.
+ * Paramaters:
+ * clientList - list of clients connected to the server
+ * room - room whose members have changed
+ */
+void publish_room(ClientList* clientList, Room* room) {
+    RosterEntry* entry;
+    // LIST: and a comma or newline after each name
+    size_t length = strlen("LIST:") + (room->members.count == 0 ? 1 : 0);
+    for (entry = roster_first(&(room->members)); entry != NULL; 
+            entry = entry->forward[0]) {
+        length += strlen(entry->name) + 1;
+    }
+    Frame* list = frame_create(length);
+    length = sprintf(list->data, "LIST:");
+    entry = roster_first(&(room->members));
+    while (entry != NULL) {
         // all clients have commer inbetween name except for last
-        if (client->next == NULL) {
-            fprintf(to, "%s", client->name);
-        } else {
-            fprintf(to, "%s,", client->name);
+        length += sprintf(list->data + length, 
+                entry->forward[0] == NULL ? "%s" : "%s,", entry->name);
+        entry = entry->forward[0];
+    }
+    list->data[length] = '\n';
+    // each name and its null, the same bytes as the text line's names and
+    // separators
+    list->binary = protocol_binary_frame(COMMAND_LIST, NULL, NULL,
+            length - strlen("LIST:") + 1 - (room->members.count == 0));
+    char* names = list->binary->data + PROTOCOL_HEADER_SIZE;
+    for (entry = roster_first(&(room->members)); entry != NULL;
+            entry = entry->forward[0]) {
+        size_t nameLength = strlen(entry->name) + 1;
+        memcpy(names, entry->name, nameLength);
+        names += nameLength;
+    }
+    RoomMembers* snapshot = group_members(clientList, room);
+    epoch_retire(__atomic_exchange_n(&(room->snapshot), snapshot,
+            __ATOMIC_SEQ_CST), free_members);
+    epoch_retire(__atomic_exchange_n(&(room->listFrame), list,
+            __ATOMIC_SEQ_CST), release_list_frame);
+}
+
+/*
+ * Function which sends the names of all clients in a room (ie
+ * LIST:name1,name2,...) to a particular client. The line is kept up to date
+ * as clients join and leave the room, so this only queues a reference to it
+ * and never locks the client list.
+ * Paramaters:
+ * room - room whose members are listed.
+ * to - queue to send informaiton to the client.
+ */
+void list_client_names(Room* room, OutQueue* to) {
+    epoch_enter();
+    Frame* list = frame_ref(__atomic_load_n(&(room->listFrame),
+            __ATOMIC_SEQ_CST));
+    epoch_exit();
+    out_queue_push(to, list);
+    frame_release(list);
+}
+
+/*
+ * Function which pushes a frame to every member of a room served by one
+ * shard. The caller must be inside an epoch.
+ * Paramaters:
+ * snapshot - members of the room
+ * shard - shard whose members are sent the frame
+ * frame - frame to be pushed
+ */
+void push_to_members(RoomMembers* snapshot, int shard, Frame* frame) {
+    for (int i = snapshot->start[shard]; i < snapshot->start[shard + 1];
+            i++) {
+        out_queue_push(snapshot->members[i]->to, frame);
+    }
+}
+
+/*
+ * Function which posts a frame to another shard's inbox, for that shard to
+ * push to its members of a room or to one of its clients. The caller must
+ * be inside an epoch, which keeps the room alive until it is referenced.
+ * Paramaters:
+ * clientList - list of clients connected to the server
+ * shard - shard to post to
+ * frame - frame to be sent
+ * room - room whose members are sent the frame, or NULL
+ * name - name of the client sent the frame if there is no room
+ */
+void post_to_shard(ClientList* clientList, int shard, Frame* frame,
+        Room* room, const char* name) {
+    FanoutMessage* fanout = slab_alloc(&fanoutSlab);
+    fanout->frame = frame_ref(frame);
+    fanout->room = room;
+    fanout->name = name == NULL ? NULL : strdup(name);
+    if (room != NULL) {
+        __atomic_fetch_add(&room->references, 1, __ATOMIC_RELAXED);
+    }
+    shard_post(&(clientList->shards[shard]), &fanout->message);
+    stats_add(STAT_CROSS_SHARD, 1);
+}
+
+/*
+ * Function which sends an encoded frame to all clients in a room. Each
+ * client's outbound queue only takes a reference to the frame, so the frame
+ * is built once however many clients there are, and a client which is slow
+ * to read cannot hold up the others. The members are taken from the room's
+ * current snapshot, so a broadcast never waits for clients joining or
+ * leaving, and costs nothing for clients in other rooms. A loop only pushes
+ * to the members it serves itself, and posts the frame once to each other
+ * shard with members in the room.
+ * Paramaters:
+ * clientList - list of clients connected to the server
+ * room - room the frame is sent to
+ * frame - frame to be broadcast
+ */
+void broadcast_frame(ClientList* clientList, Room* room, Frame* frame) {
+    int current = shard_current();
+    epoch_enter();
+    RoomMembers* snapshot = __atomic_load_n(&(room->snapshot),
+            __ATOMIC_SEQ_CST);
+    for (int shard = 0; shard < clientList->shardCount; shard++) {
+        if (current < 0 || shard == current) {
+            push_to_members(snapshot, shard, frame);
+        } else if (snapshot->start[shard + 1] > snapshot->start[shard]) {
+            post_to_shard(clientList, shard, frame, room, NULL);
         }
-        client = client->next;
     }
-    fprintf(to, "\n");
-    fflush(to);
-    pthread_mutex_unlock(&(clientList->mutex));
+    stats_add(STAT_FANOUT, snapshot->count);
+    epoch_exit();
 }
 
 /*
- * Funcction which can broadcast a given string to all clients connected to
- * the server.
+ * Funcction which can broadcast a command about a client, such as ENTER: or
+ * LEAVE:, to all clients in a room.
  * Paramaters:
- * clientList - current clients connected to the server
- * message - string to be broadcast
+ * clientList - list of clients connected to the server
+ * room - room the command is sent to
+ * command - command to be broadcast
+ * name - name of the client the command is about
  */
-void broadcast(ClientList* clientList, char* message) {
-    Client* client;
-    pthread_mutex_lock(&(clientList->mutex));
-    client = clientList->head;
-    while (client != NULL) {
-        fprintf(client->to, "%s\n", message);
-        fflush(client->to);
-        client = client->next;
+void broadcast(ClientList* clientList, Room* room, CommandType command,
+        char* name) {
+    Frame* frame = protocol_frame(command, name, NULL, 0);
+    broadcast_frame(clientList, room, frame);
+    frame_release(frame);
+}
+
+/*
+ * Function which handles the frames other shards have posted to a shard,
+ * pushing each to the shard's members of its room, or to its client. Only
+ * the thread serving the shard may call it.
+ * Paramaters:
+ * clientList - list of clients connected to the server
+ * shard - shard whose inbox is to be handled
+ */
+void deliver_shard_messages(ClientList* clientList, Shard* shard) {
+    ShardMessage* message = shard_take(shard);
+    epoch_enter();
+    while (message != NULL) {
+        FanoutMessage* fanout = (FanoutMessage*) message;
+        message = message->next;
+        if (fanout->room != NULL) {
+            push_to_members(__atomic_load_n(&(fanout->room->snapshot),
+                    __ATOMIC_SEQ_CST), shard->index, fanout->frame);
+            release_room(fanout->room);
+        } else {
+            Client* client = find_client(clientList, fanout->name);
+            if (client != NULL && client->shard == shard->index) {
+                out_queue_push(client->to, fanout->frame);
+            }
+            free(fanout->name);
+        }
+        frame_release(fanout->frame);
+        slab_free(&fanoutSlab, fanout);
     }
-    pthread_mutex_unlock(&(clientList->mutex));
+    epoch_exit();
 }
 
 /*
  * Function which creates a socket for the server and begins listening
  * for client connections. The function returns the file descirptor which
- * is being listened on.
+ * is being listened on. Sockets opened with reusePort can share a port, and
+ * the kernel spreads new connections between them.
  * Paramter:
  * port - port which the server is to listen on.
+ * reusePort - true if other sockets may listen on the same port
  * Return:
  * int - file descriptor that the server is listening on.
  *
  * (addapted from CSSE2310 lecture code)
  */
-int open_listen(const char* port) {
+int open_listen(const char* port, bool reusePort) {
     struct addrinfo* addressInfo = 0;
     struct addrinfo hints;
 
@@ -311,12 +668,32 @@ int open_listen(const char* port) {
             &optVal, sizeof(int)) < 0) {
         communications_error();
     }
+    if (reusePort && setsockopt(listenDiscriptor, SOL_SOCKET, SO_REUSEPORT,
+            &optVal, sizeof(int)) < 0) {
+        communications_error();
+    }
 
     if (bind(listenDiscriptor, (struct sockaddr*)addressInfo->ai_addr, 
             sizeof(struct sockaddr)) < 0) {
         communications_error();
     }
+    freeaddrinfo(addressInfo);
+    
+    if (listen(listenDiscriptor, SOMAXCONN) < 0) { 
+        communications_error();
+    }
+    return listenDiscriptor;
+}
 
+/*
+ * Function which finds the port a listening socket was bound to, which is
+ * chosen by the system if port 0 was asked for.
+ * Paramter:
+ * listenDiscriptor - socket the server is listening on.
+ * Return:
+ * unsigned - port the socket is listening on
+ */
+unsigned listen_port(int listenDiscriptor) {
     struct sockaddr_in address;
     memset(&address, 0, sizeof(struct sockaddr_in));
     socklen_t len = sizeof(struct sockaddr_in);
@@ -324,167 +701,319 @@ int open_listen(const char* port) {
     if (getsockname(listenDiscriptor, (struct sockaddr*)&address, &len)) {
         communications_error();
     }
-    
-    if (listen(listenDiscriptor, SOMAXCONN) < 0) { 
-        communications_error();
+    return ntohs(address.sin_port);
+}
+
+/*
+ * Function which is told by a threaded client's outbound queue when it needs
+ * the socket to become writable, and wakes the client's thread so that it
+ * starts waiting for that.
+ * Parameters:
+ * queue - queue which needs flushing
+ * writable - true if the queue has bytes waiting to be written
+ */
+void wake_client_thread(OutQueue* queue, bool writable) {
+    uint64_t wake = 1;
+    if (writable) {
+        write(*(int*) queue->owner, &wake, sizeof(wake));
     }
+}
 
-    //print listening socket
-    fprintf(stderr, "%u\n", ntohs(address.sin_port));
-    return listenDiscriptor;
+/*
+ * Function which is told by a threaded client's outbound queue when it is
+ * holding lines back, and wakes the client's thread so that it flushes the
+ * queue in time.
+ * Parameters:
+ * queue - queue which is holding lines back
+ * flushAt - time in microseconds by which the queue must be flushed
+ */
+void schedule_client_flush(OutQueue* queue, long long flushAt) {
+    wake_client_thread(queue, true);
 }
 
 /*
- * Function which waits for attempted connection from a client, and when one 
- * is recieved, generates a thread for the client to run on.
- * Paramaters:
- * fdServer - file descriptor for the server-client connection
- * serverAuth - the auth string rpovided to the server.
- *  clientList - list of clients connected to the server.
- *
- * (Adapted from CSSE2310 - lecture code)
- */
-void process_connections(int fdServer, char* serverAuth, 
-        ClientList* clientList) {
-    int serverDiscriptor;
-    struct sockaddr_in fromAddress;
-    socklen_t fromAddressSize;
-    while (1) {
-        fromAddressSize = sizeof(struct sockaddr_in);
-	// Block, waiting for a new connection. (fromAddress will be populated
-	// with address of client)
-        serverDiscriptor = accept(fdServer, (struct sockaddr*)&fromAddress, 
-                &fromAddressSize);
-        if (serverDiscriptor < 0) {
-            communications_error();
+ * Function which blocks until a complete command has been recieved from a
+ * client, writing out the client's outbound queue whenever the socket is
+ * writable in the meantime, or lines held back in it are due. The client's
+ * idle, heartbeat and write stall deadlines are kept while waiting, and the
+ * thread stops if a server taking over wakes it through the handoff. A
+ * client sending faster than the rate policy allows is not read from until
+ * it may send again, so its next command is left waiting in the buffer.
+ * Parameters:
+ * clientList - list of clients connected to the server
+ * client - client whose command is read
+ * from - buffer recieving infromaiton from client.
+ * binary - true if the client uses binary framing
+ * command - filled in with the command recieved (valid until the next
+ * command is read)
+ * Return:
+ * ReadResult - READ_COMMAND once a command has been recieved, READ_CLOSED
+ * if the client disconnected or missed a deadline, or READ_HANDOFF if it is
+ * to be handed to the server taking over.
+ */
+ReadResult read_client_command(ClientList* clientList, Client* client,
+        LineBuffer* from, bool binary, Command* command) {
+    OutQueue* to = client->to;
+    Handoff* handoff = clientList->handoff;
+    struct pollfd waiting[3];
+    struct timespec timeout;
+    uint64_t wakes;
+    long long readAt = 0;
+    while (true) {
+        long long now = now_usec();
+        // only a command which has arrived is held back
+        if (readAt <= now && protocol_command_waiting(from, binary)) {
+            long long delay = token_bucket_delay(&client->commands, now);
+            if (delay > 0) {
+                // hold back clients sending faster than the rate policy
+                // allows
+                stats_add(STAT_THROTTLED, 1);
+                readAt = now + delay;
+            } else if (protocol_next_command(from, binary, command)) {
+                token_bucket_take(&client->commands);
+                return READ_COMMAND;
+            }
         }
+        bool throttled = readAt > now;
+        long long deadline = check_client_deadlines(clientList, client, now);
+        if (deadline < 0) {
+            return READ_CLOSED;
+        }
+        long long flushAt = out_queue_flush_at(to);
+        if (flushAt > 0 && flushAt <= now) {
+            out_queue_flush(to);
+            continue;
+        }
+        long long until = flushAt == 0 || (deadline > 0 &&
+                deadline < flushAt) ? deadline : flushAt;
+        if (throttled && (until == 0 || readAt < until)) {
+            until = readAt;
+        }
+        long long wait = until - now;
+        timeout.tv_sec = wait / USEC_PER_SEC;
+        timeout.tv_nsec = (wait % USEC_PER_SEC) * NSEC_PER_USEC;
+        waiting[0].fd = from->fd;
+        // held back lines wait for their deadline, not for writability
+        waiting[0].events = (throttled ? 0 : POLLIN) |
+                (flushAt == 0 && out_queue_pending(to) ? POLLOUT : 0);
+        waiting[1].fd = *(int*) to->owner;
+        waiting[1].events = POLLIN;
+        waiting[2].fd = handoff == NULL ? -1 : handoff->wakeDiscriptor;
+        waiting[2].events = POLLIN;
+        if (ppoll(waiting, 3, until > 0 ? &timeout : NULL, NULL) <= 0) {
+            continue;
+        }
+        if ((waiting[2].revents & POLLIN) &&
+                handoff_pause(handoff, 1, false)) {
+            return READ_HANDOFF;
+        }
+        if (waiting[1].revents & POLLIN) {
+            read(waiting[1].fd, &wakes, sizeof(wakes));
+        }
+        if (waiting[0].revents & POLLOUT) {
+            out_queue_flush(to);
+        }
+        if (waiting[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t got = line_buffer_fill(from);
+            if (got > 0) {
+                stats_add(STAT_BYTES_IN, got);
+            }
+            if (from->closed) {
+                return READ_CLOSED;
+            }
+        }
+    }
+}
 
-        ClientData* data = create_client(clientList);
-        data->serverDiscriptor = serverDiscriptor;
-        data->serverAuth = serverAuth;
-
-	pthread_t threadId;
-	pthread_create(&threadId, NULL, client_thread, data);
-	pthread_detach(threadId);
+/*
+ * Function which decides whether a connection just accepted may stay open.
+ * Connections are turned away while the server already has as many open as
+ * it allows, or while it is accepting them faster than it allows, so a storm
+ * of reconnecting clients costs no more than an accept and a close each.
+ * Every admitted connection must be given back with connection_closed().
+ * Parameters:
+ * clientList - list of clients connected to the server
+ * Return:
+ * bool - true if the connection is admitted, false if the caller should
+ * close it straight away.
+ */
+bool admit_connection(ClientList* clientList) {
+    const ServerOptions* options = clientList->options;
+    int open = __atomic_add_fetch(&(clientList->connections), 1,
+            __ATOMIC_RELAXED);
+    if (options->maxConnections > 0 && open > options->maxConnections) {
+        __atomic_sub_fetch(&(clientList->connections), 1, __ATOMIC_RELAXED);
+        stats_add(STAT_CONNECTIONS_FULL, 1);
+        return false;
+    }
+    if (options->acceptRate > 0) {
+        pthread_mutex_lock(&(clientList->acceptMutex));
+        bool shed = token_bucket_delay(&(clientList->accepts),
+                now_usec()) > 0;
+        if (!shed) {
+            token_bucket_take(&(clientList->accepts));
+        }
+        pthread_mutex_unlock(&(clientList->acceptMutex));
+        if (shed) {
+            __atomic_sub_fetch(&(clientList->connections), 1,
+                    __ATOMIC_RELAXED);
+            stats_add(STAT_ACCEPTS_SHED, 1);
+            return false;
+        }
     }
+    return true;
 }
 
 /*
- * Function which checks if a client has disconnected from the server and if 
- * so ends that client thread.
+ * Function which decides whether accepting a connection failed because the
+ * server has run out of file descriptors or memory. The connection stays
+ * waiting on the listening socket, so it stays readable, and the caller
+ * stops watching it until the returned time rather than spinning or giving
+ * up. Each such failure is counted as a shed connection.
  * Parameters:
- * from - file to recieve infromaiton form client.
- * to - file top send informaiton to client.
+ * error - errno left by the failed accept
+ * Return:
+ * long long - time in microseconds to start accepting again, 0 if the
+ * failure was of any other kind.
  */
-void check_client_disconnect(FILE* from, FILE* to) {
-    if (feof(from) || ferror(from)) {
-        fclose(to);
-        fclose(from);
-        pthread_exit(NULL);
+long long accept_backoff(int error) {
+    if (error != EMFILE && error != ENFILE && error != ENOBUFS &&
+            error != ENOMEM) {
+        return 0;
     }
+    stats_add(STAT_ACCEPTS_SHED, 1);
+    return now_usec() + ACCEPT_BACKOFF_USEC;
 }
 
 /*
- * Function which waits for a response from a client with the specified command
- * type. The response is then returned.
- * Paramaters:
+ * Function which gives back the place of an admitted connection once it has
+ * closed.
+ * Parameters:
  * clientList - list of clients connected to the server
- * from - file to recieve infromation from client
- * to - file to send infromation to client.
- * Return:
- * char* - response from client.
- */
-char* wait_for_response(ClientList* clientList, FILE* from, FILE* to, 
-        char* responseCommand) {
-    char* clientResponse;
-    char commandWord[MAX_COMMAND_LENGTH];
-    // contintue reading from client until the desired type of message is 
-    // recieved
-    do {
-        usleep(100000);
-        clientResponse = read_file_line(from);
-        check_client_disconnect(from, to);
-        memcpy(commandWord, clientResponse, MAX_COMMAND_LENGTH - 1);
-        commandWord[MAX_COMMAND_LENGTH - 1] = '\0';
-    } while (strcmp(commandWord, responseCommand) != 0);
-    return clientResponse;
+ */
+void connection_closed(ClientList* clientList) {
+    __atomic_sub_fetch(&(clientList->connections), 1, __ATOMIC_RELAXED);
 }
 
 /*
- * Function which checks if the auth string provided by the client matches
- * the auth string supplied to the server. If it does an OK: is sent to the
- * client and if it dosetn the server disconnects from the client.
- * Paramters:
- * serverAuth - auth string supplied to the server.
- * clientAuth - auth string supplied to the client.
- * to - file to send informaiton to client
- * from - file to recieve information from client.
- */
-void check_auth(char* serverAuth, char* clientAuth, FILE* to, FILE* from) {
-    if (strcmp(serverAuth, clientAuth) != 0) {
-        fclose(to);
-        fclose(from);
-        pthread_exit(NULL);
-    } else {
-        fprintf(to, "OK:\n");
-        fflush(to);
-    }
+ * Function which closes the connection to a threaded client and frees the
+ * buffers used to communicate with it.
+ * Parameters:
+ * from - buffer recieving infromaiton form client.
+ * to - queue sending informaiton to client.
+ */
+void close_client_connection(LineBuffer* from, OutQueue* to) {
+    close(*(int*) to->owner);
+    close(from->fd);
+    // other threads may still be pushing to the (closed) queue from a
+    // snapshot taken before the client left
+    epoch_synchronize();
+    out_queue_destroy(to);
+    line_buffer_free(from);
 }
 
 /*
- * Function which broadcasts a message to all connected clients when a 
- * client leaves the server.
+ * Function which broadcasts a message to the clients in the room a client
+ * was talking in when the client leaves the server.
  * Paramaters:
  * clientList - clients currently connected to the server
- * name - name of client who left the server
- */
-void client_left(ClientList* clientList, char* name) {
-    remove_client(clientList, name);
-    int leaveLength = 6;
-    char* leave = malloc(leaveLength + strlen(name) + 1);
-    sprintf(leave, "LEAVE:%s", name);
-    printf("(%s has left the chat)\n", name);
+ * client - client who left the server (freed by this function)
+ */
+void client_left(ClientList* clientList, Client* client) {
+    printf("(%s has left the chat)\n", client->name);
     fflush(stdout);
-    broadcast(clientList, convert_readable(leave));
-    free(leave);
-    pthread_exit(NULL);
+    // the room and client are freed once unused, so keep them until the
+    // broadcast is done
+    epoch_enter();
+    Room* room = client->room;
+    remove_client(clientList, client);
+    broadcast(clientList, room, COMMAND_LEAVE, client->name);
+    epoch_exit();
 }
 
 /*
- * Function which broadcasts a MSG: command to all clients connected to 
- * the server when a specific client sends a message.
+ * Function which moves a client into the room with the given name, creating
+ * the room if it does not exist. The client is sent the room's recent
+ * messages, then the clients in the room being left are sent LEAVE: and
+ * those in the room being joined, including the client, ENTER:. An empty
+ * name is the default room.
  * Paramaters:
- * clietnList - list of clients connected to the server
- * name - name of client who sent the message
- * message - message to be broadcast
- */
-void broadcast_message(ClientList* clientList, char* name, 
-        char* clientMessage) {
-    int commandLength = 5;
-    char* message = (char*) malloc(commandLength + strlen(name) + 
-            strlen(clientMessage + 1));
-    sprintf(message, "MSG:%s:%s", name, clientMessage);
-    broadcast(clientList, convert_readable(message));
-    printf("%s: %s\n", name, convert_readable(clientMessage));
+ * clientList - clients currently connected to the server
+ * client - client moving rooms
+ * name - name of the room to join
+ */
+void join_room(ClientList* clientList, Client* client, char* name) {
+    if (name == NULL || name[0] == '\0') {
+        name = DEFAULT_ROOM;
+    }
+    // the room left is freed once empty, so keep it until LEAVE: is sent
+    epoch_enter();
+    pthread_mutex_lock(&(clientList->mutex));
+    Room* left = client->room;
+    Room* room = roster_find(&(clientList->rooms), name);
+    if (room == left) {
+        pthread_mutex_unlock(&(clientList->mutex));
+        epoch_exit();
+        return;
+    }
+    if (room == NULL) {
+        room = create_room(clientList, name);
+        roster_insert(&(clientList->rooms), room->name, room);
+    }
+    leave_room(clientList, client);
+    roster_insert(&(room->members), client->name, client);
+    publish_room(clientList, room);
+    client->room = room;
+    pthread_mutex_unlock(&(clientList->mutex));
+
+    stats_add(STAT_REPLAYED, backlog_replay(&room->backlog, client->to));
+    broadcast(clientList, left, COMMAND_LEAVE, client->name);
+    broadcast(clientList, room, COMMAND_ENTER, client->name);
+    epoch_exit();
+}
+
+/*
+ * Function which broadcasts a MSG: command to all clients in the room of
+ * a client which sends a message. The MSG: line and binary frame are
+ * encoded once and shared by every client's queue, and the message is
+ * relayed to binary clients exactly as it was sent.
+ * Paramaters:
+ * clientList - list of clients connected to the server
+ * room - room the message was sent in
+ * client - client who sent the message
+ * clientMessage - message to be broadcast
+ * length - bytes in the message
+ */
+void broadcast_message(ClientList* clientList, Room* room, Client* client,
+        char* clientMessage, size_t length) {
+    Frame* message = protocol_frame(COMMAND_MSG, client->name, clientMessage,
+            length);
+    message->received = now_usec();
+    message->binary->received = message->received;
+    backlog_append(&room->backlog, message);
+    if (clientList->log != NULL) {
+        chat_log_append(clientList->log, room->name, message);
+    }
+    broadcast_frame(clientList, room, message);
+    // the text line holds the message with unwriteable characters converted
+    size_t start = strlen("MSG::") + strlen(client->readableName);
+    printf("%s: %.*s\n", client->readableName,
+            (int) (message->length - start - 1), message->data + start);
     fflush(stdout);
-    free(message);
+    frame_release(message);
 }
 
 /*
- * Function which broadcastts an ENTER: message to all clients connected to
- * the server when a new client connects.
+ * Function which broadcastts an ENTER: message to all clients in the default
+ * room when a new client connects.
  * Paramters:
  * clientList - list of clients connected to the server
  * name - name of client which connected to server
  */
 void client_enter(ClientList* clientList, char* name) {
-    int enterLength = 6;
-    char* join = malloc(enterLength + strlen(name) + 1);
-    sprintf(join, "ENTER:%s", name);
     printf("(%s has entered the chat)\n", name);
     fflush(stdout);
-    broadcast(clientList, convert_readable(join));
-    free(join);
+    broadcast(clientList, clientList->defaultRoom, COMMAND_ENTER, name);
 }
 
 /*
@@ -504,21 +1033,65 @@ char* convert_readable(char* message) {
 }
 
 /*
- * Function which sends a command to a given client.
+ * Function which sends a command without an argument, such as OK: or KICK:,
+ * to a given client in whichever framing it uses. Commands are control
+ * lines, so they are written straight away rather than held back.
  * Parameters:
- * toClient - file that sends informaiton to client
- * message - message/command to be sent to client.
+ * toClient - queue that sends informaiton to client
+ * command - command to be sent to client.
  *
  */
-void send_to_client(FILE* toClient, char* message) {
-    fprintf(toClient, message);
-    fflush(toClient);
+void send_to_client(OutQueue* toClient, CommandType command) {
+    Frame* frame = protocol_frame(command, NULL, NULL, 0);
+    frame->urgent = true;
+    out_queue_push(toClient, frame);
+    frame_release(frame);
+}
+
+/*
+ * Function which sends a command without an argument to a client which may
+ * be served by another shard, posting it to that shard if so. The caller
+ * must be inside an epoch.
+ * Parameters:
+ * clientList - list of clients connected to the server
+ * client - client to send the command to
+ * command - command to be sent to client.
+ */
+void send_to_shard_client(ClientList* clientList, Client* client,
+        CommandType command) {
+    int current = shard_current();
+    if (current < 0 || client->shard == current) {
+        send_to_client(client->to, command);
+        return;
+    }
+    Frame* frame = protocol_frame(command, NULL, NULL, 0);
+    frame->urgent = true;
+    post_to_shard(clientList, client->shard, frame, NULL, client->name);
+    frame_release(frame);
+}
+
+/*
+ * Function which accepts a client's request for binary framing once it has
+ * authenticated. OK:BINARY is the last text line sent to the client, and
+ * everything after it is binary frames.
+ * Parameters:
+ * toClient - queue that sends informaiton to client
+ */
+void switch_to_binary(OutQueue* toClient) {
+    Frame* frame = protocol_text_frame(COMMAND_OK, NULL, "BINARY",
+            strlen("BINARY"));
+    frame->urgent = true;
+    out_queue_push(toClient, frame);
+    frame_release(frame);
+    out_queue_set_binary(toClient);
 }
 
 /*
  * Function which searches the list of clients connected to server to find
  * a client with a specified name. If this client exsists than the data
- * strucutre for that client is returned, otherwise null is returned.
+ * strucutre for that client is returned, otherwise null is returned. The
+ * caller must be inside an epoch, and may only use the client until it
+ * leaves the epoch.
  * Paramters:
  * clientList - list of clients connected to the server.
  * name - name of client to search for.
@@ -527,149 +1100,388 @@ void send_to_client(FILE* toClient, char* message) {
  *
  */
 Client* find_client(ClientList* clientList, char* name) {
-    Client* client;
-    Client* foundClient = NULL;
-    pthread_mutex_lock(&(clientList->mutex));
-    client = clientList->head;
-    while (client != NULL) {
-        if (strcmp(client->name, name) == 0) {
-            foundClient = client;  
-        }
-        client = client->next;
-    }
-    pthread_mutex_unlock(&(clientList->mutex));
-    return foundClient;
+    RosterSnapshot* snapshot = __atomic_load_n(&(clientList->snapshot),
+            __ATOMIC_SEQ_CST);
+    return roster_snapshot_find(snapshot, name);
 }
 
 /*
- * Function which completes name negotitation with a particular client 
- * and returns the name that has been accepted by the server.
+ * Function which checks a name sent by a client during name negotiation. If
+ * the name is empty, already in use or contains a newline or null (which
+ * only a binary client can send) NAME_TAKEN: is sent to the client,
+ * otherwise the client is added to the client list under the name and OK: is
+ * sent, followed by the recent messages of the default room. Checking and
+ * taking the name happen together, so two clients can never both be given
+ * the same name.
  * Parameters:
  * clientList - clients currently connected to the server
- * toClient - file used to send information toClient
- * fromClient - file used to recieve informaiton from client.
+ * toClient - queue used to send information to client
+ * name - name requested by the client, null terminated
+ * length - bytes in the name as recieved
  * Return:
- * char* - name of client accpeted by server.
+ * Client* - client added to the server, null if the name was rejected.
  */
-char* name_negotiation(ClientList* clientList, FILE* toClient, 
-        FILE* fromClient) {
-    char* name;
-    char* clientResponse;
-    Client* foundClient;
-    // contintue asking client for its name until a unqiue non-empty 
-    // name is given
-    do {
-        foundClient = NULL;
-        send_to_client(toClient, "WHO:\n");
-        clientResponse = wait_for_response(clientList, fromClient, 
-                toClient, "NAME:");
-        clientList->name++;
-        strtok_r(clientResponse, ":", &name);
-        foundClient = find_client(clientList, name);
-        if (foundClient != NULL || name[0] == '\0') {
-            send_to_client(toClient, "NAME_TAKEN:\n");
+Client* accept_client_name(ClientList* clientList, OutQueue* toClient,
+        char* name, size_t length) {
+    Client* client = NULL;
+    stats_add(STAT_NAME, 1);
+    if (name[0] != '\0' && strlen(name) == length &&
+            strchr(name, '\n') == NULL) {
+        client = add_client(clientList, name, NULL, toClient, true);
+    }
+    if (client == NULL) {
+        send_to_client(toClient, COMMAND_NAME_TAKEN);
+    }
+    return client;
+}
+
+/*
+ * Function which checks a command against the limit for its type, so that a
+ * client sending SAY:, LIST: or KICK: (each of which costs the server work
+ * for every client it reaches) faster than allowed has the extra commands
+ * thrown away rather than handled. The pieces of an oversized SAY: share the
+ * fate of the first.
+ * Parameters:
+ * client - client that sent the command
+ * command - command recieved from the client
+ * Return:
+ * bool - true if the command may be handled, false if it is thrown away.
+ */
+bool command_allowed(Client* client, Command* command) {
+    TokenBucket* limit;
+    switch (command->type) {
+        case COMMAND_SAY:
+            if (command->piece == LINE_MIDDLE ||
+                    command->piece == LINE_LAST) {
+                return !client->sayRejected;
+            }
+            limit = &client->sayLimit;
+            break;
+        case COMMAND_LIST:
+            limit = &client->listLimit;
+            break;
+        case COMMAND_KICK:
+            limit = &client->kickLimit;
+            break;
+        default:
+            return true;
+    }
+    bool allowed = limit->rate <= 0 ||
+            token_bucket_delay(limit, now_usec()) == 0;
+    if (allowed) {
+        token_bucket_take(limit);
+    } else {
+        stats_add(STAT_REJECTED, 1);
+    }
+    if (command->type == COMMAND_SAY) {
+        client->sayRejected = !allowed;
+    }
+    return allowed;
+}
+
+/*
+ * Function which determines which command has been sent by a chatting client
+ * and generates the appropriate response. SAY: and LIST: apply to the room
+ * the client is talking in, which JOIN:room changes and PART: returns to the
+ * default room. LEAVE: and LIST: take no argument, and PART: may name the
+ * room being left.
+ * Parameters:
+ * clientList - list of clients connected to the server.
+ * client - specific client that sent the command.
+ * command - command recieved from the client, in either framing.
+ * Return:
+ * bool - false if the client has left the server, true otherwise.
+ */
+bool process_client_command(ClientList* clientList, Client* client,
+        Command* command) {
+    Client* kickedClient;
+    char* rest = command->argument;
+    const ServerOptions* options = clientList->options;
+    if (command->piece == LINE_FIRST) {
+        stats_add(STAT_OVERSIZE, 1);
+    }
+    if (options->idleTimeout > 0 || options->pingInterval > 0) {
+        client->lastCommandAt = now_usec();
+    }
+    if (!command_allowed(client, command)) {
+        return true;
+    }
+    switch (command->type) {
+        case COMMAND_LEAVE:
+            if (command->length > 0) {
+                break;
+            }
+            stats_add(STAT_LEAVE, 1);
+            client_left(clientList, client);
+            return false;
+        case COMMAND_LIST:
+            if (command->length > 0) {
+                break;
+            }
+            __atomic_fetch_add(&client->list, 1, __ATOMIC_RELAXED);
+            stats_add(STAT_LIST, 1);
+            list_client_names(client->room, client->to);
+            break;
+        case COMMAND_SAY:
+            // pieces of a message too long to hold are each relayed as a
+            // message of their own, if they are relayed at all
+            if (command->piece != LINE_WHOLE &&
+                    (clientList->options->oversizePolicy == OVERSIZE_REJECT ||
+                    command->length == 0)) {
+                break;
+            }
+            if (command->piece == LINE_WHOLE ||
+                    command->piece == LINE_FIRST) {
+                stats_add(STAT_SAY, 1);
+                __atomic_fetch_add(&client->say, 1, __ATOMIC_RELAXED);
+            }
+            broadcast_message(clientList, client->room, client, rest,
+                    command->length);
+            break;
+        case COMMAND_KICK:
+            stats_add(STAT_KICK, 1);
+            __atomic_fetch_add(&client->kick, 1, __ATOMIC_RELAXED);
+            epoch_enter();
+            kickedClient = find_client(clientList, rest);
+            if (kickedClient != NULL) {
+                send_to_shard_client(clientList, kickedClient,
+                        COMMAND_KICK);
+            }
+            epoch_exit();
+            break;
+        case COMMAND_JOIN:
+            join_room(clientList, client, rest);
+            break;
+        case COMMAND_PART:
+            if (rest[0] == '\0' || strcmp(rest, client->room->name) == 0) {
+                join_room(clientList, client, NULL);
+            }
+            break;
+        case COMMAND_PING:
+            send_to_client(client->to, COMMAND_PONG);
+            break;
+        default:
+            break;
+    }
+    return true;
+}
+
+/*
+ * Function which keeps the deadlines of a client in the chat, and is called
+ * by the thread serving the client whenever the earliest of them may have
+ * passed. A quiet client is sent PING:, which any command (such as PONG:)
+ * answers. A client which has sent nothing for the idle timeout, or has had
+ * output waiting without any of it being written since the last check, has
+ * missed its deadline, and the caller sees it leave as if it had
+ * disconnected. Writes are only checked every write timeout, so a stalled
+ * client is caught within two of them.
+ * Parameters:
+ * clientList - list of clients connected to the server
+ * client - client whose deadlines are to be kept
+ * now - current time in microseconds
+ * Return:
+ * long long - time in microseconds of the client's next deadline, 0 if it
+ * has none, -1 if it has missed one.
+ */
+long long check_client_deadlines(ClientList* clientList, Client* client,
+        long long now) {
+    const ServerOptions* options = clientList->options;
+    long long next = 0;
+    if (options->idleTimeout > 0) {
+        next = client->lastCommandAt + options->idleTimeout;
+        if (now >= next) {
+            stats_add(STAT_IDLE_TIMEOUT, 1);
+            return -1;
+        }
+    }
+    if (options->writeTimeout > 0) {
+        if (now >= client->writeCheckAt) {
+            unsigned long written = client->written;
+            bool pending = out_queue_progress(client->to, &client->written);
+            if (pending && client->writePending &&
+                    client->written == written) {
+                stats_add(STAT_WRITE_TIMEOUT, 1);
+                return -1;
+            }
+            client->writePending = pending;
+            client->writeCheckAt = now + options->writeTimeout;
         }
-    } while (foundClient != NULL || name[0] == '\0'); 
-    send_to_client(toClient, "OK:\n");
-    return name;
+        if (next == 0 || client->writeCheckAt < next) {
+            next = client->writeCheckAt;
+        }
+    }
+    if (options->pingInterval > 0) {
+        long long pingAt = (client->pingedAt > client->lastCommandAt ?
+                client->pingedAt : client->lastCommandAt) +
+                options->pingInterval;
+        if (now >= pingAt) {
+            send_to_client(client->to, COMMAND_PING);
+            stats_add(STAT_PING, 1);
+            client->pingedAt = now;
+            pingAt = now + options->pingInterval;
+        }
+        if (next == 0 || pingAt < next) {
+            next = pingAt;
+        }
+    }
+    return next;
 }
 
 /*
- * Function which (after name negotiation is complete) determine which command 
- * has been sent by a clients and generates the approraite response. 
- * Function will repetely listen for client commands until client leaves.
+ * Function which (after name negotiation is complete) repetely listens for
+ * client commands until client leaves, at which point the caller closes the
+ * connection, or until the client is to be handed to a server taking over.
  * Parameters:
  * clientList - list of clients connected to the server.
  * client - specific client that the server is listening to.
- * toClient - file which is used to send informaiotn to client.
- * fromeClient - file which is used to recived informaiton from client.
- */
-void client_chatting(ClientList* clientList, Client* client, FILE* toClient,
-        FILE* fromClient) {
-    char* clientResponse;
-    char* clientCommand;
-    char* rest;
-    Client* kickedClient;
+ * toClient - queue which is used to send informaiotn to client.
+ * fromeClient - buffer which is used to recived informaiton from client.
+ * binary - true if the client uses binary framing
+ * Return:
+ * bool - true if the client is to be handed off, in which case the caller
+ * calls this function again if the handoff fails.
+ */
+bool client_chatting(ClientList* clientList, Client* client,
+        OutQueue* toClient, LineBuffer* fromClient, bool binary) {
+    Command clientResponse;
     // conintue reading from client until for whatever reason it leaves the
     // server.
     do {
-        usleep(100000);
-        clientResponse = read_file_line(fromClient);
-        if (feof(fromClient) || ferror(fromClient) || ferror(toClient)) {
-            client_left(clientList, client->name);
-        } else if (strcmp(clientResponse, "LEAVE:") == 0) {
-            clientList->leave++;
-            client_left(clientList, client->name);
-        } else if (strcmp(clientResponse, "LIST:") == 0) {
-            client->list++;
-            clientList->list++;
-            list_client_names(clientList, toClient);
-        } else if (clientResponse[0] != '\0') {
-            clientCommand = strtok_r(clientResponse, ":", &rest);
-            if (strcmp(clientCommand, "SAY") == 0) {
-                clientList->say++;
-                client->say++;
-                broadcast_message(clientList, convert_readable(client->name),
-                        convert_readable(rest));
-            } else if (strcmp(clientCommand, "KICK") == 0 && rest != NULL) {
-                clientList->kick++;
-                client->kick++;
-                kickedClient = find_client(clientList, rest);
-                if (kickedClient != NULL) {
-                    Client* kickedClient = find_client(clientList, rest);
-                    send_to_client(kickedClient->to, "KICK:\n");    
-                }
-            }           
+        ReadResult result = read_client_command(clientList, client,
+                fromClient, binary, &clientResponse);
+        if (result == READ_HANDOFF) {
+            return true;
         }
-    } while (1);
+        if (result == READ_CLOSED) {
+            client_left(clientList, client);
+            break;
+        }
+    } while (process_client_command(clientList, client, &clientResponse));
+    return false;
 }
 
 /*
- * Thread function that handles the communication between the client and the 
- * server including authentication, name negotiation and chatting
+ * Function which prints to stderr how many of each command has been sent by
+ * each client and by all clients, and how many commands and connections the
+ * server's limits held back or turned away, in response to a SIGHUP.
  * Paramaters:
- * passedData - data passed to client thread including the file for 
- * communicaiton between server and client, the server authenticatio code
- * and the list of clients already connected to the server.
+ * clientList - list of clients connected to the server
+ * totals - totals of the server's statistics
  */
-void* client_thread(void* passedData) {
-    char* clientResponse;
-    char* name;
-    char* clientAuth;
+void print_command_counts(ClientList* clientList, StatsTotals* totals) {
+    fprintf(stderr, "@CLIENTS@\n");
+    epoch_enter();
+    RosterSnapshot* snapshot = __atomic_load_n(&(clientList->snapshot),
+            __ATOMIC_SEQ_CST);
+    for (int i = 0; i < snapshot->count; i++) {
+        Client* client = snapshot->values[i];
+        fprintf(stderr, "%s:SAY:%d:KICK:%d:LIST:%d\n", client->name, 
+                __atomic_load_n(&client->say, __ATOMIC_RELAXED),
+                __atomic_load_n(&client->kick, __ATOMIC_RELAXED),
+                __atomic_load_n(&client->list, __ATOMIC_RELAXED));
+    }
+    epoch_exit();
+    fprintf(stderr, "@SERVER@\nserver:AUTH:%lu:NAME:%lu:SAY:%lu:KICK:%lu:"
+            "LIST:%lu:LEAVE:%lu\n", totals->counters[STAT_AUTH], 
+            totals->counters[STAT_NAME], totals->counters[STAT_SAY], 
+            totals->counters[STAT_KICK], totals->counters[STAT_LIST], 
+            totals->counters[STAT_LEAVE]);
+    fprintf(stderr, "limits:THROTTLED:%lu:REJECTED:%lu:FULL:%lu:SHED:%lu\n",
+            totals->counters[STAT_THROTTLED], totals->counters[STAT_REJECTED],
+            totals->counters[STAT_CONNECTIONS_FULL],
+            totals->counters[STAT_ACCEPTS_SHED]);
+}
 
-    //retrieving passed data
-    ClientData* data = passedData;
-    int toClientDiscriptor = data->serverDiscriptor;
-    char* serverAuth = data->serverAuth;
-    ClientList* clientList = data->clientList;
-    
-    //initiating file commucation
-    int fromClientDescriptor = dup(toClientDiscriptor);
-    FILE* toClient = fdopen(toClientDiscriptor, "w");
-    FILE* fromClient = fdopen(fromClientDescriptor, "r");
-    
-    //authentication
-    send_to_client(toClient, "AUTH:\n");
-    clientResponse = wait_for_response(clientList, fromClient, toClient,
-            "AUTH:");
-    clientList->auth++;
-    strtok_r(clientResponse, ":", &clientAuth);
-    check_auth(serverAuth, clientAuth, toClient, fromClient);
-
-    //name negotiation
-    name = name_negotiation(clientList, toClient, fromClient);
-    Client* client = add_client(clientList, name, toClient, fromClient);
-    client_enter(clientList, name);
-    
-    //client chatting
-    client_chatting(clientList, client, toClient, fromClient);
-    pthread_exit(NULL);
+/*
+ * Function which prints one of the server's latency histograms to stderr.
+ * Paramaters:
+ * label - name of what was timed
+ * histogram - times recorded in microseconds
+ */
+void print_timing(const char* label, Histogram* histogram) {
+    fprintf(stderr, "%s:COUNT:%lu:P50:%lld:P90:%lld:P99:%lld:P999:%lld:"
+            "MAX:%lld\n", label, histogram_count(histogram), 
+            histogram_percentile(histogram, 50), 
+            histogram_percentile(histogram, 90),
+            histogram_percentile(histogram, 99), 
+            histogram_percentile(histogram, 99.9),
+            histogram_percentile(histogram, 100));
+}
+
+/*
+ * Function which adds up the bytes currently waiting to be sent to each
+ * client in the chat. The clients are read from the published snapshot of
+ * the client list, so the roster lock is never taken.
+ * Paramaters:
+ * clientList - list of clients connected to the server
+ * queued - filled in with the bytes waiting for all clients
+ * deepest - filled in with the most bytes waiting for any one client
+ * Return:
+ * int - number of clients in the chat
+ */
+int queue_depths(ClientList* clientList, size_t* queued, size_t* deepest) {
+    *queued = 0;
+    *deepest = 0;
+    epoch_enter();
+    RosterSnapshot* snapshot = __atomic_load_n(&(clientList->snapshot),
+            __ATOMIC_SEQ_CST);
+    int count = snapshot->count;
+    for (int i = 0; i < count; i++) {
+        size_t bytes = out_queue_bytes(((Client*) snapshot->values[i])->to);
+        *queued += bytes;
+        if (bytes > *deepest) {
+            *deepest = bytes;
+        }
+    }
+    epoch_exit();
+    return count;
+}
+
+/*
+ * Function which prints to stderr the server's traffic and latency
+ * statistics, in response to a SIGUSR1. Queue depths are the bytes
+ * currently waiting to be sent to clients, and times are in microseconds.
+ * Paramaters:
+ * clientList - list of clients connected to the server
+ * totals - totals of the server's statistics
+ */
+void print_metrics(ClientList* clientList, StatsTotals* totals) {
+    size_t queued;
+    size_t deepest;
+    queue_depths(clientList, &queued, &deepest);
+    fprintf(stderr, "@METRICS@\nbytes:IN:%lu:OUT:%lu\nfanout:%lu\n"
+            "oversize:%lu\nqueue:TOTAL:%zu:MAX:%zu\n",
+            totals->counters[STAT_BYTES_IN], totals->counters[STAT_BYTES_OUT],
+            totals->counters[STAT_FANOUT], totals->counters[STAT_OVERSIZE],
+            queued, deepest);
+    fprintf(stderr, "alloc:SLAB:%lu:FREE:%lu:SHARED:%lu:MALLOC:%lu:"
+            "RESERVED:%zu\n", totals->counters[STAT_SLAB_ALLOC],
+            totals->counters[STAT_SLAB_FREE],
+            totals->counters[STAT_SLAB_SHARED], totals->counters[STAT_MALLOC],
+            slab_reserved());
+    fprintf(stderr, "shards:%d:POSTED:%lu\n", clientList->shardCount,
+            totals->counters[STAT_CROSS_SHARD]);
+    fprintf(stderr, "timeouts:AUTH:%lu:NAME:%lu:IDLE:%lu:WRITE:%lu\n",
+            totals->counters[STAT_AUTH_TIMEOUT],
+            totals->counters[STAT_NAME_TIMEOUT],
+            totals->counters[STAT_IDLE_TIMEOUT],
+            totals->counters[STAT_WRITE_TIMEOUT]);
+    fprintf(stderr, "pings:SENT:%lu\n", totals->counters[STAT_PING]);
+    fprintf(stderr, "backlog:REPLAYED:%lu\n",
+            totals->counters[STAT_REPLAYED]);
+    fprintf(stderr, "log:RECORDS:%lu:SYNCS:%lu:DROPPED:%lu\n",
+            totals->counters[STAT_LOG_RECORDS],
+            totals->counters[STAT_LOG_SYNCS],
+            totals->counters[STAT_LOG_DROPPED]);
+    print_timing("handshake", &totals->timings[TIMING_HANDSHAKE]);
+    print_timing("delivery", &totals->timings[TIMING_DELIVERY]);
 }
 
 /*
  * Thread function which waits for a SIGHUP to be recieved and prints to stdout
  * stats regarding how many of each command has been sent by clients/ the
- * server.
+ * server. A SIGUSR1 prints the server's traffic and latency statistics
+ * instead.
  * Paramaters:
  * data - data to be passed to thread including informaiotn regaridng how many
  * commands have been sent and what signals to wait for.
@@ -678,53 +1490,537 @@ void* statistics_thread(void* data) {
     StatisticsData* statisticsData = data;
     ClientList* clientList = statisticsData->clientList;
     sigset_t* set = statisticsData->set;
+    StatsTotals* totals = malloc(sizeof(StatsTotals));
     int signal;
     // wait for signal forever and then when one is recieved print stats
     for (;;) {
         sigwait(set, &signal);
-        fprintf(stderr, "@CLIENTS@\n");
-        Client* client = clientList->head;
-        while (client != NULL) {
-            fprintf(stderr, "%s:SAY:%d:KICK:%d:LIST:%d\n", client->name, 
-                    client->say, client->kick, client->list);
-            client = client->next;
+        stats_read(totals);
+        if (signal == SIGUSR1) {
+            print_metrics(clientList, totals);
+        } else {
+            print_command_counts(clientList, totals);
         }
-        fprintf(stderr, "@SERVER@\nserver:AUTH:%d:NAME:%d:SAY:%d:KICK:%d:"
-                "LIST:%d:LEAVE:%d\n", clientList->auth, clientList->name, 
-                clientList->say, clientList->kick, clientList->list, 
-                clientList->leave);
     }
 }
 
+/*
+ * Function which converts the value given to a numeric option, causing a
+ * usage error if it is not a non-negative number.
+ * Parameters:
+ * value - text given for the option
+ * Return:
+ * double - value of the option
+ */
+double parse_number_option(char* value) {
+    char* end;
+    double number = strtod(value, &end);
+    if (end == value || *end != '\0' || number < 0) {
+        usage_error("Usage: server authfile [port]\n");
+    }
+    return number;
+}
+
+/*
+ * Function which converts the value given to an option which counts
+ * something, causing a usage error if it is not a whole number within the
+ * given bounds.
+ * Parameters:
+ * value - text given for the option
+ * min - smallest value allowed
+ * max - largest value allowed
+ * Return:
+ * int - value of the option
+ */
+int parse_integer_option(char* value, int min, int max) {
+    char* end;
+    errno = 0;
+    long number = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || errno == ERANGE || number < min ||
+            number > max) {
+        usage_error("Usage: server authfile [port]\n");
+    }
+    return number;
+}
+
+/*
+ * Function which converts the value given to --slow-policy into the policy
+ * it names, causing a usage error if it names no policy.
+ * Parameters:
+ * value - text given for the option
+ * Return:
+ * SlowPolicy - policy named by the option
+ */
+SlowPolicy parse_slow_policy(char* value) {
+    if (strcmp(value, "drop") == 0) {
+        return SLOW_DROP_OLDEST;
+    } else if (strcmp(value, "disconnect") == 0) {
+        return SLOW_DISCONNECT;
+    } else if (strcmp(value, "kick") == 0) {
+        return SLOW_KICK;
+    }
+    usage_error("Usage: server authfile [port]\n");
+    return SLOW_DROP_OLDEST;
+}
+
+/*
+ * Function which converts the value given to --oversize into the policy it
+ * names, causing a usage error if it names no policy.
+ * Parameters:
+ * value - text given for the option
+ * Return:
+ * OversizePolicy - policy named by the option
+ */
+OversizePolicy parse_oversize_policy(char* value) {
+    if (strcmp(value, "reject") == 0) {
+        return OVERSIZE_REJECT;
+    } else if (strcmp(value, "split") == 0) {
+        return OVERSIZE_SPLIT;
+    }
+    usage_error("Usage: server authfile [port]\n");
+    return OVERSIZE_REJECT;
+}
+
+/*
+ * Function which reads the options given before the authfile when running
+ * the server. Any unrecognised option is a usage error. On return optind is
+ * the index of the first non-option argument.
+ * Supported options:
+ * --event-loop - serve every client from a single epoll event loop rather
+ *                than a thread per client.
+ * --io-uring   - serve every client from a single io_uring loop, falling
+ *                back to the epoll event loop if io_uring is unavailable.
+ * --rate N     - handle at most N commands per second from each client.
+ * --burst N    - let a client send up to N commands at once before the rate
+ *                applies (defaults to 1).
+ * --say-rate N, --list-rate N, --kick-rate N - handle at most N SAY:, LIST:
+ *                or KICK: commands per second from each client (up to
+ *                --burst at once), throwing away any more it sends.
+ * --max-connections N - close new connections as soon as they are accepted
+ *                while N are already open (default 0, for no limit).
+ * --accept-rate N - accept at most N new connections per second across the
+ *                whole server, closing any more straight away.
+ * --accept-burst N - let up to N connections be accepted at once before the
+ *                accept rate applies (defaults to the accept rate).
+ * --queue-limit BYTES - most bytes that may wait to be sent to one client.
+ * --slow-policy drop|disconnect|kick - what happens when a client's queue
+ *                is full: its oldest waiting lines are dropped (default), it
+ *                is disconnected, or it is sent KICK:.
+ * --coalesce-bytes BYTES - lines waiting for a client are written straight
+ *                away once this many bytes are waiting.
+ * --coalesce-usec N - lines sent to a client within N microseconds of the
+ *                last write to it are held back and written together (0
+ *                writes every line straight away).
+ * --max-line BYTES - longest line (or binary frame) held whole from a
+ *                client, at least 64 (0 for no limit). Longer commands are
+ *                thrown away as they arrive, except SAY: (see --oversize).
+ * --oversize reject|split - whether a SAY: longer than --max-line is thrown
+ *                away (default) or relayed as it arrives, each piece of up to
+ *                --max-line bytes as a MSG: of its own.
+ * --shards N   - with --event-loop or --io-uring, run N loops each on its
+ *                own thread and listening socket (defaults to the number of
+ *                online CPUs, at most 1024).
+ * --handshake-workers N - without --event-loop or --io-uring, take new
+ *                clients through AUTH: and NAME: on N threads started up
+ *                front (defaults to the number of online CPUs, at most
+ *                1024), giving each client a thread of its own once it has a
+ *                name.
+ * --backlog N  - keep the last N messages sent in each room, and replay them
+ *                to clients joining it (default 0, keeping none, at most
+ *                65536).
+ * --auth-timeout MS - close a client which has not authenticated within MS
+ *                milliseconds of connecting (default 10000, 0 for no limit).
+ * --name-timeout MS - close a client which has not chosen a name within MS
+ *                milliseconds of authenticating (default 30000, 0 for no
+ *                limit).
+ * --idle-timeout MS - a client in the chat which sends no command for MS
+ *                milliseconds leaves it (default 0, for no limit).
+ * --ping-interval MS - send PING: to a client in the chat which has sent no
+ *                command for MS milliseconds, and again every MS
+ *                milliseconds until it does (default 0, sending none).
+ * --write-timeout MS - a client in the chat which has had output waiting
+ *                for MS milliseconds without reading any of it leaves the
+ *                chat (default 0, for no limit).
+ * --log DIR    - write every message sent to an append-only log of segment
+ *                files in DIR, which is created if need be.
+ * --log-segment BYTES - start a new log segment once the current one holds
+ *                BYTES (defaults to 64 MiB).
+ * --log-sync MS - sync logged messages to disk at most every MS
+ *                milliseconds (default 0, syncing each batch as soon as it
+ *                is written).
+ * --handoff PATH - take over the listening sockets and clients of the
+ *                server listening on the Unix socket PATH, if there is one,
+ *                then listen on PATH for a server to take over from this
+ *                one, so the server can be replaced without dropping a
+ *                client.
+ * --metrics ADDRESS - serve the server's statistics, in the Prometheus
+ *                text format, to anything connecting to ADDRESS: a Unix
+ *                socket if it contains a '/', otherwise a port on the
+ *                loopback address.
+ * Parameters:
+ * options - options structure to be filled in
+ * argc - number of arguments given to the server
+ * argv - arguments given to the server
+ */
+void parse_server_options(ServerOptions* options, int argc, char* argv[]) {
+    struct option longOptions[] = {
+        {"event-loop", no_argument, NULL, 'e'},
+        {"io-uring", no_argument, NULL, 'u'},
+        {"rate", required_argument, NULL, 'r'},
+        {"burst", required_argument, NULL, 'b'},
+        {"say-rate", required_argument, NULL, 'S'},
+        {"list-rate", required_argument, NULL, 'L'},
+        {"kick-rate", required_argument, NULL, 'K'},
+        {"max-connections", required_argument, NULL, 'C'},
+        {"accept-rate", required_argument, NULL, 'A'},
+        {"accept-burst", required_argument, NULL, 'B'},
+        {"queue-limit", required_argument, NULL, 'q'},
+        {"slow-policy", required_argument, NULL, 'p'},
+        {"coalesce-bytes", required_argument, NULL, 'c'},
+        {"coalesce-usec", required_argument, NULL, 'd'},
+        {"max-line", required_argument, NULL, 'm'},
+        {"oversize", required_argument, NULL, 'o'},
+        {"shards", required_argument, NULL, 's'},
+        {"handshake-workers", required_argument, NULL, 'w'},
+        {"backlog", required_argument, NULL, 'k'},
+        {"auth-timeout", required_argument, NULL, 'a'},
+        {"name-timeout", required_argument, NULL, 'n'},
+        {"idle-timeout", required_argument, NULL, 'i'},
+        {"ping-interval", required_argument, NULL, 'v'},
+        {"write-timeout", required_argument, NULL, 'x'},
+        {"log", required_argument, NULL, 'l'},
+        {"log-segment", required_argument, NULL, 'g'},
+        {"log-sync", required_argument, NULL, 'y'},
+        {"handoff", required_argument, NULL, 'H'},
+        {"metrics", required_argument, NULL, 'M'},
+        {NULL, 0, NULL, 0}
+    };
+    int option;
+    options->eventLoop = false;
+    options->ioUring = false;
+    options->rate = 0;
+    options->burst = 1;
+    options->sayRate = 0;
+    options->listRate = 0;
+    options->kickRate = 0;
+    options->maxConnections = 0;
+    options->acceptRate = 0;
+    options->acceptBurst = 0;
+    options->queueLimit = DEFAULT_QUEUE_LIMIT;
+    options->coalesceBytes = DEFAULT_COALESCE_BYTES;
+    options->coalesceDelay = DEFAULT_COALESCE_DELAY;
+    options->slowPolicy = SLOW_DROP_OLDEST;
+    options->maxLine = DEFAULT_MAX_LINE;
+    options->oversizePolicy = OVERSIZE_REJECT;
+    options->shards = sysconf(_SC_NPROCESSORS_ONLN);
+    if (options->shards < 1) {
+        options->shards = 1;
+    } else if (options->shards > MAX_SHARDS) {
+        options->shards = MAX_SHARDS;
+    }
+    options->handshakeWorkers = options->shards;
+    options->authTimeout = DEFAULT_AUTH_TIMEOUT * USEC_PER_MSEC;
+    options->nameTimeout = DEFAULT_NAME_TIMEOUT * USEC_PER_MSEC;
+    options->idleTimeout = 0;
+    options->pingInterval = 0;
+    options->writeTimeout = 0;
+    options->backlog = 0;
+    options->logDirectory = NULL;
+    options->logSegment = DEFAULT_LOG_SEGMENT;
+    options->logSync = 0;
+    options->handoffPath = NULL;
+    options->metricsAddress = NULL;
+    opterr = 0;
+    while ((option = getopt_long(argc, argv, "+", longOptions, 
+            NULL)) != -1) {
+        switch (option) {
+            case 'e':
+                options->eventLoop = true;
+                break;
+            case 'u':
+                options->ioUring = true;
+                break;
+            case 'r':
+                options->rate = parse_number_option(optarg);
+                break;
+            case 'b':
+                options->burst = parse_number_option(optarg);
+                break;
+            case 'S':
+                options->sayRate = parse_number_option(optarg);
+                break;
+            case 'L':
+                options->listRate = parse_number_option(optarg);
+                break;
+            case 'K':
+                options->kickRate = parse_number_option(optarg);
+                break;
+            case 'C':
+                options->maxConnections = parse_integer_option(optarg, 0,
+                        INT_MAX);
+                break;
+            case 'A':
+                options->acceptRate = parse_number_option(optarg);
+                break;
+            case 'B':
+                options->acceptBurst = parse_number_option(optarg);
+                break;
+            case 'q':
+                options->queueLimit = parse_number_option(optarg);
+                break;
+            case 'p':
+                options->slowPolicy = parse_slow_policy(optarg);
+                break;
+            case 'c':
+                options->coalesceBytes = parse_number_option(optarg);
+                break;
+            case 'd':
+                options->coalesceDelay = parse_number_option(optarg);
+                break;
+            case 'm':
+                options->maxLine = parse_number_option(optarg);
+                if (options->maxLine > 0 && options->maxLine < MIN_MAX_LINE) {
+                    usage_error("Usage: server authfile [port]\n");
+                }
+                break;
+            case 'o':
+                options->oversizePolicy = parse_oversize_policy(optarg);
+                break;
+            case 's':
+                options->shards = parse_integer_option(optarg, 1,
+                        MAX_SHARDS);
+                break;
+            case 'w':
+                options->handshakeWorkers = parse_integer_option(optarg, 1,
+                        MAX_HANDSHAKE_WORKERS);
+                break;
+            case 'k':
+                options->backlog = parse_integer_option(optarg, 0,
+                        MAX_BACKLOG);
+                break;
+            case 'a':
+                options->authTimeout = parse_number_option(optarg) *
+                        USEC_PER_MSEC;
+                break;
+            case 'n':
+                options->nameTimeout = parse_number_option(optarg) *
+                        USEC_PER_MSEC;
+                break;
+            case 'i':
+                options->idleTimeout = parse_number_option(optarg) *
+                        USEC_PER_MSEC;
+                break;
+            case 'v':
+                options->pingInterval = parse_number_option(optarg) *
+                        USEC_PER_MSEC;
+                break;
+            case 'x':
+                options->writeTimeout = parse_number_option(optarg) *
+                        USEC_PER_MSEC;
+                break;
+            case 'l':
+                options->logDirectory = optarg;
+                break;
+            case 'g':
+                options->logSegment = parse_number_option(optarg);
+                break;
+            case 'y':
+                options->logSync = parse_number_option(optarg) *
+                        USEC_PER_MSEC;
+                break;
+            case 'H':
+                options->handoffPath = optarg;
+                break;
+            case 'M':
+                options->metricsAddress = optarg;
+                break;
+            default:
+                usage_error("Usage: server authfile [port]\n");
+        }
+    }
+    if (options->acceptBurst == 0) {
+        options->acceptBurst = options->acceptRate;
+    }
+}
+
+/*
+ * Function which works out how many sockets the server listens on: one for
+ * each shard when clients are split between loops, otherwise just one. A
+ * server taking over keeps listening on every socket it was handed, as
+ * closing one would drop the connections waiting on it, so it runs at least
+ * as many shards. Only sockets which let others share their port can be
+ * joined by more.
+ * Parameters:
+ * options - options the server was run with, whose shards are increased
+ * if need be
+ * handoff - the server's handoff, NULL if there is none
+ * Return:
+ * int - number of listening sockets
+ */
+int count_listeners(ServerOptions* options, Handoff* handoff) {
+    bool loops = options->eventLoop || options->ioUring;
+    int adopted = handoff == NULL ? 0 : handoff->adoptedListenerCount;
+    int reusePort = 0;
+    socklen_t length = sizeof(int);
+    if (adopted > 0) {
+        getsockopt(handoff->adoptedListeners[0], SOL_SOCKET, SO_REUSEPORT,
+                &reusePort, &length);
+    }
+    if (!loops) {
+        return adopted > 0 ? adopted : 1;
+    }
+    if (adopted > options->shards || (adopted > 0 && !reusePort)) {
+        options->shards = adopted;
+    }
+    return options->shards;
+}
+
+/*
+ * Function which opens the sockets the server listens on. Sockets handed
+ * over by a server this one replaced are used first, and any more listen
+ * on the same port as the first.
+ * Parameters:
+ * port - port to listen on if nothing was handed over
+ * handoff - the server's handoff, NULL if there is none
+ * count - number of listening sockets wanted
+ * reusePort - true if the sockets share their port
+ * Return:
+ * int* - the listening sockets
+ */
+int* open_listeners(const char* port, Handoff* handoff, int count,
+        bool reusePort) {
+    char firstPort[16];
+    int* listeners = malloc(count * sizeof(int));
+    int adopted = handoff == NULL ? 0 : handoff->adoptedListenerCount;
+    for (int i = 0; i < count; i++) {
+        if (i < adopted) {
+            listeners[i] = handoff->adoptedListeners[i];
+        } else if (i == 0) {
+            listeners[i] = open_listen(port, reusePort);
+        } else {
+            snprintf(firstPort, sizeof(firstPort), "%u",
+                    listen_port(listeners[0]));
+            listeners[i] = open_listen(firstPort, true);
+        }
+    }
+    return listeners;
+}
+
+/*
+ * Function which serves the clients of one shard from an event loop until
+ * the server exits.
+ * Parameters:
+ * shardData - shard to be served, and where its clients connect
+ */
+void run_shard(ShardData* shardData) {
+    shard_set_current(shardData->shard->index);
+    if (shardData->clientList->options->ioUring) {
+        // only returns if io_uring cannot be used
+        run_uring_loop(shardData->listenDiscriptor, shardData->serverAuth,
+                shardData->clientList, shardData->shard);
+    }
+    run_event_loop(shardData->listenDiscriptor, shardData->serverAuth,
+            shardData->clientList, shardData->shard);
+}
+
+/*
+ * Thread function which serves the clients of a shard other than the first.
+ * Parameters:
+ * data - ShardData of the shard to be served
+ */
+void* shard_thread(void* data) {
+    run_shard(data);
+    return NULL;
+}
+
+/*
+ * Function which starts a loop for every shard, each on its own thread with
+ * its own socket listening on the same port, so the kernel spreads new
+ * connections between the loops. The first shard is served by the calling
+ * thread, so the function only returns when the server exits.
+ * Parameters:
+ * listeners - sockets the shards listen on, one each
+ * serverAuth - string of authentication key for server
+ * clientList - list of clients connected to the server
+ */
+void run_shards(int* listeners, char* serverAuth, ClientList* clientList) {
+    pthread_t thread;
+    ShardData* shardData = calloc(clientList->shardCount, sizeof(ShardData));
+    for (int i = 0; i < clientList->shardCount; i++) {
+        shardData[i].listenDiscriptor = listeners[i];
+        shardData[i].serverAuth = serverAuth;
+        shardData[i].clientList = clientList;
+        shardData[i].shard = &(clientList->shards[i]);
+    }
+    for (int i = 1; i < clientList->shardCount; i++) {
+        pthread_create(&thread, NULL, shard_thread, &shardData[i]);
+        pthread_detach(thread);
+    }
+    run_shard(&shardData[0]);
+}
+
 int main(int argc, char* argv[]) {
     signal(SIGPIPE, SIG_IGN); //ignore SIGPIPE
     
-    int serverDiscriptor;
     pthread_t thread;
     sigset_t set;
 
-    ClientList* clientList = create_client_list();
+    ServerOptions options;
+    parse_server_options(&options, argc, argv);
     
-    // creating statstics thread
-    sigemptyset(&set);
-    sigaddset(&set, SIGHUP);
-    pthread_sigmask(SIG_BLOCK, &set, NULL);
-    StatisticsData* statisticsData = create_statistics_data(&set, clientList);
-    pthread_create(&thread, NULL, &statistics_thread, statisticsData);
-    
-    if (argc != 2 && argc != 3) {
+    int arguments = argc - optind;
+    if (arguments != 1 && arguments != 2) {
         usage_error("Usage: server authfile [port]\n");
     }
     
     // opening authfile
-    int authfileDiscriptor = open(argv[1], O_RDONLY);
+    int authfileDiscriptor = open(argv[optind], O_RDONLY);
     FILE* authfile = fdopen(authfileDiscriptor, "r");
     check_file(authfile, "Usage: server authfile [port]\n");
     char* serverAuth = read_file_line(authfile);
+    const char* port = set_port_number(argv[optind + 1], arguments);
+
+    // blocking the statistics signals before any thread is started, so only
+    // the statistics thread recieves them
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    // taking over from the server being replaced, if there is one, once
+    // nothing else can stop this one starting
+    Handoff* handoff = NULL;
+    if (options.handoffPath != NULL) {
+        handoff = handoff_open(options.handoffPath);
+        if (handoff == NULL) {
+            usage_error("Usage: server authfile [port]\n");
+        }
+    }
+    bool loops = options.eventLoop || options.ioUring;
+    int listenerCount = count_listeners(&options, handoff);
+    ClientList* clientList = create_client_list(&options);
+    clientList->handoff = handoff;
     
-    const char* port = set_port_number(argv[2], argc);
-    serverDiscriptor = open_listen(port);
-    process_connections(serverDiscriptor, serverAuth, clientList);
+    // creating statstics thread
+    StatisticsData* statisticsData = create_statistics_data(&set, clientList);
+    pthread_create(&thread, NULL, &statistics_thread, statisticsData);
+    if (options.metricsAddress != NULL &&
+            !metrics_start(options.metricsAddress, clientList)) {
+        communications_error();
+    }
+    
+    int* listeners = open_listeners(port, handoff, listenerCount, loops);
+    //print listening socket
+    fprintf(stderr, "%u\n", listen_port(listeners[0]));
+    if (handoff != NULL) {
+        handoff_start(handoff, clientList, listeners, listenerCount,
+                loops ? clientList->shardCount : options.handshakeWorkers);
+    }
+    if (loops) {
+        run_shards(listeners, serverAuth, clientList);
+    } else {
+        run_handshake_pool(listeners, listenerCount, serverAuth, clientList);
+    }
     exit(NORMAL_EXIT);
 }
 
@@ -735,13 +2031,13 @@ int main(int argc, char* argv[]) {
  * the use of a empherical port.
  * Paramters:
  * portInput - port number inputed by user when server run
- * argc - number of arguments inputed by user.
+ * argc - number of non-option arguments inputed by user.
  * Return:
  * char* - port number which should be used to generate connections with
  * client.
  */
 char* set_port_number(char* portInput, int argc) {
-    if (argc == 3) {
+    if (argc == 2) {
         return portInput;
     } else {
         return "0";
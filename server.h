@@ -0,0 +1,240 @@
+#ifndef _SERVER_H
+#define _SERVER_H
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "ratelimit.h"
+#include "outqueue.h"
+#include "linebuf.h"
+#include "roster.h"
+#include "frame.h"
+#include "protocol.h"
+#include "shard.h"
+#include "backlog.h"
+#include "chatlog.h"
+#include "handoff.h"
+
+struct Room;
+
+/*
+ * Data structure which stores information about a client which has connected
+ * to the server.
+ */
+typedef struct Client {
+    char* name;
+    // name with any unwriteable characters converted, as used in MSG:
+    char* readableName;
+    OutQueue* to;
+    // room the client is talking in, only changed by the thread serving the
+    // client while it holds the client list mutex
+    struct Room* room;
+    // counts of command sent by clients, only changed by the thread serving
+    // the client but read atomically by the statistics thread
+    int say;
+    int kick;
+    int list;
+    // limits how quickly the client's commands are handled, and how many
+    // of each costly command it may send before the rest are thrown away
+    TokenBucket commands;
+    TokenBucket sayLimit;
+    TokenBucket listLimit;
+    TokenBucket kickLimit;
+    // set while the pieces of an oversized SAY: are being thrown away
+    // because its first piece went over the limit
+    bool sayRejected;
+    // shard whose loop serves the client, which is the only thread that
+    // writes to it (always 0 when every client has a thread of its own)
+    int shard;
+    // time the client last sent a command and was last sent PING:
+    long long lastCommandAt;
+    long long pingedAt;
+    // when the client's queue is next checked for having stalled, and its
+    // progress and whether it had bytes waiting at the last check
+    long long writeCheckAt;
+    unsigned long written;
+    bool writePending;
+} Client;
+
+/*
+ * What to do with a SAY: longer than the longest line the server will hold.
+ */
+typedef enum {
+    OVERSIZE_REJECT,
+    OVERSIZE_SPLIT
+} OversizePolicy;
+
+/*
+ * Stores the command line options which change how the server runs.
+ */
+typedef struct {
+    bool eventLoop;
+    bool ioUring;
+    // commands per second each client may send (0 for no limit)
+    double rate;
+    double burst;
+    // SAY:, LIST: and KICK: commands per second each client may send before
+    // any more are thrown away (0 for no limit), up to burst at once
+    double sayRate;
+    double listRate;
+    double kickRate;
+    // most connections open at once (0 for no limit), and new connections
+    // per second accepted by the whole server (0 for no limit), up to
+    // acceptBurst at once
+    int maxConnections;
+    double acceptRate;
+    double acceptBurst;
+    // bytes which may wait to be sent to a client, and what happens to a
+    // client which lets that fill up
+    size_t queueLimit;
+    SlowPolicy slowPolicy;
+    // bytes which are written to a client straight away once waiting, and
+    // how many microseconds other lines may be held back to be written
+    // together (0 to write every line straight away)
+    size_t coalesceBytes;
+    long long coalesceDelay;
+    // longest line or binary frame held whole from a client (0 for no
+    // limit), and whether longer messages are thrown away or relayed in
+    // pieces as they arrive
+    size_t maxLine;
+    OversizePolicy oversizePolicy;
+    // loops clients are split between by the event loop and io_uring modes
+    int shards;
+    // threads taking new clients through AUTH: and NAME: in the threaded
+    // mode, and the microseconds a client has for each (0 for no limit)
+    int handshakeWorkers;
+    long long authTimeout;
+    long long nameTimeout;
+    // microseconds a client in the chat may go without sending a command,
+    // may go without sending one before being sent PING:, and may leave
+    // output waiting without any of it being written (0 for no limit)
+    long long idleTimeout;
+    long long pingInterval;
+    long long writeTimeout;
+    // messages kept in each room to be replayed to clients joining it
+    int backlog;
+    // Unix socket a server replacing this one connects to in order to take
+    // over its clients (NULL if the server is never replaced)
+    char* handoffPath;
+    // Unix socket path, or loopback port, metrics are served on to anything
+    // scraping them (NULL to serve none)
+    char* metricsAddress;
+    // directory every message is logged to (NULL to keep no log), bytes
+    // after which the log starts a new segment, and microseconds logged
+    // messages may wait to be synced to disk (0 syncs each batch written)
+    char* logDirectory;
+    size_t logSegment;
+    long long logSync;
+} ServerOptions;
+
+/*
+ * The members of a room at one moment, grouped by the shard serving them
+ * so that each shard finds its own members without looking at any other
+ * shard's. It is never changed once published.
+ */
+typedef struct {
+    int count;
+    // members served by shard s are members[start[s]] up to (but not
+    // including) members[start[s + 1]]
+    int* start;
+    Client** members;
+} RoomMembers;
+
+/*
+ * Stores information about a room, which only the clients talking in it hear.
+ * Its members are kept in a roster ordered by name, and every change
+ * publishes a new snapshot of the members and a new LIST: line, which
+ * readers use from inside an epoch without locking. The room index holds a
+ * reference to the room, as does every broadcast waiting in another shard's
+ * inbox. The room's most recent messages are kept to be replayed to clients
+ * joining it.
+ */
+typedef struct Room {
+    char* name;
+    Roster members;
+    RoomMembers* snapshot;
+    Frame* listFrame;
+    int references;
+    Backlog backlog;
+} Room;
+
+/*
+ * Stores informaiton about the clients connected to the server, which are
+ * kept in a roster indexed and ordered by name, and the rooms they talk in,
+ * indexed by room name. Every client starts in the default room, and other
+ * rooms exist while they have members. Only clients entering, leaving and
+ * moving between rooms take the mutex. Every change publishes a new snapshot
+ * of the clients, which readers use from inside an epoch without locking.
+ */
+typedef struct ClientList {
+    Roster clients;
+    Roster rooms;
+    Room* defaultRoom;
+    pthread_mutex_t mutex;
+    RosterSnapshot* snapshot;
+    const ServerOptions* options;
+    // loops the clients are split between (just one when every client has a
+    // thread of its own, which is never posted to)
+    Shard* shards;
+    int shardCount;
+    // log every message is written to, NULL if there is none
+    ChatLog* log;
+    // connections open in any stage, changed atomically by the threads
+    // accepting and closing them, and the limit on how quickly they are
+    // accepted, shared by those threads under its own mutex
+    int connections;
+    TokenBucket accepts;
+    pthread_mutex_t acceptMutex;
+    // how the clients are handed to a server replacing this one, NULL if
+    // the server is never replaced
+    Handoff* handoff;
+} ClientList;
+
+bool admit_connection(ClientList* clientList);
+
+void connection_closed(ClientList* clientList);
+
+long long accept_backoff(int error);
+
+int queue_depths(ClientList* clientList, size_t* queued, size_t* deepest);
+
+void client_enter(ClientList* clientList, char* name);
+
+void client_left(ClientList* clientList, Client* client);
+
+Client* adopt_client(ClientList* clientList, HandoffConnection* handed,
+        OutQueue* to);
+
+Client* accept_client_name(ClientList* clientList, OutQueue* toClient,
+        char* name, size_t length);
+
+long long check_client_deadlines(ClientList* clientList, Client* client,
+        long long now);
+
+bool process_client_command(ClientList* clientList, Client* client,
+        Command* command);
+
+void send_to_client(OutQueue* toClient, CommandType command);
+
+void switch_to_binary(OutQueue* toClient);
+
+void wake_client_thread(OutQueue* queue, bool writable);
+
+void schedule_client_flush(OutQueue* queue, long long flushAt);
+
+bool client_chatting(ClientList* clientList, Client* client,
+        OutQueue* toClient, LineBuffer* fromClient, bool binary);
+
+void close_client_connection(LineBuffer* from, OutQueue* to);
+
+void deliver_shard_messages(ClientList* clientList, Shard* shard);
+
+void run_event_loop(int listenDiscriptor, char* serverAuth,
+        ClientList* clientList, Shard* shard);
+
+void run_uring_loop(int listenDiscriptor, char* serverAuth,
+        ClientList* clientList, Shard* shard);
+
+void run_handshake_pool(int* listeners, int listenerCount, char* serverAuth,
+        ClientList* clientList);
+
+#endif
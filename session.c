@@ -0,0 +1,346 @@
+#include <stdlib.h>
+#include <string.h>
+#include "shared.h"
+#include "session.h"
+#include "stats.h"
+#define READ_CHUNK 4096
+
+/*
+ * Function which sets up the protocol state of a client in the given stage,
+ * with nothing recieved from it or waiting to be sent to it.
+ * Parameters:
+ * session - session to set up
+ * state - stage of the protocol the client is in
+ * fd - socket connected to the client
+ * clientList - list of clients connected to the server
+ * serverAuth - the auth string provided to the server
+ * deferred - true if the owner writes the output queue to the socket itself
+ * notify - function telling the owner whether to wait for writability
+ * schedule - function telling the owner when to flush held back output
+ * owner - data for the notify and schedule functions
+ */
+static void session_init(Session* session, SessionState state, int fd,
+        ClientList* clientList, char* serverAuth, bool deferred,
+        void (*notify)(OutQueue*, bool),
+        void (*schedule)(OutQueue*, long long), void* owner) {
+    const ServerOptions* options = clientList->options;
+    session->state = state;
+    session->client = NULL;
+    session->clientList = clientList;
+    session->serverAuth = serverAuth;
+    session->binaryWanted = false;
+    session->binary = false;
+    session->closing = false;
+    session->moreLines = false;
+    session->openedAt = now_usec();
+    session->stageAt = session->openedAt;
+    line_buffer_init(&session->input, fd, READ_CHUNK);
+    line_buffer_set_limit(&session->input, options->maxLine);
+    out_queue_init(&session->output, fd, options->queueLimit,
+            options->slowPolicy, notify, owner);
+    out_queue_set_coalescing(&session->output, options->coalesceBytes,
+            options->coalesceDelay, schedule);
+    if (deferred) {
+        out_queue_set_deferred(&session->output);
+    }
+}
+
+/*
+ * Function which sets up the protocol state of a newly accepted client and
+ * sends it the AUTH: prompt. The owner must be ready for the notify function
+ * to be called.
+ * Parameters:
+ * session - session to set up
+ * fd - non-blocking socket connected to the client
+ * clientList - list of clients connected to the server
+ * serverAuth - the auth string provided to the server
+ * deferred - true if the owner writes the output queue to the socket itself
+ * notify - function telling the owner whether to wait for writability
+ * schedule - function telling the owner when to flush held back output
+ * owner - data for the notify and schedule functions
+ */
+void session_open(Session* session, int fd, ClientList* clientList,
+        char* serverAuth, bool deferred, void (*notify)(OutQueue*, bool),
+        void (*schedule)(OutQueue*, long long), void* owner) {
+    session_init(session, STATE_AUTH, fd, clientList, serverAuth, deferred,
+            notify, schedule, owner);
+    send_to_client(&session->output, COMMAND_AUTH);
+}
+
+/*
+ * Function which sets up the protocol state of a client handed over by the
+ * server this one replaced, exactly as that server left it. A client in the
+ * chat is put back in its room without anyone being told. The session is
+ * closing if the client could not be put back. Anything recieved from the
+ * client but not yet handled is left for the owner to handle. The
+ * connection counts as admitted, whatever the server's limits, and must be
+ * given back with connection_closed() like any other.
+ * Parameters:
+ * session - session to set up
+ * handed - what the old server knew about the client
+ * clientList - list of clients connected to the server
+ * serverAuth - the auth string provided to the server
+ * deferred - true if the owner writes the output queue to the socket itself
+ * notify - function telling the owner whether to wait for writability
+ * schedule - function telling the owner when to flush held back output
+ * owner - data for the notify and schedule functions
+ */
+void session_adopt(Session* session, HandoffConnection* handed,
+        ClientList* clientList, char* serverAuth, bool deferred,
+        void (*notify)(OutQueue*, bool),
+        void (*schedule)(OutQueue*, long long), void* owner) {
+    session_init(session, handed->state, handed->fd, clientList, serverAuth,
+            deferred, notify, schedule, owner);
+    __atomic_add_fetch(&(clientList->connections), 1, __ATOMIC_RELAXED);
+    session->binaryWanted = handed->binaryWanted;
+    session->binary = handed->binary;
+    LineBuffer* input = &session->input;
+    line_buffer_append(input, handed->input, handed->inputLength);
+    input->piece = handed->piece;
+    input->remaining = handed->remaining;
+    input->discarding = handed->discarding;
+    if (session->binary) {
+        out_queue_set_binary(&session->output);
+    }
+    if (handed->outputLength > 0) {
+        // the old server's output goes out first, exactly as it was queued
+        Frame* frame = frame_create(handed->outputLength);
+        memcpy(frame->data, handed->output, handed->outputLength);
+        frame->urgent = true;
+        out_queue_push(&session->output, frame);
+        frame_release(frame);
+    }
+    if (session->state == STATE_CHAT) {
+        session->client = adopt_client(clientList, handed,
+                &session->output);
+        session->closing = session->client == NULL;
+    }
+}
+
+/*
+ * Function which records everything about a session that the server taking
+ * over its client needs to carry on exactly where this one stopped. The
+ * owner must not be reading from or writing to the socket.
+ * Parameters:
+ * session - session to record
+ * saved - filled in with the session's state (freed with
+ * handoff_connection_free())
+ */
+void session_save(Session* session, HandoffConnection* saved) {
+    LineBuffer* input = &session->input;
+    memset(saved, 0, sizeof(HandoffConnection));
+    saved->fd = input->fd;
+    saved->state = session->state;
+    saved->binaryWanted = session->binaryWanted;
+    saved->binary = session->binary;
+    if (session->state == STATE_CHAT) {
+        Client* client = session->client;
+        saved->name = strdup(client->name);
+        saved->room = strdup(client->room->name);
+        saved->say = client->say;
+        saved->kick = client->kick;
+        saved->list = client->list;
+        saved->sayRejected = client->sayRejected;
+    }
+    saved->inputLength = input->length;
+    saved->input = malloc(input->length + 1);
+    line_buffer_peek(input, saved->input, input->length);
+    saved->piece = input->piece;
+    saved->remaining = input->remaining;
+    saved->discarding = input->discarding;
+    saved->output = out_queue_copy(&session->output, &saved->outputLength);
+}
+
+/*
+ * Function which handles the AUTH: response from a connecting client. The
+ * connection is closed if the auth string does not match the server's. A
+ * client which sent BINARY: first is told OK:BINARY instead of OK:, and
+ * everything after that line is binary frames in both directions.
+ * Parameters:
+ * session - session the command was recieved on
+ * command - command recieved from the client
+ */
+static void handle_auth(Session* session, Command* command) {
+    if (command->type == COMMAND_BINARY) {
+        session->binaryWanted = true;
+        return;
+    }
+    if (command->type != COMMAND_AUTH) {
+        return;
+    }
+    stats_add(STAT_AUTH, 1);
+    // a binary payload may hold a null, so the lengths have to match too
+    size_t length = strlen(session->serverAuth);
+    if (command->length != length ||
+            memcmp(session->serverAuth, command->argument, length) != 0) {
+        session->closing = true;
+        return;
+    }
+    if (session->binaryWanted) {
+        switch_to_binary(&session->output);
+        session->binary = true;
+    } else {
+        send_to_client(&session->output, COMMAND_OK);
+    }
+    send_to_client(&session->output, COMMAND_WHO);
+    session->state = STATE_NAME;
+    session->stageAt = now_usec();
+}
+
+/*
+ * Function which handles a NAME: response from a client during name
+ * negotiation. Once a name is accepted the client joins the chat.
+ * Parameters:
+ * session - session the command was recieved on
+ * command - command recieved from the client
+ */
+static void handle_name(Session* session, Command* command) {
+    if (command->type != COMMAND_NAME) {
+        return;
+    }
+    session->client = accept_client_name(session->clientList,
+            &session->output, command->argument, command->length);
+    if (session->client == NULL) {
+        send_to_client(&session->output, COMMAND_WHO);
+        return;
+    }
+    session->state = STATE_CHAT;
+    stats_record(TIMING_HANDSHAKE, now_usec() - session->openedAt);
+    client_enter(session->clientList, session->client->name);
+}
+
+/*
+ * Function which passes a complete command recieved from a client to the
+ * handler for the stage of the protocol the session is in.
+ * Parameters:
+ * session - session the command was recieved on
+ * command - command recieved from the client
+ */
+static void handle_command(Session* session, Command* command) {
+    switch (session->state) {
+        case STATE_AUTH:
+            handle_auth(session, command);
+            break;
+        case STATE_NAME:
+            handle_name(session, command);
+            break;
+        case STATE_CHAT:
+            session->closing = !process_client_command(session->clientList,
+                    session->client, command);
+            break;
+    }
+}
+
+/*
+ * Function which handles a client which has disconnected, throwing away
+ * anything it sent which has not been handled. If the client had joined the
+ * chat every other client is told it has left.
+ * Parameters:
+ * session - session whose client has disconnected
+ */
+void session_lost(Session* session) {
+    if (session->state == STATE_CHAT) {
+        client_left(session->clientList, session->client);
+    }
+    session->closing = true;
+}
+
+/*
+ * Function which handles the complete commands recieved from a client,
+ * stopping early if the client leaves, is held back by the rate policy or
+ * the given number of commands have been handled. If the input has been
+ * closed once every command is handled the client leaves.
+ * Parameters:
+ * session - session to handle commands from
+ * maxLines - most commands to handle, 0 for no limit. If the limit is
+ * reached the session's moreLines flag is set.
+ * Return:
+ * long long - time in microseconds at which the owner should handle the
+ * remaining commands if the client is being held back, 0 otherwise.
+ */
+long long session_handle_lines(Session* session, int maxLines) {
+    Command command;
+    long long delay;
+    int handled = 0;
+    session->moreLines = false;
+    while (!session->closing) {
+        if (maxLines > 0 && handled == maxLines) {
+            session->moreLines = true;
+            return 0;
+        }
+        if (session->state == STATE_CHAT) {
+            // only a command which has arrived is held back
+            if (!protocol_command_waiting(&session->input, session->binary)) {
+                break;
+            }
+            TokenBucket* commands = &session->client->commands;
+            long long now = now_usec();
+            if ((delay = token_bucket_delay(commands, now)) > 0) {
+                stats_add(STAT_THROTTLED, 1);
+                return now + delay;
+            }
+        }
+        if (!protocol_next_command(&session->input, session->binary,
+                &command)) {
+            break;
+        }
+        if (session->state == STATE_CHAT) {
+            token_bucket_take(&session->client->commands);
+        }
+        handle_command(session, &command);
+        handled++;
+    }
+    if (!session->closing && session->input.closed) {
+        session_lost(session);
+    }
+    return 0;
+}
+
+/*
+ * Function which keeps a session's deadlines, and is called by the loop
+ * serving it whenever the earliest of them may have passed. A client which
+ * has not finished its stage of the handshake in time is closed, and one in
+ * the chat which misses a deadline leaves it as if it had disconnected.
+ * Parameters:
+ * session - session whose deadlines are to be kept
+ * now - current time in microseconds
+ * Return:
+ * long long - time in microseconds of the session's next deadline, 0 if it
+ * has none (including once it is closing).
+ */
+long long session_check_deadlines(Session* session, long long now) {
+    const ServerOptions* options = session->clientList->options;
+    if (session->state == STATE_CHAT) {
+        long long deadline = check_client_deadlines(session->clientList,
+                session->client, now);
+        if (deadline < 0) {
+            session_lost(session);
+            return 0;
+        }
+        return deadline;
+    }
+    bool authenticating = session->state == STATE_AUTH;
+    long long timeout = authenticating ? options->authTimeout :
+            options->nameTimeout;
+    if (timeout == 0) {
+        return 0;
+    }
+    if (now >= session->stageAt + timeout) {
+        stats_add(authenticating ? STAT_AUTH_TIMEOUT : STAT_NAME_TIMEOUT, 1);
+        session->closing = true;
+        return 0;
+    }
+    return session->stageAt + timeout;
+}
+
+/*
+ * Function which frees a session's input once its connection has closed.
+ * The output queue may still be in use by threads broadcasting from an
+ * older snapshot of the client list, so the owner destroys it once that can
+ * no longer happen.
+ * Parameters:
+ * session - session to close
+ */
+void session_close(Session* session) {
+    line_buffer_free(&session->input);
+}
@@ -0,0 +1,66 @@
+#ifndef _SESSION_H
+#define _SESSION_H
+#include <stdbool.h>
+#include "server.h"
+#include "linebuf.h"
+#include "outqueue.h"
+#include "protocol.h"
+#include "handoff.h"
+
+/*
+ * The stage of the protocol that a connection is currently in.
+ */
+typedef enum {
+    STATE_AUTH,
+    STATE_NAME,
+    STATE_CHAT
+} SessionState;
+
+/*
+ * Data structure which stores the protocol state of a single client served
+ * by one of the non-blocking loops (epoll or io_uring). The loop moves bytes
+ * into input and out of output, and the session turns complete lines (or
+ * binary frames) into commands, so the protocol seen by clients is the same
+ * whichever loop serves them.
+ */
+typedef struct {
+    SessionState state;
+    Client* client;
+    ClientList* clientList;
+    char* serverAuth;
+    LineBuffer input;
+    OutQueue output;
+    // set if the client asked for binary framing before authenticating, and
+    // once it has been switched to it
+    bool binaryWanted;
+    bool binary;
+    // set once the connection should be closed
+    bool closing;
+    // set if session_handle_lines() stopped at its limit, so there may be
+    // more complete commands waiting
+    bool moreLines;
+    // time the connection was accepted, and the stage it is in was entered
+    long long openedAt;
+    long long stageAt;
+} Session;
+
+void session_open(Session* session, int fd, ClientList* clientList,
+        char* serverAuth, bool deferred, void (*notify)(OutQueue*, bool),
+        void (*schedule)(OutQueue*, long long), void* owner);
+
+void session_adopt(Session* session, HandoffConnection* handed,
+        ClientList* clientList, char* serverAuth, bool deferred,
+        void (*notify)(OutQueue*, bool),
+        void (*schedule)(OutQueue*, long long), void* owner);
+
+void session_save(Session* session, HandoffConnection* saved);
+
+long long session_handle_lines(Session* session, int maxLines);
+
+long long session_check_deadlines(Session* session, long long now);
+
+void session_lost(Session* session);
+
+void session_close(Session* session);
+
+#endif
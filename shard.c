@@ -0,0 +1,86 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "shard.h"
+
+// shard served by the calling thread, -1 if it does not serve one
+static __thread int currentShard = -1;
+
+/*
+ * Function which sets up a shard with an empty inbox.
+ * Parameters:
+ * shard - shard to set up
+ * index - position of the shard among all the shards
+ */
+void shard_init(Shard* shard, int index) {
+    shard->index = index;
+    shard->wakeDiscriptor = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    shard->inbox = NULL;
+}
+
+/*
+ * Function which posts a message to a shard's inbox from any thread. The
+ * shard is only woken if its inbox was empty, as otherwise a wake up is
+ * already on its way.
+ * Parameters:
+ * shard - shard to post to
+ * message - message to post, owned by the shard until it is taken
+ */
+void shard_post(Shard* shard, ShardMessage* message) {
+    uint64_t wake = 1;
+    ShardMessage* head = __atomic_load_n(&shard->inbox, __ATOMIC_RELAXED);
+    do {
+        message->next = head;
+    } while (!__atomic_compare_exchange_n(&shard->inbox, &head, message,
+            true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (head == NULL) {
+        write(shard->wakeDiscriptor, &wake, sizeof(wake));
+    }
+}
+
+/*
+ * Function which empties a shard's inbox, clearing its wake up first so a
+ * message posted meanwhile wakes it again. Only the thread serving the
+ * shard may call it.
+ * Parameters:
+ * shard - shard whose inbox is to be emptied
+ * Return:
+ * ShardMessage* - the messages, linked by next in the order they were
+ * posted, or NULL if there were none
+ */
+ShardMessage* shard_take(Shard* shard) {
+    uint64_t wakes;
+    read(shard->wakeDiscriptor, &wakes, sizeof(wakes));
+    ShardMessage* message = __atomic_exchange_n(&shard->inbox, NULL,
+            __ATOMIC_ACQUIRE);
+    // the inbox is a stack, so turn it around
+    ShardMessage* ordered = NULL;
+    while (message != NULL) {
+        ShardMessage* next = message->next;
+        message->next = ordered;
+        ordered = message;
+        message = next;
+    }
+    return ordered;
+}
+
+/*
+ * Function which records the shard the calling thread serves.
+ * Parameters:
+ * index - shard served
+ */
+void shard_set_current(int index) {
+    currentShard = index;
+}
+
+/*
+ * Function which returns the shard the calling thread serves.
+ * Return:
+ * int - index of the shard, -1 if the thread does not serve one (as when
+ * every client has a thread of its own)
+ */
+int shard_current(void) {
+    return currentShard;
+}
@@ -0,0 +1,36 @@
+#ifndef _SHARD_H
+#define _SHARD_H
+
+/*
+ * A message posted from one shard to another. Messages are embedded at the
+ * start of whatever structure carries their contents.
+ */
+typedef struct ShardMessage {
+    struct ShardMessage* next;
+} ShardMessage;
+
+/*
+ * One of the loops serving clients when they are split between several
+ * loops, each on its own thread. Every client is only ever written to by
+ * the loop serving it, so other loops post what they want sent to it to the
+ * loop's inbox. The inbox is a lock-free stack which any number of threads
+ * push to and only the loop itself empties, and an eventfd wakes the loop
+ * when a message is posted to an empty inbox.
+ */
+typedef struct {
+    int index;
+    int wakeDiscriptor;
+    ShardMessage* inbox;
+} Shard;
+
+void shard_init(Shard* shard, int index);
+
+void shard_post(Shard* shard, ShardMessage* message);
+
+ShardMessage* shard_take(Shard* shard);
+
+void shard_set_current(int index);
+
+int shard_current(void);
+
+#endif
@@ -1,3 +1,6 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -7,6 +10,7 @@
 #include <stdbool.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <time.h>
 #include "shared.h"
 #define USAGE_ERROR_EXIT 1
 #define COMMS_ERROR 2
@@ -54,14 +58,53 @@ char* read_file_line(FILE* file) {
     char* buffer = malloc(bufferSize * sizeof(char));
     int c;
     while ((c = fgetc(file)) != '\n' && !feof(file)) {
-        fflush(stdout);
         buffer[position] = c;
         if (++position == bufferSize) {
             buffer = realloc(buffer, (bufferSize *= 2) * sizeof(char));
         }
     }
-    fflush(stdout);
     buffer = realloc(buffer, (position + 1) * sizeof(char));
     buffer[position] = '\0';
     return buffer;
 }
+
+/*
+ * Function which attempts to connect the client to the server given to port
+ * Paramters:
+ * port - port given to client to attempt to connect to the server
+ *
+ * (code addpated from CSSE2310 lecture code)
+ */
+int connect_socket(const char* port) {
+    struct addrinfo* addressInfo = 0;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;          
+    hints.ai_socktype = SOCK_STREAM;
+    int error;
+
+    if ((error = getaddrinfo("localhost", port, &hints, &addressInfo))) {
+        freeaddrinfo(addressInfo);
+        communications_error();
+    }
+
+    int connectionDiscriptor = socket(AF_INET, SOCK_STREAM, 0); 
+    if (connect(connectionDiscriptor, (struct sockaddr*)addressInfo->ai_addr, 
+            sizeof(struct sockaddr))) {
+        communications_error();
+    }
+    freeaddrinfo(addressInfo);
+    return connectionDiscriptor;
+}
+
+/*
+ * Function which returns the current time from a monotonic clock, for
+ * measuring intervals.
+ * Return:
+ * long long - current time in microseconds.
+ */
+long long now_usec() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
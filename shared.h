@@ -10,4 +10,8 @@ void usage_error(char* errorMessage);
 
 void communications_error();
 
+int connect_socket(const char* port);
+
+long long now_usec();
+
 #endif
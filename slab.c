@@ -0,0 +1,220 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include "slab.h"
+#include "stats.h"
+// more slabs than the program ever sets up
+#define MAX_SLABS 32
+// objects moved between a thread's cache and a slab's shared list at once
+#define SLAB_BATCH 32
+#define SLAB_ALIGN 16
+#define SLAB_BLOCK (64 * 1024)
+
+/*
+ * Free objects of one slab kept by a single thread.
+ */
+typedef struct {
+    SlabObject* head;
+    int count;
+} SlabCache;
+
+static Slab* slabs[MAX_SLABS];
+static int slabCount = 0;
+static pthread_mutex_t slabsMutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t reserved = 0;
+static pthread_key_t cacheKey;
+static pthread_once_t cacheKeyOnce = PTHREAD_ONCE_INIT;
+static __thread SlabCache caches[MAX_SLABS];
+static __thread bool cachesRegistered = false;
+
+/*
+ * Function which moves objects from the front of a thread's cache to a
+ * slab's shared list, where any thread can take them.
+ * Parameters:
+ * slab - slab the objects belong to
+ * cache - cache to take the objects from
+ * count - number of objects to move (no more than the cache holds)
+ */
+static void give_back(Slab* slab, SlabCache* cache, int count) {
+    SlabObject* first = cache->head;
+    SlabObject* last = first;
+    for (int i = 1; i < count; i++) {
+        last = last->next;
+    }
+    cache->head = last->next;
+    cache->count -= count;
+    pthread_mutex_lock(&slab->mutex);
+    last->next = slab->shared;
+    slab->shared = first;
+    slab->sharedCount += count;
+    pthread_mutex_unlock(&slab->mutex);
+    stats_add(STAT_SLAB_SHARED, 1);
+}
+
+/*
+ * Function which gives every object cached by a thread back to its slab
+ * when the thread exits, so they are not lost with the thread.
+ * Parameters:
+ * data - caches of the thread which exited
+ */
+static void release_caches(void* data) {
+    SlabCache* threadCaches = data;
+    int count = __atomic_load_n(&slabCount, __ATOMIC_ACQUIRE);
+    for (int id = 0; id < count; id++) {
+        if (threadCaches[id].count > 0) {
+            give_back(slabs[id], &threadCaches[id], threadCaches[id].count);
+        }
+    }
+    // anything freed by later destructors registers the caches again
+    cachesRegistered = false;
+}
+
+/*
+ * Function which creates the key used to release a thread's caches when the
+ * thread exits.
+ */
+static void create_cache_key(void) {
+    pthread_key_create(&cacheKey, release_caches);
+}
+
+/*
+ * Function which returns the index of a slab's cache in every thread,
+ * giving the slab one the first time it is used.
+ * Parameters:
+ * slab - slab wanted
+ * Return:
+ * int - index of the slab's cache
+ */
+static int slab_id(Slab* slab) {
+    int id = __atomic_load_n(&slab->id, __ATOMIC_ACQUIRE);
+    if (id >= 0) {
+        return id;
+    }
+    pthread_mutex_lock(&slabsMutex);
+    if (slab->id < 0) {
+        if (slabCount == MAX_SLABS) {
+            abort();
+        }
+        slabs[slabCount] = slab;
+        __atomic_store_n(&slab->id, slabCount, __ATOMIC_RELEASE);
+        __atomic_store_n(&slabCount, slabCount + 1, __ATOMIC_RELEASE);
+    }
+    id = slab->id;
+    pthread_mutex_unlock(&slabsMutex);
+    return id;
+}
+
+/*
+ * Function which returns the calling thread's cache for a slab, arranging
+ * for the thread's caches to be given back when it exits the first time it
+ * uses any of them.
+ * Parameters:
+ * slab - slab wanted
+ * Return:
+ * SlabCache* - the calling thread's cache for the slab
+ */
+static SlabCache* thread_cache(Slab* slab) {
+    if (!cachesRegistered) {
+        pthread_once(&cacheKeyOnce, create_cache_key);
+        pthread_setspecific(cacheKey, caches);
+        cachesRegistered = true;
+    }
+    return &caches[slab_id(slab)];
+}
+
+/*
+ * Function which carves a new block into objects and adds them to a slab's
+ * shared list. The slab's mutex must be held.
+ * Parameters:
+ * slab - slab to add objects to
+ */
+static void carve_block(Slab* slab) {
+    size_t stride = (slab->objectSize + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+    size_t count = SLAB_BLOCK / stride;
+    if (count < SLAB_BATCH) {
+        count = SLAB_BATCH;
+    }
+    char* block = malloc(stride * count);
+    for (size_t i = count; i > 0; i--) {
+        SlabObject* object = (SlabObject*) (block + (i - 1) * stride);
+        object->next = slab->shared;
+        slab->shared = object;
+    }
+    slab->sharedCount += count;
+    __atomic_fetch_add(&reserved, stride * count, __ATOMIC_RELAXED);
+}
+
+/*
+ * Function which moves a batch of objects from a slab's shared list into a
+ * thread's empty cache, carving a new block if the shared list is empty.
+ * Parameters:
+ * slab - slab to take objects from
+ * cache - cache to fill
+ */
+static void refill(Slab* slab, SlabCache* cache) {
+    pthread_mutex_lock(&slab->mutex);
+    if (slab->shared == NULL) {
+        carve_block(slab);
+    }
+    int count = slab->sharedCount < SLAB_BATCH ? slab->sharedCount :
+            SLAB_BATCH;
+    SlabObject* first = slab->shared;
+    SlabObject* last = first;
+    for (int i = 1; i < count; i++) {
+        last = last->next;
+    }
+    slab->shared = last->next;
+    slab->sharedCount -= count;
+    pthread_mutex_unlock(&slab->mutex);
+    last->next = cache->head;
+    cache->head = first;
+    cache->count += count;
+    stats_add(STAT_SLAB_SHARED, 1);
+}
+
+/*
+ * Function which allocates an object from a slab. Its contents are
+ * undefined.
+ * Parameters:
+ * slab - slab to allocate from
+ * Return:
+ * void* - the object
+ */
+void* slab_alloc(Slab* slab) {
+    SlabCache* cache = thread_cache(slab);
+    if (cache->head == NULL) {
+        refill(slab, cache);
+    }
+    SlabObject* object = cache->head;
+    cache->head = object->next;
+    cache->count--;
+    stats_add(STAT_SLAB_ALLOC, 1);
+    return object;
+}
+
+/*
+ * Function which frees an object allocated from a slab into the calling
+ * thread's cache, giving a batch back to the slab once the cache is full.
+ * Parameters:
+ * slab - slab the object was allocated from
+ * object - object to free
+ */
+void slab_free(Slab* slab, void* object) {
+    SlabCache* cache = thread_cache(slab);
+    SlabObject* freed = object;
+    freed->next = cache->head;
+    cache->head = freed;
+    if (++cache->count >= 2 * SLAB_BATCH) {
+        give_back(slab, cache, SLAB_BATCH);
+    }
+    stats_add(STAT_SLAB_FREE, 1);
+}
+
+/*
+ * Function which returns how much memory every slab has carved into
+ * objects so far.
+ * Return:
+ * size_t - bytes carved
+ */
+size_t slab_reserved(void) {
+    return __atomic_load_n(&reserved, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,39 @@
+#ifndef _SLAB_H
+#define _SLAB_H
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * An object waiting to be handed out by a slab.
+ */
+typedef struct SlabObject {
+    struct SlabObject* next;
+} SlabObject;
+
+/*
+ * Pool of objects of one size, carved out of large blocks which are reused
+ * rather than given back to the system. Each thread keeps a small cache of
+ * free objects, so most allocations and frees take no lock. A thread only
+ * locks the slab to move a batch of objects between its cache and the
+ * slab's shared list. An object may be freed by a different thread from the
+ * one which allocated it. Slabs live for as long as the program, and are
+ * set up with SLAB_INITIALIZER.
+ */
+typedef struct {
+    size_t objectSize;
+    // index of the slab's cache in every thread, -1 until first used
+    int id;
+    pthread_mutex_t mutex;
+    SlabObject* shared;
+    int sharedCount;
+} Slab;
+
+#define SLAB_INITIALIZER(size) {(size), -1, PTHREAD_MUTEX_INITIALIZER, NULL, 0}
+
+void* slab_alloc(Slab* slab);
+
+void slab_free(Slab* slab, void* object);
+
+size_t slab_reserved(void);
+
+#endif
@@ -0,0 +1,72 @@
+#include <string.h>
+#include "stats.h"
+#define STATS_SHARDS 16
+#define CACHE_LINE 64
+
+/*
+ * One shard of the server's statistics. Each thread updates a single shard,
+ * so threads rarely touch the same cache lines, and the shards are only
+ * added together when the statistics are read.
+ */
+typedef struct {
+    unsigned long counters[STAT_COUNT];
+    Histogram timings[TIMING_COUNT];
+} __attribute__((aligned(CACHE_LINE))) StatsShard;
+
+static StatsShard shards[STATS_SHARDS];
+static int nextShard = 0;
+static __thread StatsShard* shard = NULL;
+
+/*
+ * Function which returns the shard the calling thread updates, handing out
+ * shards to threads in turn.
+ * Return:
+ * StatsShard* - shard of the calling thread
+ */
+static StatsShard* thread_shard(void) {
+    if (shard == NULL) {
+        shard = &shards[__atomic_fetch_add(&nextShard, 1, __ATOMIC_RELAXED) %
+                STATS_SHARDS];
+    }
+    return shard;
+}
+
+/*
+ * Function which adds to one of the server's counters.
+ * Parameters:
+ * stat - counter to add to
+ * amount - amount to add
+ */
+void stats_add(Stat stat, unsigned long amount) {
+    __atomic_fetch_add(&thread_shard()->counters[stat], amount,
+            __ATOMIC_RELAXED);
+}
+
+/*
+ * Function which records a time in one of the server's latency histograms.
+ * Parameters:
+ * timing - histogram to record the time in
+ * usec - time in microseconds
+ */
+void stats_record(Timing timing, long long usec) {
+    histogram_record(&thread_shard()->timings[timing], usec);
+}
+
+/*
+ * Function which adds up every shard of the server's statistics.
+ * Parameters:
+ * totals - filled in with the totals
+ */
+void stats_read(StatsTotals* totals) {
+    memset(totals, 0, sizeof(StatsTotals));
+    for (int i = 0; i < STATS_SHARDS; i++) {
+        for (int stat = 0; stat < STAT_COUNT; stat++) {
+            totals->counters[stat] += __atomic_load_n(
+                    &shards[i].counters[stat], __ATOMIC_RELAXED);
+        }
+        for (int timing = 0; timing < TIMING_COUNT; timing++) {
+            histogram_merge(&totals->timings[timing],
+                    &shards[i].timings[timing]);
+        }
+    }
+}
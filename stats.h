@@ -0,0 +1,80 @@
+#ifndef _STATS_H
+#define _STATS_H
+#include "histogram.h"
+
+/*
+ * Counters kept by the server.
+ */
+typedef enum {
+    STAT_AUTH,
+    STAT_NAME,
+    STAT_SAY,
+    STAT_KICK,
+    STAT_LIST,
+    STAT_LEAVE,
+    STAT_BYTES_IN,
+    STAT_BYTES_OUT,
+    // lines queued for clients by broadcasts
+    STAT_FANOUT,
+    // commands recieved which were longer than the line limit
+    STAT_OVERSIZE,
+    // objects allocated from and freed to slabs, trips to a slab's shared
+    // list (the only time a slab is locked), and frames too large for any
+    // slab which were allocated with malloc
+    STAT_SLAB_ALLOC,
+    STAT_SLAB_FREE,
+    STAT_SLAB_SHARED,
+    STAT_MALLOC,
+    // frames posted to another shard's loop to be sent to its clients
+    STAT_CROSS_SHARD,
+    // clients closed for not authenticating, or not choosing a name, in time
+    STAT_AUTH_TIMEOUT,
+    STAT_NAME_TIMEOUT,
+    // clients in the chat closed for sending nothing, or reading nothing, for
+    // too long, and PING: lines sent to quiet clients
+    STAT_IDLE_TIMEOUT,
+    STAT_WRITE_TIMEOUT,
+    STAT_PING,
+    // commands held back by the rate policy, commands thrown away for going
+    // over the limit for their type, and connections closed as soon as they
+    // were accepted because the server was full or accepting too quickly
+    STAT_THROTTLED,
+    STAT_REJECTED,
+    STAT_CONNECTIONS_FULL,
+    STAT_ACCEPTS_SHED,
+    // messages replayed from a room's backlog to clients joining it
+    STAT_REPLAYED,
+    // messages written to the chat log, syncs of the log to disk, and
+    // messages left out of the log because its writer fell behind or failed
+    STAT_LOG_RECORDS,
+    STAT_LOG_SYNCS,
+    STAT_LOG_DROPPED,
+    STAT_COUNT
+} Stat;
+
+/*
+ * Latency histograms kept by the server, in microseconds.
+ */
+typedef enum {
+    // connection accepted to name accepted
+    TIMING_HANDSHAKE,
+    // SAY: recieved to MSG: completely written to a client
+    TIMING_DELIVERY,
+    TIMING_COUNT
+} Timing;
+
+/*
+ * Totals of every shard, as read at one time.
+ */
+typedef struct {
+    unsigned long counters[STAT_COUNT];
+    Histogram timings[TIMING_COUNT];
+} StatsTotals;
+
+void stats_add(Stat stat, unsigned long amount);
+
+void stats_record(Timing timing, long long usec);
+
+void stats_read(StatsTotals* totals);
+
+#endif
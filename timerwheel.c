@@ -0,0 +1,220 @@
+#include <stddef.h>
+#include <string.h>
+#include "timerwheel.h"
+#define SLOT_MASK (WHEEL_SLOTS - 1)
+// furthest ahead in ticks a timer can be placed
+#define WHEEL_SPAN ((1LL << (WHEEL_LEVELS * WHEEL_SLOT_BITS)) - 1)
+
+/*
+ * Function which sets up an empty timer wheel.
+ * Parameters:
+ * wheel - wheel to set up
+ * tick - microseconds in a tick
+ * now - current time in microseconds
+ */
+void timer_wheel_init(TimerWheel* wheel, long long tick, long long now) {
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+    wheel->tick = tick;
+    wheel->current = now / tick;
+    wheel->count = 0;
+}
+
+/*
+ * Function which puts a timer in the slot its expiry falls in, relative to
+ * the tick the wheel has reached. A timer due by then goes in the current
+ * slot of the lowest level.
+ * Parameters:
+ * wheel - wheel to add the timer to
+ * timer - timer to add
+ */
+static void place_timer(TimerWheel* wheel, Timer* timer) {
+    long long expires = timer->expires;
+    long long delta = expires - wheel->current;
+    if (delta < 0) {
+        expires = wheel->current;
+        delta = 0;
+    } else if (delta > WHEEL_SPAN) {
+        expires = wheel->current + WHEEL_SPAN;
+        delta = WHEEL_SPAN;
+    }
+    int level = 0;
+    while (delta >> ((level + 1) * WHEEL_SLOT_BITS) != 0) {
+        level++;
+    }
+    Timer** slot = &wheel->slots[level][(expires >>
+            (level * WHEEL_SLOT_BITS)) & SLOT_MASK];
+    timer->next = *slot;
+    if (*slot != NULL) {
+        (*slot)->link = &timer->next;
+    }
+    *slot = timer;
+    timer->link = slot;
+}
+
+/*
+ * Function which takes a timer out of its slot.
+ * Parameters:
+ * timer - scheduled timer to take out
+ */
+static void unlink_timer(Timer* timer) {
+    *timer->link = timer->next;
+    if (timer->next != NULL) {
+        timer->next->link = timer->link;
+    }
+    timer->link = NULL;
+}
+
+/*
+ * Function which schedules a timer to expire at a time, moving it if it is
+ * already scheduled.
+ * Parameters:
+ * wheel - wheel to schedule the timer on
+ * timer - timer to schedule
+ * when - time in microseconds the timer is to expire
+ */
+void timer_wheel_schedule(TimerWheel* wheel, Timer* timer, long long when) {
+    if (timer->link != NULL) {
+        unlink_timer(timer);
+    } else {
+        wheel->count++;
+    }
+    timer->expires = (when + wheel->tick - 1) / wheel->tick;
+    // the current tick has already expired
+    if (timer->expires <= wheel->current) {
+        timer->expires = wheel->current + 1;
+    }
+    place_timer(wheel, timer);
+}
+
+/*
+ * Function which cancels a timer if it is scheduled.
+ * Parameters:
+ * wheel - wheel the timer was scheduled on
+ * timer - timer to cancel
+ */
+void timer_wheel_cancel(TimerWheel* wheel, Timer* timer) {
+    if (timer->link != NULL) {
+        unlink_timer(timer);
+        wheel->count--;
+    }
+}
+
+/*
+ * Function which returns whether a timer is waiting to expire.
+ * Parameters:
+ * timer - timer to check
+ * Return:
+ * bool - true if the timer is scheduled
+ */
+bool timer_scheduled(Timer* timer) {
+    return timer->link != NULL;
+}
+
+/*
+ * Function which returns when a scheduled timer expires.
+ * Parameters:
+ * wheel - wheel the timer is scheduled on
+ * timer - scheduled timer
+ * Return:
+ * long long - time in microseconds, rounded up to a whole tick
+ */
+long long timer_expires_at(TimerWheel* wheel, Timer* timer) {
+    return timer->expires * wheel->tick;
+}
+
+/*
+ * Function which moves every timer in a slot of a higher level to the
+ * levels below, now that the wheel has reached the start of the slot.
+ * Parameters:
+ * wheel - wheel the slot belongs to
+ * level - level of the slot
+ */
+static void cascade(TimerWheel* wheel, int level) {
+    Timer** slot = &wheel->slots[level][(wheel->current >>
+            (level * WHEEL_SLOT_BITS)) & SLOT_MASK];
+    Timer* timer = *slot;
+    *slot = NULL;
+    while (timer != NULL) {
+        Timer* next = timer->next;
+        place_timer(wheel, timer);
+        timer = next;
+    }
+}
+
+/*
+ * Function which returns the next tick after the one the wheel has reached
+ * at which any timer expires or has to be moved down a level.
+ * Parameters:
+ * wheel - wheel to check
+ * Return:
+ * long long - the tick, -1 if no timers are scheduled
+ */
+static long long next_tick(TimerWheel* wheel) {
+    long long next = -1;
+    if (wheel->count == 0) {
+        return -1;
+    }
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        int shift = level * WHEEL_SLOT_BITS;
+        long long position = wheel->current >> shift;
+        for (int step = 1; step <= WHEEL_SLOTS; step++) {
+            if (wheel->slots[level][(position + step) & SLOT_MASK] != NULL) {
+                long long tick = (position + step) << shift;
+                if (next < 0 || tick < next) {
+                    next = tick;
+                }
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+/*
+ * Function which moves the wheel on to the given time and takes out every
+ * timer which has expired by then. The wheel skips straight over ticks at
+ * which nothing happens.
+ * Parameters:
+ * wheel - wheel to move on
+ * now - current time in microseconds
+ * Return:
+ * Timer* - the expired timers, linked by next, NULL if there are none
+ */
+Timer* timer_wheel_expire(TimerWheel* wheel, long long now) {
+    long long until = now / wheel->tick;
+    Timer* expired = NULL;
+    while (wheel->current < until) {
+        long long tick = next_tick(wheel);
+        if (tick < 0 || tick > until) {
+            wheel->current = until;
+            break;
+        }
+        wheel->current = tick;
+        for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+            if ((tick & ((1LL << (level * WHEEL_SLOT_BITS)) - 1)) == 0) {
+                cascade(wheel, level);
+            }
+        }
+        Timer** slot = &wheel->slots[0][tick & SLOT_MASK];
+        while (*slot != NULL) {
+            Timer* timer = *slot;
+            unlink_timer(timer);
+            wheel->count--;
+            timer->next = expired;
+            expired = timer;
+        }
+    }
+    return expired;
+}
+
+/*
+ * Function which returns when the wheel next needs moving on.
+ * Parameters:
+ * wheel - wheel to check
+ * Return:
+ * long long - time in microseconds, -1 if no timers are scheduled
+ */
+long long timer_wheel_next(TimerWheel* wheel) {
+    long long tick = next_tick(wheel);
+    return tick < 0 ? -1 : tick * wheel->tick;
+}
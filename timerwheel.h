@@ -0,0 +1,53 @@
+#ifndef _TIMERWHEEL_H
+#define _TIMERWHEEL_H
+#include <stdbool.h>
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOT_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_SLOT_BITS)
+
+/*
+ * A deadline kept by a timer wheel. Timers are embedded at the start of
+ * whatever structure the deadline belongs to.
+ */
+typedef struct Timer {
+    // time in ticks the timer expires
+    long long expires;
+    struct Timer* next;
+    // pointer to the timer in its slot's list, NULL while not scheduled
+    struct Timer** link;
+} Timer;
+
+/*
+ * Hierarchical timer wheel of deadlines owned by a single thread. Each level
+ * is a ring of slots, each covering WHEEL_SLOTS times the span of a slot on
+ * the level below, so scheduling and cancelling a timer are O(1) however
+ * many there are. Once the wheel reaches a slot on a higher level its
+ * timers are moved down to the levels below, where they expire from the
+ * lowest level. Deadlines are rounded up to a whole tick, so a timer never
+ * expires early, and deadlines beyond the top level wait in its last slot
+ * to be placed again.
+ */
+typedef struct {
+    // microseconds in a tick, the span of a slot on the lowest level
+    long long tick;
+    // tick the wheel has reached, every timer due by then having expired
+    long long current;
+    int count;
+    Timer* slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} TimerWheel;
+
+void timer_wheel_init(TimerWheel* wheel, long long tick, long long now);
+
+void timer_wheel_schedule(TimerWheel* wheel, Timer* timer, long long when);
+
+void timer_wheel_cancel(TimerWheel* wheel, Timer* timer);
+
+bool timer_scheduled(Timer* timer);
+
+long long timer_expires_at(TimerWheel* wheel, Timer* timer);
+
+Timer* timer_wheel_expire(TimerWheel* wheel, long long now);
+
+long long timer_wheel_next(TimerWheel* wheel);
+
+#endif
@@ -0,0 +1,1162 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "shared.h"
+#include "server.h"
+#include "outqueue.h"
+#include "epoch.h"
+#include "stats.h"
+#include "session.h"
+#include "slab.h"
+#include "timerwheel.h"
+#define RING_ENTRIES 4096
+#define BUFFER_COUNT 1024
+#define BUFFER_SIZE 4096
+#define BUFFER_GROUP 0
+#define MAX_BATCH 256
+// lines handled from one connection in each batch, so the frames a busy
+// sender pushes to other clients are sent before it is handled again
+#define MAX_LINES 32
+// bytes of unhandled input after which recieving from a connection stops
+// until its lines have been handled
+#define INPUT_HIGH_WATER 65536
+#define NSEC_PER_USEC 1000
+#define USEC_PER_SEC 1000000
+// microseconds in a tick of the timer wheel, short enough that held back
+// output is not kept much past its deadline
+#define TIMER_TICK 10
+// operations are told apart by the low bits of their user data, the rest
+// being the connection they belong to
+#define OP_ACCEPT 0
+#define OP_RECV 1
+#define OP_SEND 2
+#define OP_CANCEL 3
+#define OP_WAKE 4
+#define OP_HANDOFF 5
+#define OP_MASK 7
+
+/*
+ * Data structure which stores the memory shared with the kernel for an
+ * io_uring instance: the submission and completion rings and the ring of
+ * buffers that recieved bytes are placed in.
+ */
+typedef struct {
+    int fd;
+    void* rings;
+    size_t ringsSize;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned sqMask;
+    unsigned sqEntries;
+    // tail of submissions which have been filled in but not yet published
+    unsigned sqLocalTail;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe* cqes;
+    struct io_uring_buf_ring* buffers;
+    size_t buffersSize;
+    char* bufferData;
+} Ring;
+
+/*
+ * Data structure which stores the state of a single client connection being
+ * served by the io_uring loop.
+ */
+typedef struct UringConnection {
+    // expires by the earliest of the connection's deadlines: the session's
+    // next, the end of its hold by the rate policy and the flush of its held
+    // back output
+    Timer timer;
+    int fd;
+    Session session;
+    // describes the frames of the send currently in flight
+    struct iovec batch[MAX_BATCH];
+    struct msghdr message;
+    // operations submitted for the connection which have not yet finished
+    int pendingOps;
+    bool receiving;
+    // set while a cancel of the recieve is in flight
+    bool cancelling;
+    bool sending;
+    // set while the connection is waiting to have its output sent
+    bool dirty;
+    // set while the connection is waiting to have its lines handled
+    bool ready;
+    // set once the socket has been shut down and the connection is only
+    // waiting for its operations to finish
+    bool shutdown;
+    // the session's next deadline, 0 if it has none
+    long long deadline;
+    // set while the client is held back by the rate policy
+    bool parked;
+    long long resumeAt;
+    struct UringConnection* nextDirty;
+    struct UringConnection* nextReady;
+    // next connection whose timer has expired, while they are handled
+    struct UringConnection* nextDue;
+    // neighbours in the loop's list of every connection not yet released
+    struct UringConnection* previousOpen;
+    struct UringConnection* nextOpen;
+    struct UringLoop* loop;
+} UringConnection;
+
+/*
+ * Data structure which stores the information shared by every connection
+ * served by the io_uring loop.
+ */
+typedef struct UringLoop {
+    Ring ring;
+    int listenDiscriptor;
+    char* serverAuth;
+    ClientList* clientList;
+    // shard served by the loop, whose inbox wakes it
+    Shard* shard;
+    // connections with output waiting to be sent at the end of this batch
+    UringConnection* dirty;
+    // connections with recieved lines waiting to be handled
+    UringConnection* ready;
+    // deadlines of the connections
+    TimerWheel timers;
+    // set once any connection has been accepted
+    bool accepted;
+    // set if the kernel only supports recieving once per submission
+    bool singleShotRecv;
+    // set while the multishot accept is armed, and the time to arm it again
+    // after accepting ran out of file descriptors (0 if it is not waiting)
+    bool accepting;
+    long long acceptAt;
+    // every connection not yet released, so they can all be handed to
+    // another server
+    UringConnection* open;
+    int openCount;
+    // set while the loop is stopping so its clients can be handed to
+    // another server, which waits until nothing is in flight
+    bool handingOff;
+} UringLoop;
+
+static Slab connectionSlab = SLAB_INITIALIZER(sizeof(UringConnection));
+
+/*
+ * Function which makes the io_uring_setup() system call.
+ * Parameters:
+ * entries - number of submission queue entries wanted
+ * params - parameters of the ring, filled in by the kernel
+ * Return:
+ * int - file descriptor of the ring, -1 on error
+ */
+static int uring_setup(unsigned entries, struct io_uring_params* params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+/*
+ * Function which makes the io_uring_enter() system call.
+ * Parameters:
+ * ring - ring to submit to
+ * submit - number of new submissions
+ * wait - number of completions to wait for
+ * flags - IORING_ENTER_* flags
+ * arg - extra argument for the flags given
+ * size - size of arg
+ * Return:
+ * int - number of submissions consumed, -1 on error
+ */
+static int uring_enter(Ring* ring, unsigned submit, unsigned wait,
+        unsigned flags, void* arg, size_t size) {
+    return syscall(__NR_io_uring_enter, ring->fd, submit, wait, flags, arg,
+            size);
+}
+
+/*
+ * Function which unmaps and closes everything a ring holds. Any operations
+ * still in flight are cancelled by the kernel.
+ * Parameters:
+ * ring - ring to destroy
+ */
+static void destroy_ring(Ring* ring) {
+    if (ring->buffers != NULL) {
+        munmap(ring->buffers, ring->buffersSize);
+    }
+    free(ring->bufferData);
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    if (ring->rings != NULL) {
+        munmap(ring->rings, ring->ringsSize);
+    }
+    close(ring->fd);
+}
+
+/*
+ * Function which registers the ring of buffers multishot recieves place
+ * their bytes in, and gives every buffer to the kernel.
+ * Parameters:
+ * ring - ring to register the buffers with
+ * Return:
+ * bool - false if the kernel does not support provided buffer rings.
+ */
+static bool setup_buffers(Ring* ring) {
+    ring->buffersSize = BUFFER_COUNT * sizeof(struct io_uring_buf);
+    ring->buffers = mmap(NULL, ring->buffersSize, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buffers == MAP_FAILED) {
+        ring->buffers = NULL;
+        return false;
+    }
+    struct io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (unsigned long) ring->buffers;
+    registration.ring_entries = BUFFER_COUNT;
+    registration.bgid = BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+            &registration, 1) < 0) {
+        return false;
+    }
+    ring->bufferData = malloc(BUFFER_COUNT * BUFFER_SIZE);
+    for (int i = 0; i < BUFFER_COUNT; i++) {
+        struct io_uring_buf* buffer = &ring->buffers->bufs[i];
+        buffer->addr = (unsigned long) (ring->bufferData + i * BUFFER_SIZE);
+        buffer->len = BUFFER_SIZE;
+        buffer->bid = i;
+    }
+    __atomic_store_n(&ring->buffers->tail, BUFFER_COUNT, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+ * Function which creates an io_uring instance and maps its rings.
+ * Parameters:
+ * ring - ring to set up
+ * Return:
+ * const char* - NULL on success, otherwise why io_uring cannot be used (the
+ * ring is then destroyed).
+ */
+static const char* setup_ring(Ring* ring) {
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(Ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = uring_setup(RING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        return strerror(errno);
+    }
+    unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+            IORING_FEAT_EXT_ARG;
+    if ((params.features & needed) != needed) {
+        close(ring->fd);
+        return "kernel lacks required features";
+    }
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes +
+            params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ringsSize = sqSize > cqSize ? sqSize : cqSize;
+    ring->rings = mmap(NULL, ring->ringsSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->rings == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        ring->rings = ring->rings == MAP_FAILED ? NULL : ring->rings;
+        ring->sqes = ring->sqes == MAP_FAILED ? NULL : ring->sqes;
+        destroy_ring(ring);
+        return "cannot map rings";
+    }
+    char* base = ring->rings;
+    ring->sqHead = (unsigned*) (base + params.sq_off.head);
+    ring->sqTail = (unsigned*) (base + params.sq_off.tail);
+    ring->sqMask = *(unsigned*) (base + params.sq_off.ring_mask);
+    ring->sqEntries = params.sq_entries;
+    ring->sqLocalTail = *ring->sqTail;
+    // submission slots are always used in order
+    unsigned* array = (unsigned*) (base + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        array[i] = i;
+    }
+    ring->cqHead = (unsigned*) (base + params.cq_off.head);
+    ring->cqTail = (unsigned*) (base + params.cq_off.tail);
+    ring->cqMask = *(unsigned*) (base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (base + params.cq_off.cqes);
+    if (!setup_buffers(ring)) {
+        destroy_ring(ring);
+        return "kernel lacks provided buffer rings";
+    }
+    return NULL;
+}
+
+/*
+ * Function which publishes every submission filled in so far to the kernel
+ * and, if asked, waits for at least one completion.
+ * Parameters:
+ * ring - ring to submit to
+ * wait - true to wait for a completion
+ * timeout - most microseconds to wait, or -1 to wait for ever
+ */
+static void submit_ring(Ring* ring, bool wait, long long timeout) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec time;
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+    unsigned submit = ring->sqLocalTail -
+            __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    if (timeout >= 0) {
+        time.tv_sec = timeout / USEC_PER_SEC;
+        time.tv_nsec = (timeout % USEC_PER_SEC) * NSEC_PER_USEC;
+        arg.ts = (unsigned long) &time;
+    }
+    unsigned flags = IORING_ENTER_EXT_ARG |
+            (wait ? IORING_ENTER_GETEVENTS : 0);
+    if (uring_enter(ring, submit, wait ? 1 : 0, flags, &arg,
+            sizeof(arg)) < 0 && errno != EINTR && errno != ETIME &&
+            errno != EBUSY && errno != EAGAIN) {
+        communications_error();
+    }
+}
+
+/*
+ * Function which returns an empty submission queue entry, first submitting
+ * what is already queued if the submission queue is full.
+ * Parameters:
+ * ring - ring to submit to
+ * Return:
+ * struct io_uring_sqe* - entry to fill in
+ */
+static struct io_uring_sqe* next_sqe(Ring* ring) {
+    while (ring->sqLocalTail - __atomic_load_n(ring->sqHead,
+            __ATOMIC_ACQUIRE) == ring->sqEntries) {
+        submit_ring(ring, false, -1);
+    }
+    struct io_uring_sqe* sqe = &ring->sqes[ring->sqLocalTail & ring->sqMask];
+    ring->sqLocalTail++;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+/*
+ * Function which gives a buffer that the kernel filled back to it once its
+ * bytes have been copied out.
+ * Parameters:
+ * ring - ring the buffer belongs to
+ * id - id of the buffer
+ */
+static void recycle_buffer(Ring* ring, unsigned id) {
+    unsigned short tail = ring->buffers->tail;
+    struct io_uring_buf* buffer =
+            &ring->buffers->bufs[tail & (BUFFER_COUNT - 1)];
+    buffer->addr = (unsigned long) (ring->bufferData + id * BUFFER_SIZE);
+    buffer->len = BUFFER_SIZE;
+    buffer->bid = id;
+    __atomic_store_n(&ring->buffers->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Function which starts accepting connections on the listening socket. A
+ * single submission keeps accepting until it fails.
+ * Parameters:
+ * loop - loop which is listening
+ */
+static void arm_accept(UringLoop* loop) {
+    struct io_uring_sqe* sqe = next_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listenDiscriptor;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = OP_ACCEPT;
+    loop->accepting = true;
+}
+
+/*
+ * Function which waits for the shard's eventfd to say other shards have
+ * posted frames for this loop's clients.
+ * Parameters:
+ * loop - loop whose shard is to be watched
+ */
+static void arm_wake(UringLoop* loop) {
+    struct io_uring_sqe* sqe = next_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = loop->shard->wakeDiscriptor;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = OP_WAKE;
+}
+
+/*
+ * Function which waits for the handoff's eventfd to say a server is taking
+ * over.
+ * Parameters:
+ * loop - loop to be told
+ */
+static void arm_handoff(UringLoop* loop) {
+    struct io_uring_sqe* sqe = next_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = loop->clientList->handoff->wakeDiscriptor;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = OP_HANDOFF;
+}
+
+/*
+ * Function which starts recieving from a connection into the shared buffer
+ * ring. Unless the kernel is too old, a single submission keeps recieving
+ * until the connection closes or the buffers run out.
+ * Parameters:
+ * connection - connection to recieve from
+ */
+static void arm_recv(UringConnection* connection) {
+    UringLoop* loop = connection->loop;
+    struct io_uring_sqe* sqe = next_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = connection->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->ioprio = loop->singleShotRecv ? 0 : IORING_RECV_MULTISHOT;
+    sqe->user_data = (unsigned long) connection | OP_RECV;
+    connection->receiving = true;
+    connection->pendingOps++;
+}
+
+/*
+ * Function which sends as much of a connection's outbound queue as fits in
+ * one sendmsg() submission, with MSG_MORE if the queue holds more than
+ * that. Only one send is in flight per connection so that frames go out in
+ * order.
+ * Parameters:
+ * connection - connection to send to
+ */
+static void send_output(UringConnection* connection) {
+    bool more;
+    int count = out_queue_prepare(&connection->session.output,
+            connection->batch, MAX_BATCH, &more);
+    if (count == 0) {
+        return;
+    }
+    memset(&connection->message, 0, sizeof(struct msghdr));
+    connection->message.msg_iov = connection->batch;
+    connection->message.msg_iovlen = count;
+    struct io_uring_sqe* sqe = next_sqe(&connection->loop->ring);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = connection->fd;
+    sqe->addr = (unsigned long) &connection->message;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+    sqe->user_data = (unsigned long) connection | OP_SEND;
+    connection->sending = true;
+    connection->pendingOps++;
+}
+
+/*
+ * Function which is told by a connection's outbound queue when it has bytes
+ * to send, and adds the connection to those whose output is sent at the end
+ * of the current batch of completions.
+ * Parameters:
+ * queue - outbound queue of the connection
+ * writable - true if the queue has bytes waiting to be written
+ */
+static void mark_dirty(OutQueue* queue, bool writable) {
+    UringConnection* connection = queue->owner;
+    if (!writable || connection->dirty || connection->shutdown) {
+        return;
+    }
+    connection->dirty = true;
+    connection->nextDirty = connection->loop->dirty;
+    connection->loop->dirty = connection;
+}
+
+/*
+ * Function which makes sure a connection's timer expires by the given time,
+ * leaving it alone if it already expires sooner. A connection which has been
+ * shut down has no more deadlines.
+ * Parameters:
+ * connection - connection with a new deadline
+ * when - time in microseconds of the deadline
+ */
+static void schedule_by(UringConnection* connection, long long when) {
+    TimerWheel* timers = &connection->loop->timers;
+    if (connection->shutdown) {
+        return;
+    }
+    if (!timer_scheduled(&connection->timer) ||
+            when < timer_expires_at(timers, &connection->timer)) {
+        timer_wheel_schedule(timers, &connection->timer, when);
+    }
+}
+
+/*
+ * Function which is told by a connection's outbound queue when it starts
+ * holding frames back, and makes sure the connection's timer expires in
+ * time to flush the queue.
+ * Parameters:
+ * queue - outbound queue of the connection
+ * flushAt - time in microseconds by which the queue must be flushed
+ */
+static void schedule_flush(OutQueue* queue, long long flushAt) {
+    schedule_by(queue->owner, flushAt);
+}
+
+/*
+ * Function which frees a connection's outbound queue and the connection
+ * itself once no other thread can still be pushing to the queue.
+ * Parameters:
+ * data - connection to free
+ */
+static void destroy_connection(void* data) {
+    UringConnection* connection = data;
+    out_queue_destroy(&connection->session.output);
+    slab_free(&connectionSlab, connection);
+}
+
+/*
+ * Function which releases everything held by a connection which has been
+ * shut down, once the kernel has finished every operation using it.
+ * Parameters:
+ * connection - connection to release
+ */
+static void release_connection(UringConnection* connection) {
+    if (!connection->shutdown || connection->pendingOps > 0 ||
+            connection->dirty || connection->ready) {
+        return;
+    }
+    if (connection->previousOpen == NULL) {
+        connection->loop->open = connection->nextOpen;
+    } else {
+        connection->previousOpen->nextOpen = connection->nextOpen;
+    }
+    if (connection->nextOpen != NULL) {
+        connection->nextOpen->previousOpen = connection->previousOpen;
+    }
+    connection->loop->openCount--;
+    close(connection->fd);
+    connection_closed(connection->session.clientList);
+    session_close(&connection->session);
+    epoch_retire(connection, destroy_connection);
+}
+
+/*
+ * Function which shuts a connection's socket down once its session is
+ * closing, which ends any recieve or send in flight. The connection is
+ * released when they have finished.
+ * Parameters:
+ * connection - connection to close
+ */
+static void close_connection(UringConnection* connection) {
+    timer_wheel_cancel(&connection->loop->timers, &connection->timer);
+    connection->shutdown = true;
+    shutdown(connection->fd, SHUT_RDWR);
+    release_connection(connection);
+}
+
+/*
+ * Function which works out the next of a connection's session's deadlines,
+ * if it has any, and makes sure the connection's timer expires by then.
+ * Parameters:
+ * connection - connection whose deadlines have changed
+ */
+static void arm_timer(UringConnection* connection) {
+    connection->deadline = session_check_deadlines(&connection->session,
+            now_usec());
+    if (connection->deadline > 0) {
+        schedule_by(connection, connection->deadline);
+    }
+}
+
+/*
+ * Function which creates a connection for a client socket and adds it to
+ * the loop's open connections.
+ * Parameters:
+ * loop - loop that will serve the client
+ * fd - socket connected to the client
+ * Return:
+ * UringConnection* - the new connection, whose session is yet to be set up
+ */
+static UringConnection* create_connection(UringLoop* loop, int fd) {
+    UringConnection* connection = slab_alloc(&connectionSlab);
+    memset(connection, 0, sizeof(UringConnection));
+    connection->fd = fd;
+    connection->loop = loop;
+    connection->nextOpen = loop->open;
+    if (loop->open != NULL) {
+        loop->open->previousOpen = connection;
+    }
+    loop->open = connection;
+    loop->openCount++;
+    return connection;
+}
+
+/*
+ * Function which accepts a new client socket and sends it the AUTH: prompt.
+ * A connection accepted while the loop is handing off is not recieved from,
+ * so the kernel holds on to anything the client sends.
+ * Parameters:
+ * loop - loop that will serve the client
+ * fd - socket connected to the client
+ */
+static void open_connection(UringLoop* loop, int fd) {
+    int noDelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(int));
+    UringConnection* connection = create_connection(loop, fd);
+    session_open(&connection->session, fd, loop->clientList, loop->serverAuth,
+            true, mark_dirty, schedule_flush, connection);
+    arm_timer(connection);
+    if (!loop->handingOff) {
+        arm_recv(connection);
+    }
+}
+
+/*
+ * Function which cancels a connection's multishot recieve, so the kernel
+ * holds back the client's bytes until it is armed again.
+ * Parameters:
+ * connection - connection to stop recieving from
+ */
+static void stop_recv(UringConnection* connection) {
+    if (!connection->receiving || connection->cancelling) {
+        return;
+    }
+    struct io_uring_sqe* sqe = next_sqe(&connection->loop->ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (unsigned long) connection | OP_RECV;
+    sqe->user_data = (unsigned long) connection | OP_CANCEL;
+    connection->cancelling = true;
+    connection->pendingOps++;
+}
+
+/*
+ * Function which cancels a connection's send, so that whatever it had not
+ * yet written stays in its outbound queue.
+ * Parameters:
+ * connection - connection to stop sending to
+ */
+static void stop_send(UringConnection* connection) {
+    struct io_uring_sqe* sqe = next_sqe(&connection->loop->ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (unsigned long) connection | OP_SEND;
+    sqe->user_data = (unsigned long) connection | OP_CANCEL;
+    connection->pendingOps++;
+}
+
+/*
+ * Function which stops recieving from a connection until the rate policy
+ * allows its client to send another command.
+ * Parameters:
+ * connection - connection to hold back
+ * resumeAt - time in microseconds at which the connection may continue
+ */
+static void park_connection(UringConnection* connection, long long resumeAt) {
+    connection->parked = true;
+    connection->resumeAt = resumeAt;
+    schedule_by(connection, resumeAt);
+    stop_recv(connection);
+}
+
+/*
+ * Function which adds a connection to those whose lines are handled once
+ * the current batch of completions has been reaped.
+ * Parameters:
+ * connection - connection which has recieved bytes
+ */
+static void mark_ready(UringConnection* connection) {
+    if (connection->ready) {
+        return;
+    }
+    connection->ready = true;
+    connection->nextReady = connection->loop->ready;
+    connection->loop->ready = connection;
+}
+
+/*
+ * Function which handles up to MAX_LINES of the lines recieved from a
+ * connection, then either parks it, closes it, leaves it ready for the next
+ * batch or makes sure it is recieving again once its lines have run out. A
+ * connection which has moved on to another stage without a deadline pending
+ * has its timer armed for the new stage.
+ * Parameters:
+ * connection - connection to handle lines from
+ */
+static void handle_lines(UringConnection* connection) {
+    Session* session = &connection->session;
+    SessionState state = session->state;
+    long long resumeAt = session_handle_lines(session, MAX_LINES);
+    if (session->state != state && !session->closing &&
+            connection->deadline == 0) {
+        arm_timer(connection);
+    }
+    if (session->closing) {
+        close_connection(connection);
+    } else if (resumeAt > 0) {
+        park_connection(connection, resumeAt);
+    } else if (session->moreLines) {
+        mark_ready(connection);
+    } else if (!connection->receiving && !session->input.closed) {
+        arm_recv(connection);
+    }
+}
+
+/*
+ * Function which handles the completion of a recieve on a connection. The
+ * bytes recieved are copied into the session's line buffer and the buffer
+ * they arrived in is given back to the kernel straight away.
+ * Parameters:
+ * connection - connection which recieved
+ * cqe - completion of the recieve
+ */
+static void recv_complete(UringConnection* connection,
+        struct io_uring_cqe* cqe) {
+    UringLoop* loop = connection->loop;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 && !connection->shutdown) {
+            line_buffer_append(&connection->session.input,
+                    loop->ring.bufferData + id * BUFFER_SIZE, cqe->res);
+            stats_add(STAT_BYTES_IN, cqe->res);
+        }
+        recycle_buffer(&loop->ring, id);
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        connection->receiving = false;
+        connection->cancelling = false;
+        connection->pendingOps--;
+    }
+    if (connection->shutdown) {
+        release_connection(connection);
+        return;
+    }
+    if (cqe->res == -EINVAL && !loop->singleShotRecv) {
+        loop->singleShotRecv = true;
+    } else if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS &&
+            cqe->res != -ECANCELED && cqe->res != -EINTR)) {
+        connection->session.input.closed = true;
+    }
+    if (connection->session.input.length > INPUT_HIGH_WATER) {
+        stop_recv(connection);
+    }
+    if (!connection->parked) {
+        mark_ready(connection);
+    }
+}
+
+/*
+ * Function which handles the completion of a send on a connection, sending
+ * the rest of its queue if more has been pushed since.
+ * Parameters:
+ * connection - connection which was sent to
+ * cqe - completion of the send
+ */
+static void send_complete(UringConnection* connection,
+        struct io_uring_cqe* cqe) {
+    connection->sending = false;
+    connection->pendingOps--;
+    if (out_queue_complete(&connection->session.output, cqe->res)) {
+        mark_dirty(&connection->session.output, true);
+    }
+    release_connection(connection);
+}
+
+/*
+ * Function which starts stopping the loop once the handoff's eventfd says a
+ * server is taking over, by cancelling the accept and every connection's
+ * recieve and send. Until the loop is handed off or the handoff fails, no
+ * lines are handled and nothing is sent.
+ * Parameters:
+ * loop - loop to stop
+ */
+static void stop_operations(UringLoop* loop) {
+    loop->handingOff = true;
+    struct io_uring_sqe* sqe = next_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = OP_ACCEPT;
+    sqe->user_data = OP_CANCEL;
+    for (UringConnection* connection = loop->open; connection != NULL;
+            connection = connection->nextOpen) {
+        stop_recv(connection);
+        if (connection->sending) {
+            stop_send(connection);
+        }
+    }
+}
+
+/*
+ * Function which handles every completion the kernel has posted.
+ * Parameters:
+ * loop - loop whose ring is to be reaped
+ * Return:
+ * bool - false if the kernel turned out not to support multishot accept.
+ */
+static bool handle_completions(UringLoop* loop) {
+    Ring* ring = &loop->ring;
+    unsigned head = *ring->cqHead;
+    while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe* cqe = &ring->cqes[head & ring->cqMask];
+        UringConnection* connection =
+                (UringConnection*) (unsigned long) (cqe->user_data & ~OP_MASK);
+        switch (cqe->user_data & OP_MASK) {
+            case OP_ACCEPT:
+                if (cqe->res == -EINVAL && !loop->accepted) {
+                    return false;
+                }
+                if (cqe->res >= 0) {
+                    loop->accepted = true;
+                    if (admit_connection(loop->clientList)) {
+                        open_connection(loop, cqe->res);
+                    } else {
+                        close(cqe->res);
+                    }
+                }
+                if (cqe->flags & IORING_CQE_F_MORE) {
+                    break;
+                }
+                loop->accepting = false;
+                if (cqe->res < 0) {
+                    // re-arming straight away would fail again at once
+                    loop->acceptAt = accept_backoff(-cqe->res);
+                }
+                if (!loop->handingOff && loop->acceptAt == 0) {
+                    arm_accept(loop);
+                }
+                break;
+            case OP_RECV:
+                recv_complete(connection, cqe);
+                break;
+            case OP_SEND:
+                send_complete(connection, cqe);
+                break;
+            case OP_CANCEL:
+                // cancelling the accept has no connection
+                if (connection != NULL) {
+                    connection->pendingOps--;
+                    release_connection(connection);
+                }
+                break;
+            case OP_WAKE:
+                deliver_shard_messages(loop->clientList, loop->shard);
+                arm_wake(loop);
+                break;
+            case OP_HANDOFF:
+                stop_operations(loop);
+                break;
+        }
+        head++;
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+/*
+ * Function which handles whichever of a connection's deadlines have passed
+ * once its timer expires: held back output is marked to be sent, the
+ * session's deadline is checked and a parked connection is let continue.
+ * The timer is then scheduled for the next of them.
+ * Parameters:
+ * connection - connection whose timer has expired
+ * now - current time in microseconds
+ */
+static void connection_due(UringConnection* connection, long long now) {
+    OutQueue* output = &connection->session.output;
+    long long flushAt = out_queue_flush_at(output);
+    if (flushAt > 0 && flushAt <= now) {
+        out_queue_flush(output);
+    }
+    if (connection->deadline > 0 && connection->deadline <= now) {
+        connection->deadline = session_check_deadlines(&connection->session,
+                now);
+    }
+    if (connection->session.closing) {
+        close_connection(connection);
+        return;
+    }
+    if (connection->parked && connection->resumeAt <= now) {
+        connection->parked = false;
+        mark_ready(connection);
+    }
+    long long when = connection->deadline;
+    if (connection->parked && (when == 0 || connection->resumeAt < when)) {
+        when = connection->resumeAt;
+    }
+    flushAt = out_queue_flush_at(output);
+    if (flushAt > 0 && (when == 0 || flushAt < when)) {
+        when = flushAt;
+    }
+    if (when > 0) {
+        schedule_by(connection, when);
+    }
+}
+
+/*
+ * Function which handles every connection whose timer has expired, and
+ * works out how long the loop may wait for the next. Handling one can
+ * schedule the timers of others, so the expired timers are all taken off
+ * the wheel's list before any is handled.
+ * Parameters:
+ * loop - loop whose timers are to be checked
+ * Return:
+ * long long - microseconds until the timers next need checking, -1 if no
+ * timers are scheduled.
+ */
+static long long expire_timers(UringLoop* loop) {
+    long long now = now_usec();
+    UringConnection* due = NULL;
+    Timer* timer = timer_wheel_expire(&loop->timers, now);
+    while (timer != NULL) {
+        UringConnection* connection = (UringConnection*) timer;
+        timer = timer->next;
+        connection->nextDue = due;
+        due = connection;
+    }
+    while (due != NULL) {
+        UringConnection* connection = due;
+        due = connection->nextDue;
+        connection_due(connection, now);
+    }
+    long long next = timer_wheel_next(&loop->timers);
+    return next < 0 ? -1 : next > now ? next - now : 0;
+}
+
+/*
+ * Function which handles the lines of every connection that has recieved
+ * bytes, or still had lines left after the last batch.
+ * Parameters:
+ * loop - loop whose ready connections are to be handled
+ */
+static void handle_ready(UringLoop* loop) {
+    UringConnection* connection = loop->ready;
+    loop->ready = NULL;
+    while (connection != NULL) {
+        UringConnection* next = connection->nextReady;
+        connection->ready = false;
+        if (connection->shutdown) {
+            release_connection(connection);
+        } else {
+            handle_lines(connection);
+        }
+        connection = next;
+    }
+}
+
+/*
+ * Function which sends the output of every connection that has had frames
+ * pushed to it while the last batch of completions was handled, so a
+ * message broadcast to many clients goes to the kernel as one batch of
+ * sends.
+ * Parameters:
+ * loop - loop whose dirty connections are to be sent to
+ */
+static void send_dirty(UringLoop* loop) {
+    UringConnection* connection = loop->dirty;
+    loop->dirty = NULL;
+    while (connection != NULL) {
+        UringConnection* next = connection->nextDirty;
+        connection->dirty = false;
+        if (connection->shutdown) {
+            release_connection(connection);
+        } else if (!connection->sending) {
+            send_output(connection);
+        }
+        connection = next;
+    }
+}
+
+/*
+ * Function which arms the accept again once the loop has backed off from
+ * the listening socket for long enough.
+ * Parameters:
+ * loop - loop which is listening
+ * Return:
+ * long long - microseconds until the function should be called again, -1
+ * if the accept is not waiting to be armed.
+ */
+static long long resume_accepting(UringLoop* loop) {
+    if (loop->acceptAt == 0) {
+        return -1;
+    }
+    long long now = now_usec();
+    if (now < loop->acceptAt) {
+        return loop->acceptAt - now;
+    }
+    loop->acceptAt = 0;
+    arm_accept(loop);
+    return -1;
+}
+
+/*
+ * Function which checks whether a loop which is handing off has nothing
+ * left in flight, so its connections can be handed over as they are.
+ * Parameters:
+ * loop - loop which is handing off
+ * Return:
+ * bool - true if the kernel is no longer using any of the connections.
+ */
+static bool stopped(UringLoop* loop) {
+    if (loop->accepting) {
+        return false;
+    }
+    for (UringConnection* connection = loop->open; connection != NULL;
+            connection = connection->nextOpen) {
+        if (connection->pendingOps > 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Function which sends each of a stopped loop's clients, along with anything
+ * other shards posted for them, to the server taking over once every other
+ * thread has stopped. Connections which have been shut down are only
+ * counted, and are closed when the server exits. If the handoff fails the
+ * loop starts accepting, recieving and sending again.
+ * Parameters:
+ * loop - loop which has stopped
+ */
+static void hand_off(UringLoop* loop) {
+    Handoff* handoff = loop->clientList->handoff;
+    if (handoff_pause(handoff, loop->openCount, true)) {
+        deliver_shard_messages(loop->clientList, loop->shard);
+        for (UringConnection* connection = loop->open; connection != NULL;
+                connection = connection->nextOpen) {
+            if (!connection->shutdown) {
+                HandoffConnection saved;
+                session_save(&connection->session, &saved);
+                handoff_send(handoff, &saved);
+                handoff_connection_free(&saved);
+            }
+        }
+        handoff_finish(handoff);
+    }
+    loop->handingOff = false;
+    if (loop->acceptAt == 0) {
+        arm_accept(loop);
+    }
+    arm_handoff(loop);
+    for (UringConnection* connection = loop->open; connection != NULL;
+            connection = connection->nextOpen) {
+        if (!connection->shutdown && !connection->parked) {
+            mark_ready(connection);
+        }
+        mark_dirty(&connection->session.output,
+                out_queue_pending(&connection->session.output));
+    }
+}
+
+/*
+ * Function which takes over this loop's share of the clients handed over by
+ * the server this one replaced, and once every loop has taken over its
+ * share, lets them carry on where the old server left them.
+ * Parameters:
+ * loop - loop taking the clients over
+ */
+static void adopt_connections(UringLoop* loop) {
+    Handoff* handoff = loop->clientList->handoff;
+    int index = 0;
+    for (HandoffConnection* handed = handoff->adopted; handed != NULL;
+            handed = handed->next, index++) {
+        if (index % loop->clientList->shardCount != loop->shard->index) {
+            continue;
+        }
+        // the loop relies on the kernel waiting for the socket to be ready
+        fcntl(handed->fd, F_SETFL, fcntl(handed->fd, F_GETFL) & ~O_NONBLOCK);
+        UringConnection* connection = create_connection(loop, handed->fd);
+        session_adopt(&connection->session, handed, loop->clientList,
+                loop->serverAuth, true, mark_dirty, schedule_flush,
+                connection);
+        arm_timer(connection);
+    }
+    handoff_adopted(handoff);
+    for (UringConnection* connection = loop->open; connection != NULL;
+            connection = connection->nextOpen) {
+        if (connection->session.closing) {
+            close_connection(connection);
+        } else {
+            mark_ready(connection);
+        }
+    }
+}
+
+/*
+ * Function which serves every client from the calling thread using io_uring.
+ * Connections are accepted and read with multishot submissions into a ring
+ * of buffers shared with the kernel, and everything a batch of completions
+ * sends is submitted together with the next wait. The protocol seen by
+ * clients is the same as in the other modes. This function only returns if
+ * io_uring cannot be used, after saying why on stderr, so the caller can
+ * fall back to another mode. Frames other shards post for this loop's
+ * clients are pushed to them when the shard's eventfd wakes the loop.
+ * Clients handed over by a server this one replaced are served alongside
+ * those it accepts.
+ * Parameters:
+ * listenDiscriptor - file descriptor the server is listening on
+ * serverAuth - the auth string provided to the server
+ * clientList - list of clients connected to the server
+ * shard - shard served by the loop
+ */
+void run_uring_loop(int listenDiscriptor, char* serverAuth,
+        ClientList* clientList, Shard* shard) {
+    UringLoop loop;
+    memset(&loop, 0, sizeof(UringLoop));
+    loop.listenDiscriptor = listenDiscriptor;
+    loop.serverAuth = serverAuth;
+    loop.clientList = clientList;
+    loop.shard = shard;
+    timer_wheel_init(&loop.timers, TIMER_TICK, now_usec());
+    const char* error = setup_ring(&loop.ring);
+    if (error != NULL) {
+        fprintf(stderr, "io_uring unavailable: %s\n", error);
+        return;
+    }
+    fcntl(listenDiscriptor, F_SETFL,
+            fcntl(listenDiscriptor, F_GETFL) & ~O_NONBLOCK);
+    arm_accept(&loop);
+    arm_wake(&loop);
+    Handoff* handoff = clientList->handoff;
+    if (handoff != NULL) {
+        arm_handoff(&loop);
+    }
+
+    long long timeout = -1;
+    // a kernel without multishot accept fails it as soon as it is
+    // submitted, which must be known before taking over any clients
+    bool adopting = handoff != NULL && handoff->adoptedCount > 0;
+    while (1) {
+        // connections with lines left over must not wait for the kernel,
+        // unless the loop is handing off and only waiting for the kernel
+        submit_ring(&loop.ring, !adopting && (loop.handingOff ||
+                loop.ready == NULL), loop.handingOff ? -1 : timeout);
+        if (!handle_completions(&loop)) {
+            fprintf(stderr, "io_uring unavailable: %s\n",
+                    "kernel lacks multishot accept");
+            destroy_ring(&loop.ring);
+            return;
+        }
+        if (adopting) {
+            adopt_connections(&loop);
+            adopting = false;
+        }
+        if (loop.handingOff) {
+            if (stopped(&loop)) {
+                hand_off(&loop);
+            }
+            continue;
+        }
+        handle_ready(&loop);
+        // connections let continue are handled in the next pass, which
+        // does not wait for the kernel
+        timeout = expire_timers(&loop);
+        long long acceptIn = resume_accepting(&loop);
+        if (acceptIn >= 0 && (timeout < 0 || acceptIn < timeout)) {
+            timeout = acceptIn;
+        }
+        send_dirty(&loop);
+    }
+}